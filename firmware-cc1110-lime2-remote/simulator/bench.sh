@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Benchmark of the lime2 retry policy and of the remote duty cycle over a set of
+# simulated radio channels.
+# For each combination of the firmware settings below the simulator is rebuilt and
+# run once per channel condition; the output is a CSV table on stdout.
+#
+# Every list can be overridden from the environment, e.g.:
+#   DELAYS="250" RADIOOFFS="4000" CHANNELS="-p0.1" ./bench.sh
+#
+
+DURATIONS=${DURATIONS:-"5000 10000"}            # DURATION_TX_RETRIES_MSEC in lime2.c
+DELAYS=${DELAYS:-"100 250 500"}                 # DELAY_AFTER_EACH_TX_MSEC in lime2.c
+RADIOOFFS=${RADIOOFFS:-"2000 4000 8000"}        # WAIT_TIME_RADIOOFF_MSEC in remote.c (at least 1000)
+WORS=${WORS:-"0 1"}                             # ENABLE_WAKE_ON_RADIO in main.h
+CHANNELS=${CHANNELS:-"-p0 -p0.2 -b0.05,0.3 -c0.3"}
+COMMANDS=${COMMANDS:-40}
+SEED=${SEED:-1}
+
+set -e
+cd "$(dirname "$0")"
+
+first=1
+for wor in $WORS; do
+  for duration in $DURATIONS; do
+    for delay in $DELAYS; do
+      for radiooff in $RADIOOFFS; do
+        retries=$((duration / delay))
+        if [ $retries -gt 255 ]; then
+          echo "skipping DURATION_TX_RETRIES_MSEC=$duration DELAY_AFTER_EACH_TX_MSEC=$delay: too many retries" >&2
+          continue
+        fi
+
+        make -s clean
+        make -s FW_DEFINES="-DDURATION_TX_RETRIES_MSEC=$duration -DDELAY_AFTER_EACH_TX_MSEC=$delay -DWAIT_TIME_RADIOOFF_MSEC=$radiooff -DENABLE_WAKE_ON_RADIO=$wor" >&2
+
+        if [ $first -eq 1 ]; then
+          echo "wake_on_radio,num_tx_retries,delay_after_each_tx_msec,wait_time_radiooff_msec,$(./lime2sim --csv-header)"
+          first=0
+        fi
+        for channel in $CHANNELS; do
+          echo "$wor,$retries,$delay,$radiooff,$(./lime2sim -n $COMMANDS -r $SEED $channel --csv)"
+        done
+      done
+    done
+  done
+done
+make -s clean
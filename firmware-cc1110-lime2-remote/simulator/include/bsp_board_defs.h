@@ -0,0 +1,87 @@
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+ *   BSP (Board Support Package)
+ *   Target : host firmware simulator (stand-in for SmartRFCCxx10)
+ *   Board definition file.
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+ *
+ *   Replaces boards/srfccxx10/bsp_board_defs.h together with mcus/bsp_8051_defs.h:
+ *   the real 8051 definitions only support the IAR compiler.
+ *   Everything timing-related is routed to the simulator (see sim_hal.c).
+ */
+
+#ifndef BSP_BOARD_DEFS_H
+#define BSP_BOARD_DEFS_H
+
+/* ------------------------------------------------------------------------------------------------
+ *                                            Defines
+ * ------------------------------------------------------------------------------------------------
+ */
+#define BSP_BOARD_SRFCCXX10
+#define BSP_BOARD_HOST_SIMULATOR
+#define BSP_MCU_8051
+
+/* ------------------------------------------------------------------------------------------------
+ *                                          Includes
+ * ------------------------------------------------------------------------------------------------
+ */
+#include <stdint.h>
+#include "ioCC1110.h"
+#include "bsp_macros.h"
+
+/* ------------------------------------------------------------------------------------------------
+ *                                     Compiler Abstraction
+ * ------------------------------------------------------------------------------------------------
+ */
+#define __bsp_LITTLE_ENDIAN__   1
+#define __bsp_CODE_MEMSPACE__   /* empty */
+#define __bsp_XDATA_MEMSPACE__  /* empty */
+
+#define __bsp_ISR_FUNCTION__(f,v)   void f(void); void f(void)
+
+#define __bsp_ENABLE_INTERRUPTS__()         st( EA = 1; )
+#define __bsp_DISABLE_INTERRUPTS__()        st( EA = 0; )
+#define __bsp_INTERRUPTS_ARE_ENABLED__()    EA
+
+#define __bsp_ISTATE_T__                    unsigned char
+#define __bsp_GET_ISTATE__()                EA
+#define __bsp_RESTORE_ISTATE__(x)           st( EA = x; )
+
+/* ------------------------------------------------------------------------------------------------
+ *                                        Clock and Delays
+ * ------------------------------------------------------------------------------------------------
+ */
+#define __bsp_CLOCK_MHZ__         13  /* MHz, same as the real CC1110 board */
+
+#define BSP_DELAY_USECS(x)        BSP_Delay(x)
+void BSP_Delay(uint16_t);
+
+/* CPU time accounted by the simulator for each iteration of the firmware busy loops:
+ * the remote main loop, when it was a busy loop, ran about 10880 iterations per second. */
+#define BSP_MAIN_LOOP_TICK()      BSP_SimMainLoopTick()
+void BSP_SimMainLoopTick(void);
+
+/* ------------------------------------------------------------------------------------------------
+ *                                             DMA
+ * ------------------------------------------------------------------------------------------------
+ */
+/* host pointers do not fit the 16-bit DMA descriptors: each object gets a 256 bytes
+ * window of a fake XDATA space, which the DMA emulation maps back to the object */
+#define BSP_XDATA_ADDRESS(p)      BSP_SimXdataAddress(p)
+uint16_t BSP_SimXdataAddress(volatile void*);
+
+/* the emulation reloads the descriptor of a channel only when it is armed through these */
+#define BSP_DMA_ARM(mask)         BSP_SimDmaArm(mask)
+#define BSP_DMA_ABORT(mask)       BSP_SimDmaAbort(mask)
+void BSP_SimDmaArm(uint8_t);
+void BSP_SimDmaAbort(uint8_t);
+
+/* ------------------------------------------------------------------------------------------------
+ *                                        Initialization
+ * ------------------------------------------------------------------------------------------------
+ */
+#define BSP_INIT_BOARD()          BSP_InitBoard()
+void BSP_InitBoard(void);
+
+/**************************************************************************************************
+ */
+#endif
@@ -0,0 +1,32 @@
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+ *   BSP (Board Support Package)
+ *   Target : host firmware simulator (stand-in for SmartRFCCxx10)
+ *   Button definition file.
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+ *
+ *   Same button mapping as boards/srfccxx10/bsp_button_defs.h; the simulator keeps
+ *   both buttons released (pins pulled high).
+ */
+
+#ifndef BSP_BUTTON_DEFS_H
+#define BSP_BUTTON_DEFS_H
+
+#include "bsp_board_defs.h"
+#include "bsp_macros.h"
+
+#define __bsp_NUM_BUTTONS__                   2
+#define __bsp_BUTTON_DEBOUNCE_WAIT__(expr)    st( int i; for(i=0; i<500; i++) { if (!(expr)) i = 0; } )
+
+/* BUTTON1 : P1.2, active low */
+#define __bsp_BUTTON1_BIT__             2
+#define __bsp_BUTTON1_PORT__            P1
+#define __bsp_BUTTON1_IS_ACTIVE_LOW__   1
+
+/* BUTTON2 : P1.3, active low */
+#define __bsp_BUTTON2_BIT__             3
+#define __bsp_BUTTON2_PORT__            P1
+#define __bsp_BUTTON2_IS_ACTIVE_LOW__   1
+
+#include "code/bsp_generic_buttons.h"
+
+#endif
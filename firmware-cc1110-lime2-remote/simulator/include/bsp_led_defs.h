@@ -0,0 +1,33 @@
+/* =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+ *   BSP (Board Support Package)
+ *   Target : host firmware simulator (stand-in for SmartRFCCxx10)
+ *   LED definition file.
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+ *
+ *   Same LED mapping as boards/srfccxx10/bsp_led_defs.h; duplicated only because
+ *   the real file pulls in the IAR-only board definitions from its own directory.
+ */
+
+#ifndef BSP_LED_DEFS_H
+#define BSP_LED_DEFS_H
+
+#include "bsp_board_defs.h"
+
+#define __bsp_NUM_LEDS__               2
+#define __bsp_LED_BLINK_LOOP_COUNT__   0x34000
+
+/* LED1 : P1.0, active high */
+#define __bsp_LED1_BIT__            0
+#define __bsp_LED1_PORT__           P1
+#define __bsp_LED1_DDR__            P1DIR
+#define __bsp_LED1_IS_ACTIVE_LOW__  0
+
+/* LED2 : P1.1, active high */
+#define __bsp_LED2_BIT__            1
+#define __bsp_LED2_PORT__           P1
+#define __bsp_LED2_DDR__            P1DIR
+#define __bsp_LED2_IS_ACTIVE_LOW__  0
+
+#include "code/bsp_generic_leds.h"
+
+#endif
@@ -0,0 +1,275 @@
+/***********************************************************************************
+
+Filename:           ioCC1110.h
+
+Description:        Host stand-in for the IAR ioCC1110.h header, used by the firmware
+                    simulator.
+
+Operation:          Every special function register (SFR) used by the firmware is a
+                    member of the per-node "sim_sfr" structure. Each register is a union
+                    of the byte and of its 8 bits, so that bit-addressable SFRs (e.g. EA,
+                    URX0IF, P0_4) alias the byte register exactly like on the 8051 core.
+                    The "sim_sfr" symbol is made node-local when linking each simulated
+                    node, see the simulator Makefile.
+
+***********************************************************************************/
+
+#ifndef IOCC1110_H
+#define IOCC1110_H
+
+#include <stdint.h>
+
+/***********************************************************************************
+* COMPILER ABSTRACTION
+*/
+
+#define __interrupt
+#define __near_func
+#define __code
+#define __xdata
+#define __data
+#define __idata
+
+/***********************************************************************************
+* SFR STORAGE
+*/
+
+typedef union
+{
+    uint8_t byte;
+    struct
+    {
+        uint8_t b0 : 1;
+        uint8_t b1 : 1;
+        uint8_t b2 : 1;
+        uint8_t b3 : 1;
+        uint8_t b4 : 1;
+        uint8_t b5 : 1;
+        uint8_t b6 : 1;
+        uint8_t b7 : 1;
+    } bit;
+} sim_sfr_reg_t;
+
+#define SIM_SFR_LIST(X) \
+    X(P0) X(P1) X(P2) X(P0DIR) X(P1DIR) X(P2DIR) X(P0SEL) X(P1SEL) X(P2SEL) \
+    X(P0INP) X(P1INP) X(P2INP) X(P0IFG) X(P1IFG) X(P2IFG) X(PICTL) X(P1IEN) \
+    X(PERCFG) X(U0CSR) X(U0UCR) X(U0GCR) X(U0DBUF) X(U0BAUD) \
+    X(U1CSR) X(U1UCR) X(U1GCR) X(U1DBUF) X(U1BAUD) \
+    X(IEN0) X(IEN1) X(IEN2) X(TCON) X(S0CON) X(S1CON) X(IRCON) X(IRCON2) \
+    X(CLKCON) X(SLEEP) X(PCON) X(WDCTL) \
+    X(ADCCFG) X(ADCCON1) X(ADCCON2) X(ADCCON3) X(ADCL) X(ADCH) X(RNDL) X(RNDH) \
+    X(WORCTL) X(WOREVT0) X(WOREVT1) X(WORIRQ) X(WORTIME0) X(WORTIME1) \
+    X(T1CTL) X(T1CNTL) X(T1CNTH) X(T1CCTL0) X(T1CC0L) X(T1CC0H) \
+    X(T1CCTL1) X(T1CC1L) X(T1CC1H) X(T1CCTL2) X(T1CC2L) X(T1CC2H) \
+    X(DMAARM) X(DMAREQ) X(DMAIRQ) X(DMA0CFGL) X(DMA0CFGH) X(DMA1CFGL) X(DMA1CFGH) \
+    X(RFIF) X(RFIM) X(RFD) X(RFST) \
+    X(MCSM0) X(MCSM1) X(MCSM2) X(MDMCFG1) X(PKTSTATUS) X(MARCSTATE) X(RSSI)
+
+#define SIM_SFR_DECLARE(name)       sim_sfr_reg_t sfr_##name;
+
+typedef struct
+{
+    SIM_SFR_LIST(SIM_SFR_DECLARE)
+} sim_sfr_t;
+
+extern volatile sim_sfr_t sim_sfr;
+
+#define SIM_SFR(name)               (sim_sfr.sfr_##name.byte)
+#define SIM_SBIT(name, n)           (sim_sfr.sfr_##name.bit.b##n)
+
+/***********************************************************************************
+* BYTE SFRs
+*/
+
+#define P0                          SIM_SFR(P0)
+#define P1                          SIM_SFR(P1)
+#define P2                          SIM_SFR(P2)
+#define P0DIR                       SIM_SFR(P0DIR)
+#define P1DIR                       SIM_SFR(P1DIR)
+#define P2DIR                       SIM_SFR(P2DIR)
+#define P0SEL                       SIM_SFR(P0SEL)
+#define P1SEL                       SIM_SFR(P1SEL)
+#define P2SEL                       SIM_SFR(P2SEL)
+#define P0INP                       SIM_SFR(P0INP)
+#define P1INP                       SIM_SFR(P1INP)
+#define P2INP                       SIM_SFR(P2INP)
+#define P0IFG                       SIM_SFR(P0IFG)
+#define P1IFG                       SIM_SFR(P1IFG)
+#define P2IFG                       SIM_SFR(P2IFG)
+#define PICTL                       SIM_SFR(PICTL)
+#define P1IEN                       SIM_SFR(P1IEN)
+#define PERCFG                      SIM_SFR(PERCFG)
+
+#define U0CSR                       SIM_SFR(U0CSR)
+#define U0UCR                       SIM_SFR(U0UCR)
+#define U0GCR                       SIM_SFR(U0GCR)
+#define U0DBUF                      SIM_SFR(U0DBUF)
+#define U0BAUD                      SIM_SFR(U0BAUD)
+#define U1CSR                       SIM_SFR(U1CSR)
+#define U1UCR                       SIM_SFR(U1UCR)
+#define U1GCR                       SIM_SFR(U1GCR)
+#define U1DBUF                      SIM_SFR(U1DBUF)
+#define U1BAUD                      SIM_SFR(U1BAUD)
+
+#define IEN0                        SIM_SFR(IEN0)
+#define IEN1                        SIM_SFR(IEN1)
+#define IEN2                        SIM_SFR(IEN2)
+#define TCON                        SIM_SFR(TCON)
+#define S0CON                       SIM_SFR(S0CON)
+#define S1CON                       SIM_SFR(S1CON)
+#define IRCON                       SIM_SFR(IRCON)
+#define IRCON2                      SIM_SFR(IRCON2)
+
+#define CLKCON                      SIM_SFR(CLKCON)
+#define SLEEP                       SIM_SFR(SLEEP)
+#define PCON                        SIM_SFR(PCON)
+#define WDCTL                       SIM_SFR(WDCTL)
+
+#define ADCCFG                      SIM_SFR(ADCCFG)
+#define ADCCON1                     SIM_SFR(ADCCON1)
+#define ADCCON2                     SIM_SFR(ADCCON2)
+#define ADCCON3                     SIM_SFR(ADCCON3)
+#define ADCL                        SIM_SFR(ADCL)
+#define ADCH                        SIM_SFR(ADCH)
+#define RNDL                        SIM_SFR(RNDL)
+#define RNDH                        SIM_SFR(RNDH)
+
+#define WORCTL                      SIM_SFR(WORCTL)
+#define WOREVT0                     SIM_SFR(WOREVT0)
+#define WOREVT1                     SIM_SFR(WOREVT1)
+#define WORIRQ                      SIM_SFR(WORIRQ)
+#define WORTIME0                    SIM_SFR(WORTIME0)
+#define WORTIME1                    SIM_SFR(WORTIME1)
+
+#define T1CTL                       SIM_SFR(T1CTL)
+#define T1CNTL                      SIM_SFR(T1CNTL)
+#define T1CNTH                      SIM_SFR(T1CNTH)
+#define T1CCTL0                     SIM_SFR(T1CCTL0)
+#define T1CC0L                      SIM_SFR(T1CC0L)
+#define T1CC0H                      SIM_SFR(T1CC0H)
+#define T1CCTL1                     SIM_SFR(T1CCTL1)
+#define T1CC1L                      SIM_SFR(T1CC1L)
+#define T1CC1H                      SIM_SFR(T1CC1H)
+#define T1CCTL2                     SIM_SFR(T1CCTL2)
+#define T1CC2L                      SIM_SFR(T1CC2L)
+#define T1CC2H                      SIM_SFR(T1CC2H)
+
+#define DMAARM                      SIM_SFR(DMAARM)
+#define DMAREQ                      SIM_SFR(DMAREQ)
+#define DMAIRQ                      SIM_SFR(DMAIRQ)
+#define DMA0CFGL                    SIM_SFR(DMA0CFGL)
+#define DMA0CFGH                    SIM_SFR(DMA0CFGH)
+#define DMA1CFGL                    SIM_SFR(DMA1CFGL)
+#define DMA1CFGH                    SIM_SFR(DMA1CFGH)
+
+#define RFIF                        SIM_SFR(RFIF)
+#define RFIM                        SIM_SFR(RFIM)
+#define RFD                         SIM_SFR(RFD)
+#define RFST                        SIM_SFR(RFST)
+
+/* radio registers live in XDATA on the real chip */
+#define MCSM0                       SIM_SFR(MCSM0)
+#define MCSM1                       SIM_SFR(MCSM1)
+#define MCSM2                       SIM_SFR(MCSM2)
+#define MDMCFG1                     SIM_SFR(MDMCFG1)
+#define PKTSTATUS                   SIM_SFR(PKTSTATUS)
+#define MARCSTATE                   SIM_SFR(MARCSTATE)
+#define RSSI                        SIM_SFR(RSSI)
+
+/* XDATA-mapped SFRs, whose address is used by the DMA descriptors: the simulated SFR
+   is the same storage */
+#define X_U0DBUF                    U0DBUF
+
+/***********************************************************************************
+* BIT-ADDRESSABLE SFRs
+*/
+
+/* IEN0 */
+#define EA                          SIM_SBIT(IEN0, 7)
+#define STIE                        SIM_SBIT(IEN0, 5)
+#define ENCIE                       SIM_SBIT(IEN0, 4)
+#define URX1IE                      SIM_SBIT(IEN0, 3)
+#define URX0IE                      SIM_SBIT(IEN0, 2)
+#define ADCIE                       SIM_SBIT(IEN0, 1)
+#define RFTXRXIE                    SIM_SBIT(IEN0, 0)
+
+/* IEN1 */
+#define P0IE                        SIM_SBIT(IEN1, 5)
+#define T4IE                        SIM_SBIT(IEN1, 4)
+#define T3IE                        SIM_SBIT(IEN1, 3)
+#define T2IE                        SIM_SBIT(IEN1, 2)
+#define T1IE                        SIM_SBIT(IEN1, 1)
+#define DMAIE                       SIM_SBIT(IEN1, 0)
+
+/* TCON */
+#define URX1IF                      SIM_SBIT(TCON, 7)
+#define ADCIF                       SIM_SBIT(TCON, 5)
+#define URX0IF                      SIM_SBIT(TCON, 3)
+#define RFTXRXIF                    SIM_SBIT(TCON, 1)
+
+/* IRCON */
+#define STIF                        SIM_SBIT(IRCON, 7)
+#define P0IF                        SIM_SBIT(IRCON, 5)
+#define T4IF                        SIM_SBIT(IRCON, 4)
+#define T3IF                        SIM_SBIT(IRCON, 3)
+#define T2IF                        SIM_SBIT(IRCON, 2)
+#define T1IF                        SIM_SBIT(IRCON, 1)
+#define DMAIF                       SIM_SBIT(IRCON, 0)
+
+/* IRCON2 */
+#define WDTIF                       SIM_SBIT(IRCON2, 4)
+#define P1IF                        SIM_SBIT(IRCON2, 3)
+#define UTX1IF                      SIM_SBIT(IRCON2, 2)
+#define UTX0IF                      SIM_SBIT(IRCON2, 1)
+#define P2IF                        SIM_SBIT(IRCON2, 0)
+
+/* ports */
+#define P0_0                        SIM_SBIT(P0, 0)
+#define P0_1                        SIM_SBIT(P0, 1)
+#define P0_2                        SIM_SBIT(P0, 2)
+#define P0_3                        SIM_SBIT(P0, 3)
+#define P0_4                        SIM_SBIT(P0, 4)
+#define P0_5                        SIM_SBIT(P0, 5)
+#define P0_6                        SIM_SBIT(P0, 6)
+#define P0_7                        SIM_SBIT(P0, 7)
+#define P1_0                        SIM_SBIT(P1, 0)
+#define P1_1                        SIM_SBIT(P1, 1)
+#define P1_2                        SIM_SBIT(P1, 2)
+#define P1_3                        SIM_SBIT(P1, 3)
+#define P1_4                        SIM_SBIT(P1, 4)
+#define P1_5                        SIM_SBIT(P1, 5)
+#define P1_6                        SIM_SBIT(P1, 6)
+#define P1_7                        SIM_SBIT(P1, 7)
+#define P2_0                        SIM_SBIT(P2, 0)
+#define P2_1                        SIM_SBIT(P2, 1)
+#define P2_2                        SIM_SBIT(P2, 2)
+#define P2_3                        SIM_SBIT(P2, 3)
+#define P2_4                        SIM_SBIT(P2, 4)
+
+/***********************************************************************************
+* INTERRUPT VECTORS
+*
+* Only used inside "#pragma vector" lines, which GCC ignores; the simulator calls
+* the ISRs by name.
+*/
+
+#define RFTXRX_VECTOR               0
+#define ADC_VECTOR                  1
+#define URX0_VECTOR                 2
+#define URX1_VECTOR                 3
+#define ENC_VECTOR                  4
+#define ST_VECTOR                   5
+#define P2INT_VECTOR                6
+#define UTX0_VECTOR                 7
+#define DMA_VECTOR                  8
+#define T1_VECTOR                   9
+#define T2_VECTOR                   10
+#define T3_VECTOR                   11
+#define T4_VECTOR                   12
+#define P0INT_VECTOR                13
+#define UTX1_VECTOR                 14
+#define P1INT_VECTOR                15
+#define RF_VECTOR                   16
+#define WDT_VECTOR                  17
+
+#endif
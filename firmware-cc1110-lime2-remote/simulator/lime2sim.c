@@ -0,0 +1,1087 @@
+/***********************************************************************************
+
+Filename:           lime2sim.c
+
+Description:        Host simulation of the "lime2" and "remote" CC1110 firmwares talking
+                    over an ideal radio channel, driven by a model of the Linux SPI master.
+
+Operation:          The Linux side reproduces the policy of lime2node_comm_lib.php:
+                      - send the command (TURNON_/TURNOFF + TID + parameter) over SPI
+                        in a CRC-protected 'C' frame, and read the sequence number of
+                        the last frame accepted with a 'Q' frame, resending the command
+                        if it was not accepted
+                      - then poll with 'Q' frames until the ACK carrying the TID of
+                        the command is returned, giving up after 30 secs; when the reply is
+                        about another command, an 'L' frame tells whether the lime2 node
+                        has already ACKed or given up on this one. The binary commands
+                        have 16-bit TIDs (from 256), of which 'Q' carries only the low
+                        byte: their ACK is confirmed with an 'L' frame as well
+                    --host selects who polls and how often:
+                      - spidev: the PHP code itself, spawning spidev_test for each
+                        STATUS; the interval starts at 250ms and doubles up to 2 secs
+                      - gateway: the 'W' request of lime2node_spi_gateway; the interval
+                        starts at 50ms and doubles up to 250ms, with no process spawn
+                      - gpio: lime2node_spi_gateway --event-gpio; a single poll 50ms after
+                        the command, then a poll on each rising edge of the "event pending"
+                        line (LIME2_GPIO1 in lime2.c), seen by Linux after 1ms
+                      - legacy: older versions of the PHP code, sending the bare command
+                        without any CRC and a STATUS_ command
+                        every 2 secs; a first STATUS_ is sent right after the command and
+                        its reply discarded, since each reply belongs to the previous
+                        STATUS_
+                    For each command the simulator reports the SPI-to-ACK latency seen by
+                    Linux, how many radio frames "lime2" transmitted, and when the relay
+                    outputs of the "remote" node actually changed. At the end Linux reads
+                    the remote table of "lime2" with a 'T' frame.
+                    With --broadcast every command is sent at once to several remote
+                    nodes, for all their relay groups: the relay times are then the ones
+                    of the last remote node to change its outputs.
+
+                    The radio channel can be degraded (frame errors, bursts of losses,
+                    busy CCA, propagation delay) to benchmark the retry policy; --csv
+                    prints a single summary line used by bench.sh.
+
+                    The run is fully deterministic for a given --seed.
+
+                    With --serve the built-in Linux model is replaced by real processes:
+                    the SPI messages they send through libspidev_sim.so (see
+                    spidev_shim.c) are executed on the simulated lime2 node, and the
+                    virtual time is paced to the wall clock; the "event pending" line is
+                    exported to them as a GPIO line of an emulated GPIO chip.
+
+***********************************************************************************/
+
+/***********************************************************************************
+* INCLUDES
+*/
+#include "sim_node.h"
+#include "sim_spi.h"
+#include "sim_bridge.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/***********************************************************************************
+* CONSTANTS
+*/
+
+/* see lime2node_comm_lib.php */
+#define HOST_MAX_WAIT_TIME_SEC          (30)
+#define HOST_WAITED_INCREMENT_SEC       (3)         // legacy: time accounted for each STATUS_ poll
+#define HOST_FIRST_VALID_TID            '1'
+#define HOST_LAST_VALID_TID             '9'
+#define HOST_TID_FOR_STATUS_CMD         '0'
+#define HOST_FIRST_BINARY_TID           (256)       // binary commands: 16-bit TIDs, never an ASCII one
+#define HOST_LAST_BINARY_TID            (65535)
+
+#define HOST_CMD_LEN                    (9)         // COMMAND_LEN + COMMAND_POSTFIX_LEN
+#define HOST_REPLY_LEN                  (6)         // REPLY_LEN + REPLY_POSTFIX_LEN
+
+/* CRC-protected frames, see SPI_FRAME_xxx in main.h */
+#define HOST_FRAME_SYNC                 (0xA5)
+#define HOST_FRAME_OPCODE_COMMAND       ('C')
+#define HOST_FRAME_OPCODE_QUERY         ('Q')
+#define HOST_FRAME_OPCODE_QUEUE         ('L')
+#define HOST_FRAME_OPCODE_TABLE         ('T')
+#define HOST_FRAME_REPLY_OFS            (3)         // header + turnaround byte
+#define HOST_FRAME_CRC_HEADER_LEN       (4)
+#define HOST_QUERY_PAYLOAD_LEN          (HOST_REPLY_LEN + 2)
+#define HOST_QUERY_REPLY_LEN            (3 + HOST_QUERY_PAYLOAD_LEN + 2)
+#define HOST_QUEUE_NUM_CMDS             (8)         // SPI_FRAME_QUEUE_NUM_CMDS
+#define HOST_QUEUE_CMD_LEN              (4)
+#define HOST_QUEUE_PAYLOAD_LEN          (HOST_QUERY_PAYLOAD_LEN + HOST_QUEUE_NUM_CMDS * HOST_QUEUE_CMD_LEN)
+#define HOST_QUEUE_REPLY_LEN            (3 + HOST_QUEUE_PAYLOAD_LEN + 2)
+#define HOST_CMD_ACKED                  (3)         // SPI_FRAME_CMD_ACKED
+#define HOST_CMD_FAILED                 (4)         // SPI_FRAME_CMD_FAILED
+#define HOST_TABLE_ROWS                 (16)        // REMOTE_TABLE_LEN
+#define HOST_TABLE_ROW_LEN              (8)
+#define HOST_TABLE_BITMAP_LEN           (16)        // BCAST_BITMAP_LEN
+#define HOST_TABLE_PAYLOAD_LEN          (HOST_TABLE_ROWS * HOST_TABLE_ROW_LEN + 2 + HOST_TABLE_BITMAP_LEN)
+#define HOST_TABLE_REPLY_LEN            (2 + HOST_TABLE_PAYLOAD_LEN + 2)
+
+/* binary commands carried by the 'C' frames, see BIN_FRAME_xxx in main.h */
+#define HOST_BIN_OPCODE_TURN_ON         (0x80)
+#define HOST_BIN_OPCODE_TURN_OFF        (0x81)
+#define HOST_BIN_OPCODE_BATCH           (0x85)
+#define HOST_BIN_VERSION_FLAGS          (0x10)
+#define HOST_BIN_TLV_CHANNEL            (0x11)      // type 1, 1 byte
+#define HOST_BIN_TLV_OPS                (0x30)      // type 3, + number of operations
+#define HOST_BIN_TLV_DURATION           (0x42)      // type 4, 2 bytes
+#define HOST_BIN_TLV_REMOTE             (0x61)      // type 6, 1 byte
+#define HOST_BIN_BROADCAST_ID           (0xFF)      // BROADCAST_NODE_ID
+#define HOST_BIN_OP_TURN_ON             (0x80)
+#define HOST_BIN_CMD_MAX_LEN            (14)
+#define HOST_BATCH_CHANNELS             (2)         // relay groups of a --multi-valve command
+#define HOST_FRAME_MAX_RETRIES          (5)         // $spi_frame_max_retries
+#define HOST_BATCH_DELAY_USEC           (500)       // $spi_batch_delay_usec
+
+/* relay outputs of the remote node: P0.1-P0.4 (see REMOTE_GPIOx in remote.c) */
+#define REMOTE_RELAY_MASK               (0x1E)
+
+/* event pending line of the lime2 node: P0.0 (see LIME2_GPIO1 in lime2.c) */
+#define LIME2_EVENT_PENDING_MASK        (0x01)
+#define HOST_GPIO_LATENCY_USEC          (1000)      // edge to poll() wakeup in the gateway
+
+#define MAX_COMMANDS                    (1000)
+#define MAX_REMOTES                     (8)         // remote..remote8, see the Makefile
+
+
+/***********************************************************************************
+* TYPES
+*/
+
+typedef enum
+{
+    HOST_SPIDEV,
+    HOST_GATEWAY,
+    HOST_GPIO,
+    HOST_LEGACY,
+} host_policy_e;
+
+typedef struct
+{
+    const char*     name;
+    sim_time_t      poll_min_usec;      // first STATUS interval, doubled at each poll...
+    sim_time_t      poll_max_usec;      // ...up to this one
+    sim_time_t      overhead_usec;      // default Linux overhead for each SPI transfer
+} host_policy_t;
+
+typedef struct
+{
+    uint16_t        tid;
+    int             turn_on;
+    sim_node_t*     remote;             // the command is sent to it
+    uint8_t         remote_id;          // its REMOTE_NODE_ID, 0 to leave the default one
+    int             broadcast;          // sent to all the remote nodes, for all their relay groups
+    uint32_t        actuated;           // broadcast: bitmask of the remote nodes whose relays changed...
+    uint32_t        released;           // ...and went back to idle
+    sim_time_t      sent;               // time the SPI command transfer started
+    sim_time_t      acked;              // time Linux got the matching ACK (SIM_TIME_NEVER if not)
+    sim_time_t      relay_on;           // first relay change after the command
+    sim_time_t      relay_off;          // relay outputs back to idle
+    uint32_t        radio_tx;           // frames transmitted by lime2 for this command
+    uint32_t        spi_transfers;
+    uint32_t        crc_errors;         // corrupted replies seen by Linux
+    double          lime2_mj;           // energy spent by the nodes while handling this command
+    double          remote_mj;
+} command_result_t;
+
+
+/***********************************************************************************
+* LOCAL VARIABLES
+*/
+
+extern const sim_node_ops_t     sim_lime2_ops;
+extern const sim_node_ops_t     sim_remote_ops;
+extern const sim_node_ops_t     sim_remote2_ops;           // REMOTE_NODE_ID 2, see the Makefile
+extern const sim_node_ops_t     sim_remote3_ops;
+extern const sim_node_ops_t     sim_remote4_ops;
+extern const sim_node_ops_t     sim_remote5_ops;
+extern const sim_node_ops_t     sim_remote6_ops;
+extern const sim_node_ops_t     sim_remote7_ops;
+extern const sim_node_ops_t     sim_remote8_ops;
+
+/* indexed by REMOTE_NODE_ID - 1 */
+static const sim_node_ops_t*    g_remote_ops[MAX_REMOTES] =
+{
+    &sim_remote_ops, &sim_remote2_ops, &sim_remote3_ops, &sim_remote4_ops,
+    &sim_remote5_ops, &sim_remote6_ops, &sim_remote7_ops, &sim_remote8_ops,
+};
+static const char*              g_remote_names[MAX_REMOTES] =
+{
+    "remote", "remote2", "remote3", "remote4", "remote5", "remote6", "remote7", "remote8",
+};
+
+/* indexed by host_policy_e; see lime2node_comm_lib.php and lime2node_spi_gateway.c */
+static const host_policy_t      g_host_policies[] =
+{
+    { "spidev",     250000,     2000000,    50000 },    // 50ms: spidev_test spawned through sudo
+    { "gateway",    50000,      250000,     1000 },     // GW_POLL_MIN_MSEC, GW_POLL_MAX_MSEC
+    { "gpio",       50000,      0,          1000 },     // poll_max unused: polls only on edges
+    { "legacy",     2000000,    2000000,    50000 },
+};
+
+static sim_spi_config_t         g_spi = { 5000, 50000 };
+static host_policy_e            g_host_policy = HOST_SPIDEV;
+static unsigned                 g_num_commands = 4;
+static sim_time_t               g_command_interval = SIM_SEC(40);
+static sim_time_t               g_command_jitter = SIM_SEC(10);
+static uint64_t                 g_host_rng;
+static int                      g_csv = 0;
+static int                      g_multi_valve = 0;
+static uint16_t                 g_duration_min = 0;
+static int                      g_neighbour = 0;
+static int                      g_alternate = 0;
+static unsigned                 g_broadcast = 0;            // number of remote nodes, 0 without --broadcast
+static unsigned                 g_num_remotes = 1;
+static sim_node_t*              g_remotes[MAX_REMOTES];
+static sim_node_t*              g_remote2;
+static uint8_t                  g_table[HOST_TABLE_PAYLOAD_LEN];   // rows of the reply to 'T'
+static int                      g_table_valid = 0;
+static sim_actor_t*             g_host;
+static sim_node_t*              g_lime2;
+static sim_node_t*              g_remote;
+
+static command_result_t         g_results[MAX_COMMANDS];
+static command_result_t*        g_current;
+static uint32_t                 g_event_edges;              // rising edges of the event pending line
+static uint8_t                  g_slave_crc_errors;         // last counter reported by the lime2 node
+static uint8_t                  g_slave_dropped;            // same, for the frames its main loop missed
+static uint64_t                 g_spi_rng;
+
+static const char*              g_serve_socket;             // NULL: use the built-in Linux model
+static volatile int             g_serve_stop;
+
+
+/***********************************************************************************
+* LOCAL FUNCTIONS
+*/
+
+static void PortObserver(sim_node_t* node, uint8_t port, uint8_t oldval, uint8_t newval)
+{
+    if (port == 1 && ((oldval ^ newval) & 0x03))
+        sim_trace(node->name, "LEDs P1=0x%02X", newval);
+
+    if (node == g_lime2 && port == 0 && ((oldval ^ newval) & LIME2_EVENT_PENDING_MASK))
+    {
+        sim_trace(node->name, "event pending line %d", (newval & LIME2_EVENT_PENDING_MASK) != 0);
+        if (newval & LIME2_EVENT_PENDING_MASK)
+            g_event_edges++;
+        if (g_serve_socket)
+            sim_bridge_set_event_line(newval & LIME2_EVENT_PENDING_MASK);
+        return;
+    }
+
+    if (node == g_lime2 || port != 0 || !((oldval ^ newval) & REMOTE_RELAY_MASK))
+        return;
+
+    sim_trace(node->name, "relay outputs P0=0x%02X", newval & REMOTE_RELAY_MASK);
+    if (g_current && g_current->broadcast)
+    {
+        uint32_t all = (1u << g_num_remotes) - 1;
+        uint32_t bit = 0;
+        for (unsigned i = 0; i < g_num_remotes; i++)
+            if (node == g_remotes[i])
+                bit = 1u << i;
+
+        if ((newval & REMOTE_RELAY_MASK) && !(g_current->actuated & bit))
+        {
+            g_current->actuated |= bit;
+            if (g_current->actuated == all)
+                g_current->relay_on = sim_now();
+        }
+        else if (!(newval & REMOTE_RELAY_MASK) && (g_current->actuated & bit))
+        {
+            g_current->released |= bit;
+            if (g_current->released == all)
+                g_current->relay_off = sim_now();
+        }
+        return;
+    }
+    if (!g_current || node != g_current->remote)
+        return;
+
+    if ((newval & REMOTE_RELAY_MASK) && g_current->relay_on == SIM_TIME_NEVER)
+        g_current->relay_on = sim_now();
+    else if (!(newval & REMOTE_RELAY_MASK) && g_current->relay_on != SIM_TIME_NEVER)
+        g_current->relay_off = sim_now();
+}
+
+static void SendSpiCommand(const char* cmd, char tid, char param, uint8_t* reply)
+{
+    uint8_t tx[HOST_CMD_LEN];
+    uint8_t rx[HOST_CMD_LEN];
+
+    memcpy(tx, cmd, HOST_CMD_LEN - 2);
+    tx[HOST_CMD_LEN - 2] = (uint8_t)tid;
+    tx[HOST_CMD_LEN - 1] = (uint8_t)param;
+
+    sim_spi_transfer(g_host, g_lime2, &g_spi, tx, rx, sizeof(tx));
+    g_current->spi_transfers++;
+
+    // same as lime2node_trim_nulls(): drop leading NUL bytes
+    size_t first = 0;
+    while (first < sizeof(rx) && rx[first] == 0)
+        first++;
+    memset(reply, 0, HOST_REPLY_LEN);
+    memcpy(reply, rx + first, (sizeof(rx) - first) < HOST_REPLY_LEN ? (sizeof(rx) - first) : HOST_REPLY_LEN);
+}
+
+/* same as lime2node_crc16() */
+static uint16_t HostCrc16(const uint8_t* buf, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    while (len--)
+    {
+        crc ^= (uint16_t)(*buf++) << 8;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
+/* same as lime2node_build_query_frame() */
+static void BuildQueryFrame(uint8_t* tx)
+{
+    memset(tx, 0, HOST_FRAME_REPLY_OFS + HOST_QUERY_REPLY_LEN);
+    tx[0] = HOST_FRAME_SYNC;
+    tx[1] = HOST_FRAME_OPCODE_QUERY;
+
+    uint16_t crc = HostCrc16(tx + 1, HOST_FRAME_CRC_HEADER_LEN - 1);
+    tx[HOST_FRAME_CRC_HEADER_LEN + 0] = crc >> 8;
+    tx[HOST_FRAME_CRC_HEADER_LEN + 1] = crc & 0xFF;
+}
+
+/* returns 1 and fills reply and *seq if the reply to the 'Q' frame has a valid CRC */
+static int ParseQueryReply(const uint8_t* rx, uint8_t* reply, uint8_t* seq)
+{
+    const uint8_t* frame = rx + HOST_FRAME_REPLY_OFS;
+
+    uint16_t crc = HostCrc16(frame + 1, 2 + HOST_QUERY_PAYLOAD_LEN);
+    if (frame[0] != HOST_FRAME_SYNC || frame[1] != HOST_QUERY_PAYLOAD_LEN ||
+        frame[3 + HOST_QUERY_PAYLOAD_LEN] != (crc >> 8) || frame[4 + HOST_QUERY_PAYLOAD_LEN] != (crc & 0xFF))
+    {
+        sim_trace("host", "corrupted reply to 'Q'");
+        g_current->crc_errors++;
+        return 0;
+    }
+
+    *seq = frame[2];
+    memcpy(reply, frame + 3, HOST_REPLY_LEN);
+    g_slave_crc_errors = frame[3 + HOST_REPLY_LEN];
+    g_slave_dropped = frame[4 + HOST_REPLY_LEN];
+    return 1;
+}
+
+static int SendQueryOnce(uint8_t* reply, uint8_t* seq)
+{
+    uint8_t tx[HOST_FRAME_REPLY_OFS + HOST_QUERY_REPLY_LEN];
+    uint8_t rx[HOST_FRAME_REPLY_OFS + HOST_QUERY_REPLY_LEN];
+
+    BuildQueryFrame(tx);
+    sim_spi_transfer(g_host, g_lime2, &g_spi, tx, rx, sizeof(tx));
+    g_current->spi_transfers++;
+
+    return ParseQueryReply(rx, reply, seq);
+}
+
+/* same as lime2node_send_spi_query(): retries the corrupted replies */
+static int SendQuery(uint8_t* reply, uint8_t* seq)
+{
+    for (int i = 0; i < HOST_FRAME_MAX_RETRIES; i++)
+        if (SendQueryOnce(reply, seq))
+            return 1;
+    memset(reply, 0, HOST_REPLY_LEN);
+    return 0;
+}
+
+/* same as lime2node_send_spi_queue(): returns the state of the command in the queue of the
+   lime2 node, 0 if it is not there or the replies are corrupted */
+static uint8_t ReadCommandState(uint16_t tid)
+{
+    uint8_t tx[HOST_FRAME_REPLY_OFS + HOST_QUEUE_REPLY_LEN] = { HOST_FRAME_SYNC, HOST_FRAME_OPCODE_QUEUE };
+    uint8_t rx[HOST_FRAME_REPLY_OFS + HOST_QUEUE_REPLY_LEN];
+
+    uint16_t crc = HostCrc16(tx + 1, HOST_FRAME_CRC_HEADER_LEN - 1);
+    tx[HOST_FRAME_CRC_HEADER_LEN + 0] = crc >> 8;
+    tx[HOST_FRAME_CRC_HEADER_LEN + 1] = crc & 0xFF;
+
+    for (int i = 0; i < HOST_FRAME_MAX_RETRIES; i++)
+    {
+        sim_spi_transfer(g_host, g_lime2, &g_spi, tx, rx, sizeof(tx));
+        g_current->spi_transfers++;
+
+        const uint8_t* frame = rx + HOST_FRAME_REPLY_OFS;
+        crc = HostCrc16(frame + 1, 2 + HOST_QUEUE_PAYLOAD_LEN);
+        if (frame[0] != HOST_FRAME_SYNC || frame[1] != HOST_QUEUE_PAYLOAD_LEN ||
+            frame[3 + HOST_QUEUE_PAYLOAD_LEN] != (crc >> 8) || frame[4 + HOST_QUEUE_PAYLOAD_LEN] != (crc & 0xFF))
+        {
+            sim_trace("host", "corrupted reply to 'L'");
+            g_current->crc_errors++;
+            continue;
+        }
+
+        for (const uint8_t* cmd = frame + 3 + HOST_QUERY_PAYLOAD_LEN; cmd < frame + 3 + HOST_QUEUE_PAYLOAD_LEN; cmd += HOST_QUEUE_CMD_LEN)
+            if (cmd[2] && cmd[0] == (tid & 0xFF) && cmd[1] == (tid >> 8))
+                return cmd[2];
+        return 0;
+    }
+    return 0;
+}
+
+/* from a valid reply to the 'Q' frame: 1 if the command was ACKed, -1 if the lime2 node gave up
+   on it, 0 if it is still pending; the reply carries only the low byte of the TID, so the ACK
+   of a 16-bit TID is confirmed with the 'L' frame */
+static int CommandOutcome(const uint8_t* reply, uint16_t tid)
+{
+    if (tid <= 0xFF && reply[4] == tid && memcmp(reply, "ACK_", 4) == 0)
+        return 1;
+    if (reply[4] == (tid & 0xFF) && memcmp(reply, "BUSY", 4) == 0)
+        return 0;
+
+    // the reply is about another command: the queue tells how this one went
+    uint8_t state = ReadCommandState(tid);
+    return state == HOST_CMD_ACKED ? 1 : state == HOST_CMD_FAILED ? -1 : 0;
+}
+
+/* same as lime2node_build_binary_cmd() and lime2node_build_batch_cmd() (multi_valve: the same
+   action on the relay groups 1..HOST_BATCH_CHANNELS, param 0: all the relay groups); returns the
+   payload length */
+static uint8_t BuildBinaryCommand(uint8_t* payload, int turn_on, uint16_t tid, char param, int multi_valve, uint8_t remote_id)
+{
+    uint8_t len = 0;
+    payload[len++] = multi_valve ? HOST_BIN_OPCODE_BATCH : turn_on ? HOST_BIN_OPCODE_TURN_ON : HOST_BIN_OPCODE_TURN_OFF;
+    payload[len++] = HOST_BIN_VERSION_FLAGS;
+    payload[len++] = tid & 0xFF;            // 16-bit transaction ID, LSB first
+    payload[len++] = tid >> 8;
+    if (multi_valve)
+    {
+        payload[len++] = HOST_BIN_TLV_OPS | HOST_BATCH_CHANNELS;
+        for (uint8_t ch = 1; ch <= HOST_BATCH_CHANNELS; ch++)
+            payload[len++] = (turn_on ? HOST_BIN_OP_TURN_ON : 0) | ch;
+    }
+    else if (param)
+    {
+        payload[len++] = HOST_BIN_TLV_CHANNEL;
+        payload[len++] = param - '0';
+    }
+    if (turn_on && g_duration_min)
+    {
+        payload[len++] = HOST_BIN_TLV_DURATION;
+        payload[len++] = g_duration_min & 0xFF;
+        payload[len++] = g_duration_min >> 8;
+    }
+    if (remote_id)
+    {
+        payload[len++] = HOST_BIN_TLV_REMOTE;
+        payload[len++] = remote_id;
+    }
+    return len;
+}
+
+/* same as lime2node_send_spi_crc_cmd(): returns 1 once the lime2 node accepted the frame */
+static int SendCrcCommand(int turn_on, uint16_t tid, char param, uint8_t remote_id)
+{
+    uint8_t tx[HOST_FRAME_CRC_HEADER_LEN + HOST_BIN_CMD_MAX_LEN + 2] =
+        { HOST_FRAME_SYNC, HOST_FRAME_OPCODE_COMMAND };
+    uint8_t queryTx[HOST_FRAME_REPLY_OFS + HOST_QUERY_REPLY_LEN];
+    uint8_t queryRx[HOST_FRAME_REPLY_OFS + HOST_QUERY_REPLY_LEN];
+    uint8_t reply[HOST_REPLY_LEN];
+    uint8_t seq, lastSeq;
+
+    // the sequence number must differ from the one of the last frame accepted:
+    if (!SendQuery(reply, &lastSeq))
+        return 0;
+    tx[3] = lastSeq + 1;
+    uint8_t len = BuildBinaryCommand(tx + HOST_FRAME_CRC_HEADER_LEN, turn_on, tid, param, g_multi_valve, remote_id);
+    tx[2] = len;
+    uint16_t crc = HostCrc16(tx + 1, HOST_FRAME_CRC_HEADER_LEN - 1 + len);
+    tx[HOST_FRAME_CRC_HEADER_LEN + len + 0] = crc >> 8;
+    tx[HOST_FRAME_CRC_HEADER_LEN + len + 1] = crc & 0xFF;
+
+    BuildQueryFrame(queryTx);
+    for (int i = 0; i < HOST_FRAME_MAX_RETRIES; i++)
+    {
+        // the 'C' frame and a 'Q' frame in a single SPI_IOC_MESSAGE(2), see lime2node_spi_message()
+        sim_spi_xfer_t xfers[2] =
+        {
+            { tx,       NULL,       HOST_FRAME_CRC_HEADER_LEN + len + 2, 0, HOST_BATCH_DELAY_USEC, 1 },
+            { queryTx,  queryRx,    sizeof(queryTx),    0, HOST_BATCH_DELAY_USEC, 0 },
+        };
+        sim_spi_message(g_host, g_lime2, &g_spi, xfers, 2);
+        g_current->spi_transfers++;
+
+        // a corrupted reply, or one read too early, does not tell whether the frame was
+        // accepted: query again
+        if (!ParseQueryReply(queryRx, reply, &seq) || seq != tx[3])
+        {
+            if (!SendQuery(reply, &seq))
+                return 0;
+        }
+        if (seq == tx[3])
+            return 1;
+        sim_trace("host", "'C' frame not accepted, resending");
+    }
+    return 0;
+}
+
+/* same as lime2node_send_spi_table(): fills g_table from the reply to the 'T' frame */
+static int ReadRemoteTable(void)
+{
+    uint8_t tx[HOST_FRAME_REPLY_OFS + HOST_TABLE_REPLY_LEN] = { HOST_FRAME_SYNC, HOST_FRAME_OPCODE_TABLE };
+    uint8_t rx[HOST_FRAME_REPLY_OFS + HOST_TABLE_REPLY_LEN];
+
+    uint16_t crc = HostCrc16(tx + 1, HOST_FRAME_CRC_HEADER_LEN - 1);
+    tx[HOST_FRAME_CRC_HEADER_LEN + 0] = crc >> 8;
+    tx[HOST_FRAME_CRC_HEADER_LEN + 1] = crc & 0xFF;
+
+    for (int i = 0; i < HOST_FRAME_MAX_RETRIES; i++)
+    {
+        sim_spi_transfer(g_host, g_lime2, &g_spi, tx, rx, sizeof(tx));
+
+        const uint8_t* frame = rx + HOST_FRAME_REPLY_OFS;
+        crc = HostCrc16(frame + 1, 1 + HOST_TABLE_PAYLOAD_LEN);
+        if (frame[0] == HOST_FRAME_SYNC && frame[1] == HOST_TABLE_PAYLOAD_LEN &&
+            frame[2 + HOST_TABLE_PAYLOAD_LEN] == (crc >> 8) && frame[3 + HOST_TABLE_PAYLOAD_LEN] == (crc & 0xFF))
+        {
+            memcpy(g_table, frame + 2, HOST_TABLE_PAYLOAD_LEN);
+            return 1;
+        }
+        sim_trace("host", "corrupted reply to 'T'");
+    }
+    return 0;
+}
+
+static int WaitForLegacyAck(uint16_t tid)
+{
+    const host_policy_t* policy = &g_host_policies[HOST_LEGACY];
+    uint8_t reply[HOST_REPLY_LEN];
+
+    // ignore the result of the first STATUS_ command: it refers to the command before the last one
+    SendSpiCommand("STATUS_", HOST_TID_FOR_STATUS_CMD, '0', reply);
+
+    unsigned waited_sec = 0;
+    while (1)
+    {
+        sim_advance(g_host, policy->poll_min_usec);
+        SendSpiCommand("STATUS_", HOST_TID_FOR_STATUS_CMD, '0', reply);
+
+        if (waited_sec > HOST_MAX_WAIT_TIME_SEC)
+            return 0;
+        waited_sec += HOST_WAITED_INCREMENT_SEC;
+
+        if (memcmp(reply, "ACK_", 4) == 0 && reply[4] == (uint8_t)tid)
+            return 1;
+    }
+}
+
+static int WaitForEventAck(uint16_t tid)
+{
+    const host_policy_t* policy = &g_host_policies[HOST_GPIO];
+    uint8_t reply[HOST_REPLY_LEN];
+
+    // the edge may have come before the wait started: poll once anyway
+    sim_time_t deadline = sim_now() + SIM_SEC(HOST_MAX_WAIT_TIME_SEC);
+    sim_advance(g_host, policy->poll_min_usec);
+    while (1)
+    {
+        uint32_t edges = g_event_edges;
+        uint8_t seq;
+        if (!SendQueryOnce(reply, &seq))
+        {
+            // the event has been consumed by the corrupted reply: poll again soon
+            if (sim_now() >= deadline)
+                return 0;
+            sim_advance(g_host, policy->poll_min_usec);
+            continue;
+        }
+
+        int outcome = CommandOutcome(reply, tid);
+        if (outcome)
+            return outcome > 0;
+
+        while (g_event_edges == edges && sim_now() < deadline)
+            sim_advance(g_host, HOST_GPIO_LATENCY_USEC);
+        if (g_event_edges == edges)
+            return 0;
+    }
+}
+
+static int WaitForAck(uint16_t tid)
+{
+    const host_policy_t* policy = &g_host_policies[g_host_policy];
+    uint8_t reply[HOST_REPLY_LEN];
+
+    if (g_host_policy == HOST_LEGACY)
+        return WaitForLegacyAck(tid);
+    if (g_host_policy == HOST_GPIO)
+        return WaitForEventAck(tid);
+
+    // short intervals first: without retries the ACK arrives within a few hundreds of ms
+    sim_time_t deadline = sim_now() + SIM_SEC(HOST_MAX_WAIT_TIME_SEC);
+    sim_time_t interval = policy->poll_min_usec;
+    while (1)
+    {
+        sim_advance(g_host, interval);
+        uint8_t seq;
+        int valid = SendQueryOnce(reply, &seq);
+
+        int outcome = valid ? CommandOutcome(reply, tid) : 0;
+        if (outcome)
+            return outcome > 0;
+        if (sim_now() >= deadline)
+            return 0;
+
+        if (!valid)
+        {
+            interval = policy->poll_min_usec;
+            continue;
+        }
+        interval *= 2;
+        if (interval > policy->poll_max_usec)
+            interval = policy->poll_max_usec;
+    }
+}
+
+static void HostThread(void* arg)
+{
+    (void)arg;
+    // same as lime2node_get_last_transaction_id_and_advance(): the binary commands have their own TIDs
+    uint16_t first_tid = g_host_policy == HOST_LEGACY ? HOST_FIRST_VALID_TID : HOST_FIRST_BINARY_TID;
+    uint16_t last_tid = g_host_policy == HOST_LEGACY ? HOST_LAST_VALID_TID : HOST_LAST_BINARY_TID;
+    uint16_t tid = first_tid;
+
+    // let both nodes boot (LEDs are on for 1 sec at startup)
+    sim_advance(g_host, SIM_SEC(2));
+
+    for (unsigned i = 0; i < g_num_commands; i++)
+    {
+        // commands are not synchronized with the duty cycle of the remote node
+        if (g_command_jitter)
+            sim_advance(g_host, sim_rand_u32(&g_host_rng) % g_command_jitter);
+
+        command_result_t* r = &g_results[i];
+        memset(r, 0, sizeof(*r));
+        r->tid = tid;
+        r->turn_on = (i % 2) == 0;
+        // --alternate: a TURNON_ and a TURNOFF to each remote node in turn
+        r->remote = (g_alternate && (i / 2) % 2) ? g_remote2 : g_remote;
+        r->remote_id = g_alternate ? (r->remote == g_remote2 ? 2 : 1) : 0;
+        if (g_broadcast)
+        {
+            // --broadcast: the energy is still accounted to the first remote node
+            r->broadcast = 1;
+            r->remote_id = HOST_BIN_BROADCAST_ID;
+        }
+        r->acked = r->relay_on = r->relay_off = SIM_TIME_NEVER;
+        r->sent = sim_now();
+        g_current = r;
+
+        uint32_t tx_before = g_lime2->tx_frames;
+        double lime2_mj = sim_node_energy_mj(g_lime2);
+        double remote_mj = sim_node_energy_mj(r->remote);
+        sim_trace("host", "sending %s TID=%u to %s", r->turn_on ? "TURNON_" : "TURNOFF", tid, r->remote->name);
+        int accepted = 1;
+        if (g_host_policy == HOST_LEGACY)
+        {
+            uint8_t reply[HOST_REPLY_LEN];
+            SendSpiCommand(r->turn_on ? "TURNON_" : "TURNOFF", (char)tid, '1', reply);
+        }
+        else
+            accepted = SendCrcCommand(r->turn_on, tid, r->broadcast ? 0 : '1', r->remote_id);
+
+        if (accepted && WaitForAck(tid))
+            r->acked = sim_now();
+        sim_trace("host", "TID=%u %s", tid, r->acked != SIM_TIME_NEVER ? "ACKed" : "NOT ACKed");
+
+        // leave the remote node the time to actuate the relay before the next command
+        sim_time_t next = r->sent + g_command_interval;
+        if (next > sim_now())
+            sim_advance(g_host, next - sim_now());
+        r->radio_tx = g_lime2->tx_frames - tx_before;
+        r->lime2_mj = sim_node_energy_mj(g_lime2) - lime2_mj;
+        r->remote_mj = sim_node_energy_mj(r->remote) - remote_mj;
+
+        tid = (tid == last_tid) ? first_tid : tid + 1;
+    }
+
+    g_current = NULL;
+    if (g_host_policy != HOST_LEGACY)
+        g_table_valid = ReadRemoteTable();
+    sim_stop();
+}
+
+static void BridgeThread(void* arg)
+{
+    (void)arg;
+
+    if (sim_bridge_serve(sim_current(), g_lime2, &g_spi, g_serve_socket, &g_serve_stop) < 0)
+        fprintf(stderr, "sim: cannot serve SPI messages on %s\n", g_serve_socket);
+    sim_stop();
+}
+
+static void StopServing(int sig)
+{
+    (void)sig;
+    g_serve_stop = 1;
+}
+
+static void PrintTime(sim_time_t t, sim_time_t ref)
+{
+    if (t == SIM_TIME_NEVER)
+        printf(" %10s", "-");
+    else
+        printf(" %10.3f", (t - ref) / 1e6);
+}
+
+static int CompareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of an already sorted array */
+static double Percentile(const double* sorted, unsigned n, double p)
+{
+    if (n == 0)
+        return 0;
+    unsigned rank = (unsigned)(p / 100.0 * n + 0.999999);
+    return sorted[rank ? rank - 1 : 0];
+}
+
+typedef struct
+{
+    unsigned        acked;
+    unsigned        actuated;
+    double          ack_latency[MAX_COMMANDS];          // sorted, only for ACKed commands
+    double          relay_latency[MAX_COMMANDS];        // sorted, only for actuated commands
+    double          mean_radio_tx;
+    unsigned        crc_errors;
+    double          mean_lime2_mj;
+    double          mean_remote_mj;
+} summary_t;
+
+static void Summarize(summary_t* sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    for (unsigned i = 0; i < g_num_commands; i++)
+    {
+        const command_result_t* r = &g_results[i];
+        if (r->acked != SIM_TIME_NEVER)
+            sum->ack_latency[sum->acked++] = (r->acked - r->sent) / 1e6;
+        if (r->relay_on != SIM_TIME_NEVER)
+            sum->relay_latency[sum->actuated++] = (r->relay_on - r->sent) / 1e6;
+        sum->mean_radio_tx += r->radio_tx;
+        sum->crc_errors += r->crc_errors;
+        sum->mean_lime2_mj += r->lime2_mj;
+        sum->mean_remote_mj += r->remote_mj;
+    }
+    if (g_num_commands)
+    {
+        sum->mean_radio_tx /= g_num_commands;
+        sum->mean_lime2_mj /= g_num_commands;
+        sum->mean_remote_mj /= g_num_commands;
+    }
+    qsort(sum->ack_latency, sum->acked, sizeof(double), CompareDouble);
+    qsort(sum->relay_latency, sum->actuated, sizeof(double), CompareDouble);
+}
+
+static void PrintCsv(const summary_t* sum, int header)
+{
+    if (header)
+    {
+        printf("per,burst_enter,burst_exit,burst_per,cca_busy,prop_delay_us,commands,"
+               "ack_prob,relay_prob,ack_p50,ack_p90,ack_p99,relay_p50,relay_p90,relay_p99,"
+               "radio_tx,lime2_mj_per_cmd,remote_mj_per_cmd,remote_avg_ma\n");
+        return;
+    }
+
+    printf("%.3f,%.3f,%.3f,%.3f,%.3f,%u,%u,",
+           g_sim_channel.per, g_sim_channel.burst_enter_prob, g_sim_channel.burst_exit_prob,
+           g_sim_channel.burst_per, g_sim_channel.cca_busy_prob, (unsigned)g_sim_channel.prop_delay_usec,
+           g_num_commands);
+    printf("%.3f,%.3f,", g_num_commands ? (double)sum->acked / g_num_commands : 0.0,
+           g_num_commands ? (double)sum->actuated / g_num_commands : 0.0);
+    printf("%.3f,%.3f,%.3f,", Percentile(sum->ack_latency, sum->acked, 50),
+           Percentile(sum->ack_latency, sum->acked, 90), Percentile(sum->ack_latency, sum->acked, 99));
+    printf("%.3f,%.3f,%.3f,", Percentile(sum->relay_latency, sum->actuated, 50),
+           Percentile(sum->relay_latency, sum->actuated, 90), Percentile(sum->relay_latency, sum->actuated, 99));
+    printf("%.2f,%.1f,%.1f,%.3f\n", sum->mean_radio_tx, sum->mean_lime2_mj, sum->mean_remote_mj,
+           sim_node_energy_mj(g_remote) / g_sim_radio.supply_v / (sim_now() / 1e6));
+}
+
+static void PrintRemoteTable(void);
+static void PrintNodeStats(void);
+
+static void PrintResults(const summary_t* sum)
+{
+    printf("\n%-5s %-8s %-8s %10s %10s %10s %9s %9s\n",
+           "TID", "command", "node", "ack[s]", "relay[s]", "release[s]", "radio_tx", "spi_xfer");
+    for (unsigned i = 0; i < g_num_commands; i++)
+    {
+        const command_result_t* r = &g_results[i];
+        printf("%-5u %-8s %-8s", r->tid, r->turn_on ? "TURNON_" : "TURNOFF",
+               r->broadcast ? "all" : r->remote ? r->remote->name : "-");
+        PrintTime(r->acked, r->sent);
+        PrintTime(r->relay_on, r->sent);
+        PrintTime(r->relay_off, r->sent);
+        printf(" %9u %9u\n", r->radio_tx, r->spi_transfers);
+    }
+
+    printf("\nsummary: %u commands, %u ACKed, %u actuated\n", g_num_commands, sum->acked, sum->actuated);
+    if (sum->acked)
+        printf("  ACK latency seen by Linux:        p50=%.3f p90=%.3f p99=%.3f s\n",
+               Percentile(sum->ack_latency, sum->acked, 50), Percentile(sum->ack_latency, sum->acked, 90),
+               Percentile(sum->ack_latency, sum->acked, 99));
+    if (sum->actuated)
+        printf("  command-to-relay latency:         p50=%.3f p90=%.3f p99=%.3f s\n",
+               Percentile(sum->relay_latency, sum->actuated, 50), Percentile(sum->relay_latency, sum->actuated, 90),
+               Percentile(sum->relay_latency, sum->actuated, 99));
+    printf("  mean radio TX per command:        %.2f\n", sum->mean_radio_tx);
+    printf("  mean energy per command:          lime2 %.1f mJ, remote %.1f mJ\n", sum->mean_lime2_mj, sum->mean_remote_mj);
+    if (g_spi.bit_error_rate > 0)
+        printf("  SPI frames with a wrong CRC:      %u replies seen by Linux, %u frames seen by lime2\n",
+               sum->crc_errors, g_slave_crc_errors);
+    if (g_slave_dropped)
+        printf("  SPI frames dropped by lime2:      %u\n", g_slave_dropped);
+    PrintRemoteTable();
+    PrintNodeStats();
+}
+
+static void PrintRemoteTable(void)
+{
+    if (!g_table_valid)
+        return;
+
+    printf("  remote table of lime2 ('T' frame):\n");
+    for (int i = 0; i < HOST_TABLE_ROWS; i++)
+    {
+        const uint8_t* row = &g_table[i * HOST_TABLE_ROW_LEN];
+        if (row[0] == 0)
+            continue;
+        uint16_t age = row[6] | (row[7] << 8);
+        printf("    node ID %-3u last TID=%-5u battery=%-3u RSSI=%d dBm failures=%u last ACK ",
+               row[0], row[1] | (row[2] << 8), row[3], (int8_t)row[4], row[5]);
+        if (age == 0xFFFF)
+            printf("never\n");
+        else
+            printf("%u s ago\n", age);
+    }
+
+    const uint8_t* bcast = &g_table[HOST_TABLE_ROWS * HOST_TABLE_ROW_LEN];
+    if (!g_broadcast)
+        return;
+    printf("    last broadcast TID=%u ACKed by node IDs:", bcast[0] | (bcast[1] << 8));
+    for (int id = 1; id <= HOST_TABLE_BITMAP_LEN * 8; id++)
+        if (bcast[2 + (id - 1) / 8] & (1 << ((id - 1) % 8)))
+            printf(" %d", id);
+    printf("\n");
+}
+
+static void PrintNodeStats(void)
+{
+    for (int n = 0; n < sim_num_nodes(); n++)
+    {
+        const sim_node_t* node = sim_node_get(n);
+        printf("  %-8s tx=%u (CCA failures=%u) rx=%u lost=%u collisions=%u dropped=%u filtered=%u energy=%.1f mJ (avg %.3f mA)\n",
+               node->name, node->tx_frames, node->tx_cca_failures, node->rx_frames, node->rx_lost,
+               node->rx_collisions, node->rx_dropped, node->rx_filtered, sim_node_energy_mj(node),
+               sim_node_energy_mj(node) / g_sim_radio.supply_v / (sim_now() / 1e6));
+    }
+    printf("  simulated time: %.3f s\n", sim_now() / 1e6);
+}
+
+static void Usage(const char* prog)
+{
+    printf("Usage: %s [options]\n"
+           "  -n, --commands=N          number of TURNON_/TURNOFF commands to send (default %u)\n"
+           "  -i, --interval=SEC        time between two commands (default %.0f)\n"
+           "  -j, --jitter=SEC          random extra time before each command (default %.0f)\n"
+           "  -s, --speed-hz=HZ         SPI clock (default %u, as in lime2node_comm_lib.php)\n"
+           "  -o, --overhead-ms=MS      Linux overhead for each SPI transfer (default %.0f, 1 with --host=gateway or gpio)\n"
+           "  -r, --seed=N              random seed (default 1)\n"
+           "  -l, --lookahead-us=US     scheduler lookahead (default 500)\n"
+           "  -t, --time-limit=SEC      abort the simulation after this time (default: enough for all commands)\n"
+           "  -H, --host=POLICY         how Linux waits for the ACK: spidev, gateway, gpio or legacy (default %s)\n"
+           "  -E, --spi-ber=P[,HZ]      probability of a bit error on MOSI and MISO, only above HZ if given\n"
+           "  -m, --multi-valve         send each command as a batch for both relay groups (not with --host=legacy)\n"
+           "  -D, --duration=MIN        the remote turns off by itself after MIN minutes the relays turned on\n"
+           "  -T, --clock-ppm=PPM       the sleep timer of the remote runs PPM faster than the lime2 one (default 0)\n"
+           "  -N, --neighbour           add a second remote node (REMOTE_NODE_ID 2) that no command is sent to\n"
+           "  -A, --alternate           with --neighbour, send every other pair of commands to the second remote node\n"
+           "  -B, --broadcast=N         add remote nodes up to REMOTE_NODE_ID N (max %d) and send every command\n"
+           "                            to all of them at once, for all their relay groups (not with --host=legacy)\n"
+           "  -v, --verbose             trace every radio/SPI/port event\n"
+           "  -S, --serve[=SOCKET]      serve the SPI messages of real processes using libspidev_sim.so\n"
+           "                            instead of sending commands (default socket %s)\n"
+           "channel model:\n"
+           "  -p, --per=P               frame error rate of each link (default 0)\n"
+           "  -b, --burst=E,X[,P]       burst losses: probability to enter (E) and exit (X) the bad\n"
+           "                            state at each frame, frame error rate P in that state (default 1)\n"
+           "  -c, --cca-busy=P          probability that an interferer makes a CCA fail (default 0)\n"
+           "  -d, --prop-delay-us=US    propagation delay (default 0)\n"
+           "  -C, --no-collisions       overlapping frames are not lost\n"
+           "output:\n"
+           "      --csv                 print only a CSV summary line\n"
+           "      --csv-header          print only the header of the CSV summary line\n",
+           prog, g_num_commands, g_command_interval / 1e6, g_command_jitter / 1e6, g_spi.speed_hz,
+           g_host_policies[g_host_policy].overhead_usec / 1e3, g_host_policies[g_host_policy].name,
+           MAX_REMOTES, SIM_BRIDGE_DEFAULT_SOCKET);
+}
+
+
+/***********************************************************************************
+* MAIN
+*/
+
+int main(int argc, char** argv)
+{
+    enum { OPT_CSV = 256, OPT_CSV_HEADER };
+    static const struct option long_opts[] =
+    {
+        { "commands",       required_argument,  NULL, 'n' },
+        { "interval",       required_argument,  NULL, 'i' },
+        { "jitter",         required_argument,  NULL, 'j' },
+        { "speed-hz",       required_argument,  NULL, 's' },
+        { "overhead-ms",    required_argument,  NULL, 'o' },
+        { "seed",           required_argument,  NULL, 'r' },
+        { "lookahead-us",   required_argument,  NULL, 'l' },
+        { "time-limit",     required_argument,  NULL, 't' },
+        { "host",           required_argument,  NULL, 'H' },
+        { "spi-ber",        required_argument,  NULL, 'E' },
+        { "multi-valve",    no_argument,        NULL, 'm' },
+        { "duration",       required_argument,  NULL, 'D' },
+        { "clock-ppm",      required_argument,  NULL, 'T' },
+        { "neighbour",      no_argument,        NULL, 'N' },
+        { "alternate",      no_argument,        NULL, 'A' },
+        { "broadcast",      required_argument,  NULL, 'B' },
+        { "verbose",        no_argument,        NULL, 'v' },
+        { "serve",          optional_argument,  NULL, 'S' },
+        { "per",            required_argument,  NULL, 'p' },
+        { "burst",          required_argument,  NULL, 'b' },
+        { "cca-busy",       required_argument,  NULL, 'c' },
+        { "prop-delay-us",  required_argument,  NULL, 'd' },
+        { "no-collisions",  no_argument,        NULL, 'C' },
+        { "csv",            no_argument,        NULL, OPT_CSV },
+        { "csv-header",     no_argument,        NULL, OPT_CSV_HEADER },
+        { "help",           no_argument,        NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    uint64_t seed = 1;
+    sim_time_t lookahead = 500;
+    sim_time_t time_limit = SIM_TIME_NEVER;
+    int overhead_set = 0;
+    double clock_ppm = 0;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:i:j:s:o:r:l:t:H:E:mD:T:NAB:vS::p:b:c:d:Ch", long_opts, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':   g_num_commands = strtoul(optarg, NULL, 0);                          break;
+        case 'i':   g_command_interval = (sim_time_t)(atof(optarg) * 1e6);              break;
+        case 'j':   g_command_jitter = (sim_time_t)(atof(optarg) * 1e6);                break;
+        case 's':   g_spi.speed_hz = strtoul(optarg, NULL, 0);                          break;
+        case 'o':   g_spi.transfer_overhead_usec = (sim_time_t)(atof(optarg) * 1e3);
+                    overhead_set = 1;                                                   break;
+        case 'r':   seed = strtoull(optarg, NULL, 0);                                   break;
+        case 'l':   lookahead = strtoull(optarg, NULL, 0);                              break;
+        case 't':   time_limit = (sim_time_t)(atof(optarg) * 1e6);                      break;
+        case 'v':   g_sim_verbose = 1;                                                  break;
+        case 'm':   g_multi_valve = 1;                                                  break;
+        case 'D':   g_duration_min = strtoul(optarg, NULL, 0);                          break;
+        case 'T':   clock_ppm = atof(optarg);                                           break;
+        case 'N':   g_neighbour = 1;                                                    break;
+        case 'A':   g_alternate = 1;                                                    break;
+        case 'B':   g_broadcast = strtoul(optarg, NULL, 0);                             break;
+        case 'H':
+            for (c = 0; c < (int)(sizeof(g_host_policies) / sizeof(g_host_policies[0])); c++)
+                if (strcmp(optarg, g_host_policies[c].name) == 0)
+                    break;
+            if (c == (int)(sizeof(g_host_policies) / sizeof(g_host_policies[0])))
+            {
+                Usage(argv[0]);
+                return 1;
+            }
+            g_host_policy = (host_policy_e)c;
+            break;
+        case 'E':
+            if (sscanf(optarg, "%lf,%u", &g_spi.bit_error_rate, &g_spi.error_free_hz) < 1)
+            {
+                Usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'S':   g_serve_socket = optarg ? optarg : SIM_BRIDGE_DEFAULT_SOCKET;       break;
+        case 'p':   g_sim_channel.per = atof(optarg);                                   break;
+        case 'c':   g_sim_channel.cca_busy_prob = atof(optarg);                         break;
+        case 'd':   g_sim_channel.prop_delay_usec = strtoull(optarg, NULL, 0);          break;
+        case 'C':   g_sim_channel.collisions = 0;                                       break;
+        case 'b':
+            if (sscanf(optarg, "%lf,%lf,%lf", &g_sim_channel.burst_enter_prob,
+                       &g_sim_channel.burst_exit_prob, &g_sim_channel.burst_per) < 2)
+            {
+                Usage(argv[0]);
+                return 1;
+            }
+            break;
+        case OPT_CSV:           g_csv = 1;          break;
+        case OPT_CSV_HEADER:    PrintCsv(NULL, 1);  return 0;
+        default:
+            Usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (g_num_commands > MAX_COMMANDS || g_spi.speed_hz == 0 || ((g_multi_valve || g_duration_min || g_alternate) && g_host_policy == HOST_LEGACY) ||
+        (g_alternate && !g_neighbour) || g_broadcast > MAX_REMOTES ||
+        (g_broadcast && (g_alternate || g_host_policy == HOST_LEGACY)))
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+    if (g_serve_socket && !overhead_set)
+        g_spi.transfer_overhead_usec = 0;      // the real processes take their own time
+    else if (!overhead_set)
+        g_spi.transfer_overhead_usec = g_host_policies[g_host_policy].overhead_usec;
+    if (time_limit == SIM_TIME_NEVER && !g_serve_socket)
+        time_limit = SIM_SEC(60) + g_num_commands * (g_command_interval + g_command_jitter + SIM_SEC(HOST_MAX_WAIT_TIME_SEC));
+
+    sim_init(lookahead, seed);
+    g_host_rng = sim_rand_seed(0x300);
+    g_spi_rng = sim_rand_seed(0x400);
+    g_spi.rng = &g_spi_rng;
+    g_lime2 = sim_node_create("lime2", &sim_lime2_ops);
+    g_remote = sim_node_create(g_remote_names[0], g_remote_ops[0]);
+    g_remote->clock_ppm = clock_ppm;
+    g_lime2->port_observer = PortObserver;
+    g_remote->port_observer = PortObserver;
+    g_remotes[0] = g_remote;
+    g_num_remotes = g_broadcast > 1 ? g_broadcast : g_neighbour ? 2 : 1;
+    for (unsigned i = 1; i < g_num_remotes; i++)
+    {
+        g_remotes[i] = sim_node_create(g_remote_names[i], g_remote_ops[i]);
+        g_remotes[i]->clock_ppm = clock_ppm;
+        g_remotes[i]->port_observer = PortObserver;
+    }
+    g_remote2 = g_remotes[1];
+
+    if (g_serve_socket)
+    {
+        signal(SIGINT, StopServing);
+        signal(SIGTERM, StopServing);
+        printf("serving SPI messages for %s on %s, press CTRL+C to stop\n", g_lime2->name, g_serve_socket);
+        fflush(stdout);
+
+        sim_actor_create("linux", BridgeThread, NULL);
+        sim_run(time_limit);
+
+        PrintNodeStats();
+        fflush(stdout);
+        _Exit(0);
+    }
+
+    g_host = sim_actor_create("host", HostThread, NULL);
+
+    int timed_out = sim_run(time_limit);
+
+    static summary_t sum;
+    Summarize(&sum);
+    if (g_csv)
+    {
+        PrintCsv(&sum, 0);
+    }
+    else
+    {
+        if (timed_out)
+            printf("time limit of %.0f s reached\n", time_limit / 1e6);
+        PrintResults(&sum);
+    }
+    fflush(stdout);
+
+    // firmware threads never return: do not join them
+    _Exit(timed_out ? 2 : 0);
+}
@@ -0,0 +1,316 @@
+/***********************************************************************************
+
+Filename:           sim_bridge.c
+
+Description:        Unix socket bridge between real Linux processes using spidev and the
+                    USART0 of a simulated node.
+
+Operation:          See sim_bridge.h
+
+***********************************************************************************/
+
+/***********************************************************************************
+* INCLUDES
+*/
+#define _GNU_SOURCE
+#include "sim_bridge.h"
+#include "sim_spi.h"
+
+#include <errno.h>
+#include <linux/gpio.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/***********************************************************************************
+* CONSTANTS
+*/
+#define SIM_BRIDGE_TICK_USEC            (1000)      // virtual time step while no request is pending
+#define SIM_BRIDGE_MAX_CLIENTS          (8)
+
+
+/***********************************************************************************
+* LOCAL VARIABLES
+*/
+
+typedef struct
+{
+    int             fd;
+    uint8_t         edges;                      // 0: SPI client, else edge events subscriber
+    uint32_t        offset;
+    uint32_t        seqno;
+} bridge_client_t;
+
+static struct timespec  g_wall_start;
+static sim_time_t       g_virt_start;
+
+static bridge_client_t  g_clients[SIM_BRIDGE_MAX_CLIENTS];
+static int              g_num_clients;
+static int              g_event_line;
+static uint32_t         g_event_seqno;
+
+
+/***********************************************************************************
+* LOCAL FUNCTIONS
+*/
+
+static sim_time_t WallElapsed(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (sim_time_t)(now.tv_sec - g_wall_start.tv_sec) * 1000000u +
+           (now.tv_nsec - g_wall_start.tv_nsec) / 1000;
+}
+
+/* usecs the virtual clock is ahead of the wall clock (0 if it's behind) */
+static sim_time_t VirtualLead(void)
+{
+    sim_time_t virt = sim_now() - g_virt_start;
+    sim_time_t wall = WallElapsed();
+    return virt > wall ? virt - wall : 0;
+}
+
+static void WaitForWallClock(void)
+{
+    sim_time_t lead = VirtualLead();
+    if (lead)
+    {
+        struct timespec ts = { lead / 1000000u, (lead % 1000000u) * 1000 };
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+static int ReadFull(int fd, void* buf, size_t len)
+{
+    uint8_t* p = buf;
+    while (len)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int WriteFull(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = buf;
+    while (len)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int Subscribe(bridge_client_t* client)
+{
+    sim_bridge_events_req_t req;
+    sim_bridge_rsp_t rsp = { 0, 0 };
+
+    if (ReadFull(client->fd, &req, sizeof(req)) < 0)
+        return -1;
+    if (req.edges == 0)
+        rsp.status = -EINVAL;
+    if (WriteFull(client->fd, &rsp, sizeof(rsp)) < 0)
+        return -1;
+    client->edges = req.edges;
+    client->offset = req.offset;
+    return 0;
+}
+
+/* returns -1 if the client must be disconnected */
+static int HandleRequest(bridge_client_t* client, sim_actor_t* self, sim_node_t* slave, const sim_spi_config_t* cfg)
+{
+    int fd = client->fd;
+    static uint8_t          mosi[SIM_BRIDGE_MAX_LEN];
+    static uint8_t          miso[SIM_BRIDGE_MAX_LEN];
+    static sim_spi_xfer_t   xfers[SIM_BRIDGE_MAX_XFERS];
+
+    sim_bridge_req_t req;
+    sim_bridge_rsp_t rsp = { 0, 0 };
+    size_t total = 0;
+
+    if (client->edges)
+        return -1;                  // events subscribers are not supposed to write anything
+    if (ReadFull(fd, &req, sizeof(req)) < 0)
+        return -1;
+    if (req.num_xfers == SIM_BRIDGE_REQ_EVENTS)
+        return Subscribe(client);
+    if (req.num_xfers == 0 || req.num_xfers > SIM_BRIDGE_MAX_XFERS)
+        rsp.status = -EINVAL;
+
+    for (unsigned n = 0; n < req.num_xfers; n++)
+    {
+        sim_bridge_xfer_t x;
+        if (ReadFull(fd, &x, sizeof(x)) < 0)
+            return -1;
+        if (total + x.len > SIM_BRIDGE_MAX_LEN)
+            return -1;              // cannot even consume the payload: drop the client
+        if (ReadFull(fd, mosi + total, x.len) < 0)
+            return -1;
+
+        if (n < SIM_BRIDGE_MAX_XFERS)
+        {
+            xfers[n].tx = mosi + total;
+            xfers[n].rx = miso + total;
+            xfers[n].len = x.len;
+            xfers[n].speed_hz = x.speed_hz;
+            xfers[n].delay_usecs = x.delay_usecs;
+            xfers[n].cs_change = x.cs_change;
+        }
+        total += x.len;
+    }
+
+    if (rsp.status == 0)
+    {
+        sim_spi_message(self, slave, cfg, xfers, req.num_xfers);
+        rsp.len = total;
+
+        // like the real spidev, return only once the transfer is over
+        WaitForWallClock();
+    }
+
+    if (WriteFull(fd, &rsp, sizeof(rsp)) < 0 || WriteFull(fd, miso, rsp.len) < 0)
+        return -1;
+    return 0;
+}
+
+
+/***********************************************************************************
+* GLOBAL FUNCTIONS
+*/
+
+void sim_bridge_set_event_line(int value)
+{
+    value = value != 0;
+    if (value == g_event_line)
+        return;
+    g_event_line = value;
+
+    struct gpio_v2_line_event ev;
+    struct timespec now;
+    memset(&ev, 0, sizeof(ev));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ev.timestamp_ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    ev.id = value ? GPIO_V2_LINE_EVENT_RISING_EDGE : GPIO_V2_LINE_EVENT_FALLING_EDGE;
+    ev.seqno = ++g_event_seqno;
+
+    for (int i = 0; i < g_num_clients; i++)
+    {
+        bridge_client_t* client = &g_clients[i];
+        if (!(client->edges & (value ? SIM_BRIDGE_EDGE_RISING : SIM_BRIDGE_EDGE_FALLING)))
+            continue;
+        ev.offset = client->offset;
+        ev.line_seqno = ++client->seqno;
+        // a failure means the process went away: the serve loop will notice the hangup
+        WriteFull(client->fd, &ev, sizeof(ev));
+    }
+}
+
+int sim_bridge_serve(sim_actor_t* self, sim_node_t* slave, const sim_spi_config_t* cfg,
+                     const char* socket_path, volatile int* stop)
+{
+    struct sockaddr_un addr;
+    struct pollfd fds[1 + SIM_BRIDGE_MAX_CLIENTS];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        perror("sim: socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4) < 0)
+    {
+        perror("sim: cannot listen on the bridge socket");
+        close(listen_fd);
+        return -1;
+    }
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+
+    clock_gettime(CLOCK_MONOTONIC, &g_wall_start);
+    g_virt_start = sim_now();
+
+    while (!*stop)
+    {
+        // sleep until either the wall clock reaches the virtual clock or a request arrives
+        sim_time_t lead = VirtualLead();
+        struct timespec timeout = { lead / 1000000u, (lead % 1000000u) * 1000 };
+        for (int i = 0; i < g_num_clients; i++)
+        {
+            fds[1 + i].fd = g_clients[i].fd;
+            fds[1 + i].events = POLLIN;
+            fds[1 + i].revents = 0;
+        }
+        int ret = ppoll(fds, 1 + g_num_clients, &timeout, NULL);
+        if (ret < 0 && errno != EINTR)
+        {
+            perror("sim: ppoll");
+            break;
+        }
+
+        if (ret > 0)
+        {
+            for (int i = 0, n = g_num_clients; i < n; i++)
+            {
+                if (!fds[1 + i].revents)
+                    continue;
+                if (!(fds[1 + i].revents & POLLIN) || HandleRequest(&g_clients[i], self, slave, cfg) < 0)
+                {
+                    close(g_clients[i].fd);
+                    g_clients[i].fd = -1;
+                }
+            }
+            for (int i = 0; i < g_num_clients; i++)
+            {
+                if (g_clients[i].fd < 0)
+                    g_clients[i--] = g_clients[--g_num_clients];
+            }
+
+            if ((fds[0].revents & POLLIN) && g_num_clients < SIM_BRIDGE_MAX_CLIENTS)
+            {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd >= 0)
+                {
+                    memset(&g_clients[g_num_clients], 0, sizeof(g_clients[0]));
+                    g_clients[g_num_clients++].fd = fd;
+                }
+            }
+            continue;
+        }
+
+        // nothing to do: let the simulated nodes run
+        if (VirtualLead() == 0)
+            sim_advance(self, SIM_BRIDGE_TICK_USEC);
+    }
+
+    for (int i = 0; i < g_num_clients; i++)
+        close(g_clients[i].fd);
+    g_num_clients = 0;
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
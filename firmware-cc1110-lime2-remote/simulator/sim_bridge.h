@@ -0,0 +1,31 @@
+/***********************************************************************************
+
+Filename:           sim_bridge.h
+
+Description:        Unix socket bridge between real Linux processes using spidev and the
+                    USART0 of a simulated node.
+
+Operation:          See sim_bridge_proto.h
+
+***********************************************************************************/
+
+#ifndef SIM_BRIDGE_H
+#define SIM_BRIDGE_H
+
+#include "sim_bridge_proto.h"
+#include "sim_spi.h"
+
+/***********************************************************************************
+* FUNCTIONS
+*/
+
+/* Serves SPI messages received on the socket until *stop becomes non-zero; runs in the
+   context of the actor "self" and paces the virtual time to the wall clock. */
+int             sim_bridge_serve(sim_actor_t* self, sim_node_t* slave, const sim_spi_config_t* cfg,
+                                 const char* socket_path, volatile int* stop);
+
+/* New value of the "event pending" line of the slave: sends the edge events to the
+   processes which requested them. Can be called from any actor. */
+void            sim_bridge_set_event_line(int value);
+
+#endif
@@ -0,0 +1,85 @@
+/***********************************************************************************
+
+Filename:           sim_bridge_proto.h
+
+Description:        Protocol of the Unix socket bridge between real Linux processes using
+                    spidev and the USART0 of a simulated node.
+
+Operation:          libspidev_sim.so (spidev_shim.c), preloaded in a process, turns every
+                    SPI_IOC_MESSAGE ioctl on the emulated spidev device into one request
+                    on the bridge socket. The simulator (lime2sim --serve) executes the
+                    message on the simulated USART0, byte by byte in full duplex, and
+                    replies with the bytes sampled on MISO.
+
+                    While serving, the virtual time of the simulator is paced to the wall
+                    clock, so that the sleeps and timeouts of the Linux processes keep
+                    their meaning; the reply to each request is sent only when the wall
+                    clock has reached the end of the SPI transfer.
+
+                    Request:    sim_bridge_req_t, then for each transfer one
+                                sim_bridge_xfer_t followed by "len" MOSI bytes
+                    Reply:      sim_bridge_rsp_t, then the MISO bytes of every transfer
+
+                    The "event pending" line of the simulated node is exported the same
+                    way: the GPIO_V2_GET_LINE_IOCTL on the emulated GPIO chip opens a new
+                    connection and sends
+                    Request:    sim_bridge_req_t with num_xfers = SIM_BRIDGE_REQ_EVENTS,
+                                then sim_bridge_events_req_t
+                    Reply:      sim_bridge_rsp_t with len = 0
+                    after which the simulator writes one struct gpio_v2_line_event on the
+                    connection for every requested edge of the line, so that the socket
+                    itself can be returned as the line descriptor (read() and poll() work
+                    as on the real one).
+
+***********************************************************************************/
+
+#ifndef SIM_BRIDGE_PROTO_H
+#define SIM_BRIDGE_PROTO_H
+
+#include <stdint.h>
+
+/***********************************************************************************
+* CONSTANTS
+*/
+
+#define SIM_BRIDGE_DEFAULT_SOCKET       "/tmp/lime2sim.sock"
+#define SIM_BRIDGE_DEFAULT_DEVICE       "/dev/spidev2.0"
+#define SIM_BRIDGE_DEFAULT_GPIOCHIP     "/dev/gpiochip0"
+
+#define SIM_BRIDGE_MAX_XFERS            (64)
+#define SIM_BRIDGE_MAX_LEN              (4096)      // per message, summing all transfers
+
+#define SIM_BRIDGE_REQ_EVENTS           (0xFF)      // num_xfers of an edge events subscription
+#define SIM_BRIDGE_EDGE_RISING          (0x01)
+#define SIM_BRIDGE_EDGE_FALLING         (0x02)
+
+/***********************************************************************************
+* TYPES
+*/
+
+typedef struct __attribute__((packed))
+{
+    uint8_t         num_xfers;
+} sim_bridge_req_t;
+
+typedef struct __attribute__((packed))
+{
+    uint16_t        len;
+    uint32_t        speed_hz;
+    uint16_t        delay_usecs;
+    uint8_t         cs_change;
+} sim_bridge_xfer_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t        offset;                     // line offset copied in the events
+    uint8_t         edges;                      // SIM_BRIDGE_EDGE_xxx
+} sim_bridge_events_req_t;
+
+typedef struct __attribute__((packed))
+{
+    int32_t         status;                     // 0 or -errno
+    uint16_t        len;                        // MISO bytes following
+} sim_bridge_rsp_t;
+
+#endif
@@ -0,0 +1,425 @@
+/***********************************************************************************
+
+Filename:           sim_core.c
+
+Description:        Deterministic virtual-time scheduler of the firmware simulator.
+
+Operation:          See sim_core.h
+
+***********************************************************************************/
+
+/***********************************************************************************
+* INCLUDES
+*/
+#include "sim_core.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/***********************************************************************************
+* CONSTANTS
+*/
+#define SIM_MAX_ACTORS                  (16)
+#define SIM_MAX_EVENTS                  (1024)
+#define SIM_ACTOR_STACK_SIZE            (256*1024)
+
+typedef enum
+{
+    ACTOR_READY,                // running or waiting for its wake time
+    ACTOR_DONE                  // actor body returned
+} actor_state_e;
+
+struct sim_actor
+{
+    const char*         name;
+    int                 index;
+    actor_state_e       state;
+    sim_time_t          now;            // local virtual time
+    sim_time_t          wake;           // virtual time at which it will run again
+    int                 wakeable;       // inside sim_idle()
+    sim_actor_fn        body;
+    void*               arg;
+    pthread_t           thread;
+    pthread_cond_t      cond;
+};
+
+typedef struct
+{
+    sim_time_t          when;
+    uint64_t            seq;
+    sim_event_fn        fn;
+    void*               arg;
+} sim_event_t;
+
+
+/***********************************************************************************
+* LOCAL VARIABLES
+*/
+
+static struct
+{
+    sim_actor_t         actors[SIM_MAX_ACTORS];
+    int                 num_actors;
+
+    sim_event_t         events[SIM_MAX_EVENTS];         // binary min-heap on (when, seq)
+    int                 num_events;
+    uint64_t            event_seq;
+
+    sim_actor_t*        running;        // owner of the baton
+    sim_time_t          now;            // time of the running actor/event
+    sim_time_t          horizon;        // the running actor can advance without rescheduling up to here
+    sim_time_t          lookahead;
+    uint64_t            seed;
+
+    int                 stopped;
+    int                 timed_out;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      main_cond;
+} g_sim;
+
+int g_sim_verbose = 0;
+
+
+/***********************************************************************************
+* LOCAL FUNCTIONS
+*/
+
+static int EventBefore(const sim_event_t* a, const sim_event_t* b)
+{
+    return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static void EventPush(sim_event_t ev)
+{
+    if (g_sim.num_events == SIM_MAX_EVENTS)
+    {
+        fprintf(stderr, "sim: event queue overflow\n");
+        abort();
+    }
+
+    int i = g_sim.num_events++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (!EventBefore(&ev, &g_sim.events[parent]))
+            break;
+        g_sim.events[i] = g_sim.events[parent];
+        i = parent;
+    }
+    g_sim.events[i] = ev;
+}
+
+static sim_event_t EventPop(void)
+{
+    sim_event_t top = g_sim.events[0];
+    sim_event_t last = g_sim.events[--g_sim.num_events];
+
+    int i = 0;
+    for (;;)
+    {
+        int child = 2*i + 1;
+        if (child >= g_sim.num_events)
+            break;
+        if (child + 1 < g_sim.num_events && EventBefore(&g_sim.events[child+1], &g_sim.events[child]))
+            child++;
+        if (!EventBefore(&g_sim.events[child], &last))
+            break;
+        g_sim.events[i] = g_sim.events[child];
+        i = child;
+    }
+    if (g_sim.num_events > 0)
+        g_sim.events[i] = last;
+    return top;
+}
+
+static sim_time_t SaturatingAdd(sim_time_t a, sim_time_t b)
+{
+    return (a > SIM_TIME_NEVER - b) ? SIM_TIME_NEVER : a + b;
+}
+
+static void UpdateHorizon(const sim_actor_t* self)
+{
+    sim_time_t h = g_sim.num_events ? g_sim.events[0].when : SIM_TIME_NEVER;
+    for (int i = 0; i < g_sim.num_actors; i++)
+    {
+        const sim_actor_t* a = &g_sim.actors[i];
+        if (a == self || a->state != ACTOR_READY)
+            continue;
+        sim_time_t limit = SaturatingAdd(a->wake, g_sim.lookahead);
+        if (limit < h)
+            h = limit;
+    }
+    g_sim.horizon = h;
+}
+
+static void WaitForBaton(sim_actor_t* self)
+{
+    pthread_mutex_lock(&g_sim.lock);
+    while (g_sim.running != self)
+        pthread_cond_wait(&self->cond, &g_sim.lock);
+    pthread_mutex_unlock(&g_sim.lock);
+}
+
+static void PassBaton(sim_actor_t* self, sim_actor_t* next)
+{
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.running = next;
+    if (next)
+        pthread_cond_signal(&next->cond);
+    else
+        pthread_cond_signal(&g_sim.main_cond);
+    if (self)
+    {
+        while (g_sim.running != self)
+            pthread_cond_wait(&self->cond, &g_sim.lock);
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+}
+
+/*
+ * Runs pending events and hands the baton to the next actor in virtual-time order.
+ * Returns when "self" is the next actor to run (never returns once stopped).
+ */
+static void Schedule(sim_actor_t* self)
+{
+    for (;;)
+    {
+        sim_actor_t* next = NULL;
+
+        if (!g_sim.stopped)
+        {
+            for (int i = 0; i < g_sim.num_actors; i++)
+            {
+                sim_actor_t* a = &g_sim.actors[i];
+                if (a->state == ACTOR_READY && (!next || a->wake < next->wake))
+                    next = a;
+            }
+
+            if (g_sim.num_events && (!next || g_sim.events[0].when <= next->wake))
+            {
+                sim_event_t ev = EventPop();
+                g_sim.running = NULL;
+                g_sim.now = ev.when;
+                ev.fn(ev.arg);
+                continue;
+            }
+
+            if (!next)
+                g_sim.stopped = 1;
+        }
+
+        if (g_sim.stopped)
+            next = NULL;            // wake up the main thread and sleep forever
+
+        if (next != self)
+            PassBaton(self, next);
+
+        if (!self)
+            return;
+
+        // we own the baton again:
+        g_sim.running = self;
+        self->now = self->wake;
+        g_sim.now = self->now;
+        UpdateHorizon(self);
+        return;
+    }
+}
+
+static void* ActorThread(void* arg)
+{
+    sim_actor_t* self = (sim_actor_t*)arg;
+
+    WaitForBaton(self);
+    g_sim.running = self;
+    g_sim.now = self->now;
+    UpdateHorizon(self);
+
+    self->body(self->arg);
+
+    // the actor body returned: never schedule it again
+    self->state = ACTOR_DONE;
+    Schedule(self);
+    return NULL;
+}
+
+static void TimeLimitEvent(void* arg)
+{
+    (void)arg;
+    g_sim.timed_out = 1;
+    g_sim.stopped = 1;
+}
+
+
+/***********************************************************************************
+* GLOBAL FUNCTIONS
+*/
+
+void sim_init(sim_time_t lookahead, uint64_t seed)
+{
+    memset(&g_sim, 0, sizeof(g_sim));
+    g_sim.lookahead = lookahead;
+    g_sim.seed = seed ? seed : 1;
+    pthread_mutex_init(&g_sim.lock, NULL);
+    pthread_cond_init(&g_sim.main_cond, NULL);
+}
+
+sim_actor_t* sim_actor_create(const char* name, sim_actor_fn body, void* arg)
+{
+    if (g_sim.num_actors == SIM_MAX_ACTORS)
+    {
+        fprintf(stderr, "sim: too many actors\n");
+        abort();
+    }
+
+    sim_actor_t* a = &g_sim.actors[g_sim.num_actors];
+    a->name = name;
+    a->index = g_sim.num_actors++;
+    a->state = ACTOR_READY;
+    a->now = a->wake = g_sim.now;
+    a->body = body;
+    a->arg = arg;
+    pthread_cond_init(&a->cond, NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SIM_ACTOR_STACK_SIZE);
+    if (pthread_create(&a->thread, &attr, ActorThread, a) != 0)
+    {
+        perror("sim: pthread_create");
+        abort();
+    }
+    pthread_attr_destroy(&attr);
+    return a;
+}
+
+const char* sim_actor_name(const sim_actor_t* actor)
+{
+    return actor->name;
+}
+
+sim_actor_t* sim_current(void)
+{
+    return g_sim.running;
+}
+
+sim_time_t sim_now(void)
+{
+    return g_sim.now;
+}
+
+void sim_advance(sim_actor_t* self, sim_time_t usec)
+{
+    if (self != g_sim.running)
+    {
+        fprintf(stderr, "sim: actor %s advanced time without owning the baton\n", self->name);
+        abort();
+    }
+
+    self->wake = self->now + usec;
+    if (self->wake < g_sim.horizon)
+    {
+        // fast path: nobody else needs to run before us
+        self->now = self->wake;
+        g_sim.now = self->now;
+        return;
+    }
+
+    Schedule(self);
+}
+
+void sim_idle(sim_actor_t* self, sim_time_t max_usec)
+{
+    self->wakeable = 1;
+    sim_advance(self, max_usec);
+    self->wakeable = 0;
+}
+
+void sim_wakeup(sim_actor_t* actor)
+{
+    if (!actor->wakeable || actor == g_sim.running)
+        return;
+
+    sim_time_t when = g_sim.now > actor->now ? g_sim.now : actor->now;
+    if (when < actor->wake)
+    {
+        actor->wake = when;
+        sim_time_t limit = SaturatingAdd(when, g_sim.lookahead);
+        if (limit < g_sim.horizon)
+            g_sim.horizon = limit;
+    }
+}
+
+void sim_event_at(sim_time_t when, sim_event_fn fn, void* arg)
+{
+    sim_event_t ev = { when, g_sim.event_seq++, fn, arg };
+    EventPush(ev);
+    if (when < g_sim.horizon)
+        g_sim.horizon = when;
+}
+
+int sim_run(sim_time_t time_limit)
+{
+    if (time_limit != SIM_TIME_NEVER)
+        sim_event_at(time_limit, TimeLimitEvent, NULL);
+
+    Schedule(NULL);
+
+    pthread_mutex_lock(&g_sim.lock);
+    while (!g_sim.stopped || g_sim.running != NULL)
+        pthread_cond_wait(&g_sim.main_cond, &g_sim.lock);
+    pthread_mutex_unlock(&g_sim.lock);
+
+    return g_sim.timed_out;
+}
+
+void sim_stop(void)
+{
+    g_sim.stopped = 1;
+
+    sim_actor_t* self = g_sim.running;
+    if (self)
+        Schedule(self);             // never returns
+}
+
+uint32_t sim_rand_u32(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+double sim_rand_uniform(uint64_t* state)
+{
+    return sim_rand_u32(state) / 4294967296.0;
+}
+
+uint64_t sim_rand_seed(uint32_t stream)
+{
+    // splitmix64 of (seed, stream): never returns 0
+    uint64_t z = g_sim.seed + 0x9E3779B97F4A7C15ULL * (stream + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+void sim_trace(const char* who, const char* fmt, ...)
+{
+    if (!g_sim_verbose)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%10.6f %-8s ", g_sim.now / 1e6, who);
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+}
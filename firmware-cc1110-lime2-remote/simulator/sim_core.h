@@ -0,0 +1,87 @@
+/***********************************************************************************
+
+Filename:           sim_core.h
+
+Description:        Deterministic virtual-time scheduler of the firmware simulator.
+
+Operation:          Every simulated entity (a CC1110 node running the unmodified
+                    firmware, the Linux SPI master, ...) is an "actor" running in its own
+                    thread. Only one actor runs at any time: the scheduler hands the
+                    baton to the actor (or event) with the smallest virtual time, ties
+                    broken by creation order, so that every run with the same seed
+                    produces exactly the same trace.
+
+                    To avoid a thread switch for each simulated instruction, an actor is
+                    allowed to run ahead of the others by at most "lookahead" usecs.
+                    Interactions among actors (SPI bytes, radio frames) are delivered
+                    through events and interrupts, so this only affects the ordering of
+                    actions closer in time than the lookahead.
+
+***********************************************************************************/
+
+#ifndef SIM_CORE_H
+#define SIM_CORE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/***********************************************************************************
+* TYPES
+*/
+
+typedef uint64_t                    sim_time_t;         /* virtual time in usecs */
+
+#define SIM_TIME_NEVER              ((sim_time_t)UINT64_MAX)
+#define SIM_MSEC(x)                 ((sim_time_t)(x)*1000u)
+#define SIM_SEC(x)                  ((sim_time_t)(x)*1000000u)
+
+typedef struct sim_actor            sim_actor_t;
+typedef void                        (*sim_actor_fn)(void* arg);
+typedef void                        (*sim_event_fn)(void* arg);
+
+/***********************************************************************************
+* SCHEDULER
+*/
+
+void            sim_init(sim_time_t lookahead, uint64_t seed);
+
+sim_actor_t*    sim_actor_create(const char* name, sim_actor_fn body, void* arg);
+const char*     sim_actor_name(const sim_actor_t* actor);
+
+/* The actor which currently owns the baton (NULL while an event callback runs). */
+sim_actor_t*    sim_current(void);
+
+/* Current virtual time of the running actor or event. */
+sim_time_t      sim_now(void);
+
+/* Spend the given amount of (busy) virtual time. */
+void            sim_advance(sim_actor_t* self, sim_time_t usec);
+
+/* Wait for at most the given amount of virtual time; returns earlier if some other
+   actor or event calls sim_wakeup() on this actor. */
+void            sim_idle(sim_actor_t* self, sim_time_t max_usec);
+void            sim_wakeup(sim_actor_t* actor);
+
+/* Schedule a callback at the given absolute virtual time. Callbacks must not block
+   nor advance time. */
+void            sim_event_at(sim_time_t when, sim_event_fn fn, void* arg);
+
+/* Runs the simulation until sim_stop() is called or the time limit is reached.
+   Returns 0 if stopped, 1 if the time limit was hit. */
+int             sim_run(sim_time_t time_limit);
+void            sim_stop(void);
+
+/***********************************************************************************
+* UTILITIES
+*/
+
+/* Deterministic pseudo-random numbers (xorshift64*) */
+uint32_t        sim_rand_u32(uint64_t* state);
+double          sim_rand_uniform(uint64_t* state);          /* in [0,1) */
+uint64_t        sim_rand_seed(uint32_t stream);             /* independent stream from the global seed */
+
+extern int      g_sim_verbose;
+
+void            sim_trace(const char* who, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,826 @@
+/***********************************************************************************
+
+Filename:           sim_hal.c
+
+Description:        Host implementation of the BSP, bsp_extended and MRFI APIs used by
+                    the firmware, plus the USART0/interrupt emulation of a CC1110.
+
+Operation:          This file is compiled and linked once per simulated node together
+                    with the unmodified main.c, lime2.c and remote.c (see the Makefile).
+
+                    Virtual time advances only at the points where the firmware spends
+                    time: BSP_DELAY_USECS(), MRFI_DelayMs(), BSP_SleepFor(), radio
+                    operations and BSP_MAIN_LOOP_TICK() in the busy main loops.
+                    Interrupts are dispatched at those same points if enabled; interrupt
+                    sources raised by other actors (SPI bytes, received radio frames)
+                    preempt the firmware immediately when EA and the source are enabled,
+                    exactly like on the real core the ISR runs "between two instructions"
+                    of the interrupted code.
+                    The DMA channels triggered by USART0 (URX0/UTX0) are emulated as
+                    well: their descriptors are read from the XDATA addresses handed out
+                    by BSP_SimXdataAddress().
+
+***********************************************************************************/
+
+/***********************************************************************************
+* INCLUDES
+*/
+#include "bsp.h"
+#include "mrfi.h"
+#include "bsp_leds.h"
+#include "bsp_buttons.h"
+#include "bsp_extended.h"
+#include "ioCCxx10_bitdef.h"
+
+#include "sim_node.h"
+
+#include <math.h>
+#include <string.h>
+
+
+/***********************************************************************************
+* CONSTANTS
+*/
+
+/* about 1/10880 sec, as measured on the target for the busy main loop of the remote node */
+#ifndef SIM_MAIN_LOOP_TICK_USEC
+#define SIM_MAIN_LOOP_TICK_USEC         (92)
+#endif
+
+/* crystal oscillator start-up after leaving PM2 */
+#define SIM_XOSC_STARTUP_USEC           (300)
+
+/* sleep timer: 32.768 kHz periods per step for each WORCTL resolution */
+#define SIM_SLEEP_TIMER_HZ              32768u
+static const uint32_t g_sleepTimerPeriods[4] = { 1, 1u<<5, 1u<<10, 1u<<15 };
+
+/* preamble bytes sent for each MDMCFG1.NUM_PREAMBLE value */
+static const uint8_t g_preambleBytes[8] = { 2, 3, 4, 6, 8, 12, 16, 24 };
+
+/* same SmartRF modem settings used by mrfi_radio.c */
+#define SIM_MRFI_MDMCFG4                0xF6
+#define SIM_MRFI_MDMCFG3                0x83
+#define SIM_MRFI_MDMCFG1                0x22
+#define SIM_MRFI_RADIO_OSC_FREQ         26000000
+#define SIM_MRFI_PHY_PREAMBLE_SYNC      8
+#define MRFI_BACKOFF_PERIOD_USECS       __mrfi_BACKOFF_PERIOD_USECS__
+
+#define SIM_ADC_BATTERY_H               0x05        // about 80 = "FULL BATTERY" once scaled by remote.c
+#define SIM_ADC_BATTERY_L               0x40
+
+#define USART_CSR_ACTIVE                0x01
+
+/* DMA: channel 0 has its own descriptor, channels 1-4 have consecutive ones */
+#define SIM_DMA_CHANNELS                5
+#define SIM_DMA_DESC_SIZE               8
+#define SIM_DMA_TRIG_URX0               14
+#define SIM_DMA_TRIG_UTX0               15
+#define SIM_XDATA_OBJECTS               16
+
+
+/***********************************************************************************
+* GLOBAL VARIABLES
+*/
+
+volatile sim_sfr_t sim_sfr;
+const uint8_t mrfiBroadcastAddr[] = { 0xFF, 0xFF, 0xFF, 0xFF };
+
+/* from mrfi_f1f2.h */
+uint8_t MRFI_RxAddrIsFiltered(uint8_t* pAddr);
+
+/* the firmware main(), renamed at compile time */
+void fw_main(void);
+
+/* USART0 and port 0 ISRs: only the "lime2" firmware defines them */
+void ut0rx_isr(void) __attribute__((weak));
+void ut0tx_isr(void) __attribute__((weak));
+void p0int_isr(void) __attribute__((weak));
+void dma_isr(void) __attribute__((weak));
+
+
+/***********************************************************************************
+* LOCAL VARIABLES
+*/
+
+static sim_node_t*      s_node;
+static uint8_t          s_inIsr = 0;
+static uint32_t         s_isrCount = 0;                // ISRs served so far, to end BSP_IdleFor()
+static sim_time_t       s_sleepTimerReset = 0;         // when the sleep timer was last reset (WORCTL.WOR_RESET)
+
+/* MRFI */
+static uint8_t          s_mrfiRadioState = MRFI_RADIO_STATE_UNKNOWN;
+static mrfiPacket_t     s_mrfiIncomingPacket;
+static uint8_t          s_rxPending = 0;
+static sim_time_t       s_rxOnSince = 0;
+static sim_time_t       s_rxCarrierCheck = SIM_TIME_NEVER;     // MCSM2.RX_TIME_RSSI: when the RSSI gets valid
+static uint8_t          s_rxFilterEnabled = 0;
+static uint8_t          s_rxFilterAddr[MRFI_ADDR_SIZE] = { 0xFF };
+static uint16_t         s_backoffHelperUsec = 0;
+static uint16_t         s_replyDelayScalar = 0;
+
+/* DMA */
+static volatile void*   s_xdataObjects[SIM_XDATA_OBJECTS];
+static uint8_t          s_numXdataObjects = 0;
+static uint16_t         s_dmaXferCount[SIM_DMA_CHANNELS];      // transfers done since armed
+
+
+/***********************************************************************************
+* LOCAL FUNCTIONS
+*/
+
+static void ObservePorts(void)
+{
+    uint8_t p[3] = { P0, P1, P2 };
+    for (uint8_t i = 0; i < 3; i++)
+        if (p[i] != s_node->ports[i])
+            sim_node_port_changed(s_node, i, p[i]);
+}
+
+/* the 16bit sleep timer (WORTIME1:WORTIME0) counts steps of the WORCTL resolution in every power
+   mode since it was last reset, restarting from 0 whenever it reaches WOREVT1:WOREVT0 (Event0) */
+static void UpdateSleepTimer(void)
+{
+    double hz = SIM_SLEEP_TIMER_HZ * (1 + s_node->clock_ppm / 1e6);
+    uint64_t periods = (uint64_t)((sim_now() - s_sleepTimerReset) * hz / 1e6);
+    uint32_t event0 = ((uint32_t)WOREVT1 << 8) | WOREVT0;
+    uint16_t wortime = (uint16_t)(periods / g_sleepTimerPeriods[WORCTL & 0x03] % (event0 ? event0 : 0x10000));
+    WORTIME0 = (uint8_t)wortime;
+    WORTIME1 = (uint8_t)(wortime >> 8);
+}
+
+static void RfIsr(void)
+{
+    uint8_t frameLen = s_mrfiIncomingPacket.frame[__mrfi_LENGTH_FIELD_OFS__];
+
+    /* same checks done by the real MRFI receive ISR */
+    if ((s_mrfiIncomingPacket.rxMetrics[MRFI_RX_METRICS_CRC_LQI_OFS] & __mrfi_RX_METRICS_CRC_OK_MASK__) &&
+        (frameLen + __mrfi_LENGTH_FIELD_SIZE__) <= MRFI_MAX_FRAME_SIZE &&
+        frameLen >= __mrfi_HEADER_SIZE__ &&
+        !MRFI_RxAddrIsFiltered(MRFI_P_DST_ADDR(&s_mrfiIncomingPacket)))
+    {
+        s_mrfiIncomingPacket.rxMetrics[MRFI_RX_METRICS_CRC_LQI_OFS] &= __mrfi_RX_METRICS_LQI_MASK__;
+        MRFI_RxCompleteISR();
+    }
+
+    memset(s_mrfiIncomingPacket.frame, 0x00, sizeof(s_mrfiIncomingPacket.frame));
+}
+
+static volatile uint8_t* XdataPtr(uint8_t high, uint8_t low)
+{
+    uint8_t obj = high - 1;
+    if (high == 0 || obj >= s_numXdataObjects)
+        return NULL;
+    return (volatile uint8_t*)s_xdataObjects[obj] + low;
+}
+
+static volatile uint8_t* DmaDescriptor(uint8_t chan)
+{
+    volatile uint8_t* desc = chan == 0 ? XdataPtr(DMA0CFGH, DMA0CFGL) : XdataPtr(DMA1CFGH, DMA1CFGL);
+    return (desc && chan > 0) ? desc + (chan - 1) * SIM_DMA_DESC_SIZE : desc;
+}
+
+/* one single-byte transfer of every armed channel waiting for the trigger; fixed length,
+   byte-sized, single transfer mode only, which is all the firmware uses */
+static void DmaTrigger(uint8_t trig)
+{
+    static const int8_t incr[4] = { 0, 1, 2, -1 };
+
+    for (uint8_t ch = 0; ch < SIM_DMA_CHANNELS; ch++)
+    {
+        volatile uint8_t* desc = DmaDescriptor(ch);
+        if (!(DMAARM & BV(ch)) || !desc || (desc[6] & 0x1F) != trig)
+            continue;
+
+        uint16_t n = s_dmaXferCount[ch];
+        uint16_t len = ((desc[4] & 0x1F) << 8) | desc[5];
+        volatile uint8_t* src = XdataPtr(desc[0], desc[1]);
+        volatile uint8_t* dst = XdataPtr(desc[2], desc[3]);
+        if (src && dst)
+            dst[n * incr[(desc[7] >> 4) & 0x03]] = src[n * incr[desc[7] >> 6]];
+
+        s_dmaXferCount[ch] = ++n;
+        if (n >= len)
+        {
+            DMAARM &= ~BV(ch);
+            DMAIRQ |= BV(ch);
+            if (desc[7] & 0x08)         // IRQMASK
+                DMAIF = 1;
+        }
+    }
+}
+
+static void ServiceInterrupts(void)
+{
+    if (!EA || s_inIsr)
+        return;
+
+    s_inIsr = 1;
+    uint8_t guard;
+    for (guard = 0; guard < 8; guard++)
+    {
+        if (URX0IE && URX0IF && ut0rx_isr)
+        {
+            URX0IF = 0;                 // cleared by HW when vectoring
+            ut0rx_isr();
+        }
+        else if ((IEN2 & IEN2_UTX0IE) && UTX0IF && ut0tx_isr)
+        {
+            ut0tx_isr();                // the ISR must clear UTX0IF
+        }
+        else if (P0IE && P0IF && p0int_isr)
+        {
+            p0int_isr();                // the ISR must clear P0IFG and P0IF
+        }
+        else if (DMAIE && DMAIF && dma_isr)
+        {
+            dma_isr();                  // the ISR must clear DMAIRQ and DMAIF
+        }
+        else if ((IEN2 & IEN2_RFIE) && s_rxPending)
+        {
+            s_rxPending = 0;
+            RfIsr();
+        }
+        else
+            break;
+    }
+    s_inIsr = 0;
+
+    if (guard)
+    {
+        // like on the real core, an interrupt ends the idle mode (PM0)
+        s_isrCount += guard;
+        if (sim_current() != s_node->actor)
+            sim_wakeup(s_node->actor);
+    }
+}
+
+/* duration of the given sleep timer steps, with the clock skew of the node: rounded up, so that
+   the sleep timer reads the given steps when the event fires */
+static sim_time_t SleepTimerUsec(uint8_t res, uint16_t steps)
+{
+    double hz = SIM_SLEEP_TIMER_HZ * (1 + s_node->clock_ppm / 1e6);
+    return (sim_time_t)ceil(steps * g_sleepTimerPeriods[res & 0x03] * 1e6 / hz);
+}
+
+/* MCSM2.RX_TIME_RSSI: once the RSSI is valid, the radio goes to IDLE unless a carrier is sensed;
+   the MRFI state is left as it is, like on the real radio */
+static void RxCarrierCheck(void)
+{
+    if (sim_now() < s_rxCarrierCheck)
+        return;
+
+    s_rxCarrierCheck = SIM_TIME_NEVER;
+    if (!sim_radio_channel_busy(s_node))
+    {
+        sim_radio_set_state(s_node, SIM_RADIO_IDLE);
+        MARCSTATE = MARC_STATE_IDLE;
+    }
+}
+
+/* CPU busy for the given amount of time; pending interrupts are served afterwards */
+static void Spend(sim_time_t usec)
+{
+    // port writes done since the previous checkpoint happened "now"
+    ObservePorts();
+
+    // when the firmware runs inside an ISR raised by another actor, time is not accounted
+    if (sim_current() == s_node->actor)
+    {
+        if (s_rxCarrierCheck < sim_now() + usec)
+        {
+            sim_time_t before = s_rxCarrierCheck > sim_now() ? s_rxCarrierCheck - sim_now() : 0;
+            sim_advance(s_node->actor, before);
+            usec -= before;
+            RxCarrierCheck();
+        }
+        sim_advance(s_node->actor, usec);
+    }
+
+    UpdateSleepTimer();
+    ServiceInterrupts();
+    ObservePorts();
+}
+
+/* WORCTL.WOR_RESET: the firmware waits for the sleep timer to restart at the given resolution */
+static void ResetSleepTimer(uint8_t res, uint16_t event0)
+{
+    WORCTL = res & 0x03;
+    WOREVT1 = (uint8_t)(event0 >> 8);
+    WOREVT0 = (uint8_t)event0;
+    Spend(SleepTimerUsec(0, BSP_SLEEP_TIMER_RESET_TICKS));
+    s_sleepTimerReset = sim_now();
+    UpdateSleepTimer();
+}
+
+/* value returned by BSP_SleepFor() and BSP_IdleFor(): the steps of the sleep, if its sleep timer
+   event expired, plus the steps counted since then */
+static uint32_t SleptSteps(uint16_t steps, uint8_t expired)
+{
+    UpdateSleepTimer();
+    uint16_t wortime = ((uint16_t)WORTIME1 << 8) | WORTIME0;
+    return expired ? (uint32_t)steps + wortime : wortime;
+}
+
+static void SetRadio(sim_radio_state_e state)
+{
+    sim_radio_set_state(s_node, state);
+}
+
+static void Mrfi_RxModeOn(void)
+{
+    memset(s_mrfiIncomingPacket.frame, 0x00, sizeof(s_mrfiIncomingPacket.frame));
+    s_rxPending = 0;
+    s_rxOnSince = sim_now();
+    SetRadio(SIM_RADIO_RX);
+    MARCSTATE = MARC_STATE_RX;
+
+    // with MCSM2.RX_TIME_RSSI the radio ends RX by itself if it senses no carrier
+    s_rxCarrierCheck = (MCSM2 & MCSM2_RX_TIME_RSSI) ?
+        sim_now() + g_sim_radio.fs_cal_usec + g_sim_radio.rssi_valid_usec : SIM_TIME_NEVER;
+}
+
+static void Mrfi_RxModeOff(void)
+{
+    s_rxPending = 0;
+    s_rxCarrierCheck = SIM_TIME_NEVER;
+    SetRadio(SIM_RADIO_IDLE);
+    MARCSTATE = MARC_STATE_IDLE;
+}
+
+static void Mrfi_RandomBackoffDelay(void)
+{
+    uint8_t backoffs = (MRFI_RandomByte() & 0x0F) + 1;
+    for (uint8_t i = 0; i < backoffs; i++)
+        Spend(s_backoffHelperUsec);
+}
+
+
+/***********************************************************************************
+* BSP
+*/
+
+void BSP_Init(void)
+{
+    BSP_InitBoard();
+
+    /* LED driver */
+    __bsp_LED_CONFIG__(__bsp_LED1_BIT__, __bsp_LED1_PORT__, __bsp_LED1_DDR__, __bsp_LED1_IS_ACTIVE_LOW__);
+    __bsp_LED_CONFIG__(__bsp_LED2_BIT__, __bsp_LED2_PORT__, __bsp_LED2_DDR__, __bsp_LED2_IS_ACTIVE_LOW__);
+    BSP_TURN_OFF_LED1();
+    BSP_TURN_OFF_LED2();
+    ObservePorts();
+}
+
+void BSP_InitBoard(void)
+{
+    CLKCON = (CLKCON & ~CLKCON_OSC) | CLKSPD_DIV_1;
+}
+
+void BSP_Delay(uint16_t usec)
+{
+    Spend(usec);
+}
+
+void BSP_SimMainLoopTick(void)
+{
+    Spend(SIM_MAIN_LOOP_TICK_USEC);
+}
+
+void BSP_StartSleepTimer(void)
+{
+    ResetSleepTimer(0, BSP_SLEEP_TIMER_EVENT0);
+}
+
+uint32_t BSP_SleepFor(uint8_t mode, uint8_t res, uint16_t steps)
+{
+    MRFI_RxIdle();
+    MRFI_Sleep();
+    IEN2 &= ~IEN2_RFIE;                 // Disable RF interrupt
+
+    ResetSleepTimer(res, steps);
+
+    sim_time_t duration = SleepTimerUsec(res, steps);
+    if (mode == POWER_MODE_0)
+    {
+        Spend(duration);
+    }
+    else
+    {
+        SetRadio(SIM_RADIO_SLEEP);
+        Spend(duration);
+        SetRadio(SIM_RADIO_IDLE);
+        Spend(SIM_XOSC_STARTUP_USEC);
+    }
+
+    MRFI_WakeUp();
+#if !defined( END_DEVICE )
+    MRFI_RxOn();
+#endif
+    IEN2 |= IEN2_RFIE;                  // Enable RF interrupt
+    return SleptSteps(steps, 1);
+}
+
+uint32_t BSP_IdleFor(uint8_t res, uint16_t steps, volatile uint8_t* wakeFlag)
+{
+    ResetSleepTimer(res, steps);
+    ObservePorts();
+    if (*wakeFlag)
+        return SleptSteps(steps, 0);
+
+    // the CPU is halted until the sleep timer event or any interrupt served meanwhile
+    sim_time_t end = sim_now() + SleepTimerUsec(res, steps);
+    uint32_t isrCount = s_isrCount;
+    sim_node_set_cpu_halted(s_node, 1);
+    while (s_isrCount == isrCount && sim_now() < end)
+    {
+        sim_idle(s_node->actor, (s_rxCarrierCheck < end ? s_rxCarrierCheck : end) - sim_now());
+        RxCarrierCheck();
+        UpdateSleepTimer();
+    }
+    sim_node_set_cpu_halted(s_node, 0);
+    return SleptSteps(steps, sim_now() >= end);
+}
+
+uint8_t BSP_SleepUntilButton(uint8_t mode, uint8_t button)
+{
+    (void)mode;
+    (void)button;
+
+    MRFI_RxIdle();
+    MRFI_Sleep();
+    SetRadio(SIM_RADIO_SLEEP);
+
+    // the simulated buttons are never pushed
+    sim_idle(s_node->actor, SIM_TIME_NEVER - sim_now());
+    return 0;
+}
+
+uint16_t BSP_SimXdataAddress(volatile void* p)
+{
+    uint8_t obj;
+    for (obj = 0; obj < s_numXdataObjects; obj++)
+        if (s_xdataObjects[obj] == p)
+            break;
+
+    if (obj == s_numXdataObjects && s_numXdataObjects < SIM_XDATA_OBJECTS)
+        s_xdataObjects[s_numXdataObjects++] = p;
+
+    return (uint16_t)(obj + 1) << 8;
+}
+
+void BSP_SimDmaArm(uint8_t mask)
+{
+    for (uint8_t ch = 0; ch < SIM_DMA_CHANNELS; ch++)
+        if ((mask & BV(ch)) && !(DMAARM & BV(ch)))
+            s_dmaXferCount[ch] = 0;
+    DMAARM |= mask & (BV(SIM_DMA_CHANNELS) - 1);
+}
+
+void BSP_SimDmaAbort(uint8_t mask)
+{
+    DMAARM &= ~mask;
+}
+
+void BSP_createRandomAddress(addr_t* addr)
+{
+    for (uint8_t i = 0; i < NET_ADDR_SIZE; i++)
+        addr->addr[i] = MRFI_RandomByte();
+    if (addr->addr[0] == 0xFF || addr->addr[0] == 0x00)
+        addr->addr[0] = 0x79;
+}
+
+
+/***********************************************************************************
+* MRFI
+*/
+
+void MRFI_Init(void)
+{
+    s_mrfiRadioState = MRFI_RADIO_STATE_IDLE;
+    SetRadio(SIM_RADIO_IDLE);
+    MRFI_SetLogicalChannel(0);
+    MDMCFG1 = SIM_MRFI_MDMCFG1;
+
+    /* same backoff/reply-delay scaling done by mrfi_radio.c */
+    {
+        uint32_t dataRate, bits;
+        uint16_t exponent, mantissa;
+
+        mantissa = 256 + SIM_MRFI_MDMCFG3;
+        exponent = 28 - (SIM_MRFI_MDMCFG4 & 0x0F);
+        dataRate = mantissa * (SIM_MRFI_RADIO_OSC_FREQ >> exponent);
+        bits = ((uint32_t)((SIM_MRFI_PHY_PREAMBLE_SYNC + MRFI_MAX_FRAME_SIZE)*8))*10000;
+        s_replyDelayScalar = PLATFORM_FACTOR_CONSTANT + (((bits/dataRate)+5)/10);
+        s_backoffHelperUsec = MRFI_BACKOFF_PERIOD_USECS + (s_replyDelayScalar>>5)*1000;
+    }
+
+    /* enable general RF interrupts */
+    IEN2 |= IEN2_RFIE;
+
+    /* enable global interrupts */
+    BSP_ENABLE_INTERRUPTS();
+}
+
+uint8_t MRFI_Transmit(mrfiPacket_t* pPacket, uint8_t txType)
+{
+    uint8_t returnValue = MRFI_TX_RESULT_SUCCESS;
+    uint8_t frameLen = pPacket->frame[__mrfi_LENGTH_FIELD_OFS__] + __mrfi_LENGTH_FIELD_SIZE__;
+
+    /* Turn off reciever. We can ignore/drop incoming packets during transmit. */
+    Mrfi_RxModeOff();
+
+    /* the firmware may have changed the preamble length */
+    s_node->preamble_bytes = g_preambleBytes[(MDMCFG1 >> 4) & 0x07];
+
+    if (txType == MRFI_TX_TYPE_FORCED)
+    {
+        Spend(g_sim_radio.fs_cal_usec);
+        SetRadio(SIM_RADIO_TX);
+        sim_radio_transmit(s_node, pPacket->frame, frameLen);
+        Spend(sim_radio_airtime(s_node, frameLen));
+    }
+    else
+    {
+        uint8_t ccaRetries = MRFI_CCA_RETRIES;
+        while (1)
+        {
+            /* strobe RX, calibrate and wait for a valid RSSI */
+            SetRadio(SIM_RADIO_RX);
+            Spend(g_sim_radio.fs_cal_usec + g_sim_radio.rssi_valid_usec);
+
+            if (!sim_radio_cca_busy(s_node))
+            {
+                /* Clear Channel Assessment passed */
+                SetRadio(SIM_RADIO_TX);
+                sim_radio_transmit(s_node, pPacket->frame, frameLen);
+                Spend(sim_radio_airtime(s_node, frameLen));
+                break;
+            }
+
+            /* Clear Channel Assessment failed */
+            s_node->tx_cca_failures++;
+            if (ccaRetries != 0)
+            {
+                Mrfi_RxModeOff();
+                Mrfi_RandomBackoffDelay();
+                ccaRetries--;
+            }
+            else
+            {
+                returnValue = MRFI_TX_RESULT_FAILED;
+                break;
+            }
+        }
+    }
+
+    /* turn radio back off to put it in a known state */
+    Mrfi_RxModeOff();
+
+    /* If the radio was in RX state when transmit was attempted, put it back in RX state. */
+    if (s_mrfiRadioState == MRFI_RADIO_STATE_RX)
+        Mrfi_RxModeOn();
+
+    return returnValue;
+}
+
+void MRFI_Receive(mrfiPacket_t* pPacket)
+{
+    *pPacket = s_mrfiIncomingPacket;
+}
+
+uint8_t MRFI_GetRadioState(void)
+{
+    return s_mrfiRadioState;
+}
+
+void MRFI_RxOn(void)
+{
+    if (s_mrfiRadioState != MRFI_RADIO_STATE_RX)
+    {
+        s_mrfiRadioState = MRFI_RADIO_STATE_RX;
+        Mrfi_RxModeOn();
+    }
+}
+
+void MRFI_RxIdle(void)
+{
+    if (s_mrfiRadioState == MRFI_RADIO_STATE_RX)
+    {
+        Mrfi_RxModeOff();
+        s_mrfiRadioState = MRFI_RADIO_STATE_IDLE;
+    }
+}
+
+int8_t MRFI_Rssi(void)
+{
+    /* MRFI_RSSI_VALID_WAIT(): the RSSI is valid once the synthesizer is calibrated and RX settled */
+    sim_time_t valid = s_rxOnSince + g_sim_radio.fs_cal_usec + g_sim_radio.rssi_valid_usec;
+    if (sim_now() < valid)
+        Spend(valid - sim_now());
+
+    return sim_radio_channel_busy(s_node) ? -40 : -100;
+}
+
+void MRFI_SetLogicalChannel(uint8_t chan)
+{
+    (void)chan;                 // a single channel is simulated
+}
+
+uint8_t MRFI_SetRxAddrFilter(uint8_t* pAddr)
+{
+    /* first byte of filter address must not match first byte of broadcast address */
+    if (pAddr[0] == mrfiBroadcastAddr[0])
+        return 1;
+
+    memcpy(s_rxFilterAddr, pAddr, MRFI_ADDR_SIZE);
+    return 0;
+}
+
+void MRFI_EnableRxAddrFilter(void)
+{
+    s_rxFilterEnabled = 1;
+}
+
+void MRFI_DisableRxAddrFilter(void)
+{
+    s_rxFilterEnabled = 0;
+}
+
+uint8_t MRFI_RxAddrIsFiltered(uint8_t* pAddr)
+{
+    if (!s_rxFilterEnabled)
+        return 0;
+
+    if (memcmp(pAddr, s_rxFilterAddr, MRFI_ADDR_SIZE) == 0 ||
+        memcmp(pAddr, mrfiBroadcastAddr, MRFI_ADDR_SIZE) == 0)
+        return 0;
+
+    return 1;
+}
+
+void MRFI_Sleep(void)
+{
+    if (s_mrfiRadioState != MRFI_RADIO_STATE_OFF)
+    {
+        MRFI_RxIdle();
+        s_mrfiRadioState = MRFI_RADIO_STATE_OFF;
+    }
+}
+
+void MRFI_WakeUp(void)
+{
+    if (s_mrfiRadioState != MRFI_RADIO_STATE_OFF)
+        return;
+
+    s_mrfiRadioState = MRFI_RADIO_STATE_IDLE;
+    SetRadio(SIM_RADIO_IDLE);
+}
+
+uint8_t MRFI_RandomByte(void)
+{
+    RNDL = (uint8_t)sim_rand_u32(&s_node->rng);
+    return RNDL;
+}
+
+void MRFI_DelayMs(uint16_t milliseconds)
+{
+    /* the real implementation runs in 16us critical sections: interrupts are served in between */
+    while (milliseconds)
+    {
+        Spend(1000);
+        milliseconds--;
+    }
+}
+
+void MRFI_ReplyDelay(void)
+{
+    MRFI_DelayMs(s_replyDelayScalar);
+}
+
+void MRFI_PostKillSem(void)
+{
+}
+
+void MRFI_SetRFPwr(uint8_t level)
+{
+    (void)level;
+}
+
+
+/***********************************************************************************
+* SIMULATOR INTERFACE
+*/
+
+static void NodeAttach(sim_node_t* node)
+{
+    s_node = node;
+
+    /* reset values */
+    memset((void*)&sim_sfr, 0, sizeof(sim_sfr));
+    P0 = P1 = P2 = 0xFF;
+    CLKCON = CLKCON_OSC32 | CLKCON_OSC | CLKSPD_DIV_2;
+    SLEEP = SLEEP_XOSC_S | SLEEP_HFRC_S;         // both oscillators always stable
+    ADCCON1 = ADCCON1_EOC | 0x33;               // conversions complete instantly
+    ADCH = SIM_ADC_BATTERY_H;
+    ADCL = SIM_ADC_BATTERY_L;
+
+    for (uint8_t i = 0; i < 3; i++)
+        node->ports[i] = 0xFF;
+}
+
+static void NodeRun(void)
+{
+    fw_main();
+}
+
+static void NodeSpiSelect(uint8_t selected)
+{
+    uint8_t oldval = P0_4;
+
+    // SSN is active low; in SPI slave mode U0CSR.ACTIVE follows it
+    P0_4 = selected ? 0 : 1;
+    if (selected)
+        U0CSR |= USART_CSR_ACTIVE;
+    else
+        U0CSR &= ~USART_CSR_ACTIVE;
+
+    // port 0 interrupt: PICTL.P0IENH enables P0_4-P0_7, PICTL.P0ICON selects the edge
+    if ((PICTL & PICTL_P0IENH) && oldval != P0_4 && P0_4 == !(PICTL & PICTL_P0ICON))
+    {
+        P0IFG |= 0x10;
+        P0IF = 1;
+    }
+
+    ServiceInterrupts();
+    ObservePorts();
+}
+
+static uint8_t NodeSpiExchange(uint8_t mosi)
+{
+    // the byte shifted out is whatever was last loaded in U0DBUF
+    uint8_t miso = U0DBUF;
+
+    U0DBUF = mosi;
+    U0CSR |= U0CSR_RX_BYTE | U0CSR_TX_BYTE;
+    URX0IF = 1;
+    UTX0IF = 1;
+
+    // DMA triggers: the received byte is read before the next one to send is loaded
+    DmaTrigger(SIM_DMA_TRIG_URX0);
+    DmaTrigger(SIM_DMA_TRIG_UTX0);
+
+    ServiceInterrupts();
+    ObservePorts();
+    return miso;
+}
+
+static void NodeRadioDeliver(const uint8_t* frame, uint8_t len, int8_t rssi)
+{
+    if (s_mrfiRadioState != MRFI_RADIO_STATE_RX)
+        return;
+
+    // address check of the radio (PKTCTRL1.ADR_CHK = 3, set by MRFI_EnableRxAddrFilter()): only the
+    // first byte of the destination address is compared with ADDR, 0x00 and 0xFF are broadcast
+    if (s_rxFilterEnabled && len > __mrfi_DST_ADDR_OFS__ && frame[__mrfi_DST_ADDR_OFS__] != s_rxFilterAddr[0] &&
+        frame[__mrfi_DST_ADDR_OFS__] != 0x00 && frame[__mrfi_DST_ADDR_OFS__] != 0xFF)
+    {
+        s_node->rx_filtered++;
+        return;
+    }
+
+    if (s_rxPending || len > sizeof(s_mrfiIncomingPacket.frame))
+    {
+        // the DMA is re-armed only at the end of the RF ISR
+        s_node->rx_dropped++;
+        return;
+    }
+
+    memset(&s_mrfiIncomingPacket, 0, sizeof(s_mrfiIncomingPacket));
+    memcpy(s_mrfiIncomingPacket.frame, frame, len);
+    s_mrfiIncomingPacket.rxMetrics[MRFI_RX_METRICS_RSSI_OFS] = (uint8_t)rssi;
+    s_mrfiIncomingPacket.rxMetrics[MRFI_RX_METRICS_CRC_LQI_OFS] = __mrfi_RX_METRICS_CRC_OK_MASK__ | 0x30;
+    s_rxPending = 1;
+
+    ServiceInterrupts();
+    ObservePorts();
+}
+
+static uint8_t NodeReadPort(uint8_t port)
+{
+    switch (port)
+    {
+    case 0:     return P0;
+    case 1:     return P1;
+    default:    return P2;
+    }
+}
+
+const sim_node_ops_t sim_node_ops =
+{
+    .attach         = NodeAttach,
+    .run            = NodeRun,
+    .spi_select     = NodeSpiSelect,
+    .spi_exchange   = NodeSpiExchange,
+    .radio_deliver  = NodeRadioDeliver,
+    .read_port      = NodeReadPort,
+};
@@ -0,0 +1,166 @@
+/***********************************************************************************
+
+Filename:           sim_node.h
+
+Description:        Interface between a simulated CC1110 node (the unmodified firmware
+                    linked with sim_hal.c) and the rest of the simulator.
+
+Operation:          Each node is built as a single relocatable object in which every
+                    global symbol except its "sim_node_ops" table is made local (see the
+                    Makefile), so that several copies of the same firmware can run in the
+                    same process, each with its own SFRs and variables.
+
+***********************************************************************************/
+
+#ifndef SIM_NODE_H
+#define SIM_NODE_H
+
+#include "sim_core.h"
+
+/***********************************************************************************
+* CONSTANTS
+*/
+
+#define SIM_MAX_NODES                   (16)
+#define SIM_MAX_FRAME_LEN               (64)
+
+typedef enum
+{
+    SIM_RADIO_SLEEP,                    // whole chip in PM2/PM3
+    SIM_RADIO_IDLE,                     // MCU running, radio idle or off
+    SIM_RADIO_RX,                       // MCU running, radio in RX
+    SIM_RADIO_TX,                       // MCU running, radio in TX
+    SIM_RADIO_NUM_STATES
+} sim_radio_state_e;
+
+/***********************************************************************************
+* TYPES
+*/
+
+typedef struct sim_node sim_node_t;
+
+typedef struct
+{
+    /* binds the firmware instance to its simulator node */
+    void        (*attach)(sim_node_t* node);
+
+    /* firmware entry point (the firmware main()) */
+    void        (*run)(void);
+
+    /* USART0 in SPI slave mode: chip select and one full-duplex byte; returns MISO */
+    void        (*spi_select)(uint8_t selected);
+    uint8_t     (*spi_exchange)(uint8_t mosi);
+
+    /* a frame (starting with the MRFI length byte) was fully received by the radio */
+    void        (*radio_deliver)(const uint8_t* frame, uint8_t len, int8_t rssi);
+
+    /* current value of the P0/P1/P2 port registers */
+    uint8_t     (*read_port)(uint8_t port);
+} sim_node_ops_t;
+
+typedef void (*sim_port_observer_fn)(sim_node_t* node, uint8_t port, uint8_t oldval, uint8_t newval);
+
+struct sim_node
+{
+    const char*             name;
+    int                     index;
+    const sim_node_ops_t*   ops;
+    sim_actor_t*            actor;
+    uint64_t                rng;
+
+    /* radio status, updated by the firmware side through sim_radio_set_state() */
+    sim_radio_state_e       radio_state;
+    sim_time_t              radio_state_since;
+    sim_time_t              radio_time[SIM_RADIO_NUM_STATES];
+    int                     cpu_halted;         // in PM0, see BSP_IdleFor()
+    sim_time_t              cpu_halted_since;
+    sim_time_t              cpu_halted_time;
+    unsigned                preamble_bytes;     // of the frames it sends, 0 for g_sim_radio.preamble_bytes
+    double                  clock_ppm;          // how much faster its sleep timer runs
+
+    /* statistics */
+    uint32_t                tx_frames;
+    uint32_t                tx_cca_failures;
+    uint32_t                rx_frames;
+    uint32_t                rx_dropped;
+    uint32_t                rx_filtered;        // dropped by the radio address check, the CPU never saw them
+    uint32_t                rx_lost;            // corrupted by the channel (PER, burst loss)
+    uint32_t                rx_collisions;      // overlapped by another transmission
+
+    /* observed port values */
+    uint8_t                 ports[3];
+    sim_port_observer_fn    port_observer;
+    void*                   user;
+};
+
+/***********************************************************************************
+* NODE MANAGEMENT (sim_radio.c)
+*/
+
+sim_node_t*     sim_node_create(const char* name, const sim_node_ops_t* ops);
+int             sim_num_nodes(void);
+sim_node_t*     sim_node_get(int index);
+
+/***********************************************************************************
+* RADIO CHANNEL (sim_radio.c)
+*/
+
+typedef struct
+{
+    double          data_rate_bps;          // over-the-air data rate
+    unsigned        preamble_bytes;
+    unsigned        sync_bytes;
+    unsigned        crc_bytes;
+    sim_time_t      fs_cal_usec;            // frequency synthesizer calibration when leaving IDLE
+    sim_time_t      rssi_valid_usec;        // RX settling before CCA can be evaluated
+    double          supply_v;
+    double          current_ma[SIM_RADIO_NUM_STATES];
+    double          cpu_halted_saving_ma;   // less than current_ma[] while the CPU is halted (PM0)
+} sim_radio_config_t;
+
+extern sim_radio_config_t g_sim_radio;
+
+/***********************************************************************************
+* CHANNEL MODEL (sim_radio.c)
+*/
+
+typedef struct
+{
+    double          per;                    // frame error rate of each link, independent losses
+    double          burst_enter_prob;       // Gilbert-Elliott model: per-frame probability good -> bad
+    double          burst_exit_prob;        // per-frame probability bad -> good
+    double          burst_per;              // frame error rate while the link is in the bad state
+    double          cca_busy_prob;          // probability that an interferer makes a CCA fail
+    sim_time_t      prop_delay_usec;        // propagation (and receiver processing) delay
+    int             collisions;             // overlapping frames are lost at every receiver
+} sim_channel_config_t;
+
+extern sim_channel_config_t g_sim_channel;
+
+/* A channel model decides whether a CCA fails and whether a frame reaches a receiver,
+   beyond what is already decided by the radio states, the timing and the collisions.
+   The default one (sim_channel_default) applies the g_sim_channel parameters. */
+typedef struct
+{
+    int             (*cca_busy)(sim_node_t* node);
+    int             (*frame_lost)(sim_node_t* sender, sim_node_t* receiver, uint8_t len);
+} sim_channel_model_t;
+
+extern const sim_channel_model_t    sim_channel_default;
+extern const sim_channel_model_t*   g_sim_channel_model;
+
+/* called by the firmware side (sim_hal.c) */
+void            sim_radio_set_state(sim_node_t* node, sim_radio_state_e state);
+void            sim_node_set_cpu_halted(sim_node_t* node, int halted);
+int             sim_radio_channel_busy(sim_node_t* node);       // energy on the channel (RSSI)
+int             sim_radio_cca_busy(sim_node_t* node);           // same plus the channel model interferers
+sim_time_t      sim_radio_airtime(const sim_node_t* node, uint8_t frame_len);
+void            sim_radio_transmit(sim_node_t* node, const uint8_t* frame, uint8_t len);
+
+/* called whenever a node notices a change of its port registers */
+void            sim_node_port_changed(sim_node_t* node, uint8_t port, uint8_t newval);
+
+/* energy spent by the node so far, in millijoule */
+double          sim_node_energy_mj(const sim_node_t* node);
+
+#endif
@@ -0,0 +1,347 @@
+/***********************************************************************************
+
+Filename:           sim_radio.c
+
+Description:        Simulated nodes and shared radio channel.
+
+Operation:          Every frame transmitted by a node is on air for the time needed to
+                    send preamble, sync word, MRFI frame and CRC at the configured data
+                    rate. At the end of the frame (plus the propagation delay) it is
+                    delivered to every other node whose radio has been in RX since
+                    before the sync word, unless:
+                      - it overlapped in time with another transmission (collision);
+                      - the channel model drops it (random or bursty frame errors).
+                    The channel model can also make a CCA fail, to model interferers
+                    which are not simulated nodes.
+
+                    The defaults mirror the SmartRF settings in mrfi_radio.c for the
+                    CC1110 (MDMCFG4/3 = 0xF6/0x83 -> 2.4 kBaud, 4 bytes of preamble,
+                    30/32 sync word, CRC enabled); a node can send longer preambles
+                    (see preamble_bytes in sim_node_t).
+
+***********************************************************************************/
+
+/***********************************************************************************
+* INCLUDES
+*/
+#include "sim_node.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/***********************************************************************************
+* CONSTANTS
+*/
+#define SIM_MAX_ON_AIR                  (16)
+
+typedef struct
+{
+    int                 in_use;
+    sim_node_t*         sender;
+    sim_time_t          start;              // first preamble bit
+    sim_time_t          sync;               // end of the sync word
+    sim_time_t          end;                // last CRC bit
+    uint8_t             frame[SIM_MAX_FRAME_LEN];
+    uint8_t             len;
+    int                 collided;
+} on_air_t;
+
+
+/***********************************************************************************
+* GLOBAL VARIABLES
+*/
+
+sim_radio_config_t g_sim_radio =
+{
+    .data_rate_bps          = 2398.9,
+    .preamble_bytes         = 4,
+    .sync_bytes             = 2,
+    .crc_bytes              = 2,
+    .fs_cal_usec            = 800,          // FS calibration when leaving IDLE (MCSM0.FS_AUTOCAL)
+    .rssi_valid_usec        = 500,
+    .supply_v               = 3.0,
+    .current_ma             =
+    {
+        [SIM_RADIO_SLEEP]   = 0.0005,       // PM2
+        [SIM_RADIO_IDLE]    = 7.0,          // MCU at 13 MHz, radio idle
+        [SIM_RADIO_RX]      = 20.0,
+        [SIM_RADIO_TX]      = 33.0,
+    },
+    .cpu_halted_saving_ma   = 3.0,          // CPU core clock gated, radio and peripherals running
+};
+
+
+sim_channel_config_t g_sim_channel =
+{
+    .per                    = 0.0,
+    .burst_enter_prob       = 0.0,
+    .burst_exit_prob        = 1.0,
+    .burst_per              = 1.0,
+    .cca_busy_prob          = 0.0,
+    .prop_delay_usec        = 0,
+    .collisions             = 1,
+};
+
+const sim_channel_model_t* g_sim_channel_model = &sim_channel_default;
+
+
+/***********************************************************************************
+* LOCAL VARIABLES
+*/
+
+static sim_node_t       g_nodes[SIM_MAX_NODES];
+static int              g_num_nodes = 0;
+static on_air_t         g_on_air[SIM_MAX_ON_AIR];
+
+/* default channel model state */
+static uint64_t         g_channel_rng;
+static int              g_channel_rng_ready = 0;
+static uint8_t          g_link_bad[SIM_MAX_NODES][SIM_MAX_NODES];     // Gilbert-Elliott state of each link
+
+
+/***********************************************************************************
+* LOCAL FUNCTIONS
+*/
+
+static void NodeThread(void* arg)
+{
+    sim_node_t* node = (sim_node_t*)arg;
+    node->ops->run();
+}
+
+static uint64_t* ChannelRng(void)
+{
+    if (!g_channel_rng_ready)
+    {
+        g_channel_rng = sim_rand_seed(0x200);
+        g_channel_rng_ready = 1;
+    }
+    return &g_channel_rng;
+}
+
+static int DefaultCcaBusy(sim_node_t* node)
+{
+    (void)node;
+    return g_sim_channel.cca_busy_prob > 0 && sim_rand_uniform(ChannelRng()) < g_sim_channel.cca_busy_prob;
+}
+
+static int DefaultFrameLost(sim_node_t* sender, sim_node_t* receiver, uint8_t len)
+{
+    (void)len;
+    uint64_t* rng = ChannelRng();
+    uint8_t* bad = &g_link_bad[sender->index][receiver->index];
+
+    // advance the Gilbert-Elliott state of this link by one frame
+    if (g_sim_channel.burst_enter_prob > 0)
+    {
+        if (*bad)
+            *bad = !(sim_rand_uniform(rng) < g_sim_channel.burst_exit_prob);
+        else
+            *bad = sim_rand_uniform(rng) < g_sim_channel.burst_enter_prob;
+    }
+
+    double per = *bad ? g_sim_channel.burst_per : g_sim_channel.per;
+    return per > 0 && sim_rand_uniform(rng) < per;
+}
+
+static unsigned PreambleBytes(const sim_node_t* node)
+{
+    return node->preamble_bytes ? node->preamble_bytes : g_sim_radio.preamble_bytes;
+}
+
+static void EndOfFrameEvent(void* arg)
+{
+    on_air_t* tx = (on_air_t*)arg;
+    sim_time_t prop = g_sim_channel.prop_delay_usec;
+
+    for (int i = 0; i < g_num_nodes; i++)
+    {
+        sim_node_t* rx = &g_nodes[i];
+        if (rx == tx->sender)
+            continue;
+
+        // the receiver must have been listening when the sync word arrived
+        // and must still be listening now:
+        if (rx->radio_state != SIM_RADIO_RX || rx->radio_state_since > tx->sync + prop)
+            continue;
+
+        if (tx->collided)
+        {
+            rx->rx_collisions++;
+            sim_trace(rx->name, "RX frame from %s lost: collision", tx->sender->name);
+            continue;
+        }
+        if (g_sim_channel_model->frame_lost(tx->sender, rx, tx->len))
+        {
+            rx->rx_lost++;
+            sim_trace(rx->name, "RX frame from %s lost: channel error", tx->sender->name);
+            continue;
+        }
+
+        rx->rx_frames++;
+        sim_trace(rx->name, "RX frame of %u bytes from %s", tx->len, tx->sender->name);
+        rx->ops->radio_deliver(tx->frame, tx->len, -40);
+    }
+
+    tx->in_use = 0;
+}
+
+
+/***********************************************************************************
+* GLOBAL FUNCTIONS
+*/
+
+sim_node_t* sim_node_create(const char* name, const sim_node_ops_t* ops)
+{
+    if (g_num_nodes == SIM_MAX_NODES)
+    {
+        fprintf(stderr, "sim: too many nodes\n");
+        abort();
+    }
+
+    sim_node_t* node = &g_nodes[g_num_nodes];
+    memset(node, 0, sizeof(*node));
+    node->name = name;
+    node->index = g_num_nodes++;
+    node->ops = ops;
+    node->rng = sim_rand_seed(0x100 + node->index);
+    node->radio_state = SIM_RADIO_IDLE;
+    node->radio_state_since = sim_now();
+
+    ops->attach(node);
+    node->actor = sim_actor_create(name, NodeThread, node);
+    return node;
+}
+
+int sim_num_nodes(void)
+{
+    return g_num_nodes;
+}
+
+sim_node_t* sim_node_get(int index)
+{
+    return &g_nodes[index];
+}
+
+void sim_radio_set_state(sim_node_t* node, sim_radio_state_e state)
+{
+    if (state == node->radio_state)
+        return;
+
+    sim_time_t now = sim_now();
+    node->radio_time[node->radio_state] += now - node->radio_state_since;
+    node->radio_state = state;
+    node->radio_state_since = now;
+}
+
+void sim_node_set_cpu_halted(sim_node_t* node, int halted)
+{
+    if (halted == node->cpu_halted)
+        return;
+
+    sim_time_t now = sim_now();
+    if (node->cpu_halted)
+        node->cpu_halted_time += now - node->cpu_halted_since;
+    node->cpu_halted = halted;
+    node->cpu_halted_since = now;
+}
+
+int sim_radio_channel_busy(sim_node_t* node)
+{
+    sim_time_t now = sim_now();
+    sim_time_t prop = g_sim_channel.prop_delay_usec;
+    for (int i = 0; i < SIM_MAX_ON_AIR; i++)
+    {
+        const on_air_t* tx = &g_on_air[i];
+        if (tx->in_use && tx->sender != node && tx->start + prop <= now && now < tx->end + prop)
+            return 1;
+    }
+    return 0;
+}
+
+int sim_radio_cca_busy(sim_node_t* node)
+{
+    return sim_radio_channel_busy(node) || g_sim_channel_model->cca_busy(node);
+}
+
+sim_time_t sim_radio_airtime(const sim_node_t* node, uint8_t frame_len)
+{
+    unsigned bytes = PreambleBytes(node) + g_sim_radio.sync_bytes + frame_len + g_sim_radio.crc_bytes;
+    return (sim_time_t)(bytes * 8 * 1e6 / g_sim_radio.data_rate_bps);
+}
+
+void sim_radio_transmit(sim_node_t* node, const uint8_t* frame, uint8_t len)
+{
+    on_air_t* tx = NULL;
+    for (int i = 0; i < SIM_MAX_ON_AIR && !tx; i++)
+        if (!g_on_air[i].in_use)
+            tx = &g_on_air[i];
+    if (!tx || len > SIM_MAX_FRAME_LEN)
+    {
+        fprintf(stderr, "sim: cannot transmit frame from %s\n", node->name);
+        abort();
+    }
+
+    sim_time_t now = sim_now();
+    sim_time_t end = now + sim_radio_airtime(node, len);
+
+    // every frame still on air overlaps with this one
+    int collided = 0;
+    if (g_sim_channel.collisions)
+    {
+        for (int i = 0; i < SIM_MAX_ON_AIR; i++)
+        {
+            if (g_on_air[i].in_use && g_on_air[i].end > now)
+            {
+                g_on_air[i].collided = 1;
+                collided = 1;
+            }
+        }
+    }
+
+    tx->in_use = 1;
+    tx->collided = collided;
+    tx->sender = node;
+    tx->start = now;
+    tx->sync = now + (sim_time_t)((PreambleBytes(node) + g_sim_radio.sync_bytes) * 8 * 1e6 / g_sim_radio.data_rate_bps);
+    tx->end = end;
+    memcpy(tx->frame, frame, len);
+    tx->len = len;
+
+    node->tx_frames++;
+    sim_trace(node->name, "TX frame of %u bytes (%.1f ms on air)", len, (tx->end - tx->start) / 1e3);
+    sim_event_at(tx->end + g_sim_channel.prop_delay_usec, EndOfFrameEvent, tx);
+}
+
+void sim_node_port_changed(sim_node_t* node, uint8_t port, uint8_t newval)
+{
+    uint8_t oldval = node->ports[port];
+    node->ports[port] = newval;
+    if (node->port_observer)
+        node->port_observer(node, port, oldval, newval);
+}
+
+const sim_channel_model_t sim_channel_default =
+{
+    .cca_busy       = DefaultCcaBusy,
+    .frame_lost     = DefaultFrameLost,
+};
+
+double sim_node_energy_mj(const sim_node_t* node)
+{
+    double mj = 0;
+    for (int s = 0; s < SIM_RADIO_NUM_STATES; s++)
+    {
+        sim_time_t t = node->radio_time[s];
+        if (s == (int)node->radio_state)
+            t += sim_now() - node->radio_state_since;
+        mj += g_sim_radio.current_ma[s] * g_sim_radio.supply_v * (t / 1e6);
+    }
+
+    sim_time_t halted = node->cpu_halted_time;
+    if (node->cpu_halted)
+        halted += sim_now() - node->cpu_halted_since;
+    mj -= g_sim_radio.cpu_halted_saving_ma * g_sim_radio.supply_v * (halted / 1e6);
+    return mj;
+}
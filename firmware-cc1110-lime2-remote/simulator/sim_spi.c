@@ -0,0 +1,90 @@
+/***********************************************************************************
+
+Filename:           sim_spi.c
+
+Description:        Linux-side SPI master driving the USART0 of a simulated node.
+
+Operation:          See sim_spi.h
+
+***********************************************************************************/
+
+/***********************************************************************************
+* INCLUDES
+*/
+#include "sim_spi.h"
+
+
+/***********************************************************************************
+* LOCAL FUNCTIONS
+*/
+
+static uint8_t BitErrors(const sim_spi_config_t* cfg, uint32_t speed_hz)
+{
+    uint8_t mask = 0;
+
+    if (cfg->bit_error_rate <= 0 || speed_hz <= cfg->error_free_hz)
+        return 0;
+    for (int bit = 0; bit < 8; bit++)
+        if (sim_rand_uniform(cfg->rng) < cfg->bit_error_rate)
+            mask |= 1 << bit;
+    return mask;
+}
+
+
+/***********************************************************************************
+* GLOBAL FUNCTIONS
+*/
+
+sim_time_t sim_spi_byte_time(uint32_t speed_hz)
+{
+    sim_time_t t = (8 * 1000000u + speed_hz - 1) / speed_hz;
+    return t ? t : 1;
+}
+
+void sim_spi_message(sim_actor_t* self, sim_node_t* slave, const sim_spi_config_t* cfg,
+                     const sim_spi_xfer_t* xfers, unsigned num_xfers)
+{
+    size_t total = 0;
+
+    if (cfg->transfer_overhead_usec)
+        sim_advance(self, cfg->transfer_overhead_usec);
+
+    slave->ops->spi_select(1);
+    for (unsigned n = 0; n < num_xfers; n++)
+    {
+        const sim_spi_xfer_t* x = &xfers[n];
+        uint32_t speed_hz = x->speed_hz ? x->speed_hz : cfg->speed_hz;
+        sim_time_t byte_time = sim_spi_byte_time(speed_hz);
+
+        for (size_t i = 0; i < x->len; i++)
+        {
+            // the slave sees the byte (and raises its USART interrupts) after the 8th clock edge
+            sim_advance(self, byte_time);
+            uint8_t mosi = (x->tx ? x->tx[i] : 0) ^ BitErrors(cfg, speed_hz);
+            uint8_t miso = slave->ops->spi_exchange(mosi) ^ BitErrors(cfg, speed_hz);
+            if (x->rx)
+                x->rx[i] = miso;
+        }
+        total += x->len;
+
+        if (x->delay_usecs)
+            sim_advance(self, x->delay_usecs);
+
+        if (x->cs_change && n + 1 < num_xfers)
+        {
+            slave->ops->spi_select(0);
+            sim_advance(self, 1);
+            slave->ops->spi_select(1);
+        }
+    }
+    slave->ops->spi_select(0);
+
+    sim_trace(sim_actor_name(self), "SPI transfer of %zu bytes to %s", total, slave->name);
+}
+
+void sim_spi_transfer(sim_actor_t* self, sim_node_t* slave, const sim_spi_config_t* cfg,
+                      const uint8_t* tx, uint8_t* rx, size_t len)
+{
+    sim_spi_xfer_t x = { tx, rx, len, 0, 0, 0 };
+    sim_spi_message(self, slave, cfg, &x, 1);
+}
@@ -0,0 +1,63 @@
+/***********************************************************************************
+
+Filename:           sim_spi.h
+
+Description:        Linux-side SPI master driving the USART0 of a simulated node.
+
+Operation:          A transfer asserts the chip select, clocks out each byte at the
+                    configured bus speed (full duplex: the byte returned is the one the
+                    CC1110 had loaded in U0DBUF) and finally deasserts the chip select.
+                    The fixed per-transfer overhead models the time spent in the Linux
+                    process/driver before the first clock edge.
+                    Bit errors can be injected on both MOSI and MISO, optionally only
+                    above a given clock, to model a bus driven faster than it supports.
+
+***********************************************************************************/
+
+#ifndef SIM_SPI_H
+#define SIM_SPI_H
+
+#include "sim_node.h"
+
+#include <stddef.h>
+
+/***********************************************************************************
+* TYPES
+*/
+
+typedef struct
+{
+    uint32_t        speed_hz;                   // same meaning of spidev_test -s
+    sim_time_t      transfer_overhead_usec;     // user space + driver overhead for each transfer
+    double          bit_error_rate;             // probability that each bit is flipped...
+    uint32_t        error_free_hz;              // ...when clocked faster than this (0: always)
+    uint64_t*       rng;                        // required with bit_error_rate > 0
+} sim_spi_config_t;
+
+/* one segment of a message, same semantics of struct spi_ioc_transfer */
+typedef struct
+{
+    const uint8_t*  tx;                         // NULL: send zeros
+    uint8_t*        rx;                         // NULL: discard MISO
+    size_t          len;
+    uint32_t        speed_hz;                   // 0: use the config speed
+    uint16_t        delay_usecs;                // after the last bit, before changing CS
+    uint8_t         cs_change;                  // deassert CS before the next segment
+} sim_spi_xfer_t;
+
+/***********************************************************************************
+* FUNCTIONS
+*/
+
+/* Runs in the context of the actor "self", which is busy for the whole transfer. */
+void            sim_spi_transfer(sim_actor_t* self, sim_node_t* slave, const sim_spi_config_t* cfg,
+                                 const uint8_t* tx, uint8_t* rx, size_t len);
+
+/* Same as a SPI_IOC_MESSAGE(n) ioctl: CS stays asserted across the segments unless
+   cs_change is set, and is always deasserted at the end of the message. */
+void            sim_spi_message(sim_actor_t* self, sim_node_t* slave, const sim_spi_config_t* cfg,
+                                const sim_spi_xfer_t* xfers, unsigned num_xfers);
+
+sim_time_t      sim_spi_byte_time(uint32_t speed_hz);
+
+#endif
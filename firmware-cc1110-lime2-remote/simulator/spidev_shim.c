@@ -0,0 +1,439 @@
+/***********************************************************************************
+
+Filename:           spidev_shim.c
+
+Description:        LD_PRELOAD library emulating the spidev device of the lime2 node on
+                    top of the simulator (lime2sim --serve).
+
+Operation:          open() of the emulated device (LIME2SIM_SPIDEV, default /dev/spidev2.0)
+                    returns a socket connected to the simulator (LIME2SIM_SOCKET, default
+                    /tmp/lime2sim.sock). On that descriptor:
+                      - the SPI_IOC_RD_* / SPI_IOC_WR_* configuration ioctls are emulated
+                        (only 8 bits per word are supported);
+                      - every SPI_IOC_MESSAGE(n) ioctl becomes one request to the simulator,
+                        which clocks each byte through the simulated USART0 and its
+                        ut0rx_isr/ut0tx_isr in full duplex, and returns the MISO bytes.
+                    open() of the emulated GPIO chip (LIME2SIM_GPIOCHIP, default
+                    /dev/gpiochip0) returns a descriptor on which GPIO_V2_GET_LINE_IOCTL
+                    subscribes to the edges of the "event pending" line of the simulated
+                    node, whatever the line offset: the returned line descriptor is a
+                    socket where the simulator writes a struct gpio_v2_line_event for each
+                    edge (only edge detection is emulated, not GPIO_V2_LINE_GET_VALUES).
+                    Every other file is left untouched.
+
+                    Example:
+                      LD_PRELOAD=./libspidev_sim.so spidev_test -D /dev/spidev2.0 -s 5000 -p "STATUS_00" -v
+
+***********************************************************************************/
+
+/***********************************************************************************
+* INCLUDES
+*/
+#define _GNU_SOURCE
+#include "sim_bridge_proto.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+
+
+/***********************************************************************************
+* CONSTANTS
+*/
+#define SHIM_MAX_FDS                    (1024)
+
+typedef enum
+{
+    SHIM_FREE = 0,
+    SHIM_SPIDEV,
+    SHIM_GPIOCHIP,
+} shim_kind_e;
+
+typedef struct
+{
+    shim_kind_e     in_use;
+    uint32_t        mode;
+    uint8_t         bits_per_word;
+    uint32_t        max_speed_hz;
+} shim_dev_t;
+
+
+/***********************************************************************************
+* LOCAL VARIABLES
+*/
+
+static shim_dev_t       g_devs[SHIM_MAX_FDS];
+
+static int              (*real_open)(const char*, int, ...);
+static int              (*real_open64)(const char*, int, ...);
+static int              (*real_openat)(int, const char*, int, ...);
+static int              (*real_close)(int);
+static int              (*real_ioctl)(int, unsigned long, ...);
+
+
+/***********************************************************************************
+* LOCAL FUNCTIONS
+*/
+
+#define RESOLVE(sym)    do { if (!real_##sym) real_##sym = dlsym(RTLD_NEXT, #sym); } while (0)
+
+static shim_kind_e GetEmulatedKind(const char* path)
+{
+    const char* dev = getenv("LIME2SIM_SPIDEV");
+    const char* chip = getenv("LIME2SIM_GPIOCHIP");
+    if (!path)
+        return SHIM_FREE;
+    if (strcmp(path, dev ? dev : SIM_BRIDGE_DEFAULT_DEVICE) == 0)
+        return SHIM_SPIDEV;
+    if (strcmp(path, chip ? chip : SIM_BRIDGE_DEFAULT_GPIOCHIP) == 0)
+        return SHIM_GPIOCHIP;
+    return SHIM_FREE;
+}
+
+static shim_dev_t* GetDev(int fd)
+{
+    if (fd < 0 || fd >= SHIM_MAX_FDS || !g_devs[fd].in_use)
+        return NULL;
+    return &g_devs[fd];
+}
+
+static int ConnectToSimulator(void)
+{
+    const char* path = getenv("LIME2SIM_SOCKET");
+    struct sockaddr_un addr;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (fd >= SHIM_MAX_FDS)
+    {
+        RESOLVE(close);
+        real_close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path ? path : SIM_BRIDGE_DEFAULT_SOCKET, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        RESOLVE(close);
+        real_close(fd);
+        errno = ENODEV;         // no simulator: same as a missing SPI controller
+        return -1;
+    }
+    return fd;
+}
+
+static int OpenDevice(shim_kind_e kind)
+{
+    int fd = ConnectToSimulator();
+    if (fd < 0)
+        return -1;
+
+    memset(&g_devs[fd], 0, sizeof(g_devs[fd]));
+    g_devs[fd].in_use = kind;
+    g_devs[fd].mode = SPI_MODE_0;
+    g_devs[fd].bits_per_word = 8;
+    g_devs[fd].max_speed_hz = 500000;
+    return fd;
+}
+
+static int ReadFull(int fd, void* buf, size_t len)
+{
+    uint8_t* p = buf;
+    while (len)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int WriteFull(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = buf;
+    while (len)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int Message(int fd, shim_dev_t* dev, struct spi_ioc_transfer* tr, unsigned n)
+{
+    static uint8_t buf[SIM_BRIDGE_MAX_LEN];
+    sim_bridge_req_t req = { (uint8_t)n };
+    size_t total = 0;
+
+    if (n == 0 || n > SIM_BRIDGE_MAX_XFERS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    for (unsigned i = 0; i < n; i++)
+    {
+        total += tr[i].len;
+        if ((tr[i].bits_per_word && tr[i].bits_per_word != 8) || total > SIM_BRIDGE_MAX_LEN)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if (WriteFull(fd, &req, sizeof(req)) < 0)
+        goto io_error;
+    for (unsigned i = 0; i < n; i++)
+    {
+        sim_bridge_xfer_t x;
+        x.len = tr[i].len;
+        x.speed_hz = tr[i].speed_hz ? tr[i].speed_hz : dev->max_speed_hz;
+        x.delay_usecs = tr[i].delay_usecs;
+        x.cs_change = tr[i].cs_change;
+
+        // a NULL tx_buf means "send zeros"
+        const void* mosi = (const void*)(uintptr_t)tr[i].tx_buf;
+        if (!mosi)
+        {
+            memset(buf, 0, x.len);
+            mosi = buf;
+        }
+        if (WriteFull(fd, &x, sizeof(x)) < 0 || WriteFull(fd, mosi, x.len) < 0)
+            goto io_error;
+    }
+
+    sim_bridge_rsp_t rsp;
+    if (ReadFull(fd, &rsp, sizeof(rsp)) < 0)
+        goto io_error;
+    if (rsp.status != 0)
+    {
+        errno = -rsp.status;
+        return -1;
+    }
+    if (rsp.len != total || ReadFull(fd, buf, total) < 0)
+        goto io_error;
+
+    size_t ofs = 0;
+    for (unsigned i = 0; i < n; i++)
+    {
+        void* miso = (void*)(uintptr_t)tr[i].rx_buf;
+        if (miso)
+            memcpy(miso, buf + ofs, tr[i].len);
+        ofs += tr[i].len;
+    }
+    return (int)total;
+
+io_error:
+    errno = EIO;
+    return -1;
+}
+
+static int GetLine(struct gpio_v2_line_request* lreq)
+{
+    sim_bridge_req_t req = { SIM_BRIDGE_REQ_EVENTS };
+    sim_bridge_events_req_t ereq;
+    sim_bridge_rsp_t rsp;
+
+    if (lreq->num_lines != 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ereq.offset = lreq->offsets[0];
+    ereq.edges = ((lreq->config.flags & GPIO_V2_LINE_FLAG_EDGE_RISING) ? SIM_BRIDGE_EDGE_RISING : 0) |
+                 ((lreq->config.flags & GPIO_V2_LINE_FLAG_EDGE_FALLING) ? SIM_BRIDGE_EDGE_FALLING : 0);
+
+    // a connection of its own: from now on the simulator only writes edge events on it
+    int fd = ConnectToSimulator();
+    if (fd < 0)
+        return -1;
+    if (WriteFull(fd, &req, sizeof(req)) < 0 || WriteFull(fd, &ereq, sizeof(ereq)) < 0 ||
+        ReadFull(fd, &rsp, sizeof(rsp)) < 0)
+    {
+        RESOLVE(close);
+        real_close(fd);
+        errno = EIO;
+        return -1;
+    }
+    if (rsp.status != 0)
+    {
+        RESOLVE(close);
+        real_close(fd);
+        errno = -rsp.status;
+        return -1;
+    }
+    lreq->fd = fd;
+    return 0;
+}
+
+static int ChipIoctl(shim_dev_t* dev, unsigned long request, void* arg)
+{
+    (void)dev;
+    switch (request)
+    {
+    case GPIO_GET_CHIPINFO_IOCTL:
+        {
+            struct gpiochip_info* info = arg;
+            memset(info, 0, sizeof(*info));
+            strcpy(info->name, "lime2sim");
+            strcpy(info->label, "lime2 event pending");
+            info->lines = 32;
+        }
+        return 0;
+
+    case GPIO_V2_GET_LINE_IOCTL:
+        return GetLine(arg);
+
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+static int DeviceIoctl(int fd, shim_dev_t* dev, unsigned long request, void* arg)
+{
+    if (dev->in_use == SHIM_GPIOCHIP)
+        return ChipIoctl(dev, request, arg);
+
+    if (_IOC_TYPE(request) == SPI_IOC_MAGIC && _IOC_NR(request) == 0 && _IOC_DIR(request) == _IOC_WRITE)
+        return Message(fd, dev, arg, _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer));
+
+    switch (request)
+    {
+    case SPI_IOC_RD_MODE:           *(uint8_t*)arg = (uint8_t)dev->mode;                return 0;
+    case SPI_IOC_WR_MODE:           dev->mode = *(uint8_t*)arg;                         return 0;
+    case SPI_IOC_RD_MODE32:         *(uint32_t*)arg = dev->mode;                        return 0;
+    case SPI_IOC_WR_MODE32:         dev->mode = *(uint32_t*)arg;                        return 0;
+    case SPI_IOC_RD_LSB_FIRST:      *(uint8_t*)arg = (dev->mode & SPI_LSB_FIRST) != 0;  return 0;
+    case SPI_IOC_RD_BITS_PER_WORD:  *(uint8_t*)arg = dev->bits_per_word;                return 0;
+    case SPI_IOC_RD_MAX_SPEED_HZ:   *(uint32_t*)arg = dev->max_speed_hz;                return 0;
+    case SPI_IOC_WR_MAX_SPEED_HZ:   dev->max_speed_hz = *(uint32_t*)arg;                return 0;
+
+    case SPI_IOC_WR_LSB_FIRST:
+        if (*(uint8_t*)arg)
+            dev->mode |= SPI_LSB_FIRST;
+        else
+            dev->mode &= ~SPI_LSB_FIRST;
+        return 0;
+
+    case SPI_IOC_WR_BITS_PER_WORD:
+        if (*(uint8_t*)arg != 0 && *(uint8_t*)arg != 8)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        dev->bits_per_word = 8;
+        return 0;
+
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+
+/***********************************************************************************
+* INTERPOSED FUNCTIONS
+*/
+
+int open(const char* path, int flags, ...)
+{
+    shim_kind_e kind = GetEmulatedKind(path);
+    if (kind != SHIM_FREE)
+        return OpenDevice(kind);
+
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = va_arg(ap, mode_t);
+    va_end(ap);
+
+    RESOLVE(open);
+    return real_open(path, flags, mode);
+}
+
+int open64(const char* path, int flags, ...)
+{
+    shim_kind_e kind = GetEmulatedKind(path);
+    if (kind != SHIM_FREE)
+        return OpenDevice(kind);
+
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = va_arg(ap, mode_t);
+    va_end(ap);
+
+    RESOLVE(open64);
+    return real_open64(path, flags, mode);
+}
+
+int openat(int dirfd, const char* path, int flags, ...)
+{
+    shim_kind_e kind = GetEmulatedKind(path);
+    if (kind != SHIM_FREE)
+        return OpenDevice(kind);
+
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = va_arg(ap, mode_t);
+    va_end(ap);
+
+    RESOLVE(openat);
+    return real_openat(dirfd, path, flags, mode);
+}
+
+/* used instead of open() when building with _FORTIFY_SOURCE */
+int __open_2(const char* path, int flags)
+{
+    return open(path, flags, 0);
+}
+
+int __open64_2(const char* path, int flags)
+{
+    return open64(path, flags, 0);
+}
+
+int close(int fd)
+{
+    shim_dev_t* dev = GetDev(fd);
+    if (dev)
+        dev->in_use = SHIM_FREE;
+
+    RESOLVE(close);
+    return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    va_start(ap, request);
+    void* arg = va_arg(ap, void*);
+    va_end(ap);
+
+    shim_dev_t* dev = GetDev(fd);
+    if (dev)
+        return DeviceIoctl(fd, dev, request, arg);
+
+    RESOLVE(ioctl);
+    return real_ioctl(fd, request, arg);
+}
@@ -239,6 +239,63 @@ void bsp_PowerMode(uint8_t mode)
 }
 
 
+/**************************************************************************************************
+* @fn          bsp_SleptSteps
+*
+* @brief       Called with the interrupts disabled when BSP_SleepFor() or BSP_IdleFor() wake up:
+*              if the sleep timer event ended the sleep, the sleep timer restarted from 0 then
+*
+* @param       steps : as given to BSP_SleepFor() or BSP_IdleFor()
+*
+* @return      sleep timer steps elapsed since the sleep timer was reset for the sleep
+**************************************************************************************************
+*/
+static uint32_t bsp_SleptSteps(uint16_t steps)
+{
+  uint8_t expired = !STIE;                // BSP_SleepIsr() served the event
+  STIE = 0;                               // Disable Sleep Timer interrupt.
+  
+  uint8_t low = WORTIME0;                 // reading WORTIME0 latches WORTIME1
+  uint16_t now = ((uint16_t)WORTIME1 << 8) | low;
+  if (STIF)
+  {
+    // the event came after the CPU woke up: the value just read may be from before it
+    expired = 1;
+    STIF = 0;
+    WORIRQ = 0x00;                        // Clear ST local flag and disable interupt
+    low = WORTIME0;
+    now = ((uint16_t)WORTIME1 << 8) | low;
+  }
+  
+  return expired ? (uint32_t)steps + now : now;
+}
+
+
+/**************************************************************************************************
+* @fn          BSP_StartSleepTimer
+*
+* @brief       Resets the sleep timer and lets it run free: WORTIME1:WORTIME0 counts the 32kHz periods
+*              and restarts from 0 once it reaches BSP_SLEEP_TIMER_EVENT0 (about 2 secs), without
+*              interrupts. BSP_SleepFor() and BSP_IdleFor() reprogram it: call this again after them.
+*
+* @param       none
+*
+* @return      none
+**************************************************************************************************
+*/
+void BSP_StartSleepTimer(void)
+{
+  WOREVT1 = (BSP_SLEEP_TIMER_EVENT0>>8);  // Set timer high byte
+  WOREVT0 = (uint8_t)BSP_SLEEP_TIMER_EVENT0; // Set timer Low byte
+  
+  WORCTL = 0x04;                          // Reset timer, resolution of 1 period
+  uint8_t temp = WORTIME0;                // Wait one full 32kHz cycle to allow sleep timer to reset
+  while( temp == WORTIME0);
+  temp = WORTIME0;
+  while( temp == WORTIME0);
+}
+
+
 /**************************************************************************************************
 * @fn          BSP_SleepFor
 *
@@ -249,10 +306,11 @@ void bsp_PowerMode(uint8_t mode)
 *              res    : Set the sleep timer resolution (0 to 4)
 *              steps  : Set number of steps for the sleep timer. Sleep time = res * steps (0 to 655535)
 *
-* @return      none
+* @return      sleep timer steps (of the given resolution) elapsed since the sleep began, including
+*              the start-up of the crystal oscillator; the sleep timer is left reprogrammed
 **************************************************************************************************
 */
-void BSP_SleepFor(uint8_t mode, uint8_t res, uint16_t steps)
+uint32_t BSP_SleepFor(uint8_t mode, uint8_t res, uint16_t steps)
 {
   //  Set radio to sleep
   
@@ -292,7 +350,69 @@ void BSP_SleepFor(uint8_t mode, uint8_t res, uint16_t steps)
     MRFI_RxOn();
 #endif
   //SMPL_Ioctl(IOCTL_OBJ_RADIO, IOCTL_ACT_RADIO_AWAKE,0);
+  
+  BSP_DISABLE_INTERRUPTS();
+  uint32_t slept = bsp_SleptSteps(steps);
+  BSP_ENABLE_INTERRUPTS();
+  
   IEN2 |= 0x01;                           // Enable RF interrupt
+  return slept;
+}
+
+
+/**************************************************************************************************
+* @fn          BSP_IdleFor
+*
+* @brief       Enter power mode 0 (CPU halted) leaving the radio as it is: the RF interrupt and
+*              any other enabled interrupt wake up the CPU before the sleep timer does.
+*              Like BSP_SleepFor(), resets the sleep timer.
+*
+* @param       res      : Set the sleep timer resolution (0 to 4)
+*              steps    : Set number of steps for the sleep timer. Idle time = res * steps (0 to 65535)
+*              wakeFlag : set by an ISR when the CPU must not stay halted (e.g. a frame was received);
+*                         the CPU is not halted at all if it is set once the interrupts are disabled
+*
+* @return      sleep timer steps (of the given resolution) elapsed since the idle began; the sleep
+*              timer is left reprogrammed
+**************************************************************************************************
+*/
+uint32_t BSP_IdleFor(uint8_t res, uint16_t steps, volatile uint8_t* wakeFlag)
+{
+  BSP_DISABLE_INTERRUPTS();
+  
+  // Update Sleep timer
+  WORCTL = 0x04 + (res&0x03);             // Reset timer and set resolution, mask out the 2 LSB's.
+  uint8_t temp = WORTIME0;                // Wait one full 32kHz cycle to allow sleep timer to reset
+  while( temp == WORTIME0);
+  temp = WORTIME0;
+  while( temp == WORTIME0);
+  
+  WOREVT1 = (steps>>8);                   // Set timer high byte
+  WOREVT0 = (uint8_t)steps;               // Set timer Low byte
+  
+  STIF = 0;                               // Clear Sleep Timer flag in IRCON
+  WORIRQ = 0x10;                          // 0x12 Enable Interupts and clear module flag
+  STIE = 1;                               // Enable Sleep Timer interrupt.
+  
+  if (*wakeFlag)
+  {
+    // the ISR ran before the interrupts were disabled: halting now would wait for the sleep timer
+    BSP_ENABLE_INTERRUPTS();
+  }
+  else
+  {
+    // not bsp_PowerMode(POWER_MODE_0): the 8051 executes the instruction after the one enabling
+    // the interrupts before serving any of them, and an interrupt pending in PM0 wakes up the CPU
+    BSP_ENABLE_INTERRUPTS();
+    PCON |= 0x01;
+    asm("NOP");
+  }
+  
+  // woken up by another interrupt: the sleep timer event must not end a later idle
+  BSP_DISABLE_INTERRUPTS();
+  uint32_t slept = bsp_SleptSteps(steps);
+  BSP_ENABLE_INTERRUPTS();
+  return slept;
 }
 
 
@@ -66,17 +66,43 @@
                                       while (CLKCON != (0x09 | BV(7)));                         \
                                       SLEEP |= 0x04;)               /* turn off RC */
 
+/* Called once per iteration of the busy main loops; the host simulator (simulator/)
+ * provides its own definition to account for the time spent in the loop. */
+#ifndef BSP_MAIN_LOOP_TICK
+#define BSP_MAIN_LOOP_TICK()
+#endif
+
+/* 16-bit XDATA address of a variable (or XDATA-mapped register) as stored in a DMA
+ * descriptor, and arming/aborting of the DMA channels in the given DMAARM mask; the host
+ * simulator provides its own definitions to emulate the DMA controller. */
+#ifndef BSP_XDATA_ADDRESS
+#define BSP_XDATA_ADDRESS(p)          ((uint16_t)(p))
+#endif
+#ifndef BSP_DMA_ARM
+#define BSP_DMA_ARM(mask)             st( DMAARM |= (mask); )
+#endif
+#ifndef BSP_DMA_ABORT
+#define BSP_DMA_ABORT(mask)           st( DMAARM = (0x80 /* ABORT */ | (mask)); )
+#endif
+
 #define POWER_MODE_0                  0
 #define POWER_MODE_1                  1
 #define POWER_MODE_2                  2
 #define POWER_MODE_3                  3
 
+/* the sleep timer left running by BSP_StartSleepTimer(): WORTIME1:WORTIME0 restarts from 0 once it
+   reaches this value, and each reset of the sleep timer waits for about this many 32kHz periods */
+#define BSP_SLEEP_TIMER_EVENT0        0xFFFF
+#define BSP_SLEEP_TIMER_RESET_TICKS   2
+
 /* ------------------------------------------------------------------------------------------------
  *                                        Prototypes
  * ------------------------------------------------------------------------------------------------
  */
 uint8_t BSP_SleepUntilButton(uint8_t mode, uint8_t button);
-void BSP_SleepFor(uint8_t mode, uint8_t res, uint16_t steps);
+void BSP_StartSleepTimer(void);
+uint32_t BSP_SleepFor(uint8_t mode, uint8_t res, uint16_t steps);
+uint32_t BSP_IdleFor(uint8_t res, uint16_t steps, volatile uint8_t* wakeFlag);
 
 
 #define NET_ADDR_SIZE      MRFI_ADDR_SIZE   /* size of address in bytes */
@@ -138,6 +138,21 @@ typedef unsigned short istate_t;
 typedef unsigned short istate_t;
 
 
+/*****************************************************
+ * GCC (host simulator, see simulator/README.txt)
+ */
+#elif defined __GNUC__
+
+#ifndef CODE
+#define CODE
+#endif
+#ifndef XDATA
+#define XDATA
+#endif
+#define FAR
+#define NOP()  asm("nop")
+
+
 /*****************************************************
  * Other compilers
  */
@@ -17,14 +17,80 @@ Description:	    Code for the "lime2" node.
                     the transaction ID so that it's possible to associate each command with its
                     ACK.
 
+                    Commands received over SPI are appended to a FIFO queue of CMD_QUEUE_LEN
+                    entries and sent over radio one at a time, in order: the MASTER SYSTEM can
+                    thus send several commands (with different transaction IDs) without waiting
+                    for the ACK of each one. Each entry tracks its own state (queued, in-flight,
+                    acked, failed), which the reply to the 'L' frame reports for each of them;
+                    completed entries are recycled only when the queue is full.
+                    A command received while the queue is full of pending commands is rejected
+                    (a NULL reply is returned over SPI).
+
+                    SPI frames are delimited by the chip select: the deassert edge of SSN
+                    raises a port 0 interrupt which hands the bytes received since the
+                    previous edge to the main loop through a lock-free queue of
+                    SPI_RX_QUEUE_LEN frames, and restarts the TX buffer for the next
+                    transaction. Any number of frames can thus be sent back to back.
+                    The bytes of each transaction are moved by DMA channels triggered by
+                    USART0 (see SPI_DMA_CHAN_*), so that the CPU is interrupted only at the
+                    end of each frame and, for the framed STATUS, once the header is in.
+
                     The "lime2" node is supposed to have no power constraints (no battery)
                     and thus implements no special lower power policy.
 
 Notes:              Because of the way SPI operates it's important that the MASTER SYSTEM
                     sends the "STATUS" command at least twice; the first reply to the STATUS
                     command actually contains the reply for an older command.
-                    Additionally, when the lime2 node is busy doing radio operations each
-                    "STATUS" command will return a NULL reply (all zeros back over SPI).
+                    The framed STATUS (see SPI_FRAME_SYNC in main.h) avoids this: the
+                    reply is built by the DMA ISR as soon as the 2-byte header is
+                    received and is shifted out in the same transaction.
+                    With ENABLE_EVENT_PENDING_GPIO the "event pending" line (LIME2_GPIO1) is
+                    asserted whenever a command completes (ACK received, carrying the remote
+                    battery reading, or retries exhausted) and is deasserted when the MASTER
+                    SYSTEM reads the framed STATUS: the MASTER SYSTEM can wait for an edge on
+                    that line instead of polling.
+                    CRC-protected frames (see SPI_FRAME_OPCODE_COMMAND and
+                    SPI_FRAME_OPCODE_QUERY in main.h) carry a sequence number and a CRC-16,
+                    so that the MASTER SYSTEM can detect bit errors in both directions and
+                    raise the SPI clock as long as none occur: the reply to the 'Q' frame
+                    reports the sequence number of the last 'C' frame accepted and the
+                    number of frames discarded because of a wrong CRC.
+                    With ENABLE_BINARY_RADIO_FRAMES the commands are sent over radio as
+                    binary frames (see BIN_FRAME_OPCODE_FLAG in main.h) instead of the 9-byte
+                    ASCII ones; ACKs are accepted in both formats. The 'C' frame can carry
+                    a binary command as well, with a 16-bit transaction ID: the STATUS
+                    reply reports its low byte.
+                    With ENABLE_WAKE_ON_RADIO (main.h) every frame is sent with a 24-byte
+                    preamble, long enough to wake up the remote node from its carrier sniffs.
+                    The remote clock carried by its ACKs (BIN_TLV_CLOCK) tells when the next
+                    sniffs happen: the first transmission of a command is then delayed right
+                    before one of them and sent with the shortest preamble that covers the
+                    uncertainty of the prediction, which grows with the time elapsed since
+                    the last ACK; the drift of the remote clock is estimated from the ACKs.
+                    Each command is sent to the remote node named by its BIN_TLV_REMOTE (or to
+                    DEFAULT_REMOTE_NODE_ID, e.g. for the ASCII commands), whose node ID is the
+                    first byte of the destination address: the radio of the other remote nodes
+                    drops the frame without waking up their CPU (see SetRxAddressFilter()),
+                    and only the ACK coming from that node ID is accepted.
+                    The outcome of the commands is also kept per remote node, in a table of
+                    REMOTE_TABLE_LEN rows (last transaction ID ACKed, battery, RSSI, commands
+                    not ACKed since then, time since the last ACK), which the MASTER SYSTEM
+                    reads in a single transaction with the 'T' frame (SPI_FRAME_OPCODE_TABLE).
+                    A command for BROADCAST_NODE_ID (optionally limited to some groups with
+                    BIN_TLV_GROUPS) is sent once to all the remote nodes, which ACK in random
+                    slots after it: the lime2 node collects the ACKs in a bitmap and sends the
+                    command again with that bitmap, so that only the missing remote nodes ACK,
+                    until every remote node of the table has ACKed and a round brings no new
+                    ACK (after BCAST_MIN_TX transmissions), or DURATION_TX_RETRIES_MSEC
+                    elapsed. The time to reach all the remote nodes thus grows with the ACK
+                    slots rather than with one retry burst per remote node and relay group.
+                    The "ECHO___" command is a loopback to benchmark the SPI link: its payload
+                    is shifted out as is (after the usual leading NUL byte) in the next
+                    transaction, in place of the reply to the last command.
+                    The radio retries are driven by a non-blocking state machine, so SPI is
+                    served also while a command is in flight: in that case the reply to
+                    STATUS is "BUSY" followed by the transaction ID of the command being sent
+                    and the number of transmissions done so far.
                     The MASTER SYSTEM must keep polling the lime2 node with STATUS commands
                     until an "ACK" is returned (for about DURATION_TX_RETRIES_MSEC time);
                     if the command was delivered successfully it
@@ -55,15 +121,79 @@ Notes:              Because of the way SPI operates it's important that the MAST
 */
 #define ALLOW_BUTTONS_TO_OVERRIDE_LIME2                    (0)
 
-#define HOLDOFF_TIME_AFTER_CMD_MSEC                        (5000)
+// the retry policy can be overridden at build time (e.g. by the simulator benchmark, see simulator/README.txt):
+#ifndef DURATION_TX_RETRIES_MSEC
 #define DURATION_TX_RETRIES_MSEC                           (10000)              // must be bigger than the time the remote node sleeps (WAIT_TIME_RADIOOFF_MSEC)
+#endif
+#ifndef DELAY_AFTER_EACH_TX_MSEC
 #define DELAY_AFTER_EACH_TX_MSEC                           (250)
+#endif
+#ifndef NUM_TX_RETRIES
 #define NUM_TX_RETRIES                                     (DURATION_TX_RETRIES_MSEC/DELAY_AFTER_EACH_TX_MSEC)
+#endif
+
+#define CMD_QUEUE_LEN                                      (SPI_FRAME_QUEUE_NUM_CMDS)
+#define BCAST_ACK_SLOT_MSEC                                ((uint32_t)BCAST_ACK_SLOT_TICKS*1000/SLEEP_TIMER_HZ)
+#define BCAST_MIN_TX                                       (3)                  // the remote nodes not in the table yet rely on these
+#define SPI_RX_QUEUE_LEN                                   (4)                  // SPI frames received and not yet handled; must be a power of 2
 
 // getting input commands via GPIO is now deprecated (SPI is used!):
 #define ENABLE_INPUTS_VIA_GPIO                             (0)
 
+// signal completed commands to the MASTER SYSTEM on LIME2_GPIO1:
+#ifndef ENABLE_EVENT_PENDING_GPIO
+#define ENABLE_EVENT_PENDING_GPIO                          (1)
+#endif
+
+// send the commands over radio as binary frames (shorter airtime) rather than as ASCII strings;
+// the remote must run a firmware that decodes them:
+#ifndef ENABLE_BINARY_RADIO_FRAMES
+#define ENABLE_BINARY_RADIO_FRAMES                         (1)
+#endif
+
+// wake schedule of the remote node (ENABLE_WAKE_ON_RADIO): uncertainty of the predicted sniffs
+#define WOR_SYNC_GUARD_TICKS                               (33)                 // jitter of the ACK reception, about 1ms
+#define WOR_SYNC_DRIFT_PPM                                 (200)                // residual drift, once estimated
+#define WOR_SYNC_MAX_DRIFT_PPM                             (20000)              // drift before it is estimated
+#define WOR_SYNC_MIN_DRIFT_AGE_TICKS                       (30UL*SLEEP_TIMER_HZ) // shortest interval to estimate the drift
+#define WOR_SYNC_MAX_AGE_TICKS                             (600UL*SLEEP_TIMER_HZ) // older ACKs do not help, nor fit the drift math
+
+#if ENABLE_INPUTS_VIA_GPIO && ENABLE_EVENT_PENDING_GPIO
+#error "LIME2_GPIO1 cannot be both an input and the event pending output"
+#endif
+
 #define __bsp_CONFIG_AS_INPUT__(bit,port,ddr,low)          st( ddr &= ~BV(bit); )
+#define __bsp_CONFIG_AS_OUTPUT__(bit,port,ddr,low)         st( if (low) { port |= BV(bit); } else { port &= ~BV(bit); } ddr |= BV(bit); )
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *   GPIO #1 ---> event pending line toward the Lime2
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *   Polarity  :  Active High
+ *   GPIO      :  P0.0
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+#define LIME2_GPIO1_PORT__           P0
+#define LIME2_GPIO1_BIT__            0
+#define LIME2_GPIO1_DDR__            P0DIR
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *   GPIO #2 ---> spare line from the Lime2
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *   Polarity  :  Active High
+ *   GPIO      :  P0.1
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+#define LIME2_GPIO2_PORT__           P0
+#define LIME2_GPIO2_BIT__            1
+#define LIME2_GPIO2_DDR__            P0DIR
+
+#if ENABLE_EVENT_PENDING_GPIO
+#define SET_EVENT_PENDING()                                st( LIME2_GPIO1_PORT__ |= BV(LIME2_GPIO1_BIT__); )
+#define CLEAR_EVENT_PENDING()                              st( LIME2_GPIO1_PORT__ &= ~BV(LIME2_GPIO1_BIT__); )
+#else
+#define SET_EVENT_PENDING()
+#define CLEAR_EVENT_PENDING()
+#endif
 
 #define BSP_TURN_ON_LED_SPI                                BSP_TURN_ON_LED1
 #define BSP_TURN_OFF_LED_SPI                               BSP_TURN_OFF_LED1
@@ -73,122 +203,845 @@ Notes:              Because of the way SPI operates it's important that the MAST
 #define BSP_TURN_OFF_LED_RADIO                             BSP_TURN_OFF_LED2
 #define BSP_TOGGLE_LED_RADIO                               BSP_TOGGLE_LED2
 
+// SSN is active low: the SPI master deasserts it at the end of each frame
+#define SPI_SSN_BIT                                        BIT4
+#define SPI_SSN_DEASSERTED()                               (P0_4)
+
+// USART0 SPI slave DMA channels; channel 0 is used by MRFI (see mrfi_radio.c), channels 1-4
+// share DMA1CFGH:DMA1CFGL and thus have consecutive descriptors in g_spiDmaCfg
+#define SPI_DMA_CHAN_RX                                    1    // MOSI bytes -> g_rxBufferSPISlave
+#define SPI_DMA_CHAN_RX_COUNT                              2    // g_rxDmaRamp -> g_rxDmaCount, i.e. number of bytes received
+#define SPI_DMA_CHAN_RX_HEADER                             3    // first SPI_FRAME_HEADER_LEN bytes -> g_rxHeader, then DMA interrupt
+#define SPI_DMA_CHAN_TX                                    4    // g_txBufferSPISlaveACTIVE, or g_queueReply/g_tableReply for the 'L'/'T' frame -> MISO
+#define SPI_DMA_NUM_CHAN                                   4
+#define SPI_DMA_ALL_CHAN                                   (DMAARM1 | DMAARM2 | DMAARM3 | DMAARM4)
+
+/* DMA configuration data structure size */
+#define SPI_DMA_STRUCT_SIZE                                8
+
+// the replies built by dma_isr() start one byte before the turnaround one, see there
+#if SPI_FRAME_HEADER_LEN-1+SPI_FRAME_TURNAROUND_LEN+SPI_FRAME_QUERY_REPLY_LEN > SPI_COMMAND_MAX_LEN
+#error "the reply to 'Q' does not fit in g_txBufferSPISlaveACTIVE"
+#endif
+#if SPI_FRAME_TABLE_REPLY_LEN > 0xFF
+#error "REMOTE_TABLE_LEN out of range"
+#endif
+
+#define NO_REPLY_SENDING                                   (0xFF)
+
+/* byte offset 6 */
+#define SPI_DMA_WORDSIZE                                   (/*  WORDSIZE = */(  0 )  << 7)
+#define SPI_DMA_TMODE                                      (/*     TMODE = */(  0 )  << 5)     // single
+#define SPI_DMA_TRIG_URX0                                  (/*      TRIG = */( 14 )  << 0)
+#define SPI_DMA_TRIG_UTX0                                  (/*      TRIG = */( 15 )  << 0)
+
+/* byte offset 7 */
+#define SPI_DMA_SRCINC_PLUS_1                              (/*    SRCINC = */( 1 )  << 6)
+#define SPI_DMA_SRCINC_NONE                                (/*    SRCINC = */( 0 )  << 6)
+#define SPI_DMA_DESTINC_PLUS_1                             (/*   DESTINC = */( 1 )  << 4)
+#define SPI_DMA_DESTINC_NONE                               (/*   DESTINC = */( 0 )  << 4)
+#define SPI_DMA_IRQMASK_ENABLE                             (/*   IRQMASK = */( 1 )  << 3)
+#define SPI_DMA_IRQMASK_DISABLE                            (/*   IRQMASK = */( 0 )  << 3)
+#define SPI_DMA_M8                                         (/*        M8 = */( 0 )  << 2)
+#define SPI_DMA_PRIORITY                                   (/*  PRIORITY = */( 2 )  << 0)     // high: USART0 has no FIFO
+
+
+/***********************************************************************************
+* TYPES
+*/
+
+// as reported by the reply to the 'L' frame:
+typedef enum
+{
+    CMD_STATE_FREE = SPI_FRAME_CMD_FREE,
+    CMD_STATE_QUEUED = SPI_FRAME_CMD_QUEUED,            // received over SPI, waiting for the radio
+    CMD_STATE_IN_FLIGHT = SPI_FRAME_CMD_IN_FLIGHT,      // being sent over radio
+    CMD_STATE_ACKED = SPI_FRAME_CMD_ACKED,              // the remote node acknowledged it
+    CMD_STATE_FAILED = SPI_FRAME_CMD_FAILED             // no ACK after NUM_TX_RETRIES transmissions
+} cmd_state_e;
+
+typedef enum
+{
+    RADIO_IDLE = 0,             // radio off, waiting for a queued command
+    RADIO_WAIT_SNIFF,           // command ready, waiting for the predicted sniff of the remote node
+    RADIO_WAIT_ACK,             // command transmitted, RX on for DELAY_AFTER_EACH_TX_MSEC (plus the ACK slots if broadcast)
+    RADIO_SHOW_ACK              // ACK received, radio LED on for a while
+} radio_state_e;
+
+typedef struct
+{
+    command_e     cmd;
+    uint16_t      transactionID;        // ASCII commands only set the low byte
+    uint8_t       parameter;
+    uint8_t       ops[BIN_BATCH_MAX_OPS];   // CMD_BATCH only
+    uint8_t       numOps;
+    uint16_t      durationMin;          // TURNON_ and CMD_BATCH only: 0 if the remote must not turn off by itself
+    uint8_t       remoteID;             // node ID of the remote node the command is sent to, or BROADCAST_NODE_ID
+    uint8_t       groups;               // BIN_TLV_GROUPS, 0 if the command is for all the groups
+    cmd_state_e   state;
+    uint8_t       battery;              // carried by the ACK, CMD_STATE_ACKED only
+} queued_cmd_t;
+
+typedef struct
+{
+    uint8_t       len;
+    uint8_t       data[SPI_COMMAND_MAX_LEN];
+} spi_frame_t;
+
+typedef struct
+{
+    uint8_t       remoteID;             // 0 for an unused row
+    uint8_t       acked;                // at least one command was ACKed
+    uint16_t      lastTransactionID;    // of the last command ACKed
+    uint8_t       battery;
+    int8_t        rssi;                 // of the last ACK, in dBm
+    uint8_t       failures;             // commands not ACKed since the last ACK, saturated
+    uint32_t      lastSeenTicks;        // g_clockTicks at the last ACK, or when the row was taken
+} remote_entry_t;
+
+typedef struct
+{
+    uint8_t       valid;                // a remote clock was received
+    uint8_t       driftValid;
+    uint8_t       remoteID;             // the remote node the clock belongs to
+    uint32_t      localTicks;           // g_clockTicks when the last remote clock was received
+    uint32_t      remoteTicks;          // the remote clock at that time
+    uint32_t      anchorLocalTicks;     // same, for an older remote clock, to estimate the drift
+    uint32_t      anchorRemoteTicks;
+    int16_t       driftPpm;             // how much faster the remote clock runs
+} wake_sync_t;
+
 
 /***********************************************************************************
 * LOCAL VARIABLES
 */
 
 // SPI and radio SLAVE->MASTER variables
-static          uint8_t       g_noAckCount = 0;
 static          uint8_t       g_lastRemoteBatteryRead = 0;
-static          uint8_t       g_lastRemoteAckTransactionID = 0;
+static          int8_t        g_lastRemoteRssi = 0;
+static          uint16_t      g_lastRemoteAckTransactionID = 0;
+static          remote_entry_t g_remotes[REMOTE_TABLE_LEN];
 
 // SPI and radio MASTER->SLAVE variables
-static          command_e     g_lastSpiCommand = CMD_MAX;
-static          uint8_t       g_lastSpiCommandTransactionID = 0;
-static          uint8_t       g_lastSpiCommandParameter = 0;
+// the queue is a ring buffer where entries are always ordered as:
+//   [completed (acked/failed)...] [in-flight] [queued...]
+static          queued_cmd_t  g_cmdQueue[CMD_QUEUE_LEN];
+static          uint8_t       g_cmdQueueHead = 0;            // index of the oldest entry
+static          uint8_t       g_cmdQueueCount = 0;
 static          mrfiPacket_t  g_pktTx;
 
+// radio state machine:
+static          radio_state_e g_radioState = RADIO_IDLE;
+static          queued_cmd_t* g_inFlight = NULL;
+static          uint8_t       g_txAttempts = 0;
+static          uint32_t      g_radioStateStart = 0;         // sleep timer value when the current state was entered
+static          uint16_t      g_sniffDelayTicks = 0;         // RADIO_WAIT_SNIFF only
+
+// broadcast commands: the remote nodes whose ACK was received, as in BIN_TLV_BCAST_ACK
+static          uint8_t       g_bcastAcked[BCAST_BITMAP_LEN];
+static          uint16_t      g_bcastTransactionID = 0;      // of the last broadcast command
+static          uint8_t       g_bcastCmdLen = 0;             // of the command in g_pktTx, without BIN_TLV_BCAST_ACK
+static          uint8_t       g_bcastNumSlots = 0;           // ACK slots after the last transmission
+static          uint8_t       g_bcastNewAcks = 0;            // ACKs received after the last transmission
+static          uint32_t      g_bcastStart = 0;              // sleep timer value at the first transmission
+
+// sleep timer periods since boot, kept by UpdateClock(); it wraps after about 36 hours
+static          uint32_t      g_clockTicks = 0;
+
+#if ENABLE_WAKE_ON_RADIO
+static          wake_sync_t   g_wakeSync;
+
+// preamble bytes for each MDMCFG1.NUM_PREAMBLE value
+static const    uint8_t       g_preambleBytes[8] = { 2, 3, 4, 6, 8, 12, 16, 24 };
+#endif
+
+// reply to STATUS (either ACK_ or BUSY), kept up to date by the main loop so that the
+// SPI RX ISR can copy it at any time for the framed STATUS:
+static          uint8_t       g_statusReply[REPLY_LEN+REPLY_POSTFIX_LEN];
+static          uint8_t       g_queryReply[SPI_FRAME_QUERY_REPLY_LEN];    // same, as the reply to the 'Q' frame
+
+// same, with the state of each queued command, as the reply to the 'L' frame: double-buffered
+// like g_tableReply below
+static          uint8_t XDATA g_queueReply[2][SPI_FRAME_QUEUE_REPLY_LEN];
+static volatile uint8_t       g_queueReplyReady = 0;                      // index of the last one built
+static volatile uint8_t       g_queueReplySending = NO_REPLY_SENDING;     // index of the one being sent
+static          uint8_t       g_queueReplyStale = 0;                      // to be built again once it's sent
+static          uint8_t       g_queueReplyNotify = 0;                     // the event to be signalled then
+
+// g_remotes, as the reply to the 'T' frame: UpdateTableReply() builds it in the buffer that is not
+// being sent, and dma_isr() points the TX channel at the last one built
+static          uint8_t XDATA g_tableReply[2][SPI_FRAME_TABLE_REPLY_LEN];
+static volatile uint8_t       g_tableReplyReady = 0;                      // index of the last one built
+static volatile uint8_t       g_tableReplySending = NO_REPLY_SENDING;     // index of the one being sent
+static          uint8_t       g_tableReplyStale = 0;                      // to be built again once it's sent
+static          uint32_t      g_tableReplyTicks = 0;                      // g_clockTicks when it was built
+
+// CRC-protected frames:
+static          uint8_t       g_lastFrameSeq = 0;            // sequence number of the last 'C' frame accepted
+static          uint8_t       g_frameCrcErrors = 0;
+
 // SPI:
-static          uint8_t       g_rxBufferSPISlave[SPI_COMMAND_MAX_LEN];
-static          uint8_t       g_rxBufferLastIdx = 0;
+static          uint8_t XDATA g_rxBufferSPISlave[SPI_COMMAND_MAX_LEN];
+static          uint8_t XDATA g_rxHeader[SPI_FRAME_HEADER_LEN];
+
+// the DMA cannot tell how many bytes it moved: a second channel, triggered by the same
+// received bytes, copies 1, 2, 3... from the ramp table to g_rxDmaCount
+static          uint8_t XDATA g_rxDmaRamp[SPI_COMMAND_MAX_LEN];
+static volatile uint8_t XDATA g_rxDmaCount = 0;
+
+static          uint8_t XDATA g_spiDmaCfg[SPI_DMA_NUM_CHAN][SPI_DMA_STRUCT_SIZE];
+
+// frames completed by p0int_isr() (the only writer of the head) and handled by the
+// main loop (the only writer of the tail): both indexes are free-running single bytes,
+// so that no critical section is needed on either side
+static          spi_frame_t   g_rxQueue[SPI_RX_QUEUE_LEN];
+static volatile uint8_t       g_rxQueueHead = 0;
+static volatile uint8_t       g_rxQueueTail = 0;
+static volatile uint8_t       g_rxQueueDropped = 0;
+static          uint8_t       g_rxQueueDroppedReported = 0;  // the value in the reply to the 'Q' frame
 
 // for tx we adopt a double-buffered tecnique:
-static          uint8_t       g_txBufferSPISlaveACTIVE[SPI_COMMAND_MAX_LEN];
+static          uint8_t XDATA g_txBufferSPISlaveACTIVE[SPI_COMMAND_MAX_LEN];
 static          uint8_t       g_txBufferSPISlaveNEXT[SPI_COMMAND_MAX_LEN];
-static          uint8_t       g_txBufferLastIdx = 0;
+static volatile uint8_t       g_txBufferSwapPending = 0;    // NEXT to be copied in ACTIVE at the end of the transaction
 
 
 /***********************************************************************************
 * LOCAL FUNCTIONS
 */
 
-static uint8_t IsValidRadioACK()
+static uint8_t IsCompleted(const queued_cmd_t* entry)
+{
+    return entry->state == CMD_STATE_ACKED || entry->state == CMD_STATE_FAILED;
+}
+
+/* request: the command as received over SPI, its state is ignored */
+static uint8_t EnqueueCommand(const queued_cmd_t* request)
+{
+    if (g_cmdQueueCount == CMD_QUEUE_LEN)
+    {
+        // recycle the oldest entry, but only if it's not pending anymore:
+        if (!IsCompleted(&g_cmdQueue[g_cmdQueueHead]))
+            return 0;           // queue full
+        g_cmdQueue[g_cmdQueueHead].state = CMD_STATE_FREE;
+        g_cmdQueueHead = (g_cmdQueueHead + 1) % CMD_QUEUE_LEN;
+        g_cmdQueueCount--;
+    }
+
+    queued_cmd_t* entry = &g_cmdQueue[(g_cmdQueueHead + g_cmdQueueCount) % CMD_QUEUE_LEN];
+    *entry = *request;
+    entry->state = CMD_STATE_QUEUED;
+    g_cmdQueueCount++;
+    return 1;
+}
+
+static queued_cmd_t* GetNextQueuedCommand()
+{
+    for (uint8_t i = 0; i < g_cmdQueueCount; i++)
+    {
+        queued_cmd_t* entry = &g_cmdQueue[(g_cmdQueueHead + i) % CMD_QUEUE_LEN];
+        if (entry->state == CMD_STATE_QUEUED)
+            return entry;
+    }
+    return NULL;
+}
+
+static void UpdateClock()
+{
+    g_clockTicks = ReadSleepTimer();
+}
+
+#if ENABLE_WAKE_ON_RADIO
+/* remoteClock: BIN_TLV_CLOCK of an ACK of ackLen bytes, just received from remoteID */
+static void LearnWakeSchedule(const uint8_t* remoteClock, uint8_t ackLen, uint8_t remoteID)
+{
+    // only the schedule of the last remote node that replied is tracked:
+    if (g_wakeSync.remoteID != remoteID)
+    {
+        memset(&g_wakeSync, 0, sizeof(g_wakeSync));
+        g_wakeSync.remoteID = remoteID;
+    }
+
+    // the remote built the ACK before the CCA and the transmission:
+    uint32_t remoteTicks = BUILD_UINT32(remoteClock[0], remoteClock[1], remoteClock[2], remoteClock[3]) +
+                           RADIO_CCA_TICKS + (uint32_t)(ackLen + RADIO_FRAME_OVERHEAD_BYTES) * RADIO_BYTE_TICKS;
+
+    UpdateClock();
+    uint32_t age = g_clockTicks - g_wakeSync.anchorLocalTicks;
+    uint8_t anchorTooOld = age > WOR_SYNC_MAX_AGE_TICKS;
+    uint8_t rebooted = 0;
+
+    if (g_wakeSync.valid && !anchorTooOld)
+    {
+        // how much the remote clock moved away from the lime2 one since the anchor:
+        int32_t error = (int32_t)(remoteTicks - g_wakeSync.anchorRemoteTicks - age);
+        int32_t maxError = (int32_t)(age / 1000) * WOR_SYNC_MAX_DRIFT_PPM / 1000 + WOR_SYNC_GUARD_TICKS;
+        rebooted = error < -maxError || error > maxError;
+        if (!rebooted && age >= WOR_SYNC_MIN_DRIFT_AGE_TICKS)
+        {
+            g_wakeSync.driftPpm = (int16_t)(error * 1000 / (int32_t)(age / 1000));
+            g_wakeSync.driftValid = 1;
+        }
+    }
+
+    if (!g_wakeSync.valid || anchorTooOld || rebooted)
+    {
+        // the drift estimated so far still holds if only the anchor is too old
+        g_wakeSync.driftValid &= !rebooted;
+        g_wakeSync.anchorLocalTicks = g_clockTicks;
+        g_wakeSync.anchorRemoteTicks = remoteTicks;
+    }
+
+    g_wakeSync.localTicks = g_clockTicks;
+    g_wakeSync.remoteTicks = remoteTicks;
+    g_wakeSync.valid = 1;
+}
+
+/* sets the preamble of the first transmission of a command and g_sniffDelayTicks, the delay
+   after which it must be sent so that the next sniff of the remote node falls in the middle of
+   the preamble; returns 0 if the sniffs of remoteID cannot be predicted well enough to shorten the preamble */
+static uint8_t ScheduleFirstTransmission(uint8_t remoteID)
+{
+    UpdateClock();
+    uint32_t age = g_clockTicks - g_wakeSync.localTicks;
+    if (!g_wakeSync.valid || g_wakeSync.remoteID != remoteID || age > WOR_SYNC_MAX_AGE_TICKS)
+        return 0;
+
+    uint16_t driftPpm = g_wakeSync.driftValid ? WOR_SYNC_DRIFT_PPM : WOR_SYNC_MAX_DRIFT_PPM;
+    uint32_t uncertainty = WOR_SYNC_GUARD_TICKS + (age / 1000) * driftPpm / 1000;
+
+    // the shortest preamble whose half covers the uncertainty; the longest one needs no schedule
+    uint8_t numPreamble = 0;
+    while ((uint32_t)g_preambleBytes[numPreamble] * RADIO_BYTE_TICKS / 2 < uncertainty)
+    {
+        if (++numPreamble == 7)
+            return 0;
+    }
+    uint16_t halfPreambleTicks = g_preambleBytes[numPreamble] * RADIO_BYTE_TICKS / 2;
+
+    // remote clock now, and when the middle of the preamble would be on air if we sent it now:
+    int32_t drift = g_wakeSync.driftValid ? (int32_t)(age / 1000) * g_wakeSync.driftPpm / 1000 : 0;
+    uint32_t remoteNow = g_wakeSync.remoteTicks + age + drift;
+    uint32_t earliest = remoteNow + RADIO_CCA_TICKS + halfPreambleTicks;
+
+    // the sniffs sense the carrier WOR_SNIFF_SAMPLE_TICKS after the multiples of WOR_SNIFF_INTERVAL_TICKS:
+    g_sniffDelayTicks = (uint16_t)(WOR_SNIFF_SAMPLE_TICKS - earliest) & (WOR_SNIFF_INTERVAL_TICKS - 1);
+    MDMCFG1 = (MDMCFG1 & ~0x70) | (numPreamble << 4);
+    return 1;
+}
+#endif
+
+static uint8_t IsValidRadioACK(uint16_t expectedTransactionID, uint8_t expectedRemoteID)
 {
     uint8_t len = MRFI_GET_PAYLOAD_LEN(&g_pktRx);
     uint8_t* radioMsg = MRFI_P_PAYLOAD(&g_pktRx);
+    const uint8_t* battery;
+
+    // the radio filters only our own node ID, any remote node could have sent the frame:
+    uint8_t remoteID = MRFI_P_SRC_ADDR(&g_pktRx)[0];
+    if (expectedRemoteID == BROADCAST_NODE_ID ?
+        (remoteID < REMOTE_NODE_ID_MIN || remoteID > REMOTE_NODE_ID_MAX) : remoteID != expectedRemoteID)
+        return 0;
 
-    if (len == REPLY_LEN+REPLY_POSTFIX_LEN &&
+    if (IsBinFrame(radioMsg, len) && radioMsg[0] == BIN_FRAME_OPCODE_ACK &&
+      (battery = BinFrameFindTLV(radioMsg, len, BIN_TLV_BATTERY, 1)) != NULL)
+    {
+        g_lastRemoteAckTransactionID = BinFrameTransactionID(radioMsg);
+        g_lastRemoteBatteryRead = *battery;
+        g_lastRemoteRssi = (int8_t)g_pktRx.rxMetrics[MRFI_RX_METRICS_RSSI_OFS];
+#if ENABLE_WAKE_ON_RADIO
+        const uint8_t* remoteClock = BinFrameFindTLV(radioMsg, len, BIN_TLV_CLOCK, 4);
+        if (remoteClock)
+            LearnWakeSchedule(remoteClock, len, remoteID);
+#endif
+    }
+    else if (len == REPLY_LEN+REPLY_POSTFIX_LEN &&
       memcmp(radioMsg, g_ack, REPLY_LEN)==0)                    /* Acknowledge successfully received */
     {
-        g_lastRemoteAckTransactionID = radioMsg[REPLY_LEN+0];      // last byte contains transaction ID
+        // an ASCII ACK carries only the low byte of the transaction ID:
+        g_lastRemoteAckTransactionID = (expectedTransactionID & 0xFF00) | radioMsg[REPLY_LEN+0];
         g_lastRemoteBatteryRead = radioMsg[REPLY_LEN+1];      // last byte contains measurement: 80=FULL BATTERY (about 13V), 20=DEPLETED BATTERY (about 3.3V)
-        g_noAckCount = 0;
-        return 1;
+        g_lastRemoteRssi = (int8_t)g_pktRx.rxMetrics[MRFI_RX_METRICS_RSSI_OFS];
     }
+    else
+        return 0;
 
-    return 0;
+    // a late ACK for an older command of the queue does not acknowledge the current one:
+    if (g_lastRemoteAckTransactionID != expectedTransactionID)
+        return 0;
+
+    return 1;
 }
 
-static void SendCommandOverRadioWithACK()
+static uint16_t Crc16(const uint8_t* buf, uint8_t len)
 {
-    /* Build and send command */
-    MRFI_SET_PAYLOAD_LEN(&g_pktTx, COMMAND_LEN+COMMAND_POSTFIX_LEN);
-    uint8_t* cmdMsg = MRFI_P_PAYLOAD(&g_pktTx);
-    memcpy(cmdMsg, g_commands[g_lastSpiCommand], COMMAND_LEN);
-    cmdMsg[COMMAND_LEN+0] = g_lastSpiCommandTransactionID;
-    cmdMsg[COMMAND_LEN+1] = g_lastSpiCommandParameter;
+    // CRC-16/CCITT, bitwise: the frames are a few bytes long and checked in the main loop
+    uint16_t crc = 0xFFFF;
+    while (len--)
+    {
+        crc ^= (uint16_t)(*buf++) << 8;
+        for (uint8_t i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
 
-    // note that SetRxAddressFilter() is commented out in the MAIN (does not work for whatever reason) so the following
-    // two lines are useless:
-    //CopyAddress(MRFI_P_SRC_ADDR(&g_pktTx), NODE_LIME2);
-    //CopyAddress(MRFI_P_DST_ADDR(&g_pktTx), NODE_REMOTE);
+/* notify: also assert the event pending line; this is done in the same critical section
+   where the replies change, so that the DMA ISR (which deasserts it) cannot lose it. While the
+   other buffer of the reply to 'L' is being sent, the event waits for sLime2Node() to call
+   this again and build that reply */
+static void UpdateStatusReply(uint8_t notify)
+{
+    uint8_t reply[SPI_FRAME_QUERY_REPLY_LEN];
+    uint8_t* status = &reply[3];
 
-    uint8_t ackOk = 0;
-    for( uint8_t x = 0; x < NUM_TX_RETRIES; x++ )
+    if (g_inFlight)
     {
-        // show we are transmitting blinking radio LED
-        BSP_TOGGLE_LED_RADIO();
-
-        // tx!
-        MRFI_Transmit(&g_pktTx, MRFI_TX_TYPE_CCA);
+        // a command is being sent over radio: report its progress
+        memcpy(status, g_busy, REPLY_LEN);
+        status[REPLY_LEN+0]=LO_UINT16(g_inFlight->transactionID);
+        status[REPLY_LEN+1]=g_txAttempts;
+    }
+    else
+    {
+        memcpy(status, g_ack, REPLY_LEN);
+        status[REPLY_LEN+0]=LO_UINT16(g_lastRemoteAckTransactionID);
+        status[REPLY_LEN+1]=g_lastRemoteBatteryRead;
+    }
 
-        /* Turn on RX. default is RX Idle. */
-        MRFI_RxOn();
+    // build the reply to the 'Q' frame here, so that the DMA ISR only has to copy it:
+    reply[0] = SPI_FRAME_SYNC;
+    reply[1] = SPI_FRAME_QUERY_PAYLOAD_LEN;
+    reply[2] = g_lastFrameSeq;
+    status[REPLY_LEN+REPLY_POSTFIX_LEN+0] = g_frameCrcErrors;
+    g_rxQueueDroppedReported = g_rxQueueDropped;
+    status[REPLY_LEN+REPLY_POSTFIX_LEN+1] = g_rxQueueDroppedReported;
+    uint16_t crc = Crc16(&reply[1], 2+SPI_FRAME_QUERY_PAYLOAD_LEN);
+    reply[3+SPI_FRAME_QUERY_PAYLOAD_LEN+0] = HI_UINT16(crc);
+    reply[3+SPI_FRAME_QUERY_PAYLOAD_LEN+1] = LO_UINT16(crc);
+
+    // then the one to the 'L' frame, in the buffer not being sent:
+    g_queueReplyNotify |= notify;
+    uint8_t next = g_queueReplyReady ^ 1;
+    g_queueReplyStale = (next == g_queueReplySending);
+    if (!g_queueReplyStale)
+    {
+        uint8_t XDATA * queue = g_queueReply[next];
+        memcpy(queue, reply, 3+SPI_FRAME_QUERY_PAYLOAD_LEN);
+        queue[1] = SPI_FRAME_QUEUE_PAYLOAD_LEN;
 
-        DelayMsWithInterrupts(DELAY_AFTER_EACH_TX_MSEC);  /* Might have to be longer for bigger payloads */
-        if( g_sRxCallbackSemaphore )    // Is ACK arrived? this flag is set by the RX callback in main.c
+        uint8_t XDATA * p = &queue[3+SPI_FRAME_QUERY_PAYLOAD_LEN];
+        for (uint8_t i = 0; i < CMD_QUEUE_LEN; i++, p += SPI_FRAME_QUEUE_CMD_LEN)
         {
-            g_sRxCallbackSemaphore = 0;
-            if (IsValidRadioACK())
+            const queued_cmd_t* entry = &g_cmdQueue[(g_cmdQueueHead + i) % CMD_QUEUE_LEN];
+            if (i < g_cmdQueueCount)
             {
-                ackOk=1;
-                break;                // exit immediately
+                p[0] = LO_UINT16(entry->transactionID);
+                p[1] = HI_UINT16(entry->transactionID);
+                p[2] = entry->state;
+                p[3] = entry->battery;
             }
-            //else: TX the command another time!
+            else
+                memset(p, 0, SPI_FRAME_QUEUE_CMD_LEN);      // SPI_FRAME_CMD_FREE
         }
+
+        crc = Crc16(&queue[1], 2+SPI_FRAME_QUEUE_PAYLOAD_LEN);
+        p[0] = HI_UINT16(crc);
+        p[1] = LO_UINT16(crc);
+    }
+
+    bspIState_t intState;
+    BSP_ENTER_CRITICAL_SECTION(intState);
+
+    memcpy(g_statusReply, status, REPLY_LEN+REPLY_POSTFIX_LEN);
+    memcpy(g_queryReply, reply, SPI_FRAME_QUERY_REPLY_LEN);
+
+    if (!g_queueReplyStale)
+    {
+        // complete: dma_isr() can send it from now on
+        g_queueReplyReady = next;
+        if (g_queueReplyNotify)
+            SET_EVENT_PENDING();
+        g_queueReplyNotify = 0;
+    }
+
+    BSP_EXIT_CRITICAL_SECTION(intState);
+}
+
+/* rebuilds the reply to the 'T' frame from g_remotes, with the ages as of now */
+static void UpdateTableReply()
+{
+    // the other buffer may still be sent: try again later, see sLime2Node()
+    uint8_t next = g_tableReplyReady ^ 1;
+    g_tableReplyStale = (next == g_tableReplySending);
+    if (g_tableReplyStale)
+        return;
+
+    uint8_t XDATA * reply = g_tableReply[next];
+    uint8_t XDATA * row = &reply[2];
+
+    UpdateClock();
+    for (uint8_t i = 0; i < REMOTE_TABLE_LEN; i++, row += SPI_FRAME_TABLE_ROW_LEN)
+    {
+        const remote_entry_t* entry = &g_remotes[i];
+        uint32_t ageSec = (g_clockTicks - entry->lastSeenTicks) / SLEEP_TIMER_HZ;
+        uint16_t age = (!entry->acked || ageSec >= SPI_FRAME_TABLE_AGE_UNKNOWN) ? SPI_FRAME_TABLE_AGE_UNKNOWN : (uint16_t)ageSec;
+
+        row[0] = entry->remoteID;
+        row[1] = LO_UINT16(entry->lastTransactionID);
+        row[2] = HI_UINT16(entry->lastTransactionID);
+        row[3] = entry->battery;
+        row[4] = (uint8_t)entry->rssi;
+        row[5] = entry->failures;
+        row[6] = LO_UINT16(age);
+        row[7] = HI_UINT16(age);
+    }
+
+    // then the remote nodes that ACKed the last broadcast command:
+    row[0] = LO_UINT16(g_bcastTransactionID);
+    row[1] = HI_UINT16(g_bcastTransactionID);
+    memcpy(&row[2], g_bcastAcked, BCAST_BITMAP_LEN);
+
+    reply[0] = SPI_FRAME_SYNC;
+    reply[1] = SPI_FRAME_TABLE_PAYLOAD_LEN;
+    uint16_t crc = Crc16(&reply[1], 1+SPI_FRAME_TABLE_PAYLOAD_LEN);
+    reply[2+SPI_FRAME_TABLE_PAYLOAD_LEN+0] = HI_UINT16(crc);
+    reply[2+SPI_FRAME_TABLE_PAYLOAD_LEN+1] = LO_UINT16(crc);
+
+    // complete: dma_isr() can send it from now on
+    g_tableReplyReady = next;
+    g_tableReplyTicks = g_clockTicks;
+}
+
+/* the row of remoteID: if it has none, takes a free row or the one seen least recently */
+static remote_entry_t* GetRemoteEntry(uint8_t remoteID)
+{
+    remote_entry_t* oldest = &g_remotes[0];
+    for (uint8_t i = 0; i < REMOTE_TABLE_LEN; i++)
+    {
+        remote_entry_t* entry = &g_remotes[i];
+        if (entry->remoteID == remoteID)
+            return entry;
+        if (oldest->remoteID != 0 &&
+            (entry->remoteID == 0 || g_clockTicks - entry->lastSeenTicks > g_clockTicks - oldest->lastSeenTicks))
+            oldest = entry;
+    }
+
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->remoteID = remoteID;
+    oldest->lastSeenTicks = g_clockTicks;
+    return oldest;
+}
+
+static void UpdateRemoteEntry(uint8_t remoteID, uint8_t ackOk)
+{
+    UpdateClock();
+    remote_entry_t* entry = GetRemoteEntry(remoteID);
+    if (ackOk)
+    {
+        entry->acked = 1;
+        entry->lastTransactionID = g_lastRemoteAckTransactionID;
+        entry->battery = g_lastRemoteBatteryRead;
+        entry->rssi = g_lastRemoteRssi;
+        entry->failures = 0;
+        entry->lastSeenTicks = g_clockTicks;
+    }
+    else if (entry->failures < 0xFF)
+        entry->failures++;
+
+    UpdateTableReply();
+}
+
+static uint8_t HasAckedBroadcast(uint8_t remoteID)
+{
+    return g_bcastAcked[(remoteID - 1) / 8] & BV((remoteID - 1) % 8);
+}
+
+/* the remote nodes of the table (those which ACKed at least once) still missing from g_bcastAcked */
+static uint8_t CountBroadcastPending()
+{
+    uint8_t pending = 0;
+    for (uint8_t i = 0; i < REMOTE_TABLE_LEN; i++)
+    {
+        const remote_entry_t* entry = &g_remotes[i];
+        if (entry->remoteID != 0 && entry->acked && !HasAckedBroadcast(entry->remoteID))
+            pending++;
+    }
+    return pending;
+}
+
+/* appends BIN_TLV_BCAST_ACK to the broadcast command in g_pktTx, with enough ACK slots for the
+   remote nodes still missing and as much of g_bcastAcked as fits in the frame */
+static void AppendBroadcastAck()
+{
+    uint8_t pending = CountBroadcastPending();
+    g_bcastNumSlots = BCAST_MIN_ACK_SLOTS;
+    while (g_bcastNumSlots < pending && g_bcastNumSlots < BCAST_MAX_ACK_SLOTS)
+        g_bcastNumSlots *= 2;
+
+    // the bitmap up to the last remote node heard:
+    uint8_t value[1+BCAST_ACKED_MAX_LEN];
+    uint8_t bitmapLen = 0;
+    for (uint8_t i = 0; i < BCAST_BITMAP_LEN; i++)
+    {
+        if (g_bcastAcked[i])
+            bitmapLen = i + 1;
+    }
+    // signed: HandleSPIBinCommand() leaves room for value[0], but not necessarily for any bitmap byte
+    int8_t room = (int8_t)MAX_RADIO_PKT_LEN - (int8_t)g_bcastCmdLen - BIN_FRAME_TLV_HEADER_LEN - 1;
+    if (room < 0)
+        room = 0;
+    if (bitmapLen > room)
+        bitmapLen = room;
+    if (bitmapLen > BCAST_ACKED_MAX_LEN)
+        bitmapLen = BCAST_ACKED_MAX_LEN;
+
+    value[0] = g_bcastNumSlots;
+    memcpy(&value[1], g_bcastAcked, bitmapLen);
+    uint8_t* cmdMsg = MRFI_P_PAYLOAD(&g_pktTx);
+    MRFI_SET_PAYLOAD_LEN(&g_pktTx, BinFrameAppendTLV(cmdMsg, g_bcastCmdLen, BIN_TLV_BCAST_ACK, value, 1 + bitmapLen));
+    g_bcastNewAcks = 0;
+}
+
+/* an ACK of the broadcast command in flight was just validated by IsValidRadioACK() */
+static void RecordBroadcastAck()
+{
+    uint8_t remoteID = MRFI_P_SRC_ADDR(&g_pktRx)[0];
+    if (HasAckedBroadcast(remoteID))
+        return;         // a late copy: its bit may not have fit in the last transmission
+
+    g_bcastAcked[(remoteID - 1) / 8] |= BV((remoteID - 1) % 8);
+    g_bcastNewAcks++;
+    UpdateRemoteEntry(remoteID, 1);
+}
+
+/* the remote nodes of the table that did not ACK the broadcast command count it as a failure */
+static void UpdateBroadcastFailures()
+{
+    for (uint8_t i = 0; i < REMOTE_TABLE_LEN; i++)
+    {
+        remote_entry_t* entry = &g_remotes[i];
+        if (entry->remoteID != 0 && !HasAckedBroadcast(entry->remoteID) && entry->failures < 0xFF)
+            entry->failures++;
+    }
+    UpdateTableReply();
+}
+
+static uint8_t IsBroadcastAckedByAny()
+{
+    for (uint8_t i = 0; i < BCAST_BITMAP_LEN; i++)
+    {
+        if (g_bcastAcked[i])
+            return 1;
+    }
+    return 0;
+}
+
+#if ENABLE_BINARY_RADIO_FRAMES
+/* writes the binary frame of the command in cmdMsg; returns its length, 0 if it does not fit in
+   MAX_RADIO_PKT_LEN (the TLVs are then written only up to the first one that does not fit) */
+static uint8_t BuildBinCommand(const queued_cmd_t* entry, uint8_t* cmdMsg)
+{
+    uint8_t len = BinFrameInit(cmdMsg, BIN_FRAME_OPCODE_FLAG | entry->cmd, entry->transactionID);
+    if (entry->parameter >= '1' && entry->parameter <= '9')
+    {
+        uint8_t channel = entry->parameter - '0';
+        len = BinFrameAppendTLV(cmdMsg, len, BIN_TLV_CHANNEL, &channel, 1);
+    }
+    if (len && entry->numOps)
+        len = BinFrameAppendTLV(cmdMsg, len, BIN_TLV_OPS, entry->ops, entry->numOps);
+    if (len && entry->durationMin)
+    {
+        uint8_t duration[2] = { LO_UINT16(entry->durationMin), HI_UINT16(entry->durationMin) };
+        len = BinFrameAppendTLV(cmdMsg, len, BIN_TLV_DURATION, duration, 2);
+    }
+    if (len && entry->groups)
+        len = BinFrameAppendTLV(cmdMsg, len, BIN_TLV_GROUPS, &entry->groups, 1);
+    return len;
+}
+#endif
+
+/* returns 0 if the command cannot be sent over radio: it is then completed as failed */
+static uint8_t StartRadioCommand(queued_cmd_t* entry)
+{
+    /* Build the command */
+    uint8_t* cmdMsg = MRFI_P_PAYLOAD(&g_pktTx);
+#if ENABLE_BINARY_RADIO_FRAMES
+    uint8_t len = BuildBinCommand(entry, cmdMsg);
+    if (len == 0)
+    {
+        // HandleSPIBinCommand() does not queue such commands
+        entry->state = CMD_STATE_FAILED;
+        return 0;
+    }
+    MRFI_SET_PAYLOAD_LEN(&g_pktTx, len);
+
+    if (entry->remoteID == BROADCAST_NODE_ID)
+    {
+        // BIN_TLV_BCAST_ACK is appended to each transmission by AppendBroadcastAck()
+        memset(g_bcastAcked, 0, sizeof(g_bcastAcked));
+        g_bcastTransactionID = entry->transactionID;
+        g_bcastCmdLen = len;
+        g_bcastStart = ReadSleepTimer();
+        UpdateTableReply();
     }
+#else
+    MRFI_SET_PAYLOAD_LEN(&g_pktTx, COMMAND_LEN+COMMAND_POSTFIX_LEN);
+    memcpy(cmdMsg, g_commands[entry->cmd], COMMAND_LEN);
+    cmdMsg[COMMAND_LEN+0] = LO_UINT16(entry->transactionID);
+    cmdMsg[COMMAND_LEN+1] = entry->parameter;
+#endif
+
+    // the other remote nodes drop the frame in their radio, see SetRxAddressFilter(), unless broadcast:
+    CopyAddress(MRFI_P_SRC_ADDR(&g_pktTx), LIME2_NODE_ID);
+    CopyAddress(MRFI_P_DST_ADDR(&g_pktTx), entry->remoteID);
 
+    entry->state = CMD_STATE_IN_FLIGHT;
+    g_inFlight = entry;
+    g_txAttempts = 0;
+    return 1;
+}
+
+static void TransmitRadioCommand()
+{
+    // show we are transmitting blinking radio LED
+    BSP_TOGGLE_LED_RADIO();
+
+    if (g_inFlight->remoteID == BROADCAST_NODE_ID)
+        AppendBroadcastAck();
+
+    // tx!
+    MRFI_Transmit(&g_pktTx, MRFI_TX_TYPE_CCA);
+#if ENABLE_WAKE_ON_RADIO
+    // the retries do not rely on the predicted sniffs
+    MDMCFG1 = (MDMCFG1 & ~0x70) | WOR_MDMCFG1_NUM_PREAMBLE;
+#endif
+
+    /* Turn on RX. default is RX Idle. */
+    MRFI_RxOn();
+
+    g_txAttempts++;
+    g_radioStateStart = ReadSleepTimer();
+    g_radioState = RADIO_WAIT_ACK;
+    UpdateStatusReply(0);
+}
+
+static void CompleteRadioCommand(uint8_t ackOk)
+{
     /* Radio IDLE to save power */
     MRFI_RxIdle();
 
+    g_inFlight->state = ackOk ? CMD_STATE_ACKED : CMD_STATE_FAILED;
+    g_inFlight->battery = ackOk ? g_lastRemoteBatteryRead : 0;
+    if (g_inFlight->remoteID == BROADCAST_NODE_ID)
+        UpdateBroadcastFailures();          // the rows of the remote nodes that ACKed are up to date
+    else
+        UpdateRemoteEntry(g_inFlight->remoteID, ackOk);
+    g_inFlight = NULL;
+    UpdateStatusReply(1);
+
     if( ackOk )
     {
-        // show we received the ACK back, turning on radio LED:
+        // show we received the ACK back, turning on radio LED for a while:
         BSP_TURN_ON_LED_RADIO();
-        DELAY_ABOUT_QUARTER_A_SECOND_WITH_INTERRUPTS;
-        BSP_TURN_OFF_LED_RADIO();
+        g_radioStateStart = ReadSleepTimer();
+        g_radioState = RADIO_SHOW_ACK;
     }
-    else /* No ACK */
+    else /* No ACK: counted in the failures of its row of the 'T' frame */
+        g_radioState = RADIO_IDLE;
+}
+
+/* RADIO_WAIT_ACK for a broadcast command: collects the ACKs until the last slot is over, then
+   sends the command again or completes it */
+static void RunBroadcastWaitAck()
+{
+    if (g_sRxCallbackSemaphore)
     {
-        //BSP_TURN_ON_LED_RADIO();
-        //DELAY_ABOUT_QUARTER_A_SECOND_WITH_INTERRUPTS;
-        //BSP_TURN_OFF_LED_RADIO();
-        g_noAckCount++;
+        g_sRxCallbackSemaphore = 0;
+        if (IsValidRadioACK(g_inFlight->transactionID, BROADCAST_NODE_ID))
+            RecordBroadcastAck();
     }
 
-    /* No ACK at after NO_ACK_THRESHOLD. Wait until another command has to be sent. */
-    if( 0 ) //g_noAckCount == NO_ACK_THRESHOLD )
+    if (ElapsedMs(g_radioStateStart) < g_bcastNumSlots * BCAST_ACK_SLOT_MSEC + DELAY_AFTER_EACH_TX_MSEC)
+        return;
+
+    // done once a round is silent and every remote node known has ACKed: a remote node that
+    // was not heard yet (e.g. because its ACK collided) still ACKs in the silent round
+    uint8_t ackedByAny = IsBroadcastAckedByAny();
+    if (ackedByAny && g_bcastNewAcks == 0 && CountBroadcastPending() == 0 && g_txAttempts >= BCAST_MIN_TX)
+        CompleteRadioCommand(1);
+    else if (ElapsedMs(g_bcastStart) < DURATION_TX_RETRIES_MSEC)
+        TransmitRadioCommand();
+    else
+        CompleteRadioCommand(ackedByAny);
+}
+
+/* Advances the radio state machine: never blocks, except for the transmission of a
+   single frame, so that the main loop keeps serving SPI while a command is in flight */
+static void RunRadioStateMachine()
+{
+    UpdateClock();
+
+    switch (g_radioState)
     {
-        g_noAckCount = 0;
-        /* Radio IDLE to save power */
-        MRFI_RxIdle();//SMPL_Ioctl( IOCTL_OBJ_RADIO, IOCTL_ACT_RADIO_RXIDLE, 0);
+    case RADIO_IDLE:
+        {
+            queued_cmd_t* next = GetNextQueuedCommand();
+            if (next && StartRadioCommand(next))
+            {
+#if ENABLE_WAKE_ON_RADIO
+                if (ScheduleFirstTransmission(next->remoteID))
+                {
+                    g_radioStateStart = ReadSleepTimer();
+                    g_radioState = RADIO_WAIT_SNIFF;
+                    UpdateStatusReply(0);
+                    break;
+                }
+#endif
+                TransmitRadioCommand();
+            }
+        }
+        break;
 
-        BSP_TURN_ON_LED_RADIO();
-        DelayMsNOInterrupts(3000);//BSP_SleepFor( POWER_MODE_2, SLEEP_1_MS_RESOLUTION, 3000);
-        BSP_TURN_OFF_LED_RADIO();
+    case RADIO_WAIT_SNIFF:
+        if (ReadSleepTimer() - g_radioStateStart >= g_sniffDelayTicks)
+            TransmitRadioCommand();
+        break;
+
+    case RADIO_WAIT_ACK:
+        if (g_inFlight->remoteID == BROADCAST_NODE_ID)
+        {
+            RunBroadcastWaitAck();
+            break;
+        }
+
+        if( g_sRxCallbackSemaphore )    // Is ACK arrived? this flag is set by the RX callback in main.c
+        {
+            g_sRxCallbackSemaphore = 0;
+            if (IsValidRadioACK(g_inFlight->transactionID, g_inFlight->remoteID))
+            {
+                CompleteRadioCommand(1);
+                break;
+            }
+            //else: keep waiting, then TX the command another time!
+        }
+
+        if (ElapsedMs(g_radioStateStart) >= DELAY_AFTER_EACH_TX_MSEC)  /* Might have to be longer for bigger payloads */
+        {
+            if (g_txAttempts < NUM_TX_RETRIES)
+                TransmitRadioCommand();
+            else
+                CompleteRadioCommand(0);
+        }
+        break;
 
-        //BSP_SleepUntilButton( POWER_MODE_3, MASTER_BUTTON);
+    case RADIO_SHOW_ACK:
+        if (ElapsedMs(g_radioStateStart) >= 250)
+        {
+            BSP_TURN_OFF_LED_RADIO();
+            g_radioState = RADIO_IDLE;
+        }
+        break;
     }
 }
 
@@ -207,41 +1060,136 @@ static void PinConfigLime2_GPIO_INPUT()
 }
 #endif
 
+#if ENABLE_EVENT_PENDING_GPIO
+static void PinConfigLime2_GPIO_OUTPUT()
+{
+    /* I/O-Port configuration :
+     * the event pending line is a general purpose output, deasserted at boot
+     */
+
+    P0SEL &= ~BV(LIME2_GPIO1_BIT__);
+    __bsp_CONFIG_AS_OUTPUT__( LIME2_GPIO1_BIT__, LIME2_GPIO1_PORT__, LIME2_GPIO1_DDR__, 0 /* is active low */ );
+}
+#endif
+
+/* framed STATUS, 'Q' or 'T' frame: all of them are answered within the transaction */
+static uint8_t IsFramedStatus(const uint8_t XDATA * header)
+{
+    return header[0] == SPI_FRAME_SYNC &&
+           (header[1] == SPI_FRAME_OPCODE_STATUS || header[1] == SPI_FRAME_OPCODE_QUERY ||
+            header[1] == SPI_FRAME_OPCODE_QUEUE || header[1] == SPI_FRAME_OPCODE_TABLE);
+}
+
 static void ResetSPIRx()
 {
-    // reset SPI index
-    g_rxBufferLastIdx=0;
     memset(g_rxBufferSPISlave, 0, SPI_COMMAND_MAX_LEN);
+    memset(g_rxHeader, 0, SPI_FRAME_HEADER_LEN);
+    for (uint8_t i = 0; i < SPI_COMMAND_MAX_LEN; i++)
+        g_rxDmaRamp[i] = i + 1;
+    g_rxDmaCount = 0;
 }
-static void ResetSPITx()
+
+static void SPIDmaConfigChannel(uint8_t chan, uint16_t src, uint16_t dst, uint8_t len, uint8_t trig, uint8_t flags)
 {
-    // reset SPI index
-    g_txBufferLastIdx=0;
-    memset(g_txBufferSPISlaveACTIVE, 0, SPI_COMMAND_MAX_LEN);
+    uint8_t XDATA * pCfg = g_spiDmaCfg[chan - 1];
+
+    *pCfg++ = /* offset 0 : */  HI_UINT16( src );       /* SRCADDRH */
+    *pCfg++ = /* offset 1 : */  LO_UINT16( src );       /* SRCADDRL */
+    *pCfg++ = /* offset 2 : */  HI_UINT16( dst );       /* DSTADDRH */
+    *pCfg++ = /* offset 3 : */  LO_UINT16( dst );       /* DSTADDRL */
+    *pCfg++ = /* offset 4 : */  0;                      /* VLEN = use LEN, LEN high bits */
+    *pCfg++ = /* offset 5 : */  len;
+    *pCfg++ = /* offset 6 : */  SPI_DMA_WORDSIZE | SPI_DMA_TMODE | trig;
+    *pCfg   = /* offset 7 : */  flags | SPI_DMA_M8 | SPI_DMA_PRIORITY;
+}
 
-    // reset also "next" buffer so that until a valid command will be received
-    // we will continue sending zeros on the SPI:
-    memset(g_txBufferSPISlaveNEXT, 0, SPI_COMMAND_MAX_LEN);
+static void SPIDmaConfig()
+{
+    uint16_t u0dbuf = BSP_XDATA_ADDRESS(&X_U0DBUF);
+
+    SPIDmaConfigChannel(SPI_DMA_CHAN_RX,
+                        u0dbuf, BSP_XDATA_ADDRESS(g_rxBufferSPISlave), SPI_COMMAND_MAX_LEN, SPI_DMA_TRIG_URX0,
+                        SPI_DMA_SRCINC_NONE | SPI_DMA_DESTINC_PLUS_1 | SPI_DMA_IRQMASK_DISABLE);
+    SPIDmaConfigChannel(SPI_DMA_CHAN_RX_COUNT,
+                        BSP_XDATA_ADDRESS(g_rxDmaRamp), BSP_XDATA_ADDRESS(&g_rxDmaCount), SPI_COMMAND_MAX_LEN, SPI_DMA_TRIG_URX0,
+                        SPI_DMA_SRCINC_PLUS_1 | SPI_DMA_DESTINC_NONE | SPI_DMA_IRQMASK_DISABLE);
+    SPIDmaConfigChannel(SPI_DMA_CHAN_RX_HEADER,
+                        u0dbuf, BSP_XDATA_ADDRESS(g_rxHeader), SPI_FRAME_HEADER_LEN, SPI_DMA_TRIG_URX0,
+                        SPI_DMA_SRCINC_NONE | SPI_DMA_DESTINC_PLUS_1 | SPI_DMA_IRQMASK_ENABLE);
+    SPIDmaConfigChannel(SPI_DMA_CHAN_TX,
+                        BSP_XDATA_ADDRESS(g_txBufferSPISlaveACTIVE), u0dbuf, SPI_COMMAND_MAX_LEN, SPI_DMA_TRIG_UTX0,
+                        SPI_DMA_SRCINC_PLUS_1 | SPI_DMA_DESTINC_NONE | SPI_DMA_IRQMASK_DISABLE);
+
+    uint16_t cfg = BSP_XDATA_ADDRESS(&g_spiDmaCfg[0][0]);
+    DMA1CFGH = HI_UINT16( cfg );
+    DMA1CFGL = LO_UINT16( cfg );
+}
 
-    // avoid sending out a first character on the SPI due to old contents:
-    U0DBUF=0;
+/* the TX channel sends len bytes from src: the first one is the next byte loaded in U0DBUF */
+static void SPIDmaSetTx(uint16_t src, uint8_t len)
+{
+    uint8_t XDATA * pCfg = g_spiDmaCfg[SPI_DMA_CHAN_TX - 1];
+
+    pCfg[0] = HI_UINT16( src );                         /* SRCADDRH */
+    pCfg[1] = LO_UINT16( src );                         /* SRCADDRL */
+    pCfg[5] = len;                                      /* LEN */
+}
+
+/* starts the DMA transfers of the next SPI transaction from the beginning of the buffers:
+   call this only when SSN is deasserted */
+static void SPIDmaRestart()
+{
+    // an armed channel keeps its position: abort all of them first
+    BSP_DMA_ABORT(SPI_DMA_ALL_CHAN);
+    SPIDmaSetTx(BSP_XDATA_ADDRESS(g_txBufferSPISlaveACTIVE), SPI_COMMAND_MAX_LEN);
+    g_queueReplySending = NO_REPLY_SENDING;
+    g_tableReplySending = NO_REPLY_SENDING;
+    g_rxDmaCount = 0;
+    DMAIRQ &= ~SPI_DMA_ALL_CHAN;
+    BSP_DMA_ARM(SPI_DMA_ALL_CHAN);
 }
 
 static void SPITxCopyNEXTinACTIVE()             // call this only when no SPI TX is ongoing!!!!
 {
+    // the TX DMA channel is armed at the start of ACTIVE whenever SSN is deasserted
     memcpy(g_txBufferSPISlaveACTIVE, g_txBufferSPISlaveNEXT, SPI_COMMAND_MAX_LEN);
-    g_txBufferLastIdx = 0;
+    g_txBufferSwapPending = 0;
     // avoid sending out a first character on the SPI due to old contents:
     U0DBUF=0;
 }
 
-static void PrepareSPIAck()
+/* reply: NULL to send zeros */
+static void SetSPIReply(const uint8_t* reply, uint8_t len)
 {
+    bspIState_t intState;
+    BSP_ENTER_CRITICAL_SECTION(intState);
+
     // prepare the reply in the "next" buffer to avoid corrupting an already-ongoing TX
-    // using the "active" buffer
-    memcpy(g_txBufferSPISlaveNEXT, g_ack, REPLY_LEN);
-    g_txBufferSPISlaveNEXT[REPLY_LEN+0]=g_lastRemoteAckTransactionID;
-    g_txBufferSPISlaveNEXT[REPLY_LEN+1]=g_lastRemoteBatteryRead;
+    // using the "active" buffer; p0int_isr may copy it at any time, so fill it with
+    // interrupts disabled
+    memset(g_txBufferSPISlaveNEXT, 0, SPI_COMMAND_MAX_LEN);
+    if (reply)
+        memcpy(g_txBufferSPISlaveNEXT, reply, len);
+
+    // the "next" buffer becomes active right away if the bus is idle, otherwise at the
+    // end of the ongoing transaction (see p0int_isr):
+    if (SPI_SSN_DEASSERTED())
+        SPITxCopyNEXTinACTIVE();
+    else
+        g_txBufferSwapPending = 1;
+
+    BSP_EXIT_CRITICAL_SECTION(intState);
+}
+
+static void ResetSPITx()
+{
+    // until a valid command will be received we will continue sending zeros on the SPI:
+    SetSPIReply(NULL, 0);
+}
+
+static void PrepareSPIAck()
+{
+    SetSPIReply(g_statusReply, REPLY_LEN+REPLY_POSTFIX_LEN);
 }
 
 static void PinConfigLime2_SPI_INPUT(void)
@@ -301,70 +1249,66 @@ static void PinConfigLime2_SPI_INPUT(void)
     URX0IF = 0;
     UTX0IF = 0;
 
-    // before enabling any interrupt, make sure SPI variables are ready:
+    // before enabling any interrupt, make sure SPI variables and DMA descriptors are ready:
     ResetSPIRx();
+    SPIDmaConfig();
+    UpdateStatusReply(0);
     PrepareSPIAck();
-    SPITxCopyNEXTinACTIVE();
-
-    // Enable interrupt from USART0 RX by setting [IEN0.URX0IE=1]
-    URX0IE = 1;
-    // Enable interrupt from USART0 TX by setting [IEN2.UTX0IE=1]
-    //UTX0IE = 1;
-    IEN2 |= 0x4;
 
+    // Port 0 interrupt on the rising edge of P0_4-P0_7: the one of SSN (P0_4) marks
+    // the end of each SPI frame
+    PICTL = (PICTL & ~PICTL_P0ICON) | PICTL_P0IENH;
+    P0IFG = 0;
+    P0IF = 0;
+    P0IE = 1;
 
-    // Enable global interrupts
-    EA = 1;
+    // No USART0 RX/TX interrupts [IEN0.URX0IE=0, IEN2.UTX0IE=0]: the bytes are moved by
+    // DMA; the only DMA interrupt is the one of the header channel [IEN1.DMAIE=1]
+    URX0IE = 0;
+    IEN2 &= ~0x4;
+    DMAIF = 0;
+    DMAIE = 1;
 
     /***************************************************************************
      * NOTE: data receive
      *
-     * An USART0 RX complete interrupt will be generated each time a byte is
-     * received. See the interrupt routine (ut0rx_interrupt()).
-     * At the same time the content of U0DBUF will be sent out...
+     * Each byte received by USART0 triggers the 3 RX DMA channels, each byte
+     * moved by USART0 from U0DBUF to its shift register triggers the TX one,
+     * which loads the next byte to be sent out in U0DBUF.
+     * See dma_isr() and p0int_isr().
      */
 
     // at boot, send out NULLs
     U0DBUF = 0;
+    SPIDmaRestart();
+
+    // Enable global interrupts
+    EA = 1;
 }
 
-static void HandleSPI()
+/* returns 1 if the command was accepted */
+static uint8_t HandleCommand(const queued_cmd_t* request)
 {
-    int usart0_active = U0CSR & 0x1; // first bit at 1 means USART 0 busy in transmit or receive mode
-    if (usart0_active)
-        return;
-
-    if (g_rxBufferLastIdx == 0)
-        return;           // nothing received!
-
-    
-    // the idea is that we will enter this function from time to time.
-    // SPI communication is pretty fast so by the time this function checks the
-    // SPI RX buffer, we should find all bytes there. For this reason we reject
-    // what we received if its length is not correct!    
-    if (g_rxBufferLastIdx != COMMAND_LEN + COMMAND_POSTFIX_LEN /* transaction ID byte */)
-    {
-        // default: garbage command... do not provide a valid ACK on SPI:
-        ResetSPITx();
-
-        // get ready for next command:
-        ResetSPIRx();
-        return;
-    }
-
-
-    // Received a command!!
-
-    g_lastSpiCommand = String2Command(g_rxBufferSPISlave, COMMAND_LEN + COMMAND_POSTFIX_LEN);
-
-    switch (g_lastSpiCommand)
+    switch (request->cmd)
     {
+    case CMD_BATCH:
+        if (request->numOps == 0)
+        {
+            // sent as ASCII, or without operations:
+            ResetSPITx();
+            return 0;
+        }
+                // fallthrough!
     case CMD_TURN_ON:
     case CMD_TURN_OFF:
     case CMD_NO_OP:
-        // Read the transaction ID
-        g_lastSpiCommandTransactionID = g_rxBufferSPISlave[COMMAND_LEN+0];
-        g_lastSpiCommandParameter = g_rxBufferSPISlave[COMMAND_LEN+1];
+        // append the command, with its transaction ID and parameter, to the radio queue:
+        if (!EnqueueCommand(request))
+        {
+            // queue full: do not provide a valid ACK on SPI, the MASTER SYSTEM will retry later:
+            ResetSPITx();
+            return 0;
+        }
                 // fallthrough!
 
         // IMPORTANT: the transaction ID / cmdParameter given in the STATUS command is ignored:
@@ -375,17 +1319,171 @@ static void HandleSPI()
 
         // create the ACK over SPI:
         PrepareSPIAck();
-        SPITxCopyNEXTinACTIVE();            // because of initial check on usart0_active we are sure no TX is ongoing!
-        break;
+        return 1;
 
     default:
         // default: garbage command... do not provide a valid ACK on SPI:
         ResetSPITx();
+        return 0;
+    }
+}
+
+/* returns 1 if the command (COMMAND_LEN + COMMAND_POSTFIX_LEN bytes) was accepted */
+static uint8_t HandleSPICommand(const uint8_t* buf)
+{
+    queued_cmd_t request;
+    memset(&request, 0, sizeof(request));
+    request.cmd = String2Command(buf, COMMAND_LEN + COMMAND_POSTFIX_LEN);
+    request.transactionID = buf[COMMAND_LEN+0];
+    request.parameter = buf[COMMAND_LEN+1];
+    request.remoteID = DEFAULT_REMOTE_NODE_ID;
+    return HandleCommand(&request);
+}
+
+/* returns 1 if the binary command was accepted; the parameter is turned back into the ASCII
+   one of the queue, so that it can be sent over radio in either format */
+static uint8_t HandleSPIBinCommand(const uint8_t* buf, uint8_t len)
+{
+    queued_cmd_t request;
+    memset(&request, 0, sizeof(request));
+    request.cmd = BinFrame2Command(buf, len);
+    request.transactionID = BinFrameTransactionID(buf);
+
+    const uint8_t* channel = BinFrameFindTLV(buf, len, BIN_TLV_CHANNEL, 1);
+    const uint8_t* ops = BinFrameFindTLV(buf, len, BIN_TLV_OPS, BIN_TLV_ANY_LEN);
+    const uint8_t* duration = BinFrameFindTLV(buf, len, BIN_TLV_DURATION, 2);
+    const uint8_t* remote = BinFrameFindTLV(buf, len, BIN_TLV_REMOTE, 1);
+    const uint8_t* groups = BinFrameFindTLV(buf, len, BIN_TLV_GROUPS, 1);
+    request.remoteID = remote ? *remote : DEFAULT_REMOTE_NODE_ID;
+    if (groups)
+        request.groups = *groups;
+    if (channel)
+        request.parameter = '0' + *channel;
+    if (ops && request.cmd == CMD_BATCH)
+        request.numOps = BIN_TLV_LEN(ops);
+    if (duration && (request.cmd == CMD_TURN_ON || request.cmd == CMD_BATCH))
+        request.durationMin = BUILD_UINT16(duration[0], duration[1]);
+
+    // CMD_BATCH, the durations, the groups and the broadcast can only be sent over radio as a binary frame;
+    // CMD_BATCH names its relay groups in BIN_TLV_OPS, the remote node ignores BIN_TLV_CHANNEL:
+    uint8_t broadcast = request.remoteID == BROADCAST_NODE_ID;
+    if (request.numOps > BIN_BATCH_MAX_OPS || (request.cmd == CMD_BATCH && channel) ||
+        (!broadcast && (request.remoteID < REMOTE_NODE_ID_MIN || request.remoteID > REMOTE_NODE_ID_MAX)) ||
+        ((request.cmd == CMD_BATCH || request.durationMin || request.groups || broadcast) && !ENABLE_BINARY_RADIO_FRAMES))
+    {
+        ResetSPITx();
+        return 0;
+    }
+    if (request.numOps)
+        memcpy(request.ops, ops, request.numOps);
+
+#if ENABLE_BINARY_RADIO_FRAMES
+    // queue only the commands that fit in a radio frame, StartRadioCommand() builds them again;
+    // the broadcast also needs room for BIN_TLV_BCAST_ACK with the number of ACK slots, see AppendBroadcastAck():
+    uint8_t cmdMsg[MAX_RADIO_PKT_LEN];
+    uint8_t cmdLen = BuildBinCommand(&request, cmdMsg);
+    if (cmdLen == 0 || (broadcast && cmdLen + BIN_FRAME_TLV_HEADER_LEN + 1 > MAX_RADIO_PKT_LEN))
+    {
+        ResetSPITx();
+        return 0;
+    }
+#endif
+
+    return HandleCommand(&request);
+}
+
+static void HandleSPICrcFrame(const spi_frame_t* frame)
+{
+    uint8_t payloadLen = frame->data[2];
+    const uint8_t* payload = &frame->data[SPI_FRAME_CRC_HEADER_LEN];
+
+    // the MASTER SYSTEM may clock out padding after the CRC (e.g. to read the reply to 'Q'):
+    if (frame->len < SPI_FRAME_CRC_HEADER_LEN + SPI_FRAME_CRC_LEN ||
+        payloadLen > frame->len - SPI_FRAME_CRC_HEADER_LEN - SPI_FRAME_CRC_LEN ||
+        Crc16(&frame->data[1], SPI_FRAME_CRC_HEADER_LEN - 1 + payloadLen) !=
+            ((payload[payloadLen] << 8) | payload[payloadLen+1]))
+    {
+        // bit errors, or a truncated frame: the MASTER SYSTEM sees the counter in the reply to 'Q'
+        g_frameCrcErrors++;
+        UpdateStatusReply(0);
+        return;
+    }
+
+    switch (frame->data[1])
+    {
+    case SPI_FRAME_OPCODE_QUERY:
+        // it has been fully served by the ISRs, as the framed STATUS
+        BSP_TOGGLE_LED_SPI();
+        break;
+
+    case SPI_FRAME_OPCODE_COMMAND:
+        // a resent frame that had been accepted already, e.g. when a 'Q' frame batched right
+        // after it was read before this main loop got to it: do not queue the command twice
+        if (frame->data[3] == g_lastFrameSeq)
+            break;
+
+        // acknowledge the sequence number only once the command is queued: the MASTER SYSTEM
+        // resends the frame otherwise
+        if (IsBinFrame(payload, payloadLen) ? HandleSPIBinCommand(payload, payloadLen) :
+            payloadLen == COMMAND_LEN + COMMAND_POSTFIX_LEN && HandleSPICommand(payload))
+        {
+            g_lastFrameSeq = frame->data[3];
+            UpdateStatusReply(0);
+        }
         break;
     }
+}
 
-    // get ready for next command:
-    ResetSPIRx();
+static void HandleSPIFrame(const spi_frame_t* frame)
+{
+    if (frame->len >= COMMAND_LEN && memcmp(frame->data, g_commands[CMD_ECHO], COMMAND_LEN) == 0)
+    {
+        // loopback: no transaction ID nor parameter, any payload length
+        SetSPIReply(&frame->data[COMMAND_LEN], frame->len - COMMAND_LEN);
+        BSP_TOGGLE_LED_SPI();
+        return;
+    }
+
+    if (frame->len >= SPI_FRAME_HEADER_LEN && frame->data[0] == SPI_FRAME_SYNC)
+    {
+        if (frame->data[1] == SPI_FRAME_OPCODE_STATUS)
+        {
+            // framed STATUS: it has been fully served by the ISRs, which also went back to
+            // the reply of the last non-framed command for the next transaction
+            BSP_TOGGLE_LED_SPI();
+        }
+        else
+            HandleSPICrcFrame(frame);
+        return;
+    }
+
+    // the frame is exactly what the master sent while SSN was asserted: reject it if
+    // its length is not correct!
+    if (frame->len != COMMAND_LEN + COMMAND_POSTFIX_LEN /* transaction ID byte */)
+    {
+        // default: garbage command... do not provide a valid ACK on SPI:
+        ResetSPITx();
+        return;
+    }
+
+
+    // Received a command!!
+    HandleSPICommand(frame->data);
+}
+
+static void HandleSPI()
+{
+    // frames dropped by p0int_isr(): the MASTER SYSTEM sees the counter in the reply to 'Q'
+    if (g_rxQueueDropped != g_rxQueueDroppedReported)
+        UpdateStatusReply(0);
+
+    if (g_rxQueueTail == g_rxQueueHead)
+        return;           // nothing received!
+
+    HandleSPIFrame(&g_rxQueue[g_rxQueueTail & (SPI_RX_QUEUE_LEN-1)]);
+
+    // only now the ISR can reuse the entry:
+    g_rxQueueTail++;
 }
 
 /***********************************************************************************
@@ -407,32 +1505,31 @@ void sLime2Node(void)
 #if ENABLE_INPUTS_VIA_GPIO
     PinConfigLime2_GPIO_INPUT();
 #endif
+#if ENABLE_EVENT_PENDING_GPIO
+    PinConfigLime2_GPIO_OUTPUT();
+#endif
+#if ENABLE_WAKE_ON_RADIO
+    // the remote node senses the carrier only every WOR_SNIFF_INTERVAL_MSEC: stretch the preamble
+    MDMCFG1 = (MDMCFG1 & ~0x70) | WOR_MDMCFG1_NUM_PREAMBLE;        // NUM_PREAMBLE is bits 6:4
+#endif
+    UpdateTableReply();                         // valid, with no rows, until the first command completes
 
     // now wait forever for commands from LIME2 Linux SPI master
     // that we will bridge over radio toward the "remote" node:
-    unsigned int count1=0, count2=0;
     while (1)
     {
-        if (g_lastSpiCommand == CMD_TURN_ON || g_lastSpiCommand == CMD_TURN_OFF || g_lastSpiCommand == CMD_NO_OP)
-        {
-            SendCommandOverRadioWithACK();        // this can take up to DURATION_TX_RETRIES_MSEC!
-            g_lastSpiCommand = CMD_MAX;
-            //DelayMsNOInterrupts(HOLDOFF_TIME_AFTER_CMD_MSEC);       // after sending a command over radio we cannot handle any new command for a while
-        }
+        RunRadioStateMachine();                 // this is fast: no delay waiting for the ACK
 
-        count1++;
-        if ((count1 % 16) == 0)
-        {
-            count2++;
-            int handle_spi = ((count2 % 16) == 0);
-            if (handle_spi)
-            {
-                // with current settings for count1 and count2, this part is
-                // executed every ??? secs
+        HandleSPI();                            // this is very fast: no delay, nothing to do if no frame is queued
 
-                HandleSPI();            // this is very fast, no delay
-            }
-        }
+        if (g_queueReplyStale)
+            UpdateStatusReply(0);               // the reply to 'L' was being sent when the queue changed
+
+        UpdateClock();                          // also keeps ReadSleepTimer() from missing a wrap
+        if (g_tableReplyStale || g_clockTicks - g_tableReplyTicks >= SLEEP_TIMER_HZ)
+            UpdateTableReply();                 // the ages of the 'T' frame are in seconds
+
+        BSP_MAIN_LOOP_TICK();
     }
 }
 
@@ -447,51 +1544,128 @@ void sLime2Node(void)
 
 
 /***********************************************************************************
-* @fn          ut0rx_isr
+* @fn          dma_isr
 *
-* @brief       Interrupt routine which receives data from SPI master
+* @brief       Interrupt routine of the DMA controller: the header channel has
+*              received the first SPI_FRAME_HEADER_LEN bytes of the frame; for the
+*              framed STATUS, puts the reply in the TX buffer after the turnaround byte,
+*              for the 'L' and 'T' frames points the TX channel at their reply
 *
 * @param       none
 *
 * @return      0
 */
 
-#pragma vector = URX0_VECTOR
-__interrupt void ut0rx_isr(void)
+#pragma vector = DMA_VECTOR
+__interrupt void dma_isr(void)
 {
-    // Clear the CPU URX0IF interrupt flag
-    URX0IF = 0;
+    // clear the CPU DMAIF interrupt flag first, then the channel flag
+    DMAIF = 0;
 
-    // Read received byte to buffer
-    g_rxBufferSPISlave[g_rxBufferLastIdx++] = U0DBUF;
+    if (!(DMAIRQ & BV(SPI_DMA_CHAN_RX_HEADER)))
+        return;
+    DMAIRQ &= ~BV(SPI_DMA_CHAN_RX_HEADER);
 
-    // if buffer full avoid buffer overruns next time a byte is received!!
-    if (g_rxBufferLastIdx == SPI_COMMAND_MAX_LEN)
+    // framed STATUS, 'Q' or 'T' frame: reply within the same transaction, after the turnaround byte
+    if (IsFramedStatus(g_rxHeader))
     {
-        // we received garbage... go back to the start...
-        ResetSPIRx();
+        // the TX channel has already loaded the byte following the header in U0DBUF: the
+        // reply starts one byte before the turnaround one in the ACTIVE buffer
+        if (g_rxHeader[1] == SPI_FRAME_OPCODE_TABLE)
+        {
+            // sent in place, up to its end; p0int_isr() points the channel back at the ACTIVE
+            // buffer. The table carries no event
+            g_tableReplySending = g_tableReplyReady;
+            BSP_DMA_ABORT(DMAARM4);
+            SPIDmaSetTx(BSP_XDATA_ADDRESS(g_tableReply[g_tableReplySending]), SPI_FRAME_TABLE_REPLY_LEN);
+            BSP_DMA_ARM(DMAARM4);
+            return;
+        }
+        if (g_rxHeader[1] == SPI_FRAME_OPCODE_QUEUE)
+        {
+            // sent in place as well
+            g_queueReplySending = g_queueReplyReady;
+            BSP_DMA_ABORT(DMAARM4);
+            SPIDmaSetTx(BSP_XDATA_ADDRESS(g_queueReply[g_queueReplySending]), SPI_FRAME_QUEUE_REPLY_LEN);
+            BSP_DMA_ARM(DMAARM4);
+        }
+        else
+        {
+            uint8_t XDATA * dst = &g_txBufferSPISlaveACTIVE[SPI_FRAME_HEADER_LEN-1+SPI_FRAME_TURNAROUND_LEN];
+            if (g_rxHeader[1] == SPI_FRAME_OPCODE_QUERY)
+            {
+                for (uint8_t i = 0; i < SPI_FRAME_QUERY_REPLY_LEN; i++)
+                    dst[i] = g_queryReply[i];
+            }
+            else
+            {
+                for (uint8_t i = 0; i < REPLY_LEN+REPLY_POSTFIX_LEN; i++)
+                    dst[i] = g_statusReply[i];
+            }
+        }
+
+        // the MASTER SYSTEM is reading the latest status: the event has been consumed
+        CLEAR_EVENT_PENDING();
     }
 }
 
-#pragma vector = UTX0_VECTOR
-__interrupt void ut0tx_isr(void)
+/***********************************************************************************
+* @fn          p0int_isr
+*
+* @brief       Interrupt routine of port 0: on the SSN deassert edge, hands the
+*              received frame to the main loop and gets the TX buffer ready for
+*              the next transaction
+*
+* @param       none
+*
+* @return      0
+*/
+
+#pragma vector = P0INT_VECTOR
+__interrupt void p0int_isr(void)
 {
-    // Clear the CPU UTX0IF interrupt flag
-    UTX0IF = 0;
+    uint8_t flags = P0IFG;
 
-    // Write next byte to buffer
-    if (g_txBufferLastIdx == SPI_COMMAND_MAX_LEN)//REPLY_LEN+REPLY_POSTFIX_LEN)
+    // clear the pin flags first, then the CPU P0IF interrupt flag; the other pins of
+    // P0_4-P0_7 share the interrupt enable, their edges are just ignored
+    P0IFG = 0;
+    P0IF = 0;
+
+    if (!(flags & SPI_SSN_BIT))
+        return;
+
+    // the RX channel stops after SPI_COMMAND_MAX_LEN bytes: we received garbage, or an 'L' or
+    // 'T' frame already served by dma_isr()... drop it
+    uint8_t len = g_rxDmaCount;
+    if (len > 0 && len < SPI_COMMAND_MAX_LEN)
     {
-        // finished TX buffer; just send out zeros.
-        // If this point is reached it means that the main microcontroller loop is
-        // busy with the radio and HandleSPI() function is not getting called but
-        // the SPI master keeps sending us commands.
-        U0DBUF = 0;
+        if ((uint8_t)(g_rxQueueHead - g_rxQueueTail) < SPI_RX_QUEUE_LEN)
+        {
+            spi_frame_t* frame = &g_rxQueue[g_rxQueueHead & (SPI_RX_QUEUE_LEN-1)];
+            for (uint8_t i = 0; i < len; i++)
+                frame->data[i] = g_rxBufferSPISlave[i];
+            frame->len = len;
+
+            // publish the entry only once it's complete:
+            g_rxQueueHead++;
+        }
+        else
+            g_rxQueueDropped++;     // the main loop is stuck (e.g. in MRFI_Transmit): the master will retry
+    }
+
+    // the framed STATUS has overwritten the ACTIVE buffer: restore it as well
+    if (g_txBufferSwapPending ||
+        (len >= SPI_FRAME_HEADER_LEN && IsFramedStatus(g_rxBufferSPISlave)))
+    {
+        SPITxCopyNEXTinACTIVE();
     }
     else
     {
-        U0DBUF = g_txBufferSPISlaveACTIVE[g_txBufferLastIdx++];
+        // each transaction gets the reply from its start
+        U0DBUF = 0;
     }
+
+    SPIDmaRestart();
 }
 
 #endif  // LIME2
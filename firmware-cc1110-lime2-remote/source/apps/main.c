@@ -20,12 +20,19 @@ Operation:
 #include "main.h"
 
 #include <string.h>
+#include <ioCC1110.h>
+#include "hal_cc8051.h"
 
 
 /***********************************************************************************
 * LOCAL VARIABLES
 */
 
+// the clock of ReadSleepTimer(): the sleep timer is only 16 bits wide and BSP_SleepFor() and
+// BSP_IdleFor() reset it, so its periods are accumulated here
+static          uint32_t      g_sleepTimerTicks = 0;
+static          uint16_t      g_sleepTimerLast = 0;            // WORTIME1:WORTIME0 accounted so far
+
 /***********************************************************************************
 * GLOBAL VARIABLES
 */
@@ -38,10 +45,13 @@ const char* g_commands[] =
     "TURNON_",
     "TURNOFF",
     "NOOP___",
-    "STATUS_"
+    "STATUS_",
+    "ECHO___",
+    "BATCH__"        // binary frames only: rejected as an ASCII command
 };
 
 const char* g_ack = "ACK_";
+const char* g_busy = "BUSY";       // same length of g_ack
 
 
 /***********************************************************************************
@@ -64,6 +74,7 @@ void main (void)
 {
     //uint8_t buttonPushed;
     BSP_Init();
+    BSP_StartSleepTimer();
 
     // assert some preconditions:
     for (unsigned int cmdi=0; cmdi < CMD_MAX; cmdi++)
@@ -82,7 +93,7 @@ void main (void)
     MRFI_WakeUp();
     MRFI_SetLogicalChannel(MRFI_CHANNEL);
     MRFI_RxOn();
-    //SetRxAddressFilter();  // LEAVE DISABLED, FOR SOME REASON DOES NOT WORK
+    SetRxAddressFilter();
 
     /* Turn on LEDs indicating power on */
     BSP_TURN_ON_LED1();
@@ -104,29 +115,24 @@ void main (void)
 /***********************************************************************************
 * @fn          CopyAddress
 *
-* @brief
+* @brief       Writes the MRFI address of the given node (LIME2_NODE_ID or a remote node ID),
+*              or the MRFI broadcast address for BROADCAST_NODE_ID
 *
 * @return
 */
-void CopyAddress(uint8_t* destAddr, NodeType_t type)
+void CopyAddress(uint8_t* destAddr, uint8_t nodeId)
 {
-    int i;
-    for (i=0; i<MRFI_ADDR_SIZE; i++)
-    destAddr[i]=0;
-    if (type == NODE_LIME2)
-    {
-        destAddr[0]=0xAA;
-        destAddr[1]=0xAB;
-        destAddr[2]=0xAC;
-        destAddr[MRFI_ADDR_SIZE-1]=0xFF;                    // MRFI_ADDR_SIZE=4 !!!!
-    }
-    else if (type == NODE_REMOTE)
+    if (nodeId == BROADCAST_NODE_ID)
     {
-        destAddr[0]=0xBF;
-        destAddr[1]=0xBE;
-        destAddr[2]=0xBD;
-        destAddr[MRFI_ADDR_SIZE-1]=0xFF;
+        // the MRFI address filter accepts only its own address and this one:
+        memset(destAddr, 0xFF, MRFI_ADDR_SIZE);
+        return;
     }
+
+    destAddr[0]=nodeId;                                 // the only byte filtered by the radio
+    destAddr[1]=NODE_ADDR_NETWORK_1;
+    destAddr[2]=NODE_ADDR_NETWORK_2;
+    destAddr[MRFI_ADDR_SIZE-1]=NODE_ADDR_NETWORK_3;     // MRFI_ADDR_SIZE=4 !!!!
 }
 
 
@@ -149,21 +155,91 @@ void DelayMsWithInterrupts(uint16_t milliseconds)
     }
 }
 
+/***********************************************************************************
+* @fn          ReadSleepTimer
+*
+* @brief       Returns the sleep timer periods elapsed since boot: must be called more often
+*              than the sleep timer restarts (BSP_SLEEP_TIMER_EVENT0 periods, about 2 secs)
+*
+* @return
+*/
+uint32_t ReadSleepTimer(void)
+{
+    uint8_t low = WORTIME0;                 // reading WORTIME0 latches WORTIME1
+    uint16_t now = BUILD_UINT16(low, WORTIME1);
+
+    if (now >= g_sleepTimerLast)
+        g_sleepTimerTicks += now - g_sleepTimerLast;
+    else
+        g_sleepTimerTicks += now + (BSP_SLEEP_TIMER_EVENT0 - g_sleepTimerLast);
+    g_sleepTimerLast = now;
+    return g_sleepTimerTicks;
+}
+
+/* accounts a sleep that reset the sleep timer, then lets it run free again: the time elapsed
+   between the last reading and the reset is lost, apart from the periods waited by the resets */
+static void ResumeSleepTimer(uint8_t res, uint32_t steps)
+{
+    g_sleepTimerTicks += (steps << (5 * res)) + 2 * BSP_SLEEP_TIMER_RESET_TICKS;
+    BSP_StartSleepTimer();
+    g_sleepTimerLast = 0;
+}
+
+/***********************************************************************************
+* @fn          SleepFor
+*
+* @brief       BSP_SleepFor() that keeps ReadSleepTimer() counting
+*
+* @return
+*/
+void SleepFor(uint8_t mode, uint8_t res, uint16_t steps)
+{
+    ReadSleepTimer();
+    ResumeSleepTimer(res, BSP_SleepFor(mode, res, steps));
+}
+
+/***********************************************************************************
+* @fn          IdleFor
+*
+* @brief       BSP_IdleFor() that keeps ReadSleepTimer() counting
+*
+* @return
+*/
+void IdleFor(uint8_t res, uint16_t steps, volatile uint8_t* wakeFlag)
+{
+    ReadSleepTimer();
+    ResumeSleepTimer(res, BSP_IdleFor(res, steps, wakeFlag));
+}
+
+/***********************************************************************************
+* @fn          ElapsedMs
+*
+* @brief       Returns the msecs elapsed since the given ReadSleepTimer() value
+*
+* @return
+*/
+uint16_t ElapsedMs(uint32_t sleepTimerStart)
+{
+    uint32_t ticks = ReadSleepTimer() - sleepTimerStart;
+    uint32_t ms = ticks * 125 / 4096;       // == ticks * 1000 / SLEEP_TIMER_HZ without overflows
+    return ms > 0xFFFF ? 0xFFFF : (uint16_t)ms;
+}
+
 /***********************************************************************************
 * @fn          SetRxAddressFilter
 *
-* @brief
+* @brief       Accepts only the frames sent to this node (or broadcast): the senders must set
+*              the destination address with CopyAddress()
 *
 * @return
 */
 void SetRxAddressFilter()
 {
-  /* Create and set random address for this device. */
   uint8_t ownAddr[MRFI_ADDR_SIZE];
 #if LIME2
-  CopyAddress(ownAddr, NODE_LIME2);
+  CopyAddress(ownAddr, LIME2_NODE_ID);
 #elif REMOTE
-  CopyAddress(ownAddr, NODE_REMOTE);
+  CopyAddress(ownAddr, REMOTE_NODE_ID);
 #endif
   MRFI_SetRxAddrFilter(ownAddr);
   MRFI_EnableRxAddrFilter();
@@ -194,6 +270,104 @@ command_e String2Command(const uint8_t* buf, uint16_t len)
     return ret;
 }
 
+/***********************************************************************************
+* @fn          IsBinFrame
+*
+* @brief       Returns 1 if buf starts with the header of a binary frame we can decode
+*
+* @return
+*/
+uint8_t IsBinFrame(const uint8_t* buf, uint8_t len)
+{
+    return len >= BIN_FRAME_HEADER_LEN &&
+           (buf[0] & BIN_FRAME_OPCODE_FLAG) &&
+           (buf[1] >> 4) == BIN_FRAME_VERSION;
+}
+
+/***********************************************************************************
+* @fn          BinFrameInit
+*
+* @brief       Writes the header of a binary frame, without flags
+*
+* @return      the frame length
+*/
+uint8_t BinFrameInit(uint8_t* buf, uint8_t opcode, uint16_t transactionID)
+{
+    buf[0] = opcode;
+    buf[1] = BIN_FRAME_VERSION << 4;
+    buf[2] = LO_UINT16(transactionID);
+    buf[3] = HI_UINT16(transactionID);
+    return BIN_FRAME_HEADER_LEN;
+}
+
+/***********************************************************************************
+* @fn          BinFrameAppendTLV
+*
+* @brief       Appends a TLV to the binary frame of length len
+*
+* @return      the new frame length, 0 if the TLV does not fit
+*/
+uint8_t BinFrameAppendTLV(uint8_t* buf, uint8_t len, uint8_t type, const uint8_t* value, uint8_t valueLen)
+{
+    if (valueLen > 0x0F || len + BIN_FRAME_TLV_HEADER_LEN + valueLen > MAX_RADIO_PKT_LEN)
+        return 0;
+
+    buf[len++] = (type << 4) | valueLen;
+    memcpy(&buf[len], value, valueLen);
+    return len + valueLen;
+}
+
+/***********************************************************************************
+* @fn          BinFrameFindTLV
+*
+* @brief       Looks for the first TLV of the given type and value length; unknown TLVs
+*              are skipped, so that newer senders can add them
+*
+* @return      pointer to the value, NULL if not found or if the frame is malformed
+*/
+const uint8_t* BinFrameFindTLV(const uint8_t* buf, uint8_t len, uint8_t type, uint8_t valueLen)
+{
+    uint8_t i = BIN_FRAME_HEADER_LEN;
+    while (i + BIN_FRAME_TLV_HEADER_LEN <= len)
+    {
+        uint8_t tlvLen = buf[i] & 0x0F;
+        if (i + BIN_FRAME_TLV_HEADER_LEN + tlvLen > len)
+            return NULL;            // truncated
+        if ((buf[i] >> 4) == type && (tlvLen == valueLen || valueLen == BIN_TLV_ANY_LEN))
+            return &buf[i + BIN_FRAME_TLV_HEADER_LEN];
+        i += BIN_FRAME_TLV_HEADER_LEN + tlvLen;
+    }
+    return NULL;
+}
+
+/***********************************************************************************
+* @fn          BinFrameTransactionID
+*
+* @brief
+*
+* @return
+*/
+uint16_t BinFrameTransactionID(const uint8_t* buf)
+{
+    return BUILD_UINT16(buf[2], buf[3]);
+}
+
+/***********************************************************************************
+* @fn          BinFrame2Command
+*
+* @brief       Binary counterpart of String2Command()
+*
+* @return
+*/
+command_e BinFrame2Command(const uint8_t* buf, uint8_t len)
+{
+    if (!IsBinFrame(buf, len) || buf[0] == BIN_FRAME_OPCODE_ACK)
+        return CMD_MAX;
+
+    uint8_t cmd = buf[0] & ~BIN_FRAME_OPCODE_FLAG;
+    return cmd < CMD_MAX ? (command_e)cmd : CMD_MAX;
+}
+
 /***********************************************************************************
 * @fn          ShouldRESET
 *
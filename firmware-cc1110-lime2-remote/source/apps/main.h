@@ -35,6 +35,31 @@ Operation:
 #define SLEEP_32_MS_RESOLUTION        2
 #define SLEEP_1_S_RESOLUTION          3
 
+#define SLEEP_TIMER_HZ                32768           /* the sleep timer (WORTIME1:WORTIME0) is 16 bits wide */
+
+// Wake-on-Radio: the remote node sleeps in PM2 and wakes up every WOR_SNIFF_INTERVAL_TICKS
+// for a short carrier sense, while the lime2 node sends every command with the longest preamble
+// (24 bytes, 80ms at 2.4 kBaud) so that at least one sniff falls in it; both nodes must be
+// built with the same setting.
+// The sniffs happen at the multiples of WOR_SNIFF_INTERVAL_TICKS of the remote clock, which is
+// reported in the ACKs (BIN_TLV_CLOCK): the lime2 node learns this schedule and sends the first
+// transmission of a command right before a sniff, with a preamble as short as the drift allows.
+// Off until its current draw and reliability are measured on the boards.
+#ifndef ENABLE_WAKE_ON_RADIO
+#define ENABLE_WAKE_ON_RADIO          (0)
+#endif
+#define WOR_MDMCFG1_NUM_PREAMBLE      (0x70)          /* MDMCFG1.NUM_PREAMBLE: 24 bytes */
+#define WOR_SNIFF_INTERVAL_TICKS      (2048)          /* 62.5ms: shorter than the preamble minus a sniff; a power of 2 */
+#define WOR_SNIFF_SAMPLE_TICKS        (52)            /* from the wake up to the carrier sense: XOSC, calibration, RSSI */
+#define WOR_RX_TIMEOUT_MSEC           (200)           /* from the carrier to the end of the longest frame */
+
+// time on air at 2.4 kBaud, in sleep timer periods: the CCA before the transmission, then the
+// preamble (4 bytes by default), sync word and CRC around the MRFI frame (length byte, addresses
+// and payload)
+#define RADIO_CCA_TICKS               (43)
+#define RADIO_BYTE_TICKS              (109)
+#define RADIO_FRAME_OVERHEAD_BYTES    (4+2+2+1+2*MRFI_ADDR_SIZE)
+
 #define MASTER_BUTTON                 1
 #define SLAVE_BUTTON                  2
 #define BOTH_BUTTONS                  3
@@ -44,13 +69,36 @@ Operation:
 
 // we have no hard limits on SPI max command lenght but it should be
 // bigger than COMMAND_LEN+COMMAND_POSTFIX_LEN and REPLY_LEN+REPLY_POSTFIX_LEN:
-#define SPI_COMMAND_MAX_LEN           16
+#define SPI_COMMAND_MAX_LEN           24
+
+// the ECHO___ command is followed by a payload of any length up to this, instead of the
+// transaction ID and the parameter (frames of SPI_COMMAND_MAX_LEN bytes are dropped as overflowed):
+#define SPI_ECHO_MAX_LEN              (SPI_COMMAND_MAX_LEN-1-COMMAND_LEN)
+
+// MRFI addresses: the node ID followed by NODE_ADDR_NETWORK_1/2/3. The radio compares only the first
+// byte of the destination address with its own (ADDR register, see MRFI_SetRxAddrFilter()), so the
+// frames sent to the other remote nodes are dropped without waking up the CPU; 0x00 and 0xFF are
+// broadcast IDs for that check and cannot be assigned to a node.
+// BROADCAST_NODE_ID addresses all the remote nodes at once: CopyAddress() turns it into the MRFI
+// broadcast address, also accepted by the MRFI address filter.
+#define LIME2_NODE_ID                 (0xAA)
+#define BROADCAST_NODE_ID             (0xFF)
+#define REMOTE_NODE_ID_MIN            (0x01)
+#define REMOTE_NODE_ID_MAX            (0x7F)
+#ifndef REMOTE_NODE_ID
+#define REMOTE_NODE_ID                (0x01)          /* of this remote node: provision each one with -DREMOTE_NODE_ID=n */
+#endif
+#ifndef REMOTE_GROUPS
+#define REMOTE_GROUPS                 (0x01)          /* bitmask of the groups of this remote node, see BIN_TLV_GROUPS */
+#endif
+#define DEFAULT_REMOTE_NODE_ID        (0x01)          /* for the commands that name no remote node, e.g. the ASCII ones */
+#define NODE_ADDR_NETWORK_1           (0xAB)
+#define NODE_ADDR_NETWORK_2           (0xAC)
+#define NODE_ADDR_NETWORK_3           (0xFF)
 
-typedef enum
-{
-  NODE_LIME2,
-  NODE_REMOTE
-} NodeType_t;
+#if REMOTE_NODE_ID < REMOTE_NODE_ID_MIN || REMOTE_NODE_ID > REMOTE_NODE_ID_MAX
+#error "REMOTE_NODE_ID out of range"
+#endif
 
 
 /***********************************************************************************
@@ -71,12 +119,125 @@ typedef enum
 #define REPLY_LEN                                      (4)
 #define REPLY_POSTFIX_LEN                              (2)
 
+// framed STATUS, answered in a single SPI transaction (direction MASTER -> SLAVE):
+ //  SPI_FRAME_SYNC + SPI_FRAME_OPCODE_STATUS +
+ //  SPI_FRAME_TURNAROUND_LEN + REPLY_LEN + REPLY_POSTFIX_LEN padding bytes
+ // the SLAVE shifts out the turnaround byte and then the same reply of the STATUS
+ // command, which is up to date at the time the header was received
+#define SPI_FRAME_SYNC                                 (0xA5)
+#define SPI_FRAME_OPCODE_STATUS                        ('S')
+#define SPI_FRAME_HEADER_LEN                           (2)
+#define SPI_FRAME_TURNAROUND_LEN                       (1)
+
+// CRC-protected frames (direction MASTER -> SLAVE):
+ //  SPI_FRAME_SYNC + opcode + payload length + sequence number + payload + CRC-16 (MSB first)
+ // the CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) covers the opcode up to the payload;
+ // frames with a wrong CRC are discarded and counted
+#define SPI_FRAME_OPCODE_COMMAND                       ('C')     // payload: command, transaction ID and parameter
+#define SPI_FRAME_OPCODE_QUERY                         ('Q')     // no payload: CRC-protected STATUS
+#define SPI_FRAME_OPCODE_QUEUE                         ('L')     // no payload: same, with the state of each queued command
+#define SPI_FRAME_OPCODE_TABLE                         ('T')     // no payload: dump of the remote table
+#define SPI_FRAME_CRC_HEADER_LEN                       (4)
+#define SPI_FRAME_CRC_LEN                              (2)
+
+// reply to the 'Q' frame (direction SLAVE -> MASTER), after the turnaround byte like the framed STATUS:
+ //  SPI_FRAME_SYNC + payload length + sequence number of the last 'C' frame accepted + payload + CRC-16
+ //  payload: the same reply of the STATUS command + the number of frames discarded for a wrong CRC +
+ //           the number of frames dropped because the main loop did not pick them up in time
+ // the CRC covers the payload length up to the payload
+#define SPI_FRAME_QUERY_PAYLOAD_LEN                    (REPLY_LEN+REPLY_POSTFIX_LEN+2)
+#define SPI_FRAME_QUERY_REPLY_LEN                      (3+SPI_FRAME_QUERY_PAYLOAD_LEN+SPI_FRAME_CRC_LEN)
+
+// reply to the 'L' frame (direction SLAVE -> MASTER), after the turnaround byte like the 'Q' one:
+ //  the same as the reply to 'Q', with SPI_FRAME_QUEUE_NUM_CMDS entries appended to the payload, one per
+ //  command tracked by the queue, oldest first
+ //  entry: transaction ID (LSB first) + state (one of SPI_FRAME_CMD_xxx) + battery carried by its ACK
+ // the 'L' frame is padded with zeros up to the end of the reply, which is longer than SPI_COMMAND_MAX_LEN
+#define SPI_FRAME_QUEUE_NUM_CMDS                       (8)       // commands tracked at once, pending or completed
+#define SPI_FRAME_QUEUE_CMD_LEN                        (4)
+#define SPI_FRAME_QUEUE_PAYLOAD_LEN                    (SPI_FRAME_QUERY_PAYLOAD_LEN+SPI_FRAME_QUEUE_NUM_CMDS*SPI_FRAME_QUEUE_CMD_LEN)
+#define SPI_FRAME_QUEUE_REPLY_LEN                      (3+SPI_FRAME_QUEUE_PAYLOAD_LEN+SPI_FRAME_CRC_LEN)
+#define SPI_FRAME_CMD_FREE                             (0)       // unused entry
+#define SPI_FRAME_CMD_QUEUED                           (1)       // waiting for the radio
+#define SPI_FRAME_CMD_IN_FLIGHT                        (2)       // being sent over radio
+#define SPI_FRAME_CMD_ACKED                            (3)       // the remote node acknowledged it
+#define SPI_FRAME_CMD_FAILED                           (4)       // no ACK after all the retries
+
+// reply to the 'T' frame (direction SLAVE -> MASTER), after the turnaround byte like the 'Q' one:
+ //  SPI_FRAME_SYNC + payload length + REMOTE_TABLE_LEN rows + transaction ID of the last broadcast command
+ //  (LSB first) + bitmap of the remote nodes that ACKed it (BCAST_BITMAP_LEN bytes, as in BIN_TLV_BCAST_ACK) +
+ //  CRC-16 (covering the payload length up to the bitmap)
+ //  row: remote node ID (0 for an unused row) + transaction ID of its last command ACKed (LSB first) +
+ //       battery + RSSI of its last ACK (dBm, signed) + its commands not ACKed since then +
+ //       seconds since its last ACK (LSB first, 0xFFFF if never or longer)
+ // the rows are updated as soon as a command completes, the ages once per second; the 'T' frame is
+ // padded with zeros up to the end of the reply, which is longer than SPI_COMMAND_MAX_LEN
+#ifndef REMOTE_TABLE_LEN
+#define REMOTE_TABLE_LEN                               (16)      // remote nodes tracked at once, the least recently seen is replaced
+#endif
+#define SPI_FRAME_TABLE_ROW_LEN                        (8)
+#define BCAST_BITMAP_LEN                               ((REMOTE_NODE_ID_MAX+7)/8)
+#define SPI_FRAME_TABLE_PAYLOAD_LEN                    (REMOTE_TABLE_LEN*SPI_FRAME_TABLE_ROW_LEN+2+BCAST_BITMAP_LEN)
+#define SPI_FRAME_TABLE_REPLY_LEN                      (2+SPI_FRAME_TABLE_PAYLOAD_LEN+SPI_FRAME_CRC_LEN)
+#define SPI_FRAME_TABLE_AGE_UNKNOWN                    (0xFFFF)
+
+// binary frames, version BIN_FRAME_VERSION (both on SPI, as payload of the 'C' frame, and over radio):
+ //  opcode (BIN_FRAME_OPCODE_FLAG | command_e, or BIN_FRAME_OPCODE_ACK) +
+ //  version (high nibble) and flags (low nibble, none defined in version 1) +
+ //  16-bit transaction ID, LSB first +
+ //  TLVs: 1 byte with the type (high nibble) and the value length (low nibble), then the value
+ // the ASCII commands never set the high bit of their first byte, so both formats can be told apart
+#define BIN_FRAME_OPCODE_FLAG                          (0x80)
+#define BIN_FRAME_OPCODE_ACK                           (0xC0)
+#define BIN_FRAME_VERSION                              (1)
+#define BIN_FRAME_HEADER_LEN                           (4)
+#define BIN_FRAME_TLV_HEADER_LEN                       (1)
+
+#define BIN_TLV_CHANNEL                                (1)       // 1 byte: relay group, 1 for '1'... (commands)
+#define BIN_TLV_BATTERY                                (2)       // 1 byte: last battery read (ACK)
+#define BIN_TLV_OPS                                    (3)       // 1 byte per operation (CMD_BATCH)
+#define BIN_TLV_DURATION                               (4)       // 2 bytes, LSB first: minutes before the remote turns
+                                                                 // off by itself the relay groups turned on (TURNON_, CMD_BATCH)
+#define BIN_TLV_CLOCK                                  (5)       // 4 bytes, LSB first: sleep timer periods since the remote
+                                                                 // booted, when the ACK was built (ACK, with ENABLE_WAKE_ON_RADIO)
+#define BIN_TLV_REMOTE                                 (6)       // 1 byte: node ID of the remote the command is for, or
+                                                                 // BROADCAST_NODE_ID (commands on SPI only: over radio it is
+                                                                 // the destination address)
+#define BIN_TLV_GROUPS                                 (7)       // 1 byte: only the remote nodes of these groups (REMOTE_GROUPS)
+                                                                 // run the command; all of them if missing (commands)
+#define BIN_TLV_BCAST_ACK                              (8)       // 1 byte with the number of ACK slots, then up to 14 bytes with
+                                                                 // the bitmap of the remote nodes already ACKed (broadcast
+                                                                 // commands over radio only)
+#define BIN_TLV_ANY_LEN                                (0xFF)    // for BinFrameFindTLV()
+#define BIN_TLV_LEN(value)                             ((value)[-1] & 0x0F)
+
+// operations of CMD_BATCH: the relay group in the low nibble, BIN_OP_TURN_ON or not;
+// up to BIN_BATCH_MAX_OPS, so that the command fits MAX_RADIO_PKT_LEN also with BIN_TLV_DURATION
+#define BIN_OP_TURN_ON                                 (0x80)
+#define BIN_OP_CHANNEL_MASK                            (0x0F)
+#define BIN_BATCH_MAX_OPS                              (4)
+
+// broadcast commands (sent to BROADCAST_NODE_ID, binary frames only): each remote node runs the
+// command, then ACKs in one of the ACK slots that follow the frame, picked at random among the
+// number carried by BIN_TLV_BCAST_ACK (a power of 2). The lime2 node listens to all the slots and
+// sends the command again with the bitmap of the remote nodes it heard, bit (ID-1)%8 of byte
+// (ID-1)/8, so that only the others ACK again; the bitmap is cut where the frame is full, the
+// remote nodes left out of it simply keep ACKing.
+#define BCAST_MIN_ACK_SLOTS                            (4)
+#define BCAST_MAX_ACK_SLOTS                            (16)
+#define BCAST_ACK_MAX_LEN                              (BIN_FRAME_HEADER_LEN+2*BIN_FRAME_TLV_HEADER_LEN+1+4)   // BATTERY and CLOCK
+#define BCAST_ACK_GUARD_TICKS                          (655)     // CCA backoffs and processing, about 20ms
+#define BCAST_ACK_SLOT_TICKS                           (RADIO_CCA_TICKS+(BCAST_ACK_MAX_LEN+RADIO_FRAME_OVERHEAD_BYTES)*RADIO_BYTE_TICKS+BCAST_ACK_GUARD_TICKS)
+#define BCAST_ACKED_MAX_LEN                            (14)
+
 typedef enum
 {
     CMD_TURN_ON = 0,  // can be sent both on SPI and on the radio
     CMD_TURN_OFF,  // can be sent both on SPI and on the radio
     CMD_NO_OP,  // can be sent both on SPI and on the radio: used to get battery level from remote
     CMD_GET_STATUS, // can be sent only on SPI
+    CMD_ECHO,       // can be sent only on SPI: followed by up to SPI_ECHO_MAX_LEN bytes, returned in the next transaction
+    CMD_BATCH,      // can be sent both on SPI and on the radio, only as binary frame: several TURNON_/TURNOFF, one ACK
     CMD_MAX
 } command_e;
 
@@ -88,6 +249,7 @@ extern volatile uint8_t       g_sRxCallbackSemaphore;
 extern mrfiPacket_t           g_pktRx;
 extern const char*            g_commands[CMD_MAX];
 extern const char*            g_ack;
+extern const char*            g_busy;
 
 /***********************************************************************************
 * FUNCTIONS
@@ -96,9 +258,20 @@ extern const char*            g_ack;
 void sLime2Node(void);
 void sRemoteNode(void);
 int ShouldRESET(void);
-void CopyAddress(uint8_t* destAddr, NodeType_t type);
+void CopyAddress(uint8_t* destAddr, uint8_t nodeId);
 command_e String2Command(const uint8_t* buf, uint16_t len);
 
+/* Binary frames: IsBinFrame() checks the header (the version must be BIN_FRAME_VERSION),
+   BinFrameAppendTLV() returns the new frame length or 0 if the TLV does not fit in
+   MAX_RADIO_PKT_LEN, BinFrameFindTLV() returns NULL if the TLV is missing or malformed
+   (valueLen can be BIN_TLV_ANY_LEN, then use BIN_TLV_LEN() on the value). */
+uint8_t IsBinFrame(const uint8_t* buf, uint8_t len);
+uint8_t BinFrameInit(uint8_t* buf, uint8_t opcode, uint16_t transactionID);
+uint8_t BinFrameAppendTLV(uint8_t* buf, uint8_t len, uint8_t type, const uint8_t* value, uint8_t valueLen);
+const uint8_t* BinFrameFindTLV(const uint8_t* buf, uint8_t len, uint8_t type, uint8_t valueLen);
+uint16_t BinFrameTransactionID(const uint8_t* buf);
+command_e BinFrame2Command(const uint8_t* buf, uint8_t len);
+
 /* Delay loop support. Requires mrfi.h. MRFI will disable interrupts while sleeping.
    If this is not desired, use BSP_DELAY_USECS() instead.
    Note that DelayMsNOInterrupts() accepts values in uint16_t range. */
@@ -107,6 +280,15 @@ command_e String2Command(const uint8_t* buf, uint16_t len);
 /* Note that DelayMsWithInterrupts() accepts values in uint16_t range. */
 void DelayMsWithInterrupts(uint16_t milliseconds);
 
+/* The sleep timer runs in every power mode: use it as a free-running clock to measure
+   time without blocking. ReadSleepTimer() extends it to 32 bits (wrapping after about 36 hours),
+   as long as it is called at least every 2 secs and the sleeps go through SleepFor() and IdleFor()
+   instead of BSP_SleepFor() and BSP_IdleFor(), which reset it. ElapsedMs() saturates at 0xFFFF. */
+uint32_t ReadSleepTimer(void);
+uint16_t ElapsedMs(uint32_t sleepTimerStart);
+void SleepFor(uint8_t mode, uint8_t res, uint16_t steps);
+void IdleFor(uint8_t res, uint16_t steps, volatile uint8_t* wakeFlag);
+
 #endif
 
 
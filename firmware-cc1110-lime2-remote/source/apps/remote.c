@@ -9,9 +9,34 @@ Description:        Code for the "remote" node.
                     As soon as a radio command is received, the remote node will send
                     back an ACK over radio with the "transaction ID" received in the
                     over-radio comamnd. Then the actuator system is
-                    turned on/off (depending on the command).
+                    turned on/off (depending on the command) right away: the
+                    new commands are queued as soon as they are validated and run as
+                    soon as the ACK went out, while the retransmissions of a command
+                    already queued are only ACKed.
+                    Commands are decoded both as ASCII strings and as binary frames (see
+                    BIN_FRAME_OPCODE_FLAG in main.h): the ACK is sent in the same format.
+                    A CMD_BATCH binary frame carries several TURNON_/TURNOFF operations,
+                    acknowledged once and applied to all the relay groups at once.
+                    The relay pulses are ended by the sleep timer: the remote keeps
+                    sleeping and receiving commands meanwhile, and the two relay groups
+                    can pulse at the same time.
+                    A binary TURNON_ or CMD_BATCH can carry a duration (BIN_TLV_DURATION):
+                    the remote then turns the relay groups off by itself once it expires,
+                    keeping the time with the sleep timer and the time spent in PM2.
                     The remote node is supposed to be battery-powered and thus implements
-                    a low power policy.
+                    a low power policy: with ENABLE_WAKE_ON_RADIO (main.h) it stays in PM2
+                    and senses the carrier every WOR_SNIFF_INTERVAL_TICKS, waking up only for
+                    the frames sent with the long preamble of the lime2 node; otherwise it
+                    alternates WAIT_TIME_RADIOOFF_MSEC in PM2 and RX_WINDOW_MSEC in RX, with
+                    the CPU halted in PM0 until a frame is received or the window ends.
+                    The sniffs are aligned to the clock reported in the binary ACKs
+                    (BIN_TLV_CLOCK), so that the lime2 node can predict them.
+                    The radio drops the frames whose destination is not REMOTE_NODE_ID
+                    (main.h), so that several remote nodes can share the same lime2 node.
+                    Broadcast commands (BROADCAST_NODE_ID) are run by every remote node of
+                    the groups they name (REMOTE_GROUPS); each one then ACKs in a random slot
+                    after the frame, until its bit shows up in the bitmap of the ACKs heard by
+                    the lime2 node. A TURNON_/TURNOFF without relay group drives all of them.
 ***********************************************************************************/
 
 /***********************************************************************************
@@ -40,11 +65,31 @@ Description:        Code for the "remote" node.
 #define ENABLE_LOWPOWER_MODE                               (1)
 
 #define ACTUATOR_IMPULSE_DURATION_MSEC                     (3000)
+#define ACTUATOR_IMPULSE_DURATION_TICKS                    ((uint32_t)ACTUATOR_IMPULSE_DURATION_MSEC*SLEEP_TIMER_HZ/1000)
+#define ACK_LED_DURATION_MSEC                              (250)
+#define ACK_LED_DURATION_TICKS                             ((uint32_t)ACK_LED_DURATION_MSEC*SLEEP_TIMER_HZ/1000)
+
+// can be overridden at build time (e.g. by the simulator benchmark, see simulator/README.txt):
+#ifndef WAIT_TIME_RADIOOFF_MSEC
 #define WAIT_TIME_RADIOOFF_MSEC                            (4000)
+#endif
+#define RX_WINDOW_MSEC                                     (6000)
 #define APPROX_BATTERY_MEAS_INTERVAL_SEC                   (120)
 
+#define NUM_RELAY_GROUPS                                   (2)
+#define CMD_QUEUE_LEN                                      (4)          // commands ACKed and not yet run; must be a power of 2
+#define NO_BCAST_ACK_SLOT                                  (0xFF)
+#define MAX_AUTO_OFF_DURATION_MIN                          (7*24*60)    // longer durations are clamped to this
+
 // constants derived from above settings
 #define WAIT_TIME_RADIOOFF_SEC                             (WAIT_TIME_RADIOOFF_MSEC/1000)
+#define WAIT_TIME_RADIOOFF_TICKS                           ((uint32_t)WAIT_TIME_RADIOOFF_MSEC*SLEEP_TIMER_HZ/1000)
+#define RX_WINDOW_TICKS                                    ((uint32_t)RX_WINDOW_MSEC*SLEEP_TIMER_HZ/1000)
+#define WOR_RX_TIMEOUT_TICKS                               ((uint32_t)WOR_RX_TIMEOUT_MSEC*SLEEP_TIMER_HZ/1000)
+
+#if ENABLE_WAKE_ON_RADIO && !ENABLE_LOWPOWER_MODE
+#error "Wake-on-Radio requires the low power mode"
+#endif
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  *   GPIO #1 ---> attached to VALVE_CTRL1a
@@ -95,6 +140,21 @@ Description:        Code for the "remote" node.
 #define REMOTE_GPIO_ACTIVE_LOW       0
 
 
+/***********************************************************************************
+* TYPES
+*/
+
+typedef struct
+{
+    command_e     cmd;
+    uint16_t      transactionID;        // ASCII commands only set the low byte
+    uint8_t       parameter;            // ASCII encoded, also for binary commands
+    uint8_t       ops[BIN_BATCH_MAX_OPS];   // CMD_BATCH only
+    uint8_t       numOps;
+    uint16_t      durationMin;          // TURNON_ and CMD_BATCH only
+} remote_cmd_t;
+
+
 
 /***********************************************************************************
 * MACROS
@@ -114,10 +174,37 @@ Description:        Code for the "remote" node.
 */
 
 static          mrfiPacket_t  g_pktTx;
-static          command_e     g_lastCmdRx = CMD_MAX;
-static          uint8_t       g_lastTransactionIDRX = 0;
-static          uint8_t       g_lastTransactionIDApplied = 0;
-static          uint8_t       g_lastCmdParameter = 0;
+static          uint16_t      g_lastTransactionIDQueued = 0;   // the retransmissions of this command are not run again
+
+// ACK of the last broadcast command, sent by SendBroadcastAck() once the command has run:
+static          uint8_t       g_bcastAckSlot = NO_BCAST_ACK_SLOT;
+static          uint16_t      g_bcastAckTransactionID = 0;
+
+// commands ACKed over radio, run by RunQueuedCommands(): both indexes are free-running single bytes
+static          remote_cmd_t  g_cmdQueue[CMD_QUEUE_LEN];
+static          uint8_t       g_cmdQueueHead = 0;
+static          uint8_t       g_cmdQueueTail = 0;
+
+// time since boot, kept by UpdateClock(): in msecs, wrapping after about 49 days, and in sleep
+// timer periods, wrapping after about 36 hours
+static          uint32_t      g_clockMs = 0;
+static          uint16_t      g_clockMsFraction = 0;           // in 1/SLEEP_TIMER_HZ msecs
+static          uint32_t      g_clockTicks = 0;
+static          uint32_t      g_clockLastRead = 0;             // ReadSleepTimer() value accounted in the clock
+
+// g_clockMs value when each relay group must be turned off, valid if the bit of the group
+// is set in g_autoOffPending:
+static          uint32_t      g_autoOffDeadline[NUM_RELAY_GROUPS];
+static          uint8_t       g_autoOffPending = 0;
+
+// g_clockTicks value when the pulse of each relay group must end, valid if the bit of the group
+// is set in g_impulsePending:
+static          uint32_t      g_impulseDeadline[NUM_RELAY_GROUPS];
+static          uint8_t       g_impulsePending = 0;
+
+// g_clockTicks value when LED1, turned on by an ACK, must be turned off, valid if g_ledPending:
+static          uint32_t      g_ledDeadline;
+static          uint8_t       g_ledPending = 0;
 static          uint16_t      g_last_adc_result = 0;
 
 
@@ -125,6 +212,85 @@ static          uint16_t      g_last_adc_result = 0;
 * LOCAL FUNCTIONS
 */
 
+/* accounts the time elapsed since the last call: ReadSleepTimer() must not miss a wrap of the
+   sleep timer meanwhile (about 2 secs), so sleep with SleepAndUpdateClock() and IdleAndUpdateClock() */
+static void UpdateClock()
+{
+    uint32_t now = ReadSleepTimer();
+    uint32_t ticks = now - g_clockLastRead;
+    g_clockLastRead = now;
+
+    g_clockTicks += ticks;
+
+    // carry the fraction of msec over, so that the msecs do not drift from the ticks:
+    uint32_t fraction = g_clockMsFraction + (ticks % SLEEP_TIMER_HZ) * 1000;
+    g_clockMs += (ticks / SLEEP_TIMER_HZ) * 1000 + fraction / SLEEP_TIMER_HZ;
+    g_clockMsFraction = fraction % SLEEP_TIMER_HZ;
+}
+
+static void SleepAndUpdateClock(uint8_t res, uint16_t steps)
+{
+    UpdateClock();
+    SleepFor( POWER_MODE_2, res, steps );    // also counts the start-up of the crystal oscillator
+    UpdateClock();
+}
+
+/* halts the CPU in PM0 for up to the given sleep timer periods, leaving the radio as it is:
+   returns earlier if an interrupt (e.g. a received frame) wakes up the CPU, or right away if
+   a frame is already waiting */
+static void IdleAndUpdateClock(uint16_t ticks)
+{
+    UpdateClock();
+    IdleFor( SLEEP_31_25_US_RESOLUTION, ticks, &g_sRxCallbackSemaphore );
+    UpdateClock();
+}
+
+/* builds in g_pktTx the ACK of the given transaction, in the same format as the command */
+static void BuildAck(uint8_t binary, uint16_t transactionID)
+{
+    uint8_t* ackMsg = MRFI_P_PAYLOAD(&g_pktTx);
+
+    if (binary)
+    {
+        uint8_t battery = (uint8_t)g_last_adc_result;
+        uint8_t ackLen = BinFrameInit(ackMsg, BIN_FRAME_OPCODE_ACK, transactionID);
+        // a TLV that does not fit is left out: the ACK is still valid without it
+        uint8_t len = BinFrameAppendTLV(ackMsg, ackLen, BIN_TLV_BATTERY, &battery, 1);
+        if (len)
+            ackLen = len;
+#if ENABLE_WAKE_ON_RADIO
+        // lets the lime2 node predict our next sniffs
+        UpdateClock();
+        uint8_t clock[4] = { BREAK_UINT32(g_clockTicks, 0), BREAK_UINT32(g_clockTicks, 1),
+                             BREAK_UINT32(g_clockTicks, 2), BREAK_UINT32(g_clockTicks, 3) };
+        len = BinFrameAppendTLV(ackMsg, ackLen, BIN_TLV_CLOCK, clock, 4);
+        if (len)
+            ackLen = len;
+#endif
+        MRFI_SET_PAYLOAD_LEN(&g_pktTx, ackLen);
+    }
+    else
+    {
+        MRFI_SET_PAYLOAD_LEN(&g_pktTx, REPLY_LEN+REPLY_POSTFIX_LEN);
+        memcpy(ackMsg, g_ack, REPLY_LEN);
+        ackMsg[REPLY_LEN+0] = (uint8_t)transactionID;
+        ackMsg[REPLY_LEN+1] = (uint8_t)g_last_adc_result;
+    }
+
+    CopyAddress(MRFI_P_SRC_ADDR(&g_pktTx), REMOTE_NODE_ID);
+    CopyAddress(MRFI_P_DST_ADDR(&g_pktTx), LIME2_NODE_ID);
+}
+
+/* bcastAck: the BIN_TLV_BCAST_ACK of a broadcast command; returns 1 if the lime2 node already
+   received our ACK */
+static uint8_t IsBroadcastAcked(const uint8_t* bcastAck)
+{
+    uint8_t byte = (REMOTE_NODE_ID - 1) / 8;
+    return byte + 1 < BIN_TLV_LEN(bcastAck) &&
+           (bcastAck[1 + byte] & BV((REMOTE_NODE_ID - 1) % 8));
+}
+
+/* the ACK of a broadcast command is left to SendBroadcastAck(); the radio is then left idle */
 static uint8_t CheckCmdAndReplyWithAck()                // will leave the radio back in RX mode
 {
     /* Put Radio in IDLE to save power */
@@ -136,116 +302,358 @@ static uint8_t CheckCmdAndReplyWithAck()                // will leave the radio
     uint8_t len = MRFI_GET_PAYLOAD_LEN(&g_pktRx);
     uint8_t* radioMsg = MRFI_P_PAYLOAD(&g_pktRx);
 
-    g_lastCmdRx = String2Command(radioMsg, len);
-    if (g_lastCmdRx == CMD_MAX)
+    uint8_t binary = IsBinFrame(radioMsg, len);
+    remote_cmd_t rx;
+    rx.cmd = binary ? BinFrame2Command(radioMsg, len) : String2Command(radioMsg, len);
+
+    // the operations of CMD_BATCH (never sent as ASCII):
+    const uint8_t* ops = binary ? BinFrameFindTLV(radioMsg, len, BIN_TLV_OPS, BIN_TLV_ANY_LEN) : NULL;
+    rx.numOps = ops ? BIN_TLV_LEN(ops) : 0;
+
+    if (rx.cmd == CMD_MAX ||
+        (rx.cmd == CMD_BATCH && (rx.numOps == 0 || rx.numOps > BIN_BATCH_MAX_OPS)))
     {
         MRFI_RxOn();
         return 0;                 // invalid command received!
     }
+    if (rx.numOps)
+        memcpy(rx.ops, ops, rx.numOps);
+
+    // the broadcast commands are binary only, and are not ACKed again once the lime2 node heard us:
+    uint8_t broadcast = MRFI_P_DST_ADDR(&g_pktRx)[0] == BROADCAST_NODE_ID;
+    const uint8_t* bcastAck = binary ? BinFrameFindTLV(radioMsg, len, BIN_TLV_BCAST_ACK, BIN_TLV_ANY_LEN) : NULL;
+    if (broadcast && (bcastAck == NULL || BIN_TLV_LEN(bcastAck) == 0 || IsBroadcastAcked(bcastAck)))
+    {
+        MRFI_RxOn();
+        return 0;
+    }
+
+    // the commands for other groups are ACKed but not run:
+    const uint8_t* groups = binary ? BinFrameFindTLV(radioMsg, len, BIN_TLV_GROUPS, 1) : NULL;
+    uint8_t member = groups == NULL || (*groups & REMOTE_GROUPS);
+
+    const uint8_t* duration = binary ? BinFrameFindTLV(radioMsg, len, BIN_TLV_DURATION, 2) : NULL;
+    rx.durationMin = duration ? BUILD_UINT16(duration[0], duration[1]) : 0;
 
     // retrieve the transaction ID
-    g_lastTransactionIDRX = radioMsg[COMMAND_LEN+0];            // this should be ASCII encoded
-    g_lastCmdParameter = radioMsg[COMMAND_LEN+1];            // this should be ASCII encoded
+    if (binary)
+    {
+        const uint8_t* channel = BinFrameFindTLV(radioMsg, len, BIN_TLV_CHANNEL, 1);
+        rx.transactionID = BinFrameTransactionID(radioMsg);
+        rx.parameter = channel ? '0' + *channel : 0;
+    }
+    else
+    {
+        rx.transactionID = radioMsg[COMMAND_LEN+0];            // this should be ASCII encoded
+        rx.parameter = radioMsg[COMMAND_LEN+1];            // this should be ASCII encoded
+    }
+
+    // did we receive a new command or this is just an over-radio copy of the previous one?
+    if (rx.transactionID != g_lastTransactionIDQueued)
+    {
+        if (member)
+        {
+            if ((uint8_t)(g_cmdQueueHead - g_cmdQueueTail) == CMD_QUEUE_LEN)
+            {
+                MRFI_RxOn();
+                return 0;         // no room to run it: do not ACK, the lime2 node will send it again
+            }
+            g_cmdQueue[g_cmdQueueHead++ % CMD_QUEUE_LEN] = rx;
+        }
+        g_lastTransactionIDQueued = rx.transactionID;
+    }
+
+    if (broadcast)
+    {
+        // the other remote nodes are ACKing too: pick a slot at random
+        uint8_t numSlots = bcastAck[0] ? bcastAck[0] : 1;
+        g_bcastAckSlot = MRFI_RandomByte() % numSlots;
+        g_bcastAckTransactionID = rx.transactionID;
+        return 1;
+    }
 
     // Build and immediately send the acknowledge for this transaction
     // otherwise the "lime2" node will keep sending us the same command
     // over and over...
-    MRFI_SET_PAYLOAD_LEN(&g_pktTx, REPLY_LEN+REPLY_POSTFIX_LEN);
-#if 1
-    uint8_t* ackMsg = MRFI_P_PAYLOAD(&g_pktTx);
-
-    memcpy(ackMsg, g_ack, REPLY_LEN);
-    ackMsg[REPLY_LEN+0] = g_lastTransactionIDRX;
-    ackMsg[REPLY_LEN+1] = (uint8_t)g_last_adc_result;
-
-    //CopyAddress(MRFI_P_SRC_ADDR(&g_pktTx), NODE_REMOTE);
-    //CopyAddress(MRFI_P_DST_ADDR(&g_pktTx), NODE_LIME2);
-#endif
+    BuildAck(binary, rx.transactionID);
     MRFI_Transmit(&g_pktTx, MRFI_TX_TYPE_CCA);
 
-    // signal visually we are transmitting the ACK
-    BSP_TURN_ON_LED1();
-    //DELAY_ABOUT_QUARTER_A_SECOND_WITH_INTERRUPTS;
-    DelayMsNOInterrupts(250);
-    BSP_TURN_OFF_LED1();
-
     MRFI_RxOn();
     return 1;    // we received something!
 }
 
-static void ApplyCmdRx()
+/* drives the relays of the given group (ASCII encoded); returns 0 if the group is invalid */
+static uint8_t StartActuatorImpulse(uint8_t parameter, uint8_t turnOn)
 {
-    // did we receive a new command or this is just an over-radio copy of the previous one?
-    if (g_lastTransactionIDRX == g_lastTransactionIDApplied)
-      return;           // repeated command... ignore
-
-
-    // activate output relay:
-
-    switch (g_lastCmdRx)
+    if (parameter == '1')
     {
-    case CMD_TURN_ON:
-        if (g_lastCmdParameter == '1')
+        if (turnOn)
         {
           TURN_OUTPUT_PORT_ON(  REMOTE_GPIO1_BIT__, REMOTE_GPIO1_PORT__, REMOTE_GPIO1_DDR__, REMOTE_GPIO_ACTIVE_LOW );
           TURN_OUTPUT_PORT_OFF( REMOTE_GPIO2_BIT__, REMOTE_GPIO2_PORT__, REMOTE_GPIO2_DDR__, REMOTE_GPIO_ACTIVE_LOW );
         }
-        else if (g_lastCmdParameter == '2')
-        {
-          TURN_OUTPUT_PORT_ON(  REMOTE_GPIO3_BIT__, REMOTE_GPIO3_PORT__, REMOTE_GPIO3_DDR__, REMOTE_GPIO_ACTIVE_LOW );
-          TURN_OUTPUT_PORT_OFF( REMOTE_GPIO4_BIT__, REMOTE_GPIO4_PORT__, REMOTE_GPIO4_DDR__, REMOTE_GPIO_ACTIVE_LOW );
-        }
         else
-          return;       // invalid command parameter
-        break;
-        
-    case CMD_TURN_OFF:
-        if (g_lastCmdParameter == '1')
         {
           TURN_OUTPUT_PORT_OFF( REMOTE_GPIO1_BIT__, REMOTE_GPIO1_PORT__, REMOTE_GPIO1_DDR__, REMOTE_GPIO_ACTIVE_LOW );
           TURN_OUTPUT_PORT_ON(  REMOTE_GPIO2_BIT__, REMOTE_GPIO2_PORT__, REMOTE_GPIO2_DDR__, REMOTE_GPIO_ACTIVE_LOW );
         }
-        else if (g_lastCmdParameter == '2')
+    }
+    else if (parameter == '2')
+    {
+        if (turnOn)
+        {
+          TURN_OUTPUT_PORT_ON(  REMOTE_GPIO3_BIT__, REMOTE_GPIO3_PORT__, REMOTE_GPIO3_DDR__, REMOTE_GPIO_ACTIVE_LOW );
+          TURN_OUTPUT_PORT_OFF( REMOTE_GPIO4_BIT__, REMOTE_GPIO4_PORT__, REMOTE_GPIO4_DDR__, REMOTE_GPIO_ACTIVE_LOW );
+        }
+        else
         {
           TURN_OUTPUT_PORT_OFF( REMOTE_GPIO3_BIT__, REMOTE_GPIO3_PORT__, REMOTE_GPIO3_DDR__, REMOTE_GPIO_ACTIVE_LOW );
           TURN_OUTPUT_PORT_ON(  REMOTE_GPIO4_BIT__, REMOTE_GPIO4_PORT__, REMOTE_GPIO4_DDR__, REMOTE_GPIO_ACTIVE_LOW );
         }
-        else
-          return;       // invalid command parameter
-        break;
-        
-    case CMD_NO_OP:
-        // nothing to do actually!
-        g_lastTransactionIDApplied = g_lastTransactionIDRX;
-        return;
+    }
+    else
+      return 0;       // invalid command parameter
 
-    default:
-        return;         // unknown command... logical programming error?
+    return 1;
+}
+
+static void StopActuatorImpulse(uint8_t parameter)
+{
+    if (parameter == '1')
+    {
+      TURN_OUTPUT_PORT_OFF( REMOTE_GPIO1_BIT__, REMOTE_GPIO1_PORT__, REMOTE_GPIO1_DDR__, REMOTE_GPIO_ACTIVE_LOW );
+      TURN_OUTPUT_PORT_OFF( REMOTE_GPIO2_BIT__, REMOTE_GPIO2_PORT__, REMOTE_GPIO2_DDR__, REMOTE_GPIO_ACTIVE_LOW );
     }
+    else if (parameter == '2')
+    {
+      TURN_OUTPUT_PORT_OFF( REMOTE_GPIO3_BIT__, REMOTE_GPIO3_PORT__, REMOTE_GPIO3_DDR__, REMOTE_GPIO_ACTIVE_LOW );
+      TURN_OUTPUT_PORT_OFF( REMOTE_GPIO4_BIT__, REMOTE_GPIO4_PORT__, REMOTE_GPIO4_DDR__, REMOTE_GPIO_ACTIVE_LOW );
+    }
+}
+
+/* starts the pulse of the relay group, which is ended by EndExpiredImpulses(); a pulse already
+   running on the same group is restarted in the new direction */
+static uint8_t ApplyActuatorImpulse(uint8_t parameter, uint8_t turnOn)
+{
+    // activate output relay:
+    if (!StartActuatorImpulse(parameter, turnOn))
+        return 0;
 
     // the duration of the pulse needs to be tuned for your specific application.
     // in my case the electrovalve I had took quite a lot of time to stabilize to the new
     // position!
+    uint8_t group = parameter - '1';
+    UpdateClock();
+    g_impulseDeadline[group] = g_clockTicks + ACTUATOR_IMPULSE_DURATION_TICKS;
+    g_impulsePending |= BV(group);
+    return 1;
+}
 
-    DelayMsNOInterrupts(ACTUATOR_IMPULSE_DURATION_MSEC);
+/* turns on LED1 to signal an ACK; EndExpiredImpulses() turns it off, so the radio stays in RX */
+static void BlinkAckLed()
+{
+    BSP_TURN_ON_LED1();
+    UpdateClock();
+    g_ledDeadline = g_clockTicks + ACK_LED_DURATION_TICKS;
+    g_ledPending = 1;
+}
 
+/* turns off the relays whose pulse is over, and LED1 after an ACK */
+static void EndExpiredImpulses()
+{
+    UpdateClock();
+    if (g_ledPending && (int32_t)(g_clockTicks - g_ledDeadline) >= 0)
+    {
+        g_ledPending = 0;
+        BSP_TURN_OFF_LED1();
+    }
+    for (uint8_t group = 0; group < NUM_RELAY_GROUPS; group++)
+    {
+        if ((g_impulsePending & BV(group)) && (int32_t)(g_clockTicks - g_impulseDeadline[group]) >= 0)
+        {
+            g_impulsePending &= ~BV(group);
+            StopActuatorImpulse('1' + group);
+        }
+    }
+}
 
-    // then turn off relay:
+/* the sleep timer periods to wait, up to the given ones (which must be positive), before the
+   end of the next relay pulse or of the ACK blink; call EndExpiredImpulses() first */
+static uint16_t TicksToNextImpulseEnd(int32_t maxTicks)
+{
+    uint16_t steps = maxTicks > 0xFFFF ? 0xFFFF : (uint16_t)maxTicks;
+    int32_t ledLeft = (int32_t)(g_ledDeadline - g_clockTicks);
+    if (g_ledPending && ledLeft < steps)
+        steps = (uint16_t)ledLeft;
+    for (uint8_t group = 0; group < NUM_RELAY_GROUPS; group++)
+    {
+        int32_t impulseLeft = (int32_t)(g_impulseDeadline[group] - g_clockTicks);
+        if ((g_impulsePending & BV(group)) && impulseLeft < steps)
+            steps = (uint16_t)impulseLeft;
+    }
+    return steps;
+}
 
-    if (g_lastCmdParameter == '1')
+/* sleeps in PM2 for the given sleep timer periods, waking up in between to end the relay pulses
+   on time */
+static void SleepAndEndImpulses(uint32_t ticks)
+{
+    UpdateClock();
+    uint32_t end = g_clockTicks + ticks;
+    while (1)
     {
-      TURN_OUTPUT_PORT_OFF( REMOTE_GPIO1_BIT__, REMOTE_GPIO1_PORT__, REMOTE_GPIO1_DDR__, REMOTE_GPIO_ACTIVE_LOW );
-      TURN_OUTPUT_PORT_OFF( REMOTE_GPIO2_BIT__, REMOTE_GPIO2_PORT__, REMOTE_GPIO2_DDR__, REMOTE_GPIO_ACTIVE_LOW );
+        EndExpiredImpulses();
+        int32_t left = (int32_t)(end - g_clockTicks);
+        if (left <= 0)
+            break;
+
+        SleepAndUpdateClock(SLEEP_31_25_US_RESOLUTION, TicksToNextImpulseEnd(left));
     }
-    else if (g_lastCmdParameter == '2')
+}
+
+/* halts the CPU with the radio in RX until a frame is received, the next relay pulse ends or
+   the RX window ends (rxWindowEnd, in g_clockTicks) */
+static void IdleInRxWindow(uint32_t rxWindowEnd)
+{
+    EndExpiredImpulses();
+    int32_t left = (int32_t)(rxWindowEnd - g_clockTicks);
+    if (left > 0 && !g_sRxCallbackSemaphore)
+        IdleAndUpdateClock(TicksToNextImpulseEnd(left));
+}
+
+/* parameter: the relay group (ASCII encoded); durationMin: 0 to cancel a pending turn off */
+static void ScheduleAutoOff(uint8_t parameter, uint16_t durationMin)
+{
+    uint8_t group = parameter - '1';
+    if (group >= NUM_RELAY_GROUPS)
+        return;
+
+    if (durationMin == 0)
     {
-      TURN_OUTPUT_PORT_OFF( REMOTE_GPIO3_BIT__, REMOTE_GPIO3_PORT__, REMOTE_GPIO3_DDR__, REMOTE_GPIO_ACTIVE_LOW );
-      TURN_OUTPUT_PORT_OFF( REMOTE_GPIO4_BIT__, REMOTE_GPIO4_PORT__, REMOTE_GPIO4_DDR__, REMOTE_GPIO_ACTIVE_LOW );
+        g_autoOffPending &= ~BV(group);
+        return;
+    }
+
+    if (durationMin > MAX_AUTO_OFF_DURATION_MIN)
+        durationMin = MAX_AUTO_OFF_DURATION_MIN;
+    UpdateClock();
+    g_autoOffDeadline[group] = g_clockMs + (uint32_t)durationMin * 60000;
+    g_autoOffPending |= BV(group);
+}
+
+/* turns off the relay groups whose duration expired */
+static void ApplyAutoOff()
+{
+    UpdateClock();
+    for (uint8_t group = 0; group < NUM_RELAY_GROUPS; group++)
+    {
+        if ((g_autoOffPending & BV(group)) && (int32_t)(g_clockMs - g_autoOffDeadline[group]) >= 0)
+        {
+            g_autoOffPending &= ~BV(group);
+            ApplyActuatorImpulse('1' + group, 0);
+        }
+    }
+}
+
+/* parameter: the relay group (ASCII encoded), ignored if invalid */
+static void ApplyRelayGroup(uint8_t parameter, uint8_t turnOn, uint16_t durationMin)
+{
+    if (ApplyActuatorImpulse(parameter, turnOn))
+        ScheduleAutoOff(parameter, turnOn ? durationMin : 0);
+}
+
+static void ApplyCmd(const remote_cmd_t* cmd)
+{
+    switch (cmd->cmd)
+    {
+    case CMD_TURN_ON:
+    case CMD_TURN_OFF:
+        if (cmd->parameter)
+        {
+            ApplyRelayGroup(cmd->parameter, cmd->cmd == CMD_TURN_ON, cmd->durationMin);
+            break;
+        }
+        // no relay group (e.g. a broadcast TURNOFF to close every valve): all of them at the same time
+        for (uint8_t group = 0; group < NUM_RELAY_GROUPS; group++)
+            ApplyRelayGroup('1' + group, cmd->cmd == CMD_TURN_ON, cmd->durationMin);
+        break;
+
+    case CMD_BATCH:
+        // the pulses of all the relay groups run at the same time; invalid relay groups are skipped
+        for (uint8_t i = 0; i < cmd->numOps; i++)
+        {
+            uint8_t parameter = '0' + (cmd->ops[i] & BIN_OP_CHANNEL_MASK);
+            ApplyRelayGroup(parameter, cmd->ops[i] & BIN_OP_TURN_ON, cmd->durationMin);
+        }
+        break;
+
+    case CMD_NO_OP:
+        // nothing to do actually!
+        break;
+
+    default:
+        break;          // unknown command... logical programming error?
     }
-    
-    g_lastTransactionIDApplied = g_lastTransactionIDRX;
 }
 
+/* runs the commands queued by CheckCmdAndReplyWithAck(), which only start the relay pulses */
+static void RunQueuedCommands()
+{
+    while (g_cmdQueueTail != g_cmdQueueHead)
+        ApplyCmd(&g_cmdQueue[g_cmdQueueTail++ % CMD_QUEUE_LEN]);
+}
+
+/* sends the ACK of the broadcast command just run, in the slot picked by CheckCmdAndReplyWithAck():
+   sleeps in PM2 until then, ending the relay pulses on time; leaves the radio in RX */
+static void SendBroadcastAck()
+{
+    SleepAndEndImpulses((uint32_t)g_bcastAckSlot * BCAST_ACK_SLOT_TICKS);
+    g_bcastAckSlot = NO_BCAST_ACK_SLOT;
+
+    // built only now, so that BIN_TLV_CLOCK is up to date:
+    BuildAck(1, g_bcastAckTransactionID);
+    MRFI_Transmit(&g_pktTx, MRFI_TX_TYPE_CCA);
+    MRFI_RxOn();
+}
+
+#if ENABLE_WAKE_ON_RADIO
+/* sleeps in PM2 up to maxMs, waking up at every multiple of WOR_SNIFF_INTERVAL_TICKS of the clock
+   to sense the carrier, and returns as soon as a frame is received; leaves the radio in RX.
+   The sleep timer Event0 (WORCTL/WOREVT, programmed by BSP_SleepFor()) wakes up the MCU, which
+   only strobes SRX and halts: with MCSM2.RX_TIME_RSSI the radio ends RX by itself as soon as the
+   RSSI is valid and no carrier is sensed (AGCCTRL1/AGCCTRL2 thresholds) */
+static void SleepUntilRadioActivity(uint16_t maxMs)
+{
+    uint16_t numSniffs = (uint32_t)maxMs * SLEEP_TIMER_HZ / 1000 / WOR_SNIFF_INTERVAL_TICKS;
+    while (numSniffs-- && !g_sRxCallbackSemaphore)
+    {
+        UpdateClock();
+        uint16_t steps = WOR_SNIFF_INTERVAL_TICKS - (uint16_t)(g_clockTicks % WOR_SNIFF_INTERVAL_TICKS);
+        if (steps < WOR_SNIFF_SAMPLE_TICKS)
+            steps += WOR_SNIFF_INTERVAL_TICKS;      // too close to go to sleep: skip this sniff
+        SleepAndEndImpulses(steps);
+
+        MCSM2 = MCSM2_RX_TIME_RSSI | MCSM2_RX_TIME;  // no RX timeout, only the carrier sense
+        MRFI_RxOn();
+        IdleAndUpdateClock(WOR_SNIFF_SAMPLE_TICKS);  // calibration and RSSI, or a frame received
+        MCSM2 = MCSM2_RX_TIME;                       // back to the reset value: RX until told otherwise
+        if ((MARCSTATE & MARCSTATE_MARC_STATE) == MARC_STATE_IDLE)
+        {
+            MRFI_RxIdle();  // the radio is in IDLE already: this only updates the MRFI state
+            continue;       // nobody is transmitting: back to sleep
+        }
+
+        // stay in RX until the end of the frame, if the carrier is a frame we can still sync on:
+        // the CPU is halted meanwhile, the RX callback wakes it up
+        uint32_t rxEnd = g_clockTicks + WOR_RX_TIMEOUT_TICKS;
+        while (!g_sRxCallbackSemaphore && (int32_t)(rxEnd - g_clockTicks) > 0)
+            IdleInRxWindow(rxEnd);
+    }
+
+    MRFI_RxOn();
+}
+#endif
+
 static void WaitInLowPowerMode()
 {
     // IMPORTANT: we cannot sleep too much time because we must be able to
@@ -256,14 +664,20 @@ static void WaitInLowPowerMode()
       MRFI_RxIdle();              // this decreases very much power consumption!
       DelayMsNOInterrupts(WAIT_TIME_RADIOOFF_MSEC);                  
       MRFI_RxOn();                  // before leaving restore radio RX status
+    #elif ENABLE_WAKE_ON_RADIO
+      SleepUntilRadioActivity(WAIT_TIME_RADIOOFF_MSEC);
     #else    // much better battery saving in this mode: in power mode 2 consumption goes to 0.5uA (by datasheet) and crystal oscillator will still be on
-      BSP_SleepFor( POWER_MODE_2, SLEEP_1_MS_RESOLUTION, WAIT_TIME_RADIOOFF_MSEC );
+      SleepAndEndImpulses(WAIT_TIME_RADIOOFF_TICKS);
       MRFI_RxOn();                  // before leaving restore radio RX status
     #endif
 #else
     // no sleep policy: sleep with radio in RX and with interrupts enabled
     //DelayMsNOInterrupts(WAIT_TIME_RADIOOFF_MSEC);
-    DelayMsWithInterrupts(WAIT_TIME_RADIOOFF_MSEC);
+    for (uint8_t sec = 0; sec < WAIT_TIME_RADIOOFF_SEC; sec++)
+    {
+        DelayMsWithInterrupts(1000);
+        UpdateClock();              // a single delay would miss the wraps of the sleep timer
+    }
 #endif
 }
 
@@ -359,12 +773,15 @@ void sRemoteNode(void)
 
     /* turn on RX. default is RX off. */
     MRFI_RxOn();
+    UpdateClock();
 
 
-    unsigned int count1=0, count2=0;
-    //unsigned int counter_to_apply_lastcmd=0;
+    unsigned int count2=0;
     unsigned int go_low_power=0;
     unsigned int do_battery_meas=0;
+#if !ENABLE_WAKE_ON_RADIO
+    uint32_t rx_window_end = g_clockTicks + RX_WINDOW_TICKS;
+#endif
     while (1)
     {
         if( g_sRxCallbackSemaphore )                    /* Command successfully received? */
@@ -372,46 +789,48 @@ void sRemoteNode(void)
             if (CheckCmdAndReplyWithAck())              // this is very quick and will leave the radio in RX
             {
                 // we recognized a command from radio interface and we sent
-                // an ACK back however do not execute immediately the command:
-                // our ACK may not be received; in that case the MASTER will repeat
-                // us the same command till he receives our ACK.
-                // In the meantime we don't want to repeat the same commands
-                // a lot of times!!
-
-                // resetting the "counter to apply" we force restarting the
-                // wait-before-exec
-                //counter_to_apply_lastcmd = 0;
+                // an ACK back: execute it immediately. Our ACK may not be received;
+                // in that case the MASTER will repeat us the same command till he
+                // receives our ACK, but CheckCmdAndReplyWithAck() queues each
+                // transaction ID only once, so the relays are not pulsed again
+                RunQueuedCommands();                    // this only starts the relay pulses
+
+                // a broadcast command runs first, then is ACKed in its slot:
+                if (g_bcastAckSlot != NO_BCAST_ACK_SLOT)
+                    SendBroadcastAck();
+
+                // signal visually we transmitted the ACK, while still listening
+                BlinkAckLed();
             }
         }
 
-        // NOTE:
-        // 
-        #define MAIN_LOOP_CALIBRATION_CONSTANT_CYCLES_PER_SEC       ((unsigned)10880)
-        #define GO_LOW_POWER_INTERVAL_SEC                           ((unsigned)6)
-        #define MAIN_LOOP_WAIT_COUNTER                              (MAIN_LOOP_CALIBRATION_CONSTANT_CYCLES_PER_SEC*GO_LOW_POWER_INTERVAL_SEC)
-        
-        count1++;
-        go_low_power = ((count1 % MAIN_LOOP_WAIT_COUNTER) == 0);
+        BSP_MAIN_LOOP_TICK();
+
+        // the relay pulses started by the commands and by the durations, and the ACK blink:
+        if (g_impulsePending || g_ledPending)
+            EndExpiredImpulses();
+
+#if ENABLE_WAKE_ON_RADIO
+        // no need to keep listening: the sniffs catch also the retransmissions of the lime2 node
+        go_low_power = 1;
+#else
+        UpdateClock();
+        go_low_power = ((int32_t)(g_clockTicks - rx_window_end) >= 0);
+#endif
         if (go_low_power)
         {
             //BSP_TURN_ON_LED1();   // useful to measure experimentally the frequency this code is run
-          
-            if (g_lastCmdRx != CMD_MAX)
-            {
-                //counter_to_apply_lastcmd++;
-                //if (counter_to_apply_lastcmd == 3)      // wait some time before applying RX command!
-                {
-                    ApplyCmdRx();               // this will take a lot of time!
-                    g_lastCmdRx = CMD_MAX;
-                    //counter_to_apply_lastcmd = 0;
-                    // we just received something; it's unlikely we're going to receive
-                    // another command shortly... we can sleep a little bit
-                    ///go_low_power=1;
-                }
-            }
+
+            // the relay groups turned on for a given duration:
+            if (g_autoOffPending)
+                ApplyAutoOff();
 
             WaitInLowPowerMode();               // this may take a lot of time but will leave the radio in RX
             go_low_power = 0;
+#if !ENABLE_WAKE_ON_RADIO
+            UpdateClock();
+            rx_window_end = g_clockTicks + RX_WINDOW_TICKS;
+#endif
 
             // should we do a battery measurement?
             // NOTE: the time spent in the low power is dominant over other aspects, that's why the
@@ -430,7 +849,13 @@ void sRemoteNode(void)
             
             //BSP_TURN_OFF_LED1();   // useful to measure experimentally the frequency this code is run
         }
-        //else: keep spinning with radio in Rx mode for a while
+#if !ENABLE_WAKE_ON_RADIO
+        else
+        {
+            // keep the radio in Rx mode for a while, with the CPU halted
+            IdleInRxWindow(rx_window_end);
+        }
+#endif
     }
 }
 
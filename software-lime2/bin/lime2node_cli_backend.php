@@ -13,6 +13,52 @@
   include 'lime2node_comm_lib.php';
 
 
+  // sends $cmd_to_send to both relay groups and waits for the ACK: a single batch command,
+  // when supported, otherwise one command per relay group; $durationMin requires the batch command
+  function send_cmd_to_all_channels($cmd_to_send, $durationMin = 0)
+  {
+    global $use_crc_frames, $use_binary_commands;
+
+    $channels = array("1", "2");
+    if ($use_crc_frames && $use_binary_commands)
+    {
+      $ops = array();
+      foreach ($channels as $cmdParameter)
+        $ops[] = array($cmd_to_send, $cmdParameter);
+      $batches = array($ops);
+    }
+    else
+    {
+      $batches = array();
+      foreach ($channels as $cmdParameter)
+        $batches[] = array(array($cmd_to_send, $cmdParameter));
+    }
+
+    foreach ($batches as $ops) {
+      $tid = lime2node_get_last_transaction_id_and_advance();
+      if (count($ops) > 1) {
+        lime2node_write_log("INFO", "Sending $cmd_to_send command (for " . count($ops) . " channels with tid=$tid) to remote node...");
+        $result = lime2node_send_spi_batch_cmd($ops, $tid, $durationMin);
+      } else {
+        $cmdParameter = $ops[0][1];
+        lime2node_write_log("INFO", "Sending $cmd_to_send command (with param=$cmdParameter and tid=$tid) to remote node...");
+        $result = lime2node_send_spi_cmd($cmd_to_send, $tid, $cmdParameter);
+      }
+      if ($result["valid"] == false) {
+        lime2node_write_log("INFO", "Command TX over SPI failed. Aborting.");
+        die();
+      }
+
+      lime2node_write_log("INFO", "Command was sent successfully over SPI. Waiting for the ACK from the remote node...");
+      $received_ack = lime2node_wait_for_ack($tid);
+      if ($received_ack["valid"] == false) {
+        lime2node_write_log("INFO", "Failed waiting for the ACK. $cmd_to_send command probably was never received. Aborting.");
+        die();
+      }
+
+      lime2node_write_log("INFO", "Successfully received the ACK from the remote node! " . lime2node_get_battery_info($received_ack["batteryRead"]) );
+    }
+  }
 
 
   // main:
@@ -36,6 +82,8 @@
   $cmdParameter = "1";     // currently when cmd=TURNON/TURNOFF only 2 values of cmdParameter are supported: '1' or '2' to indicate the relay channel group
   $run_cmd_sequence = false;
   $get_battery_level = false;
+  $dump_remotes = false;
+  $emergency_off = false;
   
   foreach (array_keys($options) as $opt) switch ($opt) {
     case "spi-command":
@@ -55,8 +103,12 @@
         $run_cmd_sequence = true;
       } else if ($value == "GET_BATTERY_LEVEL") {
         $get_battery_level = true;
+      } else if ($value == "DUMP_REMOTES") {
+        $dump_remotes = true;
+      } else if ($value == "EMERGENCY_OFF") {
+        $emergency_off = true;
       } else {
-        echo "Invalid value for --spi-command: [$value]. Only values 'TURNON' or 'TURNOFF' or 'NOOP' or 'TURNON_WITH_TIMER' or 'GET_BATTERY_LEVEL' are accepted.\n";
+        echo "Invalid value for --spi-command: [$value]. Only values 'TURNON' or 'TURNOFF' or 'NOOP' or 'TURNON_WITH_TIMER' or 'GET_BATTERY_LEVEL' or 'DUMP_REMOTES' or 'EMERGENCY_OFF' are accepted.\n";
         die();
       }
       break;
@@ -107,55 +159,56 @@
   if ($run_cmd_sequence)
   {
     $timerMin = intval($cmdParameter);
-  
-    for ($i = 1; $i <= 2; $i++) {
-       // run a TURNON command 
-      $cmd_to_send = $turnon_cmd;
-      $cmdParameter = strval($i);
-      $tid = lime2node_get_last_transaction_id_and_advance();
-      lime2node_write_log("INFO", "Sending $cmd_to_send command (with param=$cmdParameter and tid=$tid) to remote node...");
-      $result = lime2node_send_spi_cmd($cmd_to_send, $tid, $cmdParameter);
-      if ($result["valid"] == false) {
-        lime2node_write_log("INFO", "Command TX over SPI failed. Aborting.");
-        die();
-      }
-      
-      lime2node_write_log("INFO", "First command was sent successfully over SPI. Waiting for the ACK from the remote node...");
-      $received_ack = lime2node_wait_for_ack($tid);
-      if ($received_ack["valid"] == false) {
-        lime2node_write_log("INFO", "Failed waiting for the ACK. Turn ON command probably was never received. Aborting.");
-        die();
-      }
-      
-      lime2node_write_log("INFO", "Successfully received the ACK from the remote node! " . lime2node_get_battery_info($received_ack["batteryRead"]) );
+
+    if ($use_crc_frames && $use_binary_commands)
+    {
+      // the remote node turns the relays off by itself: no need to keep the SPI bus locked meanwhile,
+      // and the relays are turned off even if this process dies
+      send_cmd_to_all_channels($turnon_cmd, $timerMin);
+      lime2node_write_log("INFO", "The remote node will turn the relays off by itself in ${timerMin} minutes");
     }
-    
-    // now wait for a certain amount of minutes
-    lime2node_write_log("INFO", "Now sleeping for ${timerMin} minutes before sending TURNOFF command");
-    sleep(60 * $timerMin);
-    
-    for ($i = 1; $i <= 2; $i++) {
-      // run a TURNOFF command 
-      $cmd_to_send = $turnoff_cmd;
-      $cmdParameter = strval($i);
-      $tid = lime2node_get_last_transaction_id_and_advance();
-      lime2node_write_log("INFO", "Sending $cmd_to_send command (with param=$cmdParameter and tid=$tid) to remote node...");
-      $result = lime2node_send_spi_cmd($cmd_to_send, $tid, $cmdParameter);
-      if ($result["valid"] == false) {
-        lime2node_write_log("INFO", "Command TX over SPI failed. Aborting.");
-        die();
-      }
-      
-      lime2node_write_log("INFO", "First command was sent successfully over SPI. Waiting for the ACK from the remote node...");
+    else
+    {
+      send_cmd_to_all_channels($turnon_cmd);
+
+      // now wait for a certain amount of minutes
+      lime2node_write_log("INFO", "Now sleeping for ${timerMin} minutes before sending TURNOFF command");
+      sleep(60 * $timerMin);
+
+      send_cmd_to_all_channels($turnoff_cmd);
+    }
+  }
+  else if ($emergency_off)
+  {
+    // a single TURNOFF for all the relay groups of all the remote nodes (or of the groups given as parameter)
+    $groups = array_key_exists('spi-command-parameter', $options) ? intval($cmdParameter) : 0;
+    $tid = lime2node_get_last_transaction_id_and_advance();
+    $result = lime2node_send_spi_broadcast_cmd($turnoff_cmd, $tid, $groups);
+
+    if ($result["valid"])
+    {
       $received_ack = lime2node_wait_for_ack($tid);
-      if ($received_ack["valid"] == false) {
-        lime2node_write_log("INFO", "Failed waiting for the ACK. Turn ON command probably was never received. Aborting.");
-        die();
-      }
-      
-      lime2node_write_log("INFO", "Successfully received the ACK from the remote node! " . lime2node_get_battery_info($received_ack["batteryRead"]) );
+      $table = lime2node_send_spi_table($broadcast);
+      if ($table !== FALSE && $broadcast["transactionID"] == $tid)
+        lime2node_write_log("INFO", "Remote nodes that ACKed: " . implode(" ", $broadcast["ackedIDs"]));
+      if (!$received_ack["valid"])
+        lime2node_write_log("INFO", "Failed waiting for the ACK.");
+    }
+    else {
+      lime2node_write_log("INFO", "Command TX over SPI failed. Aborting.");
     }
   }
+  else if ($dump_remotes)
+  {
+    // return machine-friendly output: one line per remote node, no radio exchange needed
+    $table = lime2node_send_spi_table();
+    if ($table === FALSE)
+      lime2node_write_log("INFO", "-1");
+    else foreach ($table as $row)
+      lime2node_write_log("ALERT", $row["remoteID"] . " " . $row["transactionID"] . " " .
+                          lime2node_get_battery_level_percentage($row["batteryRead"]) . " " . $row["rssi"] . " " .
+                          $row["failures"] . " " . ($row["lastAckSec"] === FALSE ? "-1" : $row["lastAckSec"]));
+  }
   else if ($get_battery_level)
   {
     // return machine-friendly output:
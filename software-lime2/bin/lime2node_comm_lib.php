@@ -12,15 +12,64 @@
 
   // constants
   $transaction_filename = 'last_spi_transaction_id';        // this filename will be created under $HOME directory
+  $binary_transaction_filename = 'last_spi_binary_transaction_id';    // same, for the binary commands
   $output_file = '/tmp/last_spi_reply';
   $last_spi_op_logfile = '/var/log/lime2node_last_operation.log';
   $enabled_loglevel = "INFO";
   $spi_bus_lockfile = "/tmp/lime2node_spi_bus.lock";
+  $spi_gateway_socket = getenv("LIME2NODE_SPI_GATEWAY_SOCKET") ?: "/run/lime2node_spi_gateway.sock";    // see software-lime2/spi_gateway
+  $spi_gateway_timeout_sec = 5;
   
   // SPI protocol details:
   $max_wait_time_sec = 30;
+  $min_poll_interval_usec = 250000;     // STATUS polling after a command: start from the lime2 retry period...
+  $max_poll_interval_usec = 2000000;    // ...and slow down up to this
   $speed_hz = 5000;
   $validack = 'ACK_';
+  $busyreply = 'BUSY';      // reply to STATUS while the lime2 node is still sending a command over radio
+  $reply_len = 6;           // ACK_/BUSY + 2 bytes
+
+  // framed STATUS, answered by the lime2 node in the same SPI transaction (see SPI_FRAME_xxx in
+  // the firmware main.h): sync byte + opcode, then the reply follows a turnaround byte
+  $use_framed_status = TRUE;      // set to FALSE with lime2 firmwares not supporting it
+  $spi_frame_sync = 0xA5;
+  $spi_frame_opcode_status = 'S';
+  $spi_frame_reply_ofs = 3;
+
+  // CRC-protected frames (see SPI_FRAME_OPCODE_COMMAND/QUERY in the firmware main.h): sync byte + opcode +
+  // payload length + sequence number + payload + CRC-16; the reply to 'Q' carries the STATUS reply, the
+  // sequence number of the last 'C' frame accepted by the lime2 node and its own CRC-16
+  $use_crc_frames = TRUE;         // set to FALSE with lime2 firmwares not supporting them
+  $spi_frame_opcode_command = 'C';
+  $spi_frame_opcode_query = 'Q';
+  $spi_frame_query_reply_len = 13;
+  $spi_frame_opcode_queue = 'L';  // the reply carries the state of each queued command, see lime2node_send_spi_queue()
+  $spi_frame_queue_cmds = 8;      // CMD_QUEUE_LEN
+  $spi_frame_queue_cmd_len = 4;
+  $spi_frame_cmd_acked = 3;       // states of a queued command
+  $spi_frame_cmd_failed = 4;
+  $spi_frame_opcode_table = 'T';  // the reply carries one row per remote node, see lime2node_send_spi_table()
+  $spi_frame_table_rows = 16;     // REMOTE_TABLE_LEN
+  $spi_frame_table_row_len = 8;
+  $spi_frame_max_retries = 5;     // corrupted replies, or 'C' frames not accepted, before giving up
+  $spi_batch_delay_usec = 500;    // pause before toggling the chip select between frames sent in a single ioctl
+
+  // binary commands carried by the C frames (see BIN_FRAME_xxx in the firmware main.h): opcode + version/flags +
+  // 16-bit transaction ID (LSB first) + TLVs, instead of the 9-byte ASCII commands
+  $use_binary_commands = TRUE;    // set to FALSE with lime2 firmwares not supporting them
+  $bin_frame_opcode_flag = 0x80;
+  $bin_frame_version = 1;
+  $bin_tlv_channel = 1;
+  $bin_tlv_ops = 3;
+  $bin_op_turn_on = 0x80;
+  $bin_opcode_batch = 0x85;      // several TURNON/TURNOFF operations acknowledged at once
+  $bin_batch_max_ops = 4;        // as many as fit a radio packet
+  $bin_tlv_duration = 4;         // minutes after which the remote node turns off by itself the relays turned on
+  $bin_tlv_remote = 6;           // node ID of the remote node (REMOTE_NODE_ID of its firmware), 1 if omitted
+  $bin_remote_id_max = 0x7F;
+  $bin_remote_id_broadcast = 0xFF; // all the remote nodes at once, see lime2node_send_spi_broadcast_cmd()
+  $bin_tlv_groups = 7;           // bitmask of the groups (REMOTE_GROUPS of their firmware) of the remote nodes addressed
+  $bin_bcast_bitmap_len = 16;    // remote nodes that ACKed the last broadcast command, in the reply to the T frame
   
   // commands - the SPI/OtA protocol dictates a len of 7 bytes:
   $turnon_cmd  = 'TURNON_';
@@ -33,6 +82,12 @@
   $first_valid_tid = 49;    // '1'
   $last_valid_tid = 57;     // '9'
 
+  // the binary commands carry a 16-bit TID: with only 9 values shared by all the remote nodes, a remote
+  // node missing 8 commands would take the next one for a retransmission of the last one it ran.
+  // Above 255, so that a binary TID never matches an ASCII one
+  $first_valid_binary_tid = 256;
+  $last_valid_binary_tid = 65535;
+
   $cmdparam_for_status_cmd = '0';
   
   // BATTERY ADC->VOLTAGE CONVERSION FACTORS
@@ -232,10 +287,287 @@
     }
   }
   
-  function lime2node_send_spi_cmd($cmd, $transactionID, $cmdParameter)
+  function lime2node_spi_gateway_request($opcode, $payload, $timeout_sec)
+  {
+    global $spi_gateway_socket, $spi_gateway_timeout_sec;
+    static $sock = FALSE;
+
+    // keep the connection to the gateway open across calls: each SPI transaction then
+    // costs just a request/reply over the Unix socket
+    if ($sock === FALSE)
+    {
+      $sock = @stream_socket_client("unix://" . $spi_gateway_socket, $errno, $errstr, $spi_gateway_timeout_sec);
+      if ($sock === FALSE)
+      {
+        lime2node_write_log("DEBUG", "Failed connecting to the SPI gateway on " . $spi_gateway_socket . ": " . $errstr);
+        return FALSE;
+      }
+    }
+
+    // request: opcode, 16bit little-endian length, payload
+    stream_set_timeout($sock, $timeout_sec);
+    $request = pack("Cv", ord($opcode), strlen($payload)) . $payload;
+    if (fwrite($sock, $request) !== strlen($request))
+    {
+      lime2node_write_log("DEBUG", "Failed sending request to the SPI gateway");
+      fclose($sock);
+      $sock = FALSE;
+      return FALSE;
+    }
+
+    // reply: status byte, 16bit little-endian length, payload
+    $reply_hdr = stream_get_contents($sock, 3);
+    if ($reply_hdr === FALSE || strlen($reply_hdr) != 3)
+    {
+      lime2node_write_log("DEBUG", "No reply from the SPI gateway");
+      fclose($sock);
+      $sock = FALSE;
+      return FALSE;
+    }
+    $hdr = unpack("Cstatus/vlen", $reply_hdr);
+    $content_str = ($hdr["len"] > 0) ? stream_get_contents($sock, $hdr["len"]) : "";
+    if (strlen($content_str) != $hdr["len"])
+    {
+      lime2node_write_log("DEBUG", "Truncated reply from the SPI gateway");
+      fclose($sock);
+      $sock = FALSE;
+      return FALSE;
+    }
+
+    return array("status" => $hdr["status"], "payload" => $content_str);
+  }
+
+  function lime2node_spi_gateway_transfer($rawcommand)
+  {
+    global $spi_gateway_timeout_sec;
+
+    // opcode 'T': full-duplex transfer
+    $reply = lime2node_spi_gateway_request('T', $rawcommand, $spi_gateway_timeout_sec);
+    if ($reply === FALSE)
+      return FALSE;
+    if ($reply["status"] != 0)
+    {
+      lime2node_write_log("DEBUG", "The SPI gateway failed the transfer with status " . $reply["status"]);
+      return FALSE;
+    }
+
+    return $reply["payload"];
+  }
+
+  function lime2node_spi_gateway_wait_for_ack($transactionID, $timeout_sec)
+  {
+    global $spi_gateway_timeout_sec;
+
+    // opcode 'W': the gateway polls the lime2 node with the Q frame (and the L frame when another
+    // command is in flight), more often right after the command, and replies as soon as the ACK
+    // with the given TID is received, the lime2 node gives up on it, or on timeout
+    $reply = lime2node_spi_gateway_request('W', pack("vv", $transactionID, $timeout_sec * 1000),
+                                           $timeout_sec + $spi_gateway_timeout_sec);
+    if ($reply === FALSE)
+      return FALSE;
+
+    // status 3: timeout, 4: the lime2 node gave up on the command
+    if ($reply["status"] != 0)
+      lime2node_write_log("DEBUG", "The SPI gateway did not receive the ACK, status " . $reply["status"]);
+    return array("valid" => ($reply["status"] == 0),
+                 "ack" => (strlen($reply["payload"]) > 0) ? array_values(unpack("C*", $reply["payload"])) : array());
+  }
+
+  function lime2node_spidev_test_escape($rawcommand)
+  {
+    // spidev_test unescapes \xNN sequences: use them for anything that is not plain ASCII
+    $escaped = "";
+    foreach (str_split($rawcommand) as $c)
+      $escaped .= (ctype_alnum($c) || $c == '_') ? $c : sprintf("\\x%02X", ord($c));
+    return $escaped;
+  }
+
+  function lime2node_spidev_test_transfer($rawcommand, $extra_args = "")
   {
     global $output_file, $speed_hz;
-    global $status_cmd, $tid_for_status_cmd, $cmdparam_for_status_cmd;
+
+    // NOTE: the "sudo" operation is required when running e.g. on a webserver that is not running as ROOT user:
+    //       to be able to send/receive data over SPI, root permissions are needed.
+    $command = 'sudo spidev_test -D /dev/spidev2.0 -s ' . strval($speed_hz) . ' -v -p "' . lime2node_spidev_test_escape($rawcommand) . '"' .
+               $extra_args . ' --output ' . $output_file;
+    lime2node_write_log("DEBUG", $command);
+
+    exec($command, $output, $retval);
+    if ($retval != 0)
+    {
+      lime2node_write_log("DEBUG", "Failed sending command... spidev_test exited with " . $retval . "... output: " . implode("\n", $output));
+      return FALSE;
+    }
+    lime2node_write_log("DEBUG", implode("\n", $output));
+
+    // read output reply from SPI
+    $handle = fopen($output_file, "rb");
+    $content_str = fread($handle, filesize($output_file));
+    fclose($handle);
+
+    return $content_str;
+  }
+
+  function lime2node_spi_transfer($rawcommand)
+  {
+    global $spi_gateway_socket;
+
+    // prefer the SPI gateway daemon when it's running; fall back to spawning spidev_test otherwise
+    if (file_exists($spi_gateway_socket))
+      return lime2node_spi_gateway_transfer($rawcommand);
+    return lime2node_spidev_test_transfer($rawcommand);
+  }
+
+  function lime2node_spi_message($frames, $delay_usec)
+  {
+    global $spi_gateway_socket, $spi_gateway_timeout_sec;
+
+    // several frames in a single SPI_IOC_MESSAGE ioctl, with the chip select toggled after each one
+    // (after $delay_usec): a single gateway request or a single spidev_test process for all of them
+    $total_len = 0;
+    foreach ($frames as $frame)
+      $total_len += strlen($frame);
+
+    if (file_exists($spi_gateway_socket))
+    {
+      // opcode 'M': length, 16bit little-endian delay and data of each frame
+      $payload = "";
+      foreach ($frames as $frame)
+        $payload .= pack("Cv", strlen($frame), $delay_usec) . $frame;
+      $reply = lime2node_spi_gateway_request('M', $payload, $spi_gateway_timeout_sec);
+      if ($reply === FALSE)
+        return FALSE;
+      if ($reply["status"] != 0)
+      {
+        lime2node_write_log("DEBUG", "The SPI gateway failed the message with status " . $reply["status"]);
+        return FALSE;
+      }
+      $content_str = $reply["payload"];
+    }
+    else
+    {
+      // spidev_test --batch repeats the same frame after the first one
+      for ($i = 2; $i < count($frames); $i++)
+        assert($frames[$i] == $frames[1]);
+      $extra_args = ' -d ' . strval($delay_usec);
+      if (count($frames) > 1)
+        $extra_args .= ' --batch ' . strval(count($frames) - 1) . ' --batch-frame "' . lime2node_spidev_test_escape($frames[1]) . '"';
+      $content_str = lime2node_spidev_test_transfer($frames[0], $extra_args);
+    }
+
+    if ($content_str === FALSE || strlen($content_str) != $total_len)
+      return FALSE;
+
+    // split the bytes received back into one string per frame
+    $ret = array();
+    $ofs = 0;
+    foreach ($frames as $frame)
+    {
+      $ret[] = substr($content_str, $ofs, strlen($frame));
+      $ofs += strlen($frame);
+    }
+    return $ret;
+  }
+
+  function lime2node_build_duration_tlv($durationMin)
+  {
+    global $bin_tlv_duration;
+
+    if ($durationMin <= 0)
+      return "";
+    return chr(($bin_tlv_duration << 4) | 2) . pack("v", min($durationMin, 0xFFFF));
+  }
+
+  function lime2node_build_remote_tlv($remoteID)
+  {
+    global $bin_tlv_remote, $bin_remote_id_max, $bin_remote_id_broadcast;
+
+    if ($remoteID == 0)
+      return "";
+    assert(($remoteID > 0 && $remoteID <= $bin_remote_id_max) || $remoteID == $bin_remote_id_broadcast);
+    return chr(($bin_tlv_remote << 4) | 1) . chr($remoteID);
+  }
+
+  function lime2node_build_groups_tlv($groups)
+  {
+    global $bin_tlv_groups;
+
+    if ($groups == 0)
+      return "";
+    assert($groups > 0 && $groups <= 0xFF);
+    return chr(($bin_tlv_groups << 4) | 1) . chr($groups);
+  }
+
+  function lime2node_build_binary_cmd($cmd, $transactionID, $cmdParameter, $durationMin = 0, $remoteID = 0)
+  {
+    global $turnon_cmd, $turnoff_cmd, $noop_cmd, $status_cmd;
+    global $bin_frame_opcode_flag, $bin_frame_version, $bin_tlv_channel;
+
+    // same order of the command_e enum of the firmware:
+    $opcode = array_search($cmd, array($turnon_cmd, $turnoff_cmd, $noop_cmd, $status_cmd));
+    assert($opcode !== FALSE);
+
+    $frame = chr($bin_frame_opcode_flag | $opcode) . chr($bin_frame_version << 4) . pack("v", $transactionID);
+    if ($cmdParameter >= '1' && $cmdParameter <= '9')
+      $frame .= chr(($bin_tlv_channel << 4) | 1) . chr(intval($cmdParameter));
+    if ($cmd == $turnon_cmd)
+      $frame .= lime2node_build_duration_tlv($durationMin);
+    return $frame . lime2node_build_remote_tlv($remoteID);
+  }
+
+  function lime2node_build_batch_cmd($ops, $transactionID, $durationMin = 0, $remoteID = 0)
+  {
+    global $turnon_cmd, $bin_frame_version, $bin_tlv_ops, $bin_op_turn_on, $bin_opcode_batch;
+
+    // one byte per operation: the relay group in the low nibble, the high bit set to turn it on
+    $opsbytes = "";
+    foreach ($ops as $op)
+      $opsbytes .= chr(($op[0] == $turnon_cmd ? $bin_op_turn_on : 0) | intval($op[1]));
+
+    return chr($bin_opcode_batch) . chr($bin_frame_version << 4) . pack("v", $transactionID) .
+           chr(($bin_tlv_ops << 4) | strlen($opsbytes)) . $opsbytes . lime2node_build_duration_tlv($durationMin) .
+           lime2node_build_remote_tlv($remoteID);
+  }
+
+  // $ops is an array of (TURNON or TURNOFF command, relay group) pairs, applied by the remote node
+  // at the same time and acknowledged with a single ACK for $transactionID; with $durationMin the
+  // remote node turns off by itself the relay groups turned on once it expires; $remoteID selects
+  // the remote node (0 for the default one)
+  function lime2node_send_spi_batch_cmd($ops, $transactionID, $durationMin = 0, $remoteID = 0)
+  {
+    global $turnon_cmd, $turnoff_cmd, $use_crc_frames, $use_binary_commands, $bin_batch_max_ops;
+
+    assert($use_crc_frames && $use_binary_commands);
+    assert(count($ops) > 0 && count($ops) <= $bin_batch_max_ops);
+    foreach ($ops as $op)
+    {
+      assert($op[0] == $turnon_cmd || $op[0] == $turnoff_cmd);
+      lime2node_assert_valid_cmd($op[0], $op[1]);
+    }
+
+    lime2node_write_log("DEBUG", "Sending batch of " . count($ops) . " operations over SPI with transaction ID=" . $transactionID);
+    return lime2node_send_spi_crc_cmd(lime2node_build_batch_cmd($ops, $transactionID, $durationMin, $remoteID));
+  }
+
+  // TURNON or TURNOFF of all the relay groups of all the remote nodes with a single radio command, e.g. to
+  // close every valve at once; $groups: bitmask of the groups of remote nodes that must run it, 0 for all.
+  // The ACK arrives once every remote node known to the lime2 node ACKed, see lime2node_send_spi_table()
+  function lime2node_send_spi_broadcast_cmd($cmd, $transactionID, $groups = 0)
+  {
+    global $turnon_cmd, $turnoff_cmd, $use_crc_frames, $use_binary_commands, $bin_remote_id_broadcast;
+
+    assert($use_crc_frames && $use_binary_commands);
+    assert($cmd == $turnon_cmd || $cmd == $turnoff_cmd);
+
+    lime2node_write_log("DEBUG", "Sending broadcast command over SPI:" . $cmd . " with transaction ID=" . $transactionID . " and groups=" . $groups);
+    return lime2node_send_spi_crc_cmd(lime2node_build_binary_cmd($cmd, $transactionID, "", 0, $bin_remote_id_broadcast) .
+                                      lime2node_build_groups_tlv($groups));
+  }
+
+  // $durationMin: only for TURNON; $remoteID: only with binary commands; see lime2node_send_spi_batch_cmd()
+  function lime2node_send_spi_cmd($cmd, $transactionID, $cmdParameter, $durationMin = 0, $remoteID = 0)
+  {
+    global $status_cmd, $tid_for_status_cmd, $cmdparam_for_status_cmd, $use_crc_frames, $use_binary_commands;
 
     lime2node_assert_valid_cmd($cmd, $cmdParameter);
     
@@ -250,27 +582,21 @@
     lime2node_write_log("DEBUG", "Sending command over SPI:" . $cmd . " with transaction ID=" . $transactionID . " and parameter=" . $cmdParameter);
     $rawcommand = $cmd . chr($transactionID) . $cmdParameter;
 
-    // NOTE: the "sudo" operation is required when running e.g. on a webserver that is not running as ROOT user:
-    //       to be able to send/receive data over SPI, root permissions are needed.
-    $command = 'sudo spidev_test -D /dev/spidev2.0 -s ' . strval($speed_hz) . ' -v -p "' . $rawcommand . '" --output ' . $output_file;
-    lime2node_write_log("DEBUG", $command);
+    if ($use_crc_frames && $use_binary_commands)
+      return lime2node_send_spi_crc_cmd(lime2node_build_binary_cmd($cmd, $transactionID, $cmdParameter, $durationMin, $remoteID));
+    assert($durationMin == 0 && $remoteID == 0);
+    if ($use_crc_frames)
+      return lime2node_send_spi_crc_cmd($rawcommand);
 
-    exec($command, $output, $retval);
-    if ($retval != 0)
+    $content_str = lime2node_spi_transfer($rawcommand);
+    if ($content_str === FALSE)
     {
-      lime2node_write_log("DEBUG", "Failed sending command... spidev_test exited with " . $retval . "... output: " . implode("\n", $output));
       $ret_array = array(
           "valid"  => FALSE,
           "ack" => array(),
       );
       return $ret_array;
     }
-    lime2node_write_log("DEBUG", implode("\n", $output));
-
-    // read output reply from SPI
-    $handle = fopen($output_file, "rb");
-    $content_str = fread($handle, filesize($output_file));
-    fclose($handle);
 
     // transform in binary array of uint8
     $content_arr = unpack("C*", $content_str);
@@ -285,6 +611,261 @@
     return $ret_array;
   }
 
+  function lime2node_crc16($str)
+  {
+    // CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF), as the lime2 firmware
+    $crc = 0xFFFF;
+    foreach (unpack("C*", $str) as $byte)
+    {
+      $crc ^= $byte << 8;
+      for ($i = 0; $i < 8; $i++)
+        $crc = ($crc & 0x8000) ? (($crc << 1) ^ 0x1021) & 0xFFFF : ($crc << 1) & 0xFFFF;
+    }
+    return $crc;
+  }
+
+  function lime2node_build_crc_frame($opcode, $seq, $payload)
+  {
+    global $spi_frame_sync;
+
+    $body = $opcode . chr(strlen($payload)) . chr($seq & 0xFF) . $payload;
+    return chr($spi_frame_sync) . $body . pack("n", lime2node_crc16($body));
+  }
+
+  function lime2node_build_query_frame()
+  {
+    global $spi_frame_opcode_query, $spi_frame_reply_ofs, $spi_frame_query_reply_len;
+
+    // padded so that the whole reply is clocked in the same transaction
+    $rawcommand = lime2node_build_crc_frame($spi_frame_opcode_query, 0, "");
+    return $rawcommand . str_repeat(chr(0), $spi_frame_reply_ofs + $spi_frame_query_reply_len - strlen($rawcommand));
+  }
+
+  function lime2node_parse_query_reply($content_str)
+  {
+    global $spi_frame_sync, $spi_frame_reply_ofs, $spi_frame_query_reply_len, $reply_len;
+
+    // sync byte, payload length, sequence number, payload (STATUS reply + CRC error and dropped frames
+    // counters), CRC-16
+    $reply = substr($content_str, $spi_frame_reply_ofs, $spi_frame_query_reply_len);
+    if (strlen($reply) != $spi_frame_query_reply_len)
+      return FALSE;
+    $payload_len = ord($reply[1]);
+    if (ord($reply[0]) != $spi_frame_sync || $payload_len != $reply_len + 2 ||
+        unpack("n", substr($reply, 3 + $payload_len, 2))[1] != lime2node_crc16(substr($reply, 1, 2 + $payload_len)))
+    {
+      lime2node_write_log("DEBUG", "Received a reply to the Q frame with a wrong CRC");
+      return FALSE;
+    }
+
+    $content_arr = array_values(unpack("C*", $reply));
+    return array(
+        "valid" => TRUE,
+        "seq" => $content_arr[2],
+        "ack" => array_slice($content_arr, 3, $reply_len),
+        "crc_errors" => $content_arr[3 + $reply_len],
+        "dropped" => $content_arr[4 + $reply_len],
+    );
+  }
+
+  function lime2node_send_spi_query()
+  {
+    global $spi_frame_max_retries;
+
+    $rawcommand = lime2node_build_query_frame();
+
+    // a corrupted reply is simply read again: the 'Q' frame has no side effects
+    for ($i = 0; $i < $spi_frame_max_retries; $i++)
+    {
+      lime2node_write_log("DEBUG", "Sending Q frame over SPI");
+      $content_str = lime2node_spi_transfer($rawcommand);
+      if ($content_str === FALSE || strlen($content_str) != strlen($rawcommand))
+        break;
+
+      $query_ret = lime2node_parse_query_reply($content_str);
+      if ($query_ret !== FALSE)
+        return $query_ret;
+    }
+
+    return array(
+        "valid"  => FALSE,
+        "ack" => array(),
+    );
+  }
+
+  // returns the commands tracked by the queue of the lime2 node, oldest first, indexed by transaction ID:
+  // "state" (one of $spi_frame_cmd_xxx, or 1 queued and 2 in flight) and "batteryRead" (carried by the ACK)
+  function lime2node_send_spi_queue()
+  {
+    global $spi_frame_sync, $spi_frame_opcode_queue, $spi_frame_reply_ofs, $spi_frame_query_reply_len, $spi_frame_max_retries;
+    global $spi_frame_queue_cmds, $spi_frame_queue_cmd_len;
+
+    $cmds_len = $spi_frame_queue_cmds * $spi_frame_queue_cmd_len;
+    $query_payload_len = $spi_frame_query_reply_len - 5;
+    $payload_len = $query_payload_len + $cmds_len;
+    $reply_len = 3 + $payload_len + 2;
+    $rawcommand = lime2node_build_crc_frame($spi_frame_opcode_queue, 0, "");
+    $rawcommand .= str_repeat(chr(0), $spi_frame_reply_ofs + $reply_len - strlen($rawcommand));
+
+    // a corrupted reply is simply read again: the 'L' frame has no side effects
+    for ($i = 0; $i < $spi_frame_max_retries; $i++)
+    {
+      lime2node_write_log("DEBUG", "Sending L frame over SPI");
+      $content_str = lime2node_spi_transfer($rawcommand);
+      if ($content_str === FALSE || strlen($content_str) != strlen($rawcommand))
+        break;
+
+      // the same as the reply to the Q frame, with the queued commands appended to the payload
+      $reply = substr($content_str, $spi_frame_reply_ofs, $reply_len);
+      if (ord($reply[0]) != $spi_frame_sync || ord($reply[1]) != $payload_len ||
+          unpack("n", substr($reply, 3 + $payload_len, 2))[1] != lime2node_crc16(substr($reply, 1, 2 + $payload_len)))
+      {
+        lime2node_write_log("DEBUG", "Received a reply to the L frame with a wrong CRC");
+        continue;
+      }
+
+      $queue = array();
+      for ($ofs = 3 + $query_payload_len; $ofs < 3 + $payload_len; $ofs += $spi_frame_queue_cmd_len)
+      {
+        $cmd = unpack("vtransactionID/Cstate/CbatteryRead", substr($reply, $ofs, $spi_frame_queue_cmd_len));
+        if ($cmd["state"] != 0)
+          $queue[$cmd["transactionID"]] = array("state" => $cmd["state"], "batteryRead" => $cmd["batteryRead"]);
+      }
+      return $queue;
+    }
+
+    return FALSE;
+  }
+
+  // returns the remote table of the lime2 node, one array per remote node it sent commands to:
+  // "remoteID", "transactionID" (of the last command ACKed), "batteryRead", "rssi" (dBm, of the last ACK),
+  // "failures" (commands not ACKed since then) and "lastAckSec" (seconds since the last ACK, FALSE if never);
+  // $broadcast is set to the "transactionID" of the last broadcast command and the "ackedIDs" of the remote
+  // nodes that ACKed it
+  function lime2node_send_spi_table(&$broadcast = NULL)
+  {
+    global $spi_frame_sync, $spi_frame_opcode_table, $spi_frame_reply_ofs, $spi_frame_max_retries;
+    global $spi_frame_table_rows, $spi_frame_table_row_len, $bin_bcast_bitmap_len;
+
+    $rows_len = $spi_frame_table_rows * $spi_frame_table_row_len;
+    $payload_len = $rows_len + 2 + $bin_bcast_bitmap_len;
+    $reply_len = 2 + $payload_len + 2;
+    $rawcommand = lime2node_build_crc_frame($spi_frame_opcode_table, 0, "");
+    $rawcommand .= str_repeat(chr(0), $spi_frame_reply_ofs + $reply_len - strlen($rawcommand));
+
+    // a corrupted reply is simply read again: the 'T' frame has no side effects
+    for ($i = 0; $i < $spi_frame_max_retries; $i++)
+    {
+      lime2node_write_log("DEBUG", "Sending T frame over SPI");
+      $content_str = lime2node_spi_transfer($rawcommand);
+      if ($content_str === FALSE || strlen($content_str) != strlen($rawcommand))
+        break;
+
+      $reply = substr($content_str, $spi_frame_reply_ofs, $reply_len);
+      if (ord($reply[0]) != $spi_frame_sync || ord($reply[1]) != $payload_len ||
+          unpack("n", substr($reply, 2 + $payload_len, 2))[1] != lime2node_crc16(substr($reply, 1, 1 + $payload_len)))
+      {
+        lime2node_write_log("DEBUG", "Received a reply to the T frame with a wrong CRC");
+        continue;
+      }
+
+      $table = array();
+      for ($ofs = 2; $ofs < 2 + $rows_len; $ofs += $spi_frame_table_row_len)
+      {
+        $row = unpack("CremoteID/vtransactionID/CbatteryRead/crssi/Cfailures/vlastAckSec", substr($reply, $ofs, $spi_frame_table_row_len));
+        if ($row["remoteID"] == 0)
+          continue;
+        if ($row["lastAckSec"] == 0xFFFF)
+          $row["lastAckSec"] = FALSE;
+        $table[] = $row;
+      }
+
+      $bitmap = unpack("C*", substr($reply, 2 + $rows_len + 2, $bin_bcast_bitmap_len));
+      $broadcast = array("transactionID" => unpack("v", substr($reply, 2 + $rows_len, 2))[1], "ackedIDs" => array());
+      for ($id = 1; $id <= 8 * $bin_bcast_bitmap_len; $id++)
+        if ($bitmap[1 + intdiv($id - 1, 8)] & (1 << (($id - 1) % 8)))
+          $broadcast["ackedIDs"][] = $id;
+      return $table;
+    }
+
+    return FALSE;
+  }
+
+  function lime2node_send_spi_crc_cmd($rawcommand)
+  {
+    global $spi_frame_opcode_command, $spi_frame_max_retries, $spi_batch_delay_usec;
+
+    // the sequence number must differ from the one of the last frame accepted by the lime2 node:
+    $query_ret = lime2node_send_spi_query();
+    if (!$query_ret["valid"])
+      return $query_ret;
+    $seq = ($query_ret["seq"] + 1) & 0xFF;
+    $frame = lime2node_build_crc_frame($spi_frame_opcode_command, $seq, $rawcommand);
+
+    for ($i = 0; $i < $spi_frame_max_retries; $i++)
+    {
+      // the C frame and a Q frame in a single ioctl: the lime2 node acknowledges the sequence number
+      // only once the command is queued, which is usually done before the Q frame comes in
+      lime2node_write_log("DEBUG", "Sending C+Q frames over SPI with sequence number " . $seq);
+      $replies = lime2node_spi_message(array($frame, lime2node_build_query_frame()), $spi_batch_delay_usec);
+      if ($replies === FALSE)
+        break;
+
+      $query_ret = lime2node_parse_query_reply($replies[1]);
+      if ($query_ret === FALSE || $query_ret["seq"] != $seq)
+        // corrupted reply, or read too early: query again before resending (a resent frame
+        // already accepted is ignored by the lime2 node anyway)
+        $query_ret = lime2node_send_spi_query();
+      if (!$query_ret["valid"] || $query_ret["seq"] == $seq)
+        return $query_ret;
+
+      lime2node_write_log("DEBUG", "The C frame was not accepted (" . $query_ret["crc_errors"] . " CRC errors and " . $query_ret["dropped"] . " dropped frames so far on the lime2 node), resending");
+    }
+
+    return array(
+        "valid"  => FALSE,
+        "ack" => array(),
+    );
+  }
+
+  function lime2node_send_spi_framed_status()
+  {
+    global $spi_frame_sync, $spi_frame_opcode_status, $spi_frame_reply_ofs, $reply_len;
+
+    lime2node_write_log("DEBUG", "Sending framed STATUS over SPI");
+    $rawcommand = chr($spi_frame_sync) . $spi_frame_opcode_status . str_repeat(chr(0), $spi_frame_reply_ofs - 2 + $reply_len);
+
+    $content_str = lime2node_spi_transfer($rawcommand);
+    if ($content_str === FALSE || strlen($content_str) != strlen($rawcommand))
+    {
+      $ret_array = array(
+          "valid"  => FALSE,
+          "ack" => array(),
+      );
+      return $ret_array;
+    }
+
+    // the bytes received while sending the header are meaningless; the reply is not trimmed
+    // since its position is fixed:
+    $content_arr = array_values(unpack("C*", $content_str));
+    $ret_array = array(
+        "valid"  => TRUE,
+        "ack" => array_slice($content_arr, $spi_frame_reply_ofs, $reply_len),
+    );
+    return $ret_array;
+  }
+
+  function lime2node_send_spi_status()
+  {
+    global $use_framed_status, $use_crc_frames, $status_cmd, $tid_for_status_cmd, $cmdparam_for_status_cmd;
+
+    if ($use_crc_frames)
+      return lime2node_send_spi_query();
+    if ($use_framed_status)
+      return lime2node_send_spi_framed_status();
+    return lime2node_send_spi_cmd($status_cmd, $tid_for_status_cmd, $cmdparam_for_status_cmd);
+  }
+
   function lime2node_parse_ack($cmdreply)
   {
     global $validack;
@@ -323,41 +904,71 @@
 
   function lime2node_wait_for_ack($transactionID)
   {
-    global $status_cmd, $tid_for_status_cmd, $max_wait_time_sec, $cmdparam_for_status_cmd;
+    global $status_cmd, $tid_for_status_cmd, $max_wait_time_sec, $cmdparam_for_status_cmd, $busyreply, $use_framed_status, $use_crc_frames;
+    global $spi_gateway_socket, $min_poll_interval_usec, $max_poll_interval_usec;
+    global $spi_frame_cmd_acked, $spi_frame_cmd_failed;
 
     $invalid_ack_ret = array(
         "valid" => FALSE,
     );
 
-    // ignore the result of the first STATUS command: it's crap related to the command before the last sent command!!
-    $send_ret = lime2node_send_spi_cmd($status_cmd, $tid_for_status_cmd, $cmdparam_for_status_cmd);
-    if (!$send_ret["valid"])
-      // failed SPI transaction... something is really going bad
-      return $invalid_ack_ret;
+    // the SPI gateway can wait for the ACK on our behalf: it polls the lime2 node much more often
+    // than we could and replies as soon as the ACK arrives
+    if (($use_framed_status || $use_crc_frames) && file_exists($spi_gateway_socket))
+    {
+      $send_ret = lime2node_spi_gateway_wait_for_ack($transactionID, $max_wait_time_sec);
+      if ($send_ret !== FALSE)
+      {
+        $valid_ack_ret = lime2node_parse_ack($send_ret["ack"]);
+        // the ACK carries only the low byte of the TID, the gateway checked the whole TID
+        if ($send_ret["valid"] && $valid_ack_ret["valid"] && $valid_ack_ret["transactionID"]==($transactionID & 0xFF))
+        {
+          lime2node_write_log("DEBUG", "Received valid ACK; last ACK'ed transaction ID=" . $valid_ack_ret["transactionID"] 
+                                        . ". " . lime2node_get_battery_info($valid_ack_ret["batteryRead"]));
+          return $valid_ack_ret;
+        }
+        lime2node_write_log("DEBUG", "The SPI gateway did not return a valid ACK. Aborting.");
+        return $invalid_ack_ret;
+      }
+      //else: the gateway is not working; try polling by ourselves
+    }
+
+    if (!$use_framed_status && !$use_crc_frames)
+    {
+      // ignore the result of the first STATUS command: it's crap related to the command before the last sent command!!
+      $send_ret = lime2node_send_spi_cmd($status_cmd, $tid_for_status_cmd, $cmdparam_for_status_cmd);
+      if (!$send_ret["valid"])
+        // failed SPI transaction... something is really going bad
+        return $invalid_ack_ret;
+    }
 
     //$ack = $send_ret["ack"];
-    $waited_time_sec = 0;
+    $start_time = microtime(TRUE);
+    $poll_interval_usec = $min_poll_interval_usec;
     $valid_ack_ret = array(
         "transactionID" => 0,
     );
     while (TRUE) //count($ack)==0)    // NULL replies immediately after a command mean that the radio is still 
     {                                 // estabilishing connection with the "remote" node
-      sleep(2);
+      // poll often while the ACK is likely to come soon, then back off:
+      usleep($poll_interval_usec);
+      $poll_interval_usec = min(2 * $poll_interval_usec, $max_poll_interval_usec);
 
-      $send_ret = lime2node_send_spi_cmd($status_cmd, $tid_for_status_cmd, $cmdparam_for_status_cmd);
+      $send_ret = lime2node_send_spi_status();
       if (!$send_ret["valid"])
         // failed SPI transaction... something is really going bad
         return $invalid_ack_ret;
 
+      $waited_time_sec = microtime(TRUE) - $start_time;
       if ($waited_time_sec > $max_wait_time_sec)
       {
-        lime2node_write_log("DEBUG", "After " . $waited_time_sec . "secs still no valid ACK received. Aborting.");
+        lime2node_write_log("DEBUG", "After " . round($waited_time_sec) . "secs still no valid ACK received. Aborting.");
         break;
       }
-      $waited_time_sec = $waited_time_sec + 3;
 
       $ack = $send_ret["ack"];
       $valid_ack_ret = lime2node_parse_ack($ack);
+      // the status carries only the low byte of the TID: the ACK of a 16-bit TID is confirmed with the queue below
       if ($valid_ack_ret["valid"]==1)
       {
         if ($valid_ack_ret["transactionID"]==$transactionID)
@@ -368,10 +979,39 @@
         }
         else
         {
-          lime2node_write_log("DEBUG", "Received ACK for a previous transaction ID " . $valid_ack_ret["transactionID"] 
+          lime2node_write_log("DEBUG", "Received ACK for another transaction ID " . $valid_ack_ret["transactionID"] 
                                         . " while waiting for ACK of ID " . $transactionID);
         }
       }
+      else if (count($ack)==6 && array_slice($ack, 0, 4) == array_values(unpack("C*", $busyreply)))
+      {
+        // BUSY + transaction ID in flight + number of radio transmissions done so far
+        lime2node_write_log("DEBUG", "The lime2 node is still sending transaction ID " . $ack[4] . " over radio (" . $ack[5] . " attempts so far)");
+        if ($ack[4] == ($transactionID & 0xFF))
+          continue;
+      }
+
+      // the status is about another command: with several commands queued, ours may have been
+      // ACKed (or given up) while we were not looking
+      if ($use_crc_frames)
+      {
+        $queue = lime2node_send_spi_queue();
+        if ($queue !== FALSE && isset($queue[$transactionID]))
+        {
+          $cmd = $queue[$transactionID];
+          if ($cmd["state"] == $spi_frame_cmd_acked)
+          {
+            lime2node_write_log("DEBUG", "Received valid ACK; transaction ID=" . $transactionID
+                                          . " was ACK'ed before the last one. " . lime2node_get_battery_info($cmd["batteryRead"]));
+            return array("valid" => TRUE, "transactionID" => $transactionID, "batteryRead" => $cmd["batteryRead"]);
+          }
+          if ($cmd["state"] == $spi_frame_cmd_failed)
+          {
+            lime2node_write_log("DEBUG", "The lime2 node gave up sending transaction ID " . $transactionID . ". Aborting.");
+            return $invalid_ack_ret;
+          }
+        }
+      }
     }
 
     lime2node_write_log("DEBUG", "Invalid ACK received (waiting for the ACK of transaction ID=" . $transactionID .
@@ -381,14 +1021,20 @@
 
   function lime2node_get_last_transaction_id_and_advance()
   {
-    global $transaction_filename, $first_valid_tid, $last_valid_tid;
+    global $transaction_filename, $first_valid_tid, $last_valid_tid, $use_crc_frames, $use_binary_commands;
+    global $binary_transaction_filename, $first_valid_binary_tid, $last_valid_binary_tid;
+
+    // the binary commands are sent by lime2node_send_spi_cmd() under the same conditions
+    $binary = $use_crc_frames && $use_binary_commands;
+    $first_tid = $binary ? $first_valid_binary_tid : $first_valid_tid;
+    $last_tid = $binary ? $last_valid_binary_tid : $last_valid_tid;
 
     $homedir = getenv("HOME");
     if (count($homedir)==0 || !file_exists($homedir))
       $homedir = "/tmp";
 
     // load last TID from file:
-    $transaction_file = $homedir . "/" . $transaction_filename;
+    $transaction_file = $homedir . "/" . ($binary ? $binary_transaction_filename : $transaction_filename);
     if (file_exists($transaction_file))
       $str = file_get_contents($transaction_file);
     else
@@ -396,11 +1042,11 @@
 
     $ret_tid = intval($str)+1;
 
-    // since the TID is sent over commandline it should stay inside the ASCII range:
-    if ($ret_tid < $first_valid_tid)
-      $ret_tid=$first_valid_tid;    // reset transaction ID so that it always stays inside an uint8_t
-    if ($ret_tid > $last_valid_tid)
-      $ret_tid=$first_valid_tid;    // reset transaction ID so that it always stays inside an uint8_t
+    // the ASCII TID is sent over commandline so it should stay inside the ASCII range, the binary one in 16 bits:
+    if ($ret_tid < $first_tid)
+      $ret_tid=$first_tid;    // reset transaction ID so that it always stays inside its range
+    if ($ret_tid > $last_tid)
+      $ret_tid=$first_tid;    // reset transaction ID so that it always stays inside its range
 
     // advance TID
     file_put_contents($transaction_file, $ret_tid);
@@ -0,0 +1,982 @@
+/*
+ * lime2node_spi_gateway.c
+ * Long-running daemon that owns the SPI bus toward the "lime2" node and serves
+ * SPI transfers to local clients over a Unix socket.
+ * Part of the https://github.com/f18m/microirrigation-control github project
+ *
+ * The SPI device is opened and configured once at startup; after that every
+ * client request results in exactly one SPI_IOC_MESSAGE ioctl, without any
+ * process spawn, sudo invocation or temporary file.
+ *
+ * See README.txt in this folder for the protocol spoken over the Unix socket.
+ *
+ * When the "event pending" line of the lime2 node is wired to a GPIO of the
+ * Lime2 (--event-gpio), clients waiting for an ACK are served on the rising
+ * edges of that line, read through the GPIO character device, instead of
+ * polling the lime2 node periodically.
+ *
+ * The status is read with the CRC-protected 'Q' frame: corrupted replies are
+ * discarded, and after a few of them in a row the SPI clock is halved (never
+ * below --speed). With --autotune the daemon starts at --speed and doubles the
+ * SPI clock as long as no CRC error shows up, on either side of the bus.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* wire protocol: see README.txt */
+#define GW_HDR_LEN		3
+#define GW_MAX_PAYLOAD		512
+
+#define GW_OP_TRANSFER		'T'
+#define GW_OP_WAIT_ACK		'W'
+#define GW_OP_MESSAGE		'M'
+
+#define GW_MSG_SEG_HDR_LEN	3	/* 'M' segment: length, delay_usecs (16bit little endian) */
+#define GW_MSG_MAX_SEGMENTS	32
+
+#define GW_STATUS_OK		0
+#define GW_STATUS_BAD_REQUEST	1
+#define GW_STATUS_SPI_ERROR	2
+#define GW_STATUS_TIMEOUT	3
+#define GW_STATUS_FAILED	4
+
+#define GW_MAX_CLIENTS		8
+
+/*
+ * framed STATUS of the lime2 firmware (see SPI_FRAME_xxx in main.h): sync byte,
+ * opcode, turnaround byte, then the ACK_/BUSY reply in the same transfer
+ */
+#define LIME2_FRAME_SYNC		0xA5
+#define LIME2_FRAME_OPCODE_STATUS	'S'
+#define LIME2_FRAME_REPLY_OFS		3
+#define LIME2_REPLY_LEN			6
+
+/*
+ * CRC-protected 'Q' frame (see SPI_FRAME_OPCODE_QUERY in main.h): sync byte,
+ * opcode, payload length (0), sequence number, CRC-16; the reply starts at
+ * LIME2_FRAME_REPLY_OFS as well: sync byte, payload length, sequence number of
+ * the last 'C' frame accepted, 6 bytes status, CRC error counter, dropped
+ * frames counter, CRC-16
+ */
+#define LIME2_FRAME_OPCODE_QUERY	'Q'
+#define LIME2_QUERY_LEN			6
+#define LIME2_QUERY_PAYLOAD_LEN		(LIME2_REPLY_LEN + 2)
+#define LIME2_QUERY_REPLY_LEN		(3 + LIME2_QUERY_PAYLOAD_LEN + 2)
+
+/*
+ * 'L' frame (see SPI_FRAME_OPCODE_QUEUE in main.h): the same as 'Q', its reply
+ * carries also one entry per command in the queue of the lime2 node, oldest
+ * first: transaction ID (16bit little endian), state, battery of its ACK
+ */
+#define LIME2_FRAME_OPCODE_QUEUE	'L'
+#define LIME2_QUEUE_NUM_CMDS		8
+#define LIME2_QUEUE_CMD_LEN		4
+#define LIME2_QUEUE_PAYLOAD_LEN		(LIME2_QUERY_PAYLOAD_LEN + LIME2_QUEUE_NUM_CMDS * LIME2_QUEUE_CMD_LEN)
+#define LIME2_QUEUE_REPLY_LEN		(3 + LIME2_QUEUE_PAYLOAD_LEN + 2)
+#define LIME2_CMD_ACKED			3
+#define LIME2_CMD_FAILED		4
+
+/* consecutive corrupted replies before halving the SPI clock */
+#define GW_CRC_BACKOFF_ERRORS	3
+/* 'Q' transfers at each step of --autotune */
+#define GW_AUTOTUNE_PROBES	32
+
+/*
+ * STATUS polling while waiting for an ACK: no ACK can come before a radio round
+ * trip (tens of msecs at 2.4 kBaud), then the interval doubles up to
+ * the lime2 retry period (DELAY_AFTER_EACH_TX_MSEC)
+ */
+#define GW_POLL_MIN_MSEC	50
+#define GW_POLL_MAX_MSEC	250
+
+#define GW_NO_POLL		UINT64_MAX	/* with --event-gpio: wait for the next edge */
+
+struct wait_ack {
+	int active;
+	uint16_t tid;
+	uint64_t deadline_ms;
+	uint64_t next_poll_ms;
+	unsigned interval_ms;
+};
+
+struct client {
+	int fd;
+	size_t rx_len;
+	uint8_t rx[GW_HDR_LEN + GW_MAX_PAYLOAD];
+	struct wait_ack wait;
+};
+
+static const char *device = "/dev/spidev2.0";
+static const char *socket_path = "/run/lime2node_spi_gateway.sock";
+static const char *socket_group;
+static mode_t socket_mode = 0660;
+static uint32_t mode;
+static uint8_t bits = 8;
+static uint32_t speed = 5000;
+static uint32_t min_speed;		/* --speed: the backoff never goes below it */
+static uint32_t autotune_max_speed;	/* 0 without --autotune */
+static uint16_t delay;
+static int verbose;
+static const char *event_gpio;		/* "CHIP:LINE", NULL to poll periodically */
+
+static int spi_fd = -1;
+static uint8_t query_seq;
+static unsigned crc_errors_in_a_row;
+static int gpio_fd = -1;
+static struct client clients[GW_MAX_CLIENTS];
+static volatile sig_atomic_t stop_requested;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void pabort(const char *s)
+{
+	perror(s);
+	abort();
+}
+
+/* CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF), as the lime2 firmware */
+static uint16_t crc16(const uint8_t *buf, size_t len)
+{
+	uint16_t crc = 0xFFFF;
+	int i;
+
+	while (len--) {
+		crc ^= (uint16_t)*buf++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static void hex_dump(const void *src, size_t length, const char *prefix)
+{
+	const uint8_t *p = src;
+
+	printf("%s |", prefix);
+	while (length-- > 0)
+		printf(" %02X", *p++);
+	printf("\n");
+}
+
+/*
+ * SPI device handling
+ */
+
+static void spi_open(void)
+{
+	int ret;
+
+	spi_fd = open(device, O_RDWR);
+	if (spi_fd < 0)
+		pabort("can't open device");
+
+	ret = ioctl(spi_fd, SPI_IOC_WR_MODE32, &mode);
+	if (ret == -1)
+		pabort("can't set spi mode");
+
+	ret = ioctl(spi_fd, SPI_IOC_RD_MODE32, &mode);
+	if (ret == -1)
+		pabort("can't get spi mode");
+
+	ret = ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
+	if (ret == -1)
+		pabort("can't set bits per word");
+
+	ret = ioctl(spi_fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
+	if (ret == -1)
+		pabort("can't get bits per word");
+
+	ret = ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+	if (ret == -1)
+		pabort("can't set max speed hz");
+
+	ret = ioctl(spi_fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed);
+	if (ret == -1)
+		pabort("can't get max speed hz");
+
+	printf("%s: spi mode 0x%x, %d bits per word, %d Hz\n",
+	       device, mode, bits, speed);
+}
+
+static int spi_transfer(const uint8_t *tx, uint8_t *rx, size_t len)
+{
+	struct spi_ioc_transfer tr = {
+		.tx_buf = (unsigned long)tx,
+		.rx_buf = (unsigned long)rx,
+		.len = len,
+		.delay_usecs = delay,
+		.speed_hz = speed,
+		.bits_per_word = bits,
+	};
+
+	if (ioctl(spi_fd, SPI_IOC_MESSAGE(1), &tr) < 1) {
+		perror("can't send spi message");
+		return -1;
+	}
+
+	if (verbose) {
+		hex_dump(tx, len, "TX");
+		hex_dump(rx, len, "RX");
+	}
+	return 0;
+}
+
+static void spi_set_speed(uint32_t hz)
+{
+	if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz) == -1) {
+		perror("can't set max speed hz");
+		return;
+	}
+	speed = hz;
+}
+
+/*
+ * Reads the status of the lime2 node with a 'Q' frame: returns 0 and fills
+ * status (LIME2_REPLY_LEN bytes) and *slave_crc_errors on success, 1 if the
+ * reply is corrupted, -1 if the transfer failed.
+ */
+static int query_status(uint8_t *status, uint8_t *slave_crc_errors)
+{
+	uint8_t tx[LIME2_FRAME_REPLY_OFS + LIME2_QUERY_REPLY_LEN] = {
+		LIME2_FRAME_SYNC, LIME2_FRAME_OPCODE_QUERY, 0, query_seq++
+	};
+	uint8_t rx[sizeof(tx)];
+	const uint8_t *reply = rx + LIME2_FRAME_REPLY_OFS;
+	uint16_t crc = crc16(tx + 1, 3);
+
+	tx[4] = crc >> 8;
+	tx[5] = crc & 0xFF;
+	if (spi_transfer(tx, rx, sizeof(tx)) < 0)
+		return -1;
+
+	crc = crc16(reply + 1, 2 + LIME2_QUERY_PAYLOAD_LEN);
+	if (reply[0] != LIME2_FRAME_SYNC || reply[1] != LIME2_QUERY_PAYLOAD_LEN ||
+	    reply[3 + LIME2_QUERY_PAYLOAD_LEN] != (crc >> 8) ||
+	    reply[4 + LIME2_QUERY_PAYLOAD_LEN] != (crc & 0xFF)) {
+		if (verbose)
+			printf("corrupted reply to 'Q' at %u Hz\n", speed);
+		return 1;
+	}
+
+	memcpy(status, reply + 3, LIME2_REPLY_LEN);
+	*slave_crc_errors = reply[3 + LIME2_REPLY_LEN];
+	return 0;
+}
+
+/*
+ * Reads the queue of the lime2 node with an 'L' frame: returns 0 and fills
+ * cmds (LIME2_QUEUE_NUM_CMDS entries) on success, 1 if the reply is corrupted,
+ * -1 if the transfer failed.
+ */
+static int query_queue(uint8_t *cmds)
+{
+	uint8_t tx[LIME2_FRAME_REPLY_OFS + LIME2_QUEUE_REPLY_LEN] = {
+		LIME2_FRAME_SYNC, LIME2_FRAME_OPCODE_QUEUE, 0, query_seq++
+	};
+	uint8_t rx[sizeof(tx)];
+	const uint8_t *reply = rx + LIME2_FRAME_REPLY_OFS;
+	uint16_t crc = crc16(tx + 1, 3);
+
+	tx[4] = crc >> 8;
+	tx[5] = crc & 0xFF;
+	if (spi_transfer(tx, rx, sizeof(tx)) < 0)
+		return -1;
+
+	crc = crc16(reply + 1, 2 + LIME2_QUEUE_PAYLOAD_LEN);
+	if (reply[0] != LIME2_FRAME_SYNC || reply[1] != LIME2_QUEUE_PAYLOAD_LEN ||
+	    reply[3 + LIME2_QUEUE_PAYLOAD_LEN] != (crc >> 8) ||
+	    reply[4 + LIME2_QUEUE_PAYLOAD_LEN] != (crc & 0xFF)) {
+		if (verbose)
+			printf("corrupted reply to 'L' at %u Hz\n", speed);
+		return 1;
+	}
+
+	memcpy(cmds, reply + 3 + LIME2_QUERY_PAYLOAD_LEN,
+	       LIME2_QUEUE_NUM_CMDS * LIME2_QUEUE_CMD_LEN);
+	return 0;
+}
+
+/* the entry of the command with the given TID in the reply to 'L', NULL if none */
+static const uint8_t *find_queued_cmd(const uint8_t *cmds, uint16_t tid)
+{
+	int i;
+
+	for (i = 0; i < LIME2_QUEUE_NUM_CMDS; i++) {
+		const uint8_t *cmd = cmds + i * LIME2_QUEUE_CMD_LEN;
+
+		if (cmd[2] && cmd[0] == (tid & 0xFF) && cmd[1] == (tid >> 8))
+			return cmd;
+	}
+	return NULL;
+}
+
+/* the status is the ACK_ of the command with the given TID: it carries only the low byte of
+ * the TID, so the ACK_ of a 16-bit TID is told apart only by the reply to 'L' */
+static int status_is_ack_of(const uint8_t *status, uint16_t tid)
+{
+	return tid <= 0xFF && status[4] == tid && memcmp(status, "ACK_", 4) == 0;
+}
+
+/* the ACK_/BUSY status may be about the command with the given TID */
+static int status_is_about(const uint8_t *status, uint16_t tid)
+{
+	return status[4] == (tid & 0xFF) &&
+	       (status_is_ack_of(status, tid) || memcmp(status, "BUSY", 4) == 0);
+}
+
+/* bit errors on the bus: after a few in a row, halve the SPI clock */
+static void crc_error_backoff(void)
+{
+	uint32_t hz;
+
+	if (++crc_errors_in_a_row < GW_CRC_BACKOFF_ERRORS)
+		return;
+	crc_errors_in_a_row = 0;
+
+	hz = speed / 2 > min_speed ? speed / 2 : min_speed;
+	if (hz != speed) {
+		printf("%u CRC errors in a row: lowering the SPI clock to %u Hz\n",
+		       GW_CRC_BACKOFF_ERRORS, hz);
+		spi_set_speed(hz);
+	}
+}
+
+/*
+ * Doubles the SPI clock from --speed up to max_hz as long as GW_AUTOTUNE_PROBES
+ * 'Q' frames in a row get a valid reply and the lime2 node does not count any
+ * CRC error, then keeps the last speed that passed.
+ */
+static void spi_autotune(uint32_t max_hz)
+{
+	uint8_t status[LIME2_REPLY_LEN];
+	uint8_t errors, first_errors = 0;
+	uint32_t good = 0, hz = speed;
+	int i, ret;
+
+	while (1) {
+		spi_set_speed(hz);
+		for (i = 0; i < GW_AUTOTUNE_PROBES; i++) {
+			ret = query_status(status, &errors);
+			if (ret != 0)
+				break;
+			if (i == 0)
+				first_errors = errors;
+			else if (errors != first_errors)
+				break;	/* the lime2 node got a corrupted 'Q' frame */
+		}
+		printf("autotune: %u Hz %s\n", hz, i == GW_AUTOTUNE_PROBES ? "ok" : "failed");
+		if (i < GW_AUTOTUNE_PROBES)
+			break;
+
+		good = hz;
+		if (hz >= max_hz)
+			break;
+		hz = hz * 2 < max_hz ? hz * 2 : max_hz;
+	}
+
+	if (!good) {
+		fprintf(stderr, "autotune: no valid reply from the lime2 node at %u Hz\n", speed);
+		good = min_speed;
+	}
+	spi_set_speed(good);
+	printf("autotune: using %u Hz\n", speed);
+}
+
+/*
+ * Sends several frames in a single SPI_IOC_MESSAGE ioctl: the chip select is
+ * toggled after each one, after its delay_usecs, so that the lime2 node sees
+ * distinct frames. rx gets the bytes received during all of them, in order.
+ */
+static int spi_message(const uint8_t *const *tx, const size_t *len,
+		       const uint16_t *delay_usecs, unsigned n, uint8_t *rx)
+{
+	struct spi_ioc_transfer tr[GW_MSG_MAX_SEGMENTS];
+	size_t ofs = 0;
+	unsigned i;
+
+	memset(tr, 0, sizeof(tr));
+	for (i = 0; i < n; i++) {
+		tr[i].tx_buf = (unsigned long)tx[i];
+		tr[i].rx_buf = (unsigned long)(rx + ofs);
+		tr[i].len = len[i];
+		tr[i].delay_usecs = delay_usecs[i];
+		tr[i].speed_hz = speed;
+		tr[i].bits_per_word = bits;
+		/* the chip select is always deasserted at the end of the message */
+		tr[i].cs_change = i + 1 < n;
+		ofs += len[i];
+	}
+
+	if (ioctl(spi_fd, SPI_IOC_MESSAGE(n), tr) < 1) {
+		perror("can't send spi message");
+		return -1;
+	}
+
+	if (verbose) {
+		for (i = 0; i < n; i++) {
+			hex_dump(tx[i], len[i], "TX");
+			hex_dump((const uint8_t *)(unsigned long)tr[i].rx_buf, len[i], "RX");
+		}
+	}
+	return 0;
+}
+
+/*
+ * Event pending line handling
+ */
+
+static void gpio_open(void)
+{
+	struct gpio_v2_line_request req;
+	char chip[64];
+	const char *sep = strrchr(event_gpio, ':');
+	int fd;
+
+	if (!sep || sep == event_gpio || (size_t)(sep - event_gpio) >= sizeof(chip)) {
+		fprintf(stderr, "invalid event GPIO (expected CHIP:LINE): %s\n", event_gpio);
+		exit(1);
+	}
+	memcpy(chip, event_gpio, sep - event_gpio);
+	chip[sep - event_gpio] = '\0';
+
+	fd = open(chip, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		pabort("can't open gpio chip");
+
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = atoi(sep + 1);
+	req.num_lines = 1;
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING;
+	strncpy(req.consumer, "lime2node_spi_gateway", sizeof(req.consumer) - 1);
+	if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+		pabort("can't request gpio line");
+	close(fd);
+
+	gpio_fd = req.fd;
+	printf("%s: waiting for ACKs on the rising edges of line %u\n",
+	       chip, req.offsets[0]);
+}
+
+/* drains the edge events; returns the number of events read */
+static int gpio_read_events(void)
+{
+	struct gpio_v2_line_event ev[16];
+	ssize_t n;
+
+	n = read(gpio_fd, ev, sizeof(ev));
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		pabort("can't read gpio events");
+	}
+	if (verbose && n > 0)
+		printf("event pending line: %zd edges\n", n / (ssize_t)sizeof(ev[0]));
+	return n / sizeof(ev[0]);
+}
+
+/*
+ * Unix socket handling
+ */
+
+static int socket_open(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", socket_path);
+		exit(1);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		pabort("can't create socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	/* a stale socket left by a previous instance would make bind() fail */
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		pabort("can't bind socket");
+
+	if (socket_group) {
+		struct group *gr = getgrnam(socket_group);
+
+		if (!gr) {
+			fprintf(stderr, "unknown group: %s\n", socket_group);
+			exit(1);
+		}
+		if (chown(socket_path, -1, gr->gr_gid) < 0)
+			pabort("can't change socket group");
+	}
+	if (chmod(socket_path, socket_mode) < 0)
+		pabort("can't change socket permissions");
+
+	if (listen(fd, GW_MAX_CLIENTS) < 0)
+		pabort("can't listen on socket");
+
+	printf("listening on %s\n", socket_path);
+	return fd;
+}
+
+static void client_accept(int listen_fd)
+{
+	int fd;
+	int i;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < GW_MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = fd;
+			clients[i].rx_len = 0;
+			if (verbose)
+				printf("client %d connected\n", i);
+			return;
+		}
+	}
+
+	fprintf(stderr, "too many clients, dropping new connection\n");
+	close(fd);
+}
+
+static void client_close(struct client *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->rx_len = 0;
+	c->wait.active = 0;
+}
+
+static int client_reply(struct client *c, uint8_t status,
+			const uint8_t *payload, size_t len)
+{
+	uint8_t hdr[GW_HDR_LEN] = { status, len & 0xFF, len >> 8 };
+
+	if (write(c->fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+	if (len && write(c->fd, payload, len) != (ssize_t)len)
+		return -1;
+	return 0;
+}
+
+static int client_process(struct client *c, uint8_t op,
+			  const uint8_t *payload, size_t len)
+{
+	uint8_t rx[GW_MAX_PAYLOAD];
+
+	switch (op) {
+	case GW_OP_TRANSFER:
+		if (len == 0)
+			return client_reply(c, GW_STATUS_BAD_REQUEST, NULL, 0);
+		if (spi_transfer(payload, rx, len) < 0)
+			return client_reply(c, GW_STATUS_SPI_ERROR, NULL, 0);
+		return client_reply(c, GW_STATUS_OK, rx, len);
+
+	case GW_OP_MESSAGE: {
+		/* a sequence of segments: length (1 byte), delay_usecs (16bit little endian), data */
+		const uint8_t *tx[GW_MSG_MAX_SEGMENTS];
+		size_t seg_len[GW_MSG_MAX_SEGMENTS];
+		uint16_t seg_delay[GW_MSG_MAX_SEGMENTS];
+		size_t ofs = 0, total = 0;
+		unsigned n = 0;
+
+		while (ofs < len) {
+			if (n == GW_MSG_MAX_SEGMENTS || ofs + GW_MSG_SEG_HDR_LEN > len ||
+			    payload[ofs] == 0 ||
+			    ofs + GW_MSG_SEG_HDR_LEN + payload[ofs] > len)
+				return client_reply(c, GW_STATUS_BAD_REQUEST, NULL, 0);
+			seg_len[n] = payload[ofs];
+			seg_delay[n] = payload[ofs + 1] | (payload[ofs + 2] << 8);
+			tx[n] = payload + ofs + GW_MSG_SEG_HDR_LEN;
+			total += seg_len[n];
+			ofs += GW_MSG_SEG_HDR_LEN + seg_len[n];
+			n++;
+		}
+		if (n == 0)
+			return client_reply(c, GW_STATUS_BAD_REQUEST, NULL, 0);
+		if (spi_message(tx, seg_len, seg_delay, n, rx) < 0)
+			return client_reply(c, GW_STATUS_SPI_ERROR, NULL, 0);
+		return client_reply(c, GW_STATUS_OK, rx, total);
+	}
+
+	case GW_OP_WAIT_ACK:
+		/* TID (8 or 16bit little endian) + timeout in msecs (16bit little endian): the reply
+		 * is sent by poll_status() */
+		if (len != 3 && len != 4)
+			return client_reply(c, GW_STATUS_BAD_REQUEST, NULL, 0);
+		c->wait.active = 1;
+		c->wait.tid = len == 4 ? payload[0] | (payload[1] << 8) : payload[0];
+		c->wait.deadline_ms = now_ms() + (payload[len - 2] | (payload[len - 1] << 8));
+		c->wait.interval_ms = GW_POLL_MIN_MSEC;
+		/* even with --event-gpio, poll once: the edge may have come before the request */
+		c->wait.next_poll_ms = now_ms() + c->wait.interval_ms;
+		return 0;
+
+	default:
+		return client_reply(c, GW_STATUS_BAD_REQUEST, NULL, 0);
+	}
+}
+
+static void client_process_buffered(struct client *c)
+{
+	size_t len;
+
+	/* process all complete requests received so far; a client waiting for an
+	 * ACK gets no other request served until the wait is over */
+	while (c->rx_len >= GW_HDR_LEN && !c->wait.active) {
+		len = c->rx[1] | (c->rx[2] << 8);
+		if (len > GW_MAX_PAYLOAD) {
+			client_reply(c, GW_STATUS_BAD_REQUEST, NULL, 0);
+			client_close(c);
+			return;
+		}
+		if (c->rx_len < GW_HDR_LEN + len)
+			return;		/* wait for the rest of the payload */
+
+		if (client_process(c, c->rx[0], c->rx + GW_HDR_LEN, len) < 0) {
+			client_close(c);
+			return;
+		}
+
+		c->rx_len -= GW_HDR_LEN + len;
+		memmove(c->rx, c->rx + GW_HDR_LEN + len, c->rx_len);
+	}
+}
+
+static void client_read(struct client *c)
+{
+	ssize_t n;
+
+	n = read(c->fd, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len);
+	if (n <= 0) {
+		client_close(c);
+		return;
+	}
+	c->rx_len += n;
+	client_process_buffered(c);
+}
+
+/*
+ * Polls the lime2 node with a 'Q' frame on behalf of all the clients waiting
+ * for an ACK, and returns the msecs until the next poll (-1 if none).
+ * When the reply is about another command than the one a client waits for,
+ * an 'L' frame tells whether the lime2 node has ACKed or given up on it.
+ * A last poll is done at the deadline, so that a timeout carries the last reply.
+ * A corrupted reply is as good as no poll: the clients keep waiting.
+ */
+static int poll_status(void)
+{
+	uint8_t reply[LIME2_REPLY_LEN];
+	uint8_t cmds[LIME2_QUEUE_NUM_CMDS * LIME2_QUEUE_CMD_LEN];
+	uint8_t slave_crc_errors;
+	uint64_t now = now_ms();
+	int due = 0, spi_ok = 0, ret = 0, queue_ret = 1;
+	int timeout = -1;
+	int i;
+
+	for (i = 0; i < GW_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].wait.active &&
+		    (now >= clients[i].wait.next_poll_ms || now >= clients[i].wait.deadline_ms))
+			due = 1;
+	}
+	if (due) {
+		ret = query_status(reply, &slave_crc_errors);
+		spi_ok = ret >= 0;
+		if (ret > 0)
+			crc_error_backoff();
+		else if (ret == 0)
+			crc_errors_in_a_row = 0;
+	}
+	for (i = 0; due && ret == 0 && i < GW_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].wait.active &&
+		    !status_is_about(reply, clients[i].wait.tid)) {
+			queue_ret = query_queue(cmds);
+			spi_ok = queue_ret >= 0;
+			if (queue_ret > 0)
+				crc_error_backoff();
+			break;
+		}
+	}
+
+	for (i = 0; i < GW_MAX_CLIENTS; i++) {
+		struct client *c = &clients[i];
+		const uint8_t *cmd = queue_ret == 0 ? find_queued_cmd(cmds, c->wait.tid) : NULL;
+		int done = 0;
+
+		if (c->fd < 0 || !c->wait.active)
+			continue;
+
+		if (due && !spi_ok) {
+			c->wait.active = 0;
+			done = client_reply(c, GW_STATUS_SPI_ERROR, NULL, 0);
+		} else if (due && ret == 0 && status_is_ack_of(reply, c->wait.tid)) {
+			c->wait.active = 0;
+			done = client_reply(c, GW_STATUS_OK, reply, LIME2_REPLY_LEN);
+		} else if (cmd && cmd[2] == LIME2_CMD_ACKED) {
+			/* an older ACK: the same reply it had, with the battery it carried */
+			uint8_t ack[LIME2_REPLY_LEN] = { 'A', 'C', 'K', '_', cmd[0], cmd[3] };
+
+			c->wait.active = 0;
+			done = client_reply(c, GW_STATUS_OK, ack, LIME2_REPLY_LEN);
+		} else if (cmd && cmd[2] == LIME2_CMD_FAILED) {
+			c->wait.active = 0;
+			done = client_reply(c, GW_STATUS_FAILED, reply, LIME2_REPLY_LEN);
+		} else if (now >= c->wait.deadline_ms) {
+			/* return the last reply, it may tell how far the lime2 node got */
+			c->wait.active = 0;
+			done = client_reply(c, GW_STATUS_TIMEOUT, ret == 0 ? reply : NULL,
+					    ret == 0 ? LIME2_REPLY_LEN : 0);
+		} else if (due && (ret > 0 || queue_ret > 0)) {
+			/* corrupted reply: retry soon, the event may be lost otherwise */
+			c->wait.next_poll_ms = now + GW_POLL_MIN_MSEC;
+		} else if (now >= c->wait.next_poll_ms && gpio_fd >= 0) {
+			c->wait.next_poll_ms = GW_NO_POLL;
+		} else if (now >= c->wait.next_poll_ms) {
+			c->wait.interval_ms *= 2;
+			if (c->wait.interval_ms > GW_POLL_MAX_MSEC)
+				c->wait.interval_ms = GW_POLL_MAX_MSEC;
+			c->wait.next_poll_ms = now + c->wait.interval_ms;
+		}
+
+		if (done < 0) {
+			client_close(c);
+			continue;
+		}
+		if (c->wait.active) {
+			uint64_t next = c->wait.next_poll_ms < c->wait.deadline_ms ?
+					c->wait.next_poll_ms : c->wait.deadline_ms;
+			int ms = next > now ? (int)(next - now) : 0;
+
+			if (timeout < 0 || ms < timeout)
+				timeout = ms;
+		} else if (c->rx_len) {
+			/* serve the requests queued while waiting */
+			timeout = 0;
+		}
+	}
+	return timeout;
+}
+
+/* a rising edge of the event pending line: poll now on behalf of all waiting clients */
+static void wake_waiting_clients(void)
+{
+	uint64_t now = now_ms();
+	int i;
+
+	for (i = 0; i < GW_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].wait.active)
+			clients[i].wait.next_poll_ms = now;
+	}
+}
+
+static void handle_signal(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-DsadHOLCSgmev]\n", prog);
+	puts("  -D --device   device to use (default /dev/spidev2.0)\n"
+	     "  -s --speed    max speed (Hz, default 5000)\n"
+	     "  -a --autotune MAX_HZ  double the speed from --speed up to MAX_HZ as\n"
+	     "                long as the lime2 node replies without CRC errors\n"
+	     "  -d --delay    delay (usec)\n"
+	     "  -H --cpha     clock phase\n"
+	     "  -O --cpol     clock polarity\n"
+	     "  -L --lsb      least significant bit first\n"
+	     "  -C --cs-high  chip select active high\n"
+	     "  -S --socket   Unix socket path (default /run/lime2node_spi_gateway.sock)\n"
+	     "  -g --group    group owning the Unix socket\n"
+	     "  -m --mode     permissions of the Unix socket (octal, default 0660)\n"
+	     "  -e --event-gpio CHIP:LINE  GPIO wired to the event pending line of the\n"
+	     "                lime2 node (e.g. /dev/gpiochip0:7): wait for the ACKs on\n"
+	     "                its rising edges instead of polling\n"
+	     "  -v --verbose  Verbose (dump every transfer)\n");
+	exit(1);
+}
+
+static void parse_opts(int argc, char *argv[])
+{
+	while (1) {
+		static const struct option lopts[] = {
+			{ "device",  1, 0, 'D' },
+			{ "speed",   1, 0, 's' },
+			{ "autotune", 1, 0, 'a' },
+			{ "delay",   1, 0, 'd' },
+			{ "cpha",    0, 0, 'H' },
+			{ "cpol",    0, 0, 'O' },
+			{ "lsb",     0, 0, 'L' },
+			{ "cs-high", 0, 0, 'C' },
+			{ "socket",  1, 0, 'S' },
+			{ "group",   1, 0, 'g' },
+			{ "mode",    1, 0, 'm' },
+			{ "event-gpio", 1, 0, 'e' },
+			{ "verbose", 0, 0, 'v' },
+			{ NULL, 0, 0, 0 },
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "D:s:a:d:HOLCS:g:m:e:v", lopts, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'D':
+			device = optarg;
+			break;
+		case 's':
+			speed = atoi(optarg);
+			break;
+		case 'a':
+			autotune_max_speed = atoi(optarg);
+			break;
+		case 'd':
+			delay = atoi(optarg);
+			break;
+		case 'H':
+			mode |= SPI_CPHA;
+			break;
+		case 'O':
+			mode |= SPI_CPOL;
+			break;
+		case 'L':
+			mode |= SPI_LSB_FIRST;
+			break;
+		case 'C':
+			mode |= SPI_CS_HIGH;
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'g':
+			socket_group = optarg;
+			break;
+		case 'm':
+			socket_mode = strtol(optarg, NULL, 8);
+			break;
+		case 'e':
+			event_gpio = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			print_usage(argv[0]);
+			break;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfds[2 + GW_MAX_CLIENTS];
+	int listen_fd;
+	int i, n, timeout = -1;
+
+	parse_opts(argc, argv);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (i = 0; i < GW_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	spi_open();
+	min_speed = speed;
+	if (autotune_max_speed > speed)
+		spi_autotune(autotune_max_speed);
+	if (event_gpio)
+		gpio_open();
+	listen_fd = socket_open();
+
+	while (!stop_requested) {
+		pfds[0].fd = listen_fd;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < GW_MAX_CLIENTS; i++) {
+			pfds[1 + i].fd = clients[i].fd;
+			/* while waiting for an ACK only a hangup is relevant */
+			pfds[1 + i].events = clients[i].wait.active ? 0 : POLLIN;
+		}
+		/* a negative fd is ignored by poll() */
+		pfds[1 + GW_MAX_CLIENTS].fd = gpio_fd;
+		pfds[1 + GW_MAX_CLIENTS].events = POLLIN;
+
+		n = poll(pfds, ARRAY_SIZE(pfds), timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pabort("poll failed");
+		}
+
+		/* clients are served one request at a time: the SPI bus is never shared */
+		for (i = 0; i < GW_MAX_CLIENTS; i++) {
+			if (clients[i].fd < 0)
+				continue;
+			if (pfds[1 + i].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(&clients[i]);
+			else if (clients[i].rx_len && !clients[i].wait.active)
+				client_process_buffered(&clients[i]);
+		}
+
+		if (pfds[0].revents & POLLIN)
+			client_accept(listen_fd);
+
+		if ((pfds[1 + GW_MAX_CLIENTS].revents & POLLIN) && gpio_read_events() > 0)
+			wake_waiting_clients();
+
+		timeout = poll_status();
+	}
+
+	for (i = 0; i < GW_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0)
+			client_close(&clients[i]);
+	}
+	close(listen_fd);
+	unlink(socket_path);
+	close(spi_fd);
+	if (gpio_fd >= 0)
+		close(gpio_fd);
+
+	return 0;
+}
@@ -44,6 +44,14 @@ static int verbose;
 static int transfer_size;
 static int iterations;
 static int interval = 5; /* interval in seconds for showing transfer rate */
+static int echo_bench;
+static char *echo_speeds;
+static char *echo_sizes;
+static int echo_gap_us;
+static int batch_frames;
+static char *batch_frame = "\\xA5S\\x00\\x00\\x00\\x00\\x00\\x00\\x00";	/* lime2 framed STATUS */
+
+#define BATCH_MAX_FRAMES	64
 
 uint8_t default_tx[] = {
 	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
@@ -113,10 +121,25 @@ static int unescape(char *_dst, char *_src, size_t len)
 	return ret;
 }
 
+static void write_output(uint8_t const *rx, size_t len)
+{
+	int out_fd;
+	ssize_t ret;
+
+	out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out_fd < 0)
+		pabort("could not open output file");
+
+	ret = write(out_fd, rx, len);
+	if (ret != (ssize_t)len)
+		pabort("not all bytes written to output file");
+
+	close(out_fd);
+}
+
 static void transfer(int fd, uint8_t const *tx, uint8_t const *rx, size_t len)
 {
 	int ret;
-	int out_fd;
 	struct spi_ioc_transfer tr = {
 		.tx_buf = (unsigned long)tx,
 		.rx_buf = (unsigned long)rx,
@@ -148,25 +171,76 @@ static void transfer(int fd, uint8_t const *tx, uint8_t const *rx, size_t len)
 	if (verbose)
 		hex_dump(tx, len, 32, "TX");
 
-	if (output_file) {
-		out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-		if (out_fd < 0)
-			pabort("could not open output file");
+	if (output_file)
+		write_output(rx, len);
+
+	if (verbose)
+		hex_dump(rx, len, 32, "RX");
+}
+
+/*
+ * Sends tx followed by batch_frames copies of batch_frame in a single
+ * SPI_IOC_MESSAGE ioctl: the chip select is toggled after each frame, after a
+ * pause of --delay usecs, so that the lime2 node sees them as distinct frames.
+ * The output file gets the bytes received during all of them, in order.
+ */
+static void transfer_batch(int fd, uint8_t const *tx, size_t len)
+{
+	struct spi_ioc_transfer tr[1 + BATCH_MAX_FRAMES];
+	size_t frame_len = strlen(batch_frame);
+	size_t total;
+	uint8_t *frame;
+	uint8_t *rx;
+	int i, ret;
+
+	if (batch_frames < 1)
+		pabort("invalid number of batched frames");
+	if (batch_frames > BATCH_MAX_FRAMES)
+		pabort("too many batched frames");
+
+	frame = malloc(frame_len);
+	if (!frame)
+		pabort("can't allocate batch frame buffer");
+	frame_len = unescape((char *)frame, batch_frame, frame_len);
+
+	total = len + batch_frames * frame_len;
+	rx = malloc(total);
+	if (!rx)
+		pabort("can't allocate rx buffer");
+
+	memset(tr, 0, sizeof(tr));
+	for (i = 0; i <= batch_frames; i++) {
+		tr[i].tx_buf = (unsigned long)(i ? frame : tx);
+		tr[i].rx_buf = (unsigned long)(i ? rx + len + (i - 1) * frame_len : rx);
+		tr[i].len = i ? frame_len : len;
+		tr[i].delay_usecs = delay;
+		tr[i].speed_hz = speed;
+		tr[i].bits_per_word = bits;
+		/* the chip select is always deasserted at the end of the message */
+		tr[i].cs_change = i < batch_frames;
+	}
 
-		ret = write(out_fd, rx, len);
-		if (ret != len)
-			pabort("not all bytes written to output file");
+	ret = ioctl(fd, SPI_IOC_MESSAGE(1 + batch_frames), tr);
+	if (ret < 1)
+		pabort("can't send spi message");
 
-		close(out_fd);
+	if (verbose) {
+		for (i = 0; i <= batch_frames; i++) {
+			hex_dump((void *)(unsigned long)tr[i].tx_buf, tr[i].len, 32, "TX");
+			hex_dump((void *)(unsigned long)tr[i].rx_buf, tr[i].len, 32, "RX");
+		}
 	}
 
-	if (verbose)
-		hex_dump(rx, len, 32, "RX");
+	if (output_file)
+		write_output(rx, total);
+
+	free(rx);
+	free(frame);
 }
 
 static void print_usage(const char *prog)
 {
-	printf("Usage: %s [-DsbdlHOLC3vpNR24SI]\n", prog);
+	printf("Usage: %s [-DsbdlHOLC3vpNR24SIeB]\n", prog);
 	puts("  -D --device   device to use (default /dev/spidev1.1)\n"
 	     "  -s --speed    max speed (Hz)\n"
 	     "  -d --delay    delay (usec)\n"
@@ -186,7 +260,19 @@ static void print_usage(const char *prog)
 	     "  -2 --dual     dual transfer\n"
 	     "  -4 --quad     quad transfer\n"
 	     "  -S --size     transfer size\n"
-	     "  -I --iter     iterations\n");
+	     "  -I --iter     iterations\n"
+	     "  -e --echo     benchmark the link with the ECHO___ command of the lime2\n"
+	     "                firmware and print the results as JSON\n"
+	     "  --speeds      with --echo: comma separated SPI speeds to sweep (Hz,\n"
+	     "                default --speed)\n"
+	     "  --sizes       with --echo: comma separated payload sizes to sweep\n"
+	     "                (1-16 bytes, default 16)\n"
+	     "  --gap         with --echo: pause between transactions (usec, default 0)\n"
+	     "  -B --batch    send the -p data followed by this number of STATUS frames\n"
+	     "                in a single ioctl, toggling the chip select after each\n"
+	     "                frame and pausing --delay usecs before\n"
+	     "  --batch-frame frame sent after the -p data with --batch (default the\n"
+	     "                lime2 framed STATUS \"\\xA5S\\x00\\x00\\x00\\x00\\x00\\x00\\x00\")\n");
 	exit(1);
 }
 
@@ -213,11 +299,17 @@ static void parse_opts(int argc, char *argv[])
 			{ "quad",    0, 0, '4' },
 			{ "size",    1, 0, 'S' },
 			{ "iter",    1, 0, 'I' },
+			{ "echo",    0, 0, 'e' },
+			{ "speeds",  1, 0, 'x' },
+			{ "sizes",   1, 0, 'z' },
+			{ "gap",     1, 0, 'g' },
+			{ "batch",   1, 0, 'B' },
+			{ "batch-frame", 1, 0, 'F' },
 			{ NULL, 0, 0, 0 },
 		};
 		int c;
 
-		c = getopt_long(argc, argv, "D:s:d:b:i:o:lHOLC3NR24p:vS:I:",
+		c = getopt_long(argc, argv, "D:s:d:b:i:o:lHOLC3NR24p:vS:I:eB:",
 				lopts, NULL);
 
 		if (c == -1)
@@ -284,6 +376,24 @@ static void parse_opts(int argc, char *argv[])
 		case 'I':
 			iterations = atoi(optarg);
 			break;
+		case 'e':
+			echo_bench = 1;
+			break;
+		case 'x':
+			echo_speeds = optarg;
+			break;
+		case 'z':
+			echo_sizes = optarg;
+			break;
+		case 'g':
+			echo_gap_us = atoi(optarg);
+			break;
+		case 'B':
+			batch_frames = atoi(optarg);
+			break;
+		case 'F':
+			batch_frame = optarg;
+			break;
 		default:
 			print_usage(argv[0]);
 			break;
@@ -312,7 +422,10 @@ static void transfer_escaped_string(int fd, char *str)
 		pabort("can't allocate rx buffer");
 
 	size = unescape((char *)tx, str, size);
-	transfer(fd, tx, rx, size);
+	if (batch_frames)
+		transfer_batch(fd, tx, size);
+	else
+		transfer(fd, tx, rx, size);
 	free(rx);
 	free(tx);
 }
@@ -401,6 +514,196 @@ static void transfer_buf(int fd, int len)
 	free(tx);
 }
 
+/*
+ * ECHO___ loopback benchmark against the lime2 firmware: each transaction sends
+ * "ECHO___" + a payload and clocks back the payload of the previous transaction,
+ * which the firmware shifts out after a leading NUL byte.
+ */
+#define ECHO_CMD		"ECHO___"
+#define ECHO_CMD_LEN		7
+#define ECHO_MAX_PAYLOAD	16	/* SPI_ECHO_MAX_LEN in the firmware main.h */
+#define ECHO_RX_OFS		1
+#define ECHO_MAX_STEPS		32
+#define ECHO_HIST_BUCKETS	20	/* log2 buckets, from <2us to >=512ms */
+
+struct echo_result {
+	uint32_t speed;
+	int size;
+	int transfers;
+	double elapsed_s;
+	uint64_t bytes;
+	uint64_t byte_errors;
+	int late;		/* echo of an older transaction: the firmware lagged behind */
+	double lat_min_us, lat_max_us, lat_sum_us;
+	uint64_t hist[ECHO_HIST_BUCKETS];
+};
+
+static double elapsed_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+/* payload of transaction n: a sequence number, then bytes derived from it */
+static void echo_payload(uint8_t *p, int size, uint32_t n)
+{
+	int i;
+
+	p[0] = n;
+	for (i = 1; i < size; i++)
+		p[i] = (n * 0x9E + i * 0x3B) ^ 0x5A;
+}
+
+static void echo_step(int fd, struct echo_result *r)
+{
+	uint8_t tx[ECHO_CMD_LEN + ECHO_MAX_PAYLOAD];
+	uint8_t rx[sizeof(tx)];
+	uint8_t expected[ECHO_MAX_PAYLOAD], older[ECHO_MAX_PAYLOAD];
+	struct timespec start, t0, t1;
+	int len = ECHO_CMD_LEN + r->size;
+	int n, i, errors;
+	double us;
+	struct spi_ioc_transfer tr = {
+		.tx_buf = (unsigned long)tx,
+		.rx_buf = (unsigned long)rx,
+		.len = len,
+		.delay_usecs = delay,
+		.speed_hz = r->speed,
+		.bits_per_word = bits,
+	};
+
+	memcpy(tx, ECHO_CMD, ECHO_CMD_LEN);
+	r->lat_min_us = 1e12;
+
+	/* the first transaction only loads the echo buffer */
+	echo_payload(tx + ECHO_CMD_LEN, r->size, 0);
+	if (ioctl(fd, SPI_IOC_MESSAGE(1), &tr) < 1)
+		pabort("can't send spi message");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 1; n <= r->transfers; n++) {
+		/* the firmware loads the echo from its main loop, between the transactions */
+		if (echo_gap_us)
+			usleep(echo_gap_us);
+		echo_payload(tx + ECHO_CMD_LEN, r->size, n);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (ioctl(fd, SPI_IOC_MESSAGE(1), &tr) < 1)
+			pabort("can't send spi message");
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		us = elapsed_us(&t0, &t1);
+		r->lat_sum_us += us;
+		if (us < r->lat_min_us)
+			r->lat_min_us = us;
+		if (us > r->lat_max_us)
+			r->lat_max_us = us;
+		for (i = 0; i < ECHO_HIST_BUCKETS - 1 && us >= (2 << i); i++)
+			;
+		r->hist[i]++;
+
+		echo_payload(expected, r->size, n - 1);
+		echo_payload(older, r->size, n - 2);
+		if (n > 1 && memcmp(rx + ECHO_RX_OFS, older, r->size) == 0) {
+			r->late++;
+			continue;
+		}
+		for (i = 0, errors = 0; i < r->size; i++)
+			errors += rx[ECHO_RX_OFS + i] != expected[i];
+		r->byte_errors += errors;
+		r->bytes += r->size;
+		if (verbose && errors) {
+			hex_dump(tx, len, 32, "TX");
+			hex_dump(rx, len, 32, "RX");
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	r->elapsed_s = elapsed_us(&start, &t1) / 1e6;
+}
+
+static int parse_list(char *str, uint32_t *out, int max)
+{
+	int n = 0;
+	char *tok;
+
+	for (tok = strtok(str, ","); tok && n < max; tok = strtok(NULL, ","))
+		out[n++] = strtoul(tok, NULL, 0);
+	return n;
+}
+
+static void echo_print_json(const struct echo_result *res, int num)
+{
+	double best_tps = 0;
+	uint32_t best_speed = 0;
+	int best_size = 0;
+	const char *sep;
+	int i, j;
+
+	printf("{\n  \"device\": \"%s\",\n  \"steps\": [\n", device);
+	for (i = 0; i < num; i++) {
+		const struct echo_result *r = &res[i];
+		double tps = r->elapsed_s > 0 ? r->transfers / r->elapsed_s : 0;
+
+		if (r->byte_errors == 0 && r->late == 0 && tps > best_tps) {
+			best_tps = tps;
+			best_speed = r->speed;
+			best_size = r->size;
+		}
+
+		printf("    { \"speed_hz\": %u, \"payload_size\": %d, \"transfers\": %d,"
+		       " \"transactions_per_sec\": %.1f,\n", r->speed, r->size, r->transfers, tps);
+		printf("      \"bytes_checked\": %llu, \"byte_errors\": %llu, \"byte_error_rate\": %.3g,"
+		       " \"late_echoes\": %d,\n", (unsigned long long)r->bytes,
+		       (unsigned long long)r->byte_errors,
+		       r->bytes ? (double)r->byte_errors / r->bytes : 0.0, r->late);
+		printf("      \"latency_us\": { \"min\": %.1f, \"mean\": %.1f, \"max\": %.1f,"
+		       " \"histogram\": [", r->lat_min_us,
+		       r->transfers ? r->lat_sum_us / r->transfers : 0.0, r->lat_max_us);
+		for (j = 0, sep = " "; j < ECHO_HIST_BUCKETS; j++) {
+			if (!r->hist[j])
+				continue;
+			/* upper bound of the bucket in usecs, null for the last one */
+			if (j < ECHO_HIST_BUCKETS - 1)
+				printf("%s{ \"lt\": %d, \"count\": %llu }", sep, 2 << j,
+				       (unsigned long long)r->hist[j]);
+			else
+				printf("%s{ \"lt\": null, \"count\": %llu }", sep,
+				       (unsigned long long)r->hist[j]);
+			sep = ", ";
+		}
+		printf(" ] } }%s\n", i + 1 < num ? "," : "");
+	}
+	printf("  ],\n  \"max_sustainable\": { \"speed_hz\": %u, \"payload_size\": %d,"
+	       " \"transactions_per_sec\": %.1f }\n}\n", best_speed, best_size, best_tps);
+}
+
+static void echo_benchmark(int fd)
+{
+	static struct echo_result res[ECHO_MAX_STEPS];
+	uint32_t speeds[ECHO_MAX_STEPS] = { speed };
+	uint32_t sizes[ECHO_MAX_STEPS] = { ECHO_MAX_PAYLOAD };
+	int num_speeds = 1, num_sizes = 1, num = 0;
+	int i, j;
+
+	if (echo_speeds)
+		num_speeds = parse_list(echo_speeds, speeds, ECHO_MAX_STEPS);
+	if (echo_sizes)
+		num_sizes = parse_list(echo_sizes, sizes, ECHO_MAX_STEPS);
+
+	for (i = 0; i < num_speeds; i++) {
+		for (j = 0; j < num_sizes && num < ECHO_MAX_STEPS; j++) {
+			struct echo_result *r = &res[num++];
+
+			if (sizes[j] < 1 || sizes[j] > ECHO_MAX_PAYLOAD)
+				pabort("invalid echo payload size");
+			r->speed = speeds[i];
+			r->size = sizes[j];
+			r->transfers = iterations > 0 ? iterations : 100;
+			echo_step(fd, r);
+		}
+	}
+	echo_print_json(res, num);
+}
+
 int main(int argc, char *argv[])
 {
 	int ret = 0;
@@ -445,6 +748,13 @@ int main(int argc, char *argv[])
 	if (ret == -1)
 		pabort("can't get max speed hz");
 
+	if (echo_bench) {
+		/* keep stdout valid JSON */
+		echo_benchmark(fd);
+		close(fd);
+		return ret;
+	}
+
 	printf("spi mode: 0x%x\n", mode);
 	printf("bits per word: %d\n", bits);
 	printf("max speed: %d Hz (%d KHz)\n", speed, speed/1000);